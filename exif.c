@@ -14,9 +14,19 @@
  * limitations under the License.
  */
 
+#ifdef __linux__
+#define _GNU_SOURCE // for copy_file_range()
+#endif
+#define _FILE_OFFSET_BITS 64 // for fseeko() beyond 2GB
 #ifdef _MSC_VER
 #include <windows.h>
 #define vsnprintf _vsnprintf
+#define fseeko _fseeki64
+#define ftello _ftelli64
+#define THREAD_LOCAL __declspec(thread)
+#else
+#include <pthread.h>
+#define THREAD_LOCAL __thread
 #endif
 #include <stdio.h>
 #include <stddef.h>
@@ -25,12 +35,29 @@
 #include <string.h>
 #include <memory.h>
 #include <ctype.h>
+#include <math.h>
+#include <errno.h>
+#ifdef _MSC_VER
+#include <io.h> // for _commit()
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <process.h> // for _getpid()
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#endif
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <linux/fs.h> // for FICLONE
+#endif
 #include "exif.h"
 
-#pragma pack(2)
-
 #define VERSION  "1.0.1"
 
+// the layouts in the file are packed (the others are aligned naturally)
+#pragma pack(push, 2)
+
 // TIFF Header
 typedef struct _tiff_Header {
     unsigned short byteOrder;
@@ -54,6 +81,36 @@ typedef struct {
     unsigned int offset;
 } IFD_TAG;
 
+#pragma pack(pop)
+
+// tag field in IFD of classic TIFF or BigTIFF - internal use
+typedef struct {
+    unsigned short tag;
+    unsigned short type;
+    unsigned long long count;
+    unsigned long long offset;
+    unsigned char data[8]; // the value or the offset as stored in the file
+} TIFF_FIELD;
+
+// the TIFF data read out of the Exif segment - internal use
+typedef struct {
+    unsigned long long base;   // file offset of the TIFF header
+    unsigned long long length; // length of the TIFF data (0: in the Exif segment)
+    unsigned long long ifd0thOffset;
+    int big; // BigTIFF
+} TIFF_FILE_STATE;
+
+// sizes in the IFD of classic TIFF or BigTIFF
+#define IFD_COUNT_SIZE  ((TiffFile.big) ? 8 : 2)
+#define IFD_FIELD_SIZE  ((TiffFile.big) ? 20 : 12)
+#define IFD_OFFSET_SIZE ((TiffFile.big) ? 8 : 4)
+
+// field types of TIFF and BigTIFF which are not in Exif
+#define TYPE_IFD    13
+#define TYPE_LONG8  16
+#define TYPE_SLONG8 17
+#define TYPE_IFD8   18
+
 // tag node - internal use
 typedef struct _tagNode TagNode;
 struct _tagNode {
@@ -65,8 +122,29 @@ struct _tagNode {
     unsigned short error;
     TagNode *prev;
     TagNode *next;
+    unsigned int rawOffset; // offset of the tag field in the original data (0=new)
+    int interned;           // 1 if byteData is shared in the string pool
 };
 
+// original TIFF data of the Exif segment shared by the IFD tables - internal use
+typedef struct {
+    int refCount;
+    int ifdCount; // number of the IFD tables parsed from the data
+    unsigned short byteOrder;
+    unsigned int length;
+    unsigned char *data;
+} RawSegment;
+
+// the end offset returned for the circular pointers
+#define IFD_END_CIRCULAR 0xFFFFFFFF
+// max number of the IFDs followed by the pointers (0th, Exif, Interoperability)
+#define IFD_PATH_MAX 3
+
+// number of the words of the tag presence bitmap in the IFD table
+// (enough for KnownTagIds[]. the GPS and Interoperability tag IDs are
+// used as the bit index directly)
+#define TAG_PRESENCE_WORDS 4
+
 // IFD table - internal use
 typedef struct _ifdTable IfdTable;
 struct _ifdTable {
@@ -77,13 +155,401 @@ struct _ifdTable {
     unsigned short offset;
     unsigned short length;
     unsigned char *p;
+    RawSegment *raw;        // original data (NULL if not parsed from the file)
+    unsigned int rawOffset; // offset of the IFD in the original data
+    int modified;           // 1 if the tags are changed after parsing
+    unsigned int presence[TAG_PRESENCE_WORDS]; // bitmap of the known tags
+    unsigned int otherPresence; // hashed bits of the other tags
+    struct _ifdTable *makerNote; // MakerNote IFD decoded from the Exif IFD
+    int makerNoteVendor;    // MAKERNOTE_xxx, or -1 if not decoded yet
+    int tiffFile;           // 1 if parsed from the TIFF file
+};
+
+// the tag IDs of the 0th, 1st and Exif IFD in the presence bitmap
+// (sorted by the ID)
+static const unsigned short KnownTagIds[] = {
+    TAG_ImageWidth, TAG_ImageLength, TAG_BitsPerSample, TAG_Compression,
+    TAG_PhotometricInterpretation, TAG_ImageDescription, TAG_Make, TAG_Model,
+    TAG_StripOffsets, TAG_Orientation, TAG_SamplesPerPixel, TAG_RowsPerStrip,
+    TAG_StripByteCounts, TAG_XResolution, TAG_YResolution,
+    TAG_PlanarConfiguration, TAG_ResolutionUnit, TAG_TransferFunction,
+    TAG_Software, TAG_DateTime, TAG_Artist, TAG_WhitePoint,
+    TAG_PrimaryChromaticities, TAG_JPEGInterchangeFormat,
+    TAG_JPEGInterchangeFormatLength, TAG_YCbCrCoefficients,
+    TAG_YCbCrSubSampling, TAG_YCbCrPositioning, TAG_ReferenceBlackWhite,
+    TAG_Rating, TAG_Copyright, TAG_ExposureTime, TAG_FNumber,
+    TAG_ExifIFDPointer, TAG_ExposureProgram, TAG_SpectralSensitivity,
+    TAG_GPSInfoIFDPointer, TAG_PhotographicSensitivity, TAG_OECF,
+    TAG_SensitivityType, TAG_StandardOutputSensitivity,
+    TAG_RecommendedExposureIndex, TAG_ISOSpeed, TAG_ISOSpeedLatitudeyyy,
+    TAG_ISOSpeedLatitudezzz, TAG_ExifVersion, TAG_DateTimeOriginal,
+    TAG_DateTimeDigitized, TAG_ComponentsConfiguration,
+    TAG_CompressedBitsPerPixel, TAG_ShutterSpeedValue, TAG_ApertureValue,
+    TAG_BrightnessValue, TAG_ExposureBiasValue, TAG_MaxApertureValue,
+    TAG_SubjectDistance, TAG_MeteringMode, TAG_LightSource, TAG_Flash,
+    TAG_FocalLength, TAG_SubjectArea, TAG_MakerNote, TAG_UserComment,
+    TAG_SubSecTime, TAG_SubSecTimeOriginal, TAG_SubSecTimeDigitized,
+    TAG_FlashPixVersion, TAG_ColorSpace, TAG_PixelXDimension,
+    TAG_PixelYDimension, TAG_RelatedSoundFile, TAG_InteroperabilityIFDPointer,
+    TAG_FlashEnergy, TAG_SpatialFrequencyResponse, TAG_FocalPlaneXResolution,
+    TAG_FocalPlaneYResolution, TAG_FocalPlaneResolutionUnit,
+    TAG_SubjectLocation, TAG_ExposureIndex, TAG_SensingMethod, TAG_FileSource,
+    TAG_SceneType, TAG_CFAPattern, TAG_CustomRendered, TAG_ExposureMode,
+    TAG_WhiteBalance, TAG_DigitalZoomRatio, TAG_FocalLengthIn35mmFormat,
+    TAG_SceneCaptureType, TAG_GainControl, TAG_Contrast, TAG_Saturation,
+    TAG_Sharpness, TAG_DeviceSettingDescription, TAG_SubjectDistanceRange,
+    TAG_ImageUniqueID, TAG_CameraOwnerName, TAG_BodySerialNumber,
+    TAG_LensSpecification, TAG_LensMake, TAG_LensModel, TAG_LensSerialNumber,
+    TAG_Gamma
+};
+
+// the length of the date and time value "YYYY:MM:DD HH:MM:SS"
+#define DATETIME_LENGTH 20
+
+// the padding segment (APP15) to keep the free space after the Exif segment
+#define PADDING_SEGMENT_ID      "PADDING\0"
+#define PADDING_SEGMENT_ID_LEN  8
+#define PADDING_SEGMENT_MIN     (2 + 2 + PADDING_SEGMENT_ID_LEN)
+
+// the buffer size to shift the data in the file
+#define SHIFT_BUFFER_SIZE       65536
+
+// the sidecar file of splitExifSegmentToSidecar() (little-endian)
+//   0: "EXSC"
+//   4: version (short)
+//   6: header size (short)
+//   8: offset of the Exif segment in the original file
+//  12: length of the Exif segment
+//  16: size of the JPEG file without the segment
+//  20: identity of the JPEG file without the segment
+//  24: the Exif segment data from the APP1 marker
+#define SIDECAR_ID              "EXSC"
+#define SIDECAR_ID_LEN          4
+#define SIDECAR_VERSION         1
+#define SIDECAR_HEADER_SIZE     24
+#define SIDECAR_IDENTITY_LEN    4096
+
+// the reference file of splitExifSegmentToStore()
+//   0: "EXSR"
+//   4: same as the sidecar
+//  24: the key of the segment in the store (64bit)
+#define STORE_REFERENCE_ID      "EXSR"
+#define STORE_REFERENCE_SIZE    (SIDECAR_HEADER_SIZE + 8)
+
+// the buffer size to read the image data of getImageHashOfJPEGFile()
+#define IMAGE_HASH_BUFFER_SIZE  (256 * 1024)
+
+// number of the fingerprints sorted in memory as a run of
+// groupJPEGFilesByFingerprint()
+#define FINGERPRINT_RUN_SIZE      (256 * 1024)
+// number of the fingerprints buffered for each run while merging
+#define FINGERPRINT_MERGE_BUFFER  256
+
+// the statistics of getTagStatisticsOfJPEGFiles()
+#define STATS_CHUNK_SIZE        4096  // number of the paths read at once
+#define STATS_TAG_TABLE_SIZE    1024  // distinct tags of all IFDs (power of 2)
+#define STATS_VALUE_TABLE_SIZE  1024  // distinct values of a tag (power of 2)
+#define STATS_VALUE_LEN         64
+#define STATS_TOP_VALUES        20    // number of the values in the report
+#define STATS_HLL_BITS          12    // 4096 registers, about 1.6% error
+#define STATS_SIZE_BUCKETS      256   // 8 buckets for each power of 2
+#define STATS_VALUE_FIELDS      3     // Make, Model, ExposureProgram
+#define STATS_DISTINCT_FIELDS   (STATS_VALUE_FIELDS + 1) // and the camera
+#define STATS_SIZE_FIELDS       3     // Exif segment, thumbnail, MakerNote
+
+// number of the pairs compared at once by diffExifSegmentOfJPEGFilePairs()
+#define DIFF_CHUNK_SIZE         1024
+// maximum length of a value in the report of the differences
+#define DIFF_VALUE_LEN          256
+
+// an output file of the batch function waiting to be durable
+typedef struct {
+    const char *fileName;
+    char *tmpName; // file to be renamed, or NULL if updated in place
+    int *pResult;  // result of the file, set to an error if not durable
+} DURABLE_ENTRY;
+
+// the output files of the batch function synced per group
+typedef struct {
+    DURABLE_ENTRY *entries; // for each index of the batch
+    int *pending;           // indexes of the entries not synced yet
+    int pendingCount;
+#ifdef _MSC_VER
+    CRITICAL_SECTION lock;
+#else
+    pthread_mutex_t lock;
+#endif
+} DURABLE_GROUP;
+
+// an interned string in the string pool
+typedef struct _poolString PoolString;
+struct _poolString {
+    PoolString *next; // next string in the same bucket
+    unsigned int hash;
+    unsigned int length;
+    int code;         // dictionary code (0, 1, 2, ...)
+    unsigned char data[1];
 };
 
+#define STRING_POOL_BUCKETS 4096 // must be a power of 2
+#define STRING_POOL_LOCKS   64   // locks for the buckets
+
+// the pool of the immutable strings shared by the tag nodes
+typedef struct {
+    PoolString *buckets[STRING_POOL_BUCKETS];
+    PoolString **strings; // indexed by the code
+    int count;
+    int max;
+    // [STRING_POOL_LOCKS] is for the strings
+#ifdef _MSC_VER
+    CRITICAL_SECTION locks[STRING_POOL_LOCKS + 1];
+#else
+    pthread_mutex_t locks[STRING_POOL_LOCKS + 1];
+#endif
+} StringPool;
+
+// report text of a worker to be written in order
+typedef struct {
+    char *text;
+    size_t length;
+    size_t max;
+} REPORT_TEXT;
+
+// parameters of shiftDateTimeInJPEGFiles()
+typedef struct {
+    const char **fileNames;
+    long seconds;
+    int flags;
+    const char *make;
+    const char *model;
+    const char *serial;
+    int *results;
+    REPORT_TEXT *reports;
+    DURABLE_GROUP *durable; // NULL if not durable output
+} SHIFT_DATETIME_BATCH;
+
+typedef void (*BATCH_FUNC)(void *ctx, int index);
+
+// an edit in the manifest of updateTagDataInJPEGFilesFromManifest()
+typedef struct {
+    char *fileName;
+    IFD_TYPE ifdType;
+    struct _tagNode *tag; // NULL if the line is invalid
+    int line;
+} MANIFEST_EDIT;
+
+// result of the edits for a JPEG file
+typedef struct {
+    int sts;
+    int inPlace;
+    int rewritten;
+    int errorLine;
+} MANIFEST_RESULT;
+
+// parameters of updateTagDataInJPEGFilesFromManifest()
+typedef struct {
+    MANIFEST_EDIT *edits;
+    int groupCount;
+    int *groupStart; // index of the first edit of each JPEG file
+    MANIFEST_RESULT *results;
+    DURABLE_GROUP *durable; // NULL if not durable output
+} MANIFEST_BATCH;
+
+// parameters of minifyExifSegmentInJPEGFiles()
+typedef struct {
+    const char **inFileNames;
+    const char **outFileNames; // NULL to overwrite the original files
+    int flags;
+    const unsigned short *keepTagIds;
+    int keepCount;
+    int *results;
+    long *savedBytes;
+    DURABLE_GROUP *durable; // NULL if not durable output
+} MINIFY_BATCH;
+
+// state of the XXH64 hash
+typedef struct {
+    unsigned long long total;
+    unsigned long long v[4];
+    unsigned char mem[32];
+    unsigned int memSize;
+} XXH64_STATE;
+
+// parameters of getImageHashOfJPEGFiles()
+typedef struct {
+    const char **fileNames;
+    unsigned long long *hashes;
+    void ***ifdTableArrays; // NULL if not needed
+    int *results;
+} IMAGE_HASH_BATCH;
+
+// paths read from a list file in chunks
+typedef struct {
+    FILE *fp;
+    int max;                    // maximum number of the paths of a chunk
+    int eof;
+    long listed;                // number of the paths listed so far
+    unsigned int sampleRate;    // read 1 of n paths at random (0, 1: all)
+    unsigned long long random;  // state of the random number generator
+    char *names;                // buffer of the paths of the chunk
+    size_t nameMax;
+    size_t *nameOffsets;
+    char **paths;               // paths of the chunk
+    long *offsets;              // offset of each path in the list file
+} PATH_LIST;
+
+// fingerprint of a JPEG file of groupJPEGFilesByFingerprint()
+// (sorted by camera, time and settings)
+typedef struct {
+    unsigned long long camera;   // hash of Make, Model and BodySerialNumber
+    unsigned long long time;     // DateTimeOriginal and SubSecTimeOriginal
+                                 // in msec (0 if not exist)
+    unsigned long long settings; // hash of FocalLength and ExposureTime
+    unsigned long long uniqueId; // hash of ImageUniqueID (0 if not exist)
+    long pathOffset;             // offset of the path in the list file
+} FINGERPRINT;
+
+// parameters of the fingerprint extraction
+typedef struct {
+    char **paths;
+    FINGERPRINT *records;
+    int *results;
+} FINGERPRINT_BATCH;
+
+// parameters of a pass of the radix sort of the fingerprints
+typedef struct {
+    FINGERPRINT *src;
+    FINGERPRINT *dst;
+    size_t count;
+    int slices;
+    int column; // 0: settings, 1: time, 2: camera
+    int shift;
+    size_t (*counts)[256]; // counts of each slice, then the offsets to scatter
+} RADIX_BATCH;
+
+// a sorted run of the fingerprints being merged
+typedef struct {
+    FINGERPRINT *buf;
+    int index;
+    int count;
+    long pos; // range of the run remaining in the temporary file
+    long end;
+} FINGERPRINT_RUN;
+
+// group of the fingerprints being reported
+typedef struct {
+    long *offsets;
+    int count;
+    int max;
+} FINGERPRINT_GROUP;
+
+// counter of a tag of getTagStatisticsOfJPEGFiles()
+typedef struct {
+    unsigned int key; // (IFD type << 16 | tag ID) + 1, or 0 if empty
+    long count;
+} STATS_TAG;
+
+// counter of a value of a tag
+typedef struct {
+    unsigned long long hash; // 0 if empty
+    long count;
+    char value[STATS_VALUE_LEN];
+} STATS_VALUE;
+
+// histogram of the sizes in the logarithmic buckets
+typedef struct {
+    long count;
+    unsigned int min;
+    unsigned int max;
+    long buckets[STATS_SIZE_BUCKETS];
+} STATS_SIZE;
+
+// statistics of the files (each worker has a partial one to be merged)
+typedef struct {
+    long files;
+    long exif;
+    long errors;
+    STATS_TAG tags[STATS_TAG_TABLE_SIZE];
+    long tagOverflow;
+    STATS_VALUE values[STATS_VALUE_FIELDS][STATS_VALUE_TABLE_SIZE];
+    long valueOverflow[STATS_VALUE_FIELDS];
+    unsigned char hll[STATS_DISTINCT_FIELDS][1 << STATS_HLL_BITS]; // HyperLogLog
+    STATS_SIZE sizes[STATS_SIZE_FIELDS];
+} TAG_STATISTICS;
+
+// parameters of getTagStatisticsOfJPEGFiles()
+typedef struct {
+    char **paths;
+    int count;
+    int slices;
+    TAG_STATISTICS *partials; // partial statistics of each slice
+} STATS_BATCH;
+
+// differences of the tags being collected
+typedef struct {
+    TagDiffInfo *diffs;
+    int count;
+    int max;
+} TAG_DIFF_LIST;
+
+// parameters of diffExifSegmentOfJPEGFilePairs()
+typedef struct {
+    const char **fileNamesA;
+    const char **fileNamesB;
+    int *results;
+    REPORT_TEXT *reports;
+} DIFF_BATCH;
+
+// layout of the IFD-structured MakerNote
+typedef struct {
+    int vendor;               // MAKERNOTE_xxx
+    int selfContained;        // 1 if the offsets are relative to the MakerNote
+    unsigned int base;        // offset of the base of the offsets in the MakerNote
+                              // (self-contained only)
+    unsigned int ifdOffset;   // offset of the IFD from the base, or from the
+                              // top of the MakerNote if not self-contained
+    unsigned short byteOrder; // 0x4949, 0x4D4D, or 0 if the same as the Exif
+} MAKERNOTE_FORMAT;
+
+// the growable array of the IFD tables terminated by NULL
+typedef struct {
+    void **ifds;
+    int count;
+    int max; // including the terminating NULL
+} IFD_LIST;
+
+// max number of the SubIFDs read per IFD of the TIFF file
+#define TIFF_SUB_IFD_MAX 32
+
+// the IFDs decoded per IFD in the chain of the TIFF file
+typedef struct {
+    IfdTable *nth;   // NULL for the 0th and 1st IFD
+    IfdTable **subs; // the SubIFDs
+    int subCount;
+    int sts;
+} TIFF_CHAIN_ENTRY;
+
+// parameters of parseTiffIfds()
+typedef struct {
+    const char *fileName; // opened by each thread, or NULL to use 'fp'
+    FILE *fp;
+    APP1_HEADER app1Header;    // the thread-local state of the file
+    TIFF_FILE_STATE tiffFile;
+    unsigned long long *chain; // offsets of the IFDs in the chain
+    TIFF_CHAIN_ENTRY *entries; // for each IFD in the chain
+    int count;
+    int slices;
+} TIFF_CHAIN_BATCH;
+
 static int init(FILE*);
 static int systemIsLittleEndian();
 static int dataIsLittleEndian();
 static void freeIfdTable(void*);
-static void *parseIFD(FILE*, unsigned int, IFD_TYPE);
+static void *parseIFD(FILE*, unsigned long long, IFD_TYPE);
+static int getTiffValue(const unsigned char *p, int size, unsigned short type,
+                        unsigned int *pVal);
+static void **createIfdTableArrayFromFile(FILE *fp, const char *fileName,
+                                          int *result);
 static TagNode *getTagNodePtrFromIfd(IfdTable*, unsigned short);
 static TagNode *duplicateTagNode(TagNode*);
 static void freeTagNode(void*);
@@ -91,6 +557,10 @@ static char *getTagName(int, unsigned short);
 static int countIfdTableOnIfdTableArray(void **ifdTableArray);
 static IfdTable *getIfdTableFromIfdTableArray(void **ifdTableArray, IFD_TYPE ifdType);
 static void *createIfdTable(IFD_TYPE IfdType, unsigned short tagCount, unsigned int nextOfs);
+static int getTagPresenceBit(IFD_TYPE ifdType, unsigned short tagId);
+static void setTagPresence(IfdTable *ifd, unsigned short tagId);
+static void refreshTagPresence(IfdTable *ifd);
+static int tagIsPresent(IfdTable *ifd, unsigned short tagId);
 static void *addTagNodeToIfd(void *pIfd, unsigned short tagId, unsigned short type,
                       unsigned int count, unsigned int *numData,unsigned char *byteData);
 static int writeExifSegment(FILE *fp, void **ifdTableArray);
@@ -99,14 +569,236 @@ static int fixLengthAndOffsetInIfdTables(void **ifdTableArray);
 static int setSingleNumDataToTag(TagNode *tag, unsigned int value);
 static int getApp1StartOffset(FILE *fp, const char *App1IDString,
                               size_t App1IDStringLength, int *pDQTOffset);
+static int seekToRelativeOffset(FILE *fp, unsigned long long ofs);
+static unsigned short fix_short(unsigned short us);
+static unsigned int fix_int(unsigned int ui);
+static int findTagFieldInIfd(FILE *fp, unsigned int ifdOffset, unsigned short tagId,
+                             IFD_TAG *pTagField, unsigned int *pFieldOffset);
+static int clearIfdInFile(FILE *fp, unsigned int ifdOffset,
+                          unsigned int keepOffset, unsigned int keepLength);
+static int getIfdOffsetInFile(FILE *fp, IFD_TYPE ifdType, unsigned int *pOffset);
+static int getNextIfdOffsetInFile(FILE *fp, unsigned long long ifdOffset,
+                                  unsigned long long *pNextOffset);
+static int getSubIfdOffsetsInFile(FILE *fp, unsigned long long ifdOffset,
+                                  unsigned long long *offsets, int max);
+static int readIfdTagCount(FILE *fp, unsigned long long ifdOffset,
+                           unsigned long long *pCount);
+static int readTiffField(FILE *fp, TIFF_FIELD *field);
+static int findTiffFieldInIfd(FILE *fp, unsigned long long ifdOffset,
+                              unsigned short tagId, TIFF_FIELD *field);
+static int readTiffOffsets(FILE *fp, const TIFF_FIELD *field,
+                           unsigned long long *offsets, int max);
+static void getIfdPointer(FILE *fp, IfdTable *ifd, unsigned long long ifdOffset,
+                          unsigned short tagId, unsigned long long *pOffset);
+static int initTiffFile(FILE *fp);
+static void decodeMakerNoteInFile(FILE *fp, IfdTable *ifd0th, IfdTable *exif,
+                                  unsigned long long exifOffset);
+static int parseTiffIfds(FILE *fp, const char *fileName, IFD_LIST *list);
+static int getTiffChainOffsets(FILE *fp, unsigned long long **pChain, int *pCount);
+static void tiffChainBatchFunc(void *ctx, int index);
+static int addIfdToList(IFD_LIST *list, void *ifd);
+static int isOffsetTag(IFD_TYPE ifdType, unsigned short tagId);
+static int isTiffFileOffsetTag(IfdTable *ifd, unsigned short tagId);
+static unsigned int getTagValueSize(unsigned short type, unsigned int count);
+static unsigned long long getTiffDataLength();
+static int packTagValue(TagNode *tag, unsigned char *p);
+static int updateTagDataInFile(FILE *fp, IFD_TYPE ifdType, TagNode *tag,
+                               int checkOnly);
+static int readAsciiValueInFile(FILE *fp, unsigned int ofs, unsigned int count,
+                                char *buf, size_t bufSize);
+static int asciiTagInFileMatches(FILE *fp, IFD_TYPE ifdType,
+                                 unsigned short tagId, const char *str);
+static int shiftDateTimeString(const char *value, long seconds, char *newValue);
+static int shiftDateTimeToReport(const char *JPEGFileName, long seconds,
+                                 int flags, const char *make, const char *model,
+                                 const char *serial, REPORT_TEXT *report);
+static int shiftGPSDateTimeInFile(FILE *fp, const char *fileName,
+                                  long seconds, int flags, REPORT_TEXT *report);
+static int reportShiftedValue(REPORT_TEXT *report, const char *fileName,
+                    IFD_TYPE ifdType, unsigned short tagId,
+                    const char *from, const char *to, int flags);
+static int writeReportText(const REPORT_TEXT *report, const char *reportFileName);
+static void shiftDateTimeBatchFunc(void *ctx, int index);
+static int replaceFile(const char *srcFileName, const char *dstFileName);
+static char *createTempFile(const char *fileName);
+static void runBatch(BATCH_FUNC func, void *ctx, int count);
+static int createDurableGroup(int count, DURABLE_GROUP **pGroup);
+static void beginDurableOutput(DURABLE_GROUP *group, int index,
+                               const char *fileName, int *pResult);
+static void endDurableOutput(DURABLE_GROUP *group, int index, int written);
+static void finishDurableGroup(DURABLE_GROUP *group);
+static int rewriteTagsInJPEGFile(const char *fileName, const IFD_TYPE *ifdTypes,
+                                 TagNode **tags, int count);
+static int readManifestLine(FILE *fp, char **pLine, size_t *pMax);
+static int parseManifestLine(char *line, MANIFEST_EDIT *edit);
+static int compareManifestEdit(const void *a, const void *b);
+static void updateTagDataBatchFunc(void *ctx, int index);
+static void minifyIfdTableArray(void **ifdTableArray, int flags,
+                                const unsigned short *keepTagIds, int keepCount);
+static int tagValueIsEmpty(TagNode *tag);
+static long getFileSize(const char *fileName);
+static void minifyBatchFunc(void *ctx, int index);
+static int copyFileData(FILE *fpr, FILE *fpw, long length);
+static int copyFileRange(FILE *fpr, long srcOffset, FILE *fpw, long length);
+static unsigned int getSidecarIdentity(FILE *fp, long size);
+static int stripExifSegmentToFile(const char *inJPEGFileName,
+                                  const char *outJPEGFileName,
+                                  unsigned char **pSegment,
+                                  unsigned char *header);
+static int checkSidecarHeader(const unsigned char *header, const char *id,
+                              FILE *fpr, long *pFileSize);
+static int insertSegmentAtOffset(FILE *fpr, long fileSize, const unsigned char *header,
+                                 const unsigned char *segment,
+                                 const char *outJPEGFileName);
+static char *getStorePath(const char *storeDirName, const char *key);
+static int storeObjectMatches(const char *path, const unsigned char *segment,
+                              unsigned int length);
+static void xxh64Reset(XXH64_STATE *state);
+static void xxh64Update(XXH64_STATE *state, const unsigned char *data, unsigned int len);
+static unsigned long long xxh64Digest(const XXH64_STATE *state);
+static int hashImageData(FILE *fp, unsigned long long *pHash);
+static void imageHashBatchFunc(void *ctx, int index);
+static void hashTagValue(XXH64_STATE *state, IfdTable *ifd, unsigned short tagId);
+static unsigned long long getCaptureTime(IfdTable *exif);
+static int getFingerprintOfFile(const char *fileName, FINGERPRINT *fingerprint);
+static void fingerprintBatchFunc(void *ctx, int index);
+static int extractFingerprints(PATH_LIST *list, FINGERPRINT *records);
+static unsigned long long getFingerprintKey(const FINGERPRINT *fingerprint, int column);
+static void radixCountFunc(void *ctx, int index);
+static void radixScatterFunc(void *ctx, int index);
+static int sortFingerprints(FINGERPRINT *records, size_t count);
+static int compareFingerprint(const FINGERPRINT *a, const FINGERPRINT *b);
+static int readFingerprintRun(FILE *fp, FINGERPRINT_RUN *run);
+static int addToFingerprintGroup(FINGERPRINT_GROUP *group, long pathOffset);
+static int reportFingerprintGroup(FILE *fpw, FILE *fpList, const char *kind,
+                                  long groupNo, const FINGERPRINT_GROUP *group);
+static void siftFingerprintRunHeap(FINGERPRINT_RUN *runs, int *heap, int heapCount);
+static int groupFingerprintRuns(FINGERPRINT_RUN *runs, int runCount, FILE *fpTmp,
+                                FILE *fpList, FILE *fpw, long burstGap,
+                                long *pBursts, long *pDuplicates);
+static int initPathList(PATH_LIST *list, FILE *fp, int max, unsigned int sampleRate);
+static void freePathList(PATH_LIST *list);
+static int readPathList(PATH_LIST *list);
+static void addStatsTag(TAG_STATISTICS *stats, unsigned int key, long count);
+static void addStatsValue(TAG_STATISTICS *stats, int field, unsigned long long hash,
+                          const char *value, long count);
+static void addHyperLogLog(unsigned char *registers, unsigned long long hash);
+static double estimateHyperLogLog(const unsigned char *registers);
+static void addStatsSize(STATS_SIZE *sizes, unsigned int size);
+static unsigned int getStatsSizePercentile(const STATS_SIZE *sizes, int percent);
+static int formatStatsValue(TagNode *tag, char *buf);
+static void addFileToTagStatistics(TAG_STATISTICS *stats, const char *fileName);
+static void statsBatchFunc(void *ctx, int index);
+static void mergeTagStatistics(TAG_STATISTICS *dst, const TAG_STATISTICS *src);
+static int compareStatsTag(const void *a, const void *b);
+static int compareStatsValue(const void *a, const void *b);
+static int ifdTableArraysHaveSameRawData(void **ifdTableArrayA, void **ifdTableArrayB);
+static int getSortedTagNodes(IfdTable *ifd, TagNode ***pTags);
+static int compareTagNodeValues(TagNode *a, TagNode *b);
+static int addTagDiff(TAG_DIFF_LIST *list, IFD_TYPE ifdType, unsigned short tagId, int kind);
+static int diffIfdTables(IfdTable *a, IfdTable *b, IFD_TYPE ifdType, TAG_DIFF_LIST *list);
+static int diffExifSegmentOfFiles(const char *JPEGFileNameA, const char *JPEGFileNameB,
+                                  TagDiffInfo **pDiffs, void ***pIfdArrayA,
+                                  void ***pIfdArrayB);
+static void formatDiffValue(TagNode *tag, int withType, char *buf, size_t size);
+static int appendReportText(REPORT_TEXT *report, const char *fmt, ...);
+static void diffBatchFunc(void *ctx, int index);
+static IfdTable *getMakerNoteIfd(void **ifdTableArray);
+static void resetMakerNote(IfdTable *ifd);
+static unsigned short getByteOrderInSegment(const unsigned char *p);
+static int getMakerNoteFormat(const unsigned char *p, unsigned int len,
+                              TagNode *make, MAKERNOTE_FORMAT *fmt);
+static int decodeMakerNote(void **ifdTableArray, IfdTable *exif, TagNode *tag,
+                           IfdTable **pIfd);
+static IfdTable *parseMakerNote(FILE *fp, unsigned long long tiffLen,
+                                unsigned long long top, unsigned int count,
+                                unsigned short byteOrder,
+                                const MAKERNOTE_FORMAT *fmt);
+static FILE *openMemoryFile(unsigned char *data, unsigned int length);
+static void writeTagStatistics(FILE *fpw, TAG_STATISTICS *stats, long listed,
+                               unsigned int sampleRate);
+static unsigned short getShortInSegment(const unsigned char *p, int littleEndian);
+static unsigned int getIntInSegment(const unsigned char *p, int littleEndian);
+static unsigned long long getInt64InSegment(const unsigned char *p, int littleEndian);
+static void setShortInSegment(unsigned char *p, unsigned short us, int littleEndian);
+static void setIntInSegment(unsigned char *p, unsigned int ui, int littleEndian);
+static int checkExifSegment(const unsigned char *segment, unsigned int length,
+                            int *pLittleEndian);
+static unsigned char *findTagInSegment(unsigned char *tiff, unsigned int tiffLen,
+                                       int littleEndian, unsigned int ifdOffset,
+                                       unsigned short tagId);
+static unsigned int getIfdEndInSegment(unsigned char *tiff, unsigned int tiffLen,
+                                       int littleEndian, unsigned int ifdOffset,
+                                       int followPointers);
+static unsigned int getIfdEndOnPath(unsigned char *tiff, unsigned int tiffLen,
+                                    int littleEndian, unsigned int ifdOffset,
+                                    int followPointers, unsigned int *path, int depth);
+static RawSegment *loadRawSegment(FILE *fp);
+static void setRawSegmentToIfd(IfdTable *ifd, RawSegment *raw, unsigned int ifdOffset);
+static void releaseRawSegment(IfdTable *ifd);
+static int tagMatchesRawData(TagNode *tag, RawSegment *raw);
+static int tagMatchesField(TagNode *tag, const unsigned char *tiff,
+                           unsigned int tiffLen, int le,
+                           const unsigned char *field);
+static unsigned int getIfdOffsetInSegment(unsigned char *tiff, unsigned int tiffLen,
+                                          int littleEndian, IFD_TYPE ifdType);
+static int verifyExifSegment(const unsigned char *segment, unsigned int length,
+                             void **ifdTableArray);
+static int ifdIsModified(IfdTable *ifd);
+static unsigned int getRawThumbnailOffset(IfdTable *ifd);
+static unsigned int writeIfdToRawData(IfdTable *ifd, unsigned char *tiff,
+                                      unsigned int ofs);
+static void clearOldIfdInRawData(IfdTable *ifd, unsigned char *tiff);
+static unsigned int getOldIfdEndInRawData(IfdTable *ifd);
+static unsigned int getRawValueSlot(IfdTable *ifd, TagNode *tag);
+static int setPointerInRawData(unsigned char *tiff, unsigned int tiffLen,
+                               int littleEndian, unsigned int ifdOffset,
+                               unsigned short tagId, unsigned int value);
+static int buildExifSegmentFromRawData(void **ifdTableArray,
+                                       unsigned char **pSegment,
+                                       unsigned int *pLength);
+static unsigned char *writeExifSegmentToMemory(void **ifdTableArray,
+                                               unsigned int *pLength, int *pResult);
+static int cloneFile(const char *srcFileName, const char *dstFileName);
+static int writeSegmentToClonedFile(const char *inJPEGFileName,
+                                    const char *outJPEGFileName,
+                                    const unsigned char *segment,
+                                    unsigned int length);
+static unsigned char *createExifSegment(void **ifdTableArray,
+                                        unsigned int *pLength, int *pResult);
+static int insertSpaceToFile(FILE *fp, long regionStart, long pos,
+                             long minLength, unsigned int *pLength);
+static int writeZeroToFile(FILE *fp, unsigned int len);
+static int writePaddingSegments(FILE *fp, unsigned int length);
+static void lockStringPool(StringPool *pool, int index);
+static void unlockStringPool(StringPool *pool, int index);
+static PoolString *getPoolString(unsigned char *data);
+static unsigned char *internString(StringPool *pool, const unsigned char *data,
+                                   unsigned int length);
+static int validateIfdInFile(FILE *fp, IFD_TYPE ifdType,
+                             unsigned int *offsets, const char **pReason);
+static void setOutputByteOrderToHeader(void);
 static unsigned short swab16(unsigned short us);
 static void PRINTF(char **ms, const char *fmt, ...);
 static void _dumpIfdTable(void *pIfd, char **p);
 
 static int Verbose = 0;
-static int App1StartOffset = -1;
-static int JpegDQTOffset = -1;
-static APP1_HEADER App1Header;
+static int BatchThreads = 1;
+static int CloneOutput = 0;
+static int VerifyOutput = 0;
+static StringPool *CurrentStringPool = NULL;
+static int OutputByteOrder = OUTPUT_BYTE_ORDER_KEEP;
+static int DurableGroupSize = 0;
+static DURABLE_CALLBACK DurableCallback = NULL;
+static void *DurableUserData = NULL;
+
+// the state of the file currently processed by each thread
+static THREAD_LOCAL int App1StartOffset = -1;
+static THREAD_LOCAL int JpegDQTOffset = -1;
+static THREAD_LOCAL APP1_HEADER App1Header;
+// the TIFF data read out of the Exif segment (TIFF file or MakerNote)
+static THREAD_LOCAL TIFF_FILE_STATE TiffFile;
+static THREAD_LOCAL DURABLE_ENTRY *DurableEntry = NULL;
 
 // public funtions
 
@@ -123,6 +815,112 @@ void setVerbose(int v)
     Verbose = v;
 }
 
+/**
+ * setBatchThreads()
+ *
+ * Set the number of the worker threads used by the batch functions
+ *
+ * parameters
+ *  [in] n : number of the threads (1=process the files sequentially)
+ */
+void setBatchThreads(int n)
+{
+    BatchThreads = (n < 1) ? 1 : n;
+}
+
+/**
+ * setCloneOutput()
+ *
+ * Clone the original JPEG file to create the output file on/off
+ *
+ * parameters
+ *  [in] v : 1=on  0=off
+ *
+ * note
+ * If the size of the Exif segment is not changed, the output file is
+ * created as a clone of the original file (reflink on Linux) and only
+ * the Exif segment is written to it.
+ * updateExifSegmentInJPEGFile() keeps the size if each changed value is
+ * not larger than the original one and no tag is added, since the values
+ * and the IFD tables are overwritten in place.
+ */
+void setCloneOutput(int v)
+{
+    CloneOutput = v;
+}
+
+/**
+ * setDurableOutput()
+ *
+ * Make the output files of the batch functions durable before returning
+ *
+ * parameters
+ *  [in] groupSize : number of the files synced at once (0=off)
+ *  [in] callback : (optional) function called when a group is durable
+ *  [in] userData : passed to the callback
+ *
+ * note
+ * The rewritten files are written to the new temporary files
+ * ("name.<pid>.<thread id>.<n>.tmp")
+ * and renamed after the whole group is synced (syncfs() for each file
+ * system on Linux, fsync() of the files in parallel on the others).
+ * The parent directories of the renamed files are synced once per
+ * group. The files updated in place are synced with the group.
+ * The callback receives the file names of the group and 0 or the error
+ * code, and may be called from the worker threads at the same time.
+ * If the group fails to be durable, the result of each file in it is
+ * ERR_WRITE_FILE.
+ * This affects shiftDateTimeInJPEGFiles() and
+ * updateTagDataInJPEGFilesFromManifest().
+ */
+void setDurableOutput(int groupSize, DURABLE_CALLBACK callback,
+                      void *userData)
+{
+    DurableGroupSize = (groupSize < 0) ? 0 : groupSize;
+    DurableCallback = callback;
+    DurableUserData = userData;
+}
+
+/**
+ * setVerifyOutput()
+ *
+ * Verify the Exif segment before writing it on/off
+ *
+ * parameters
+ *  [in] v : 1=on  0=off
+ *
+ * note
+ * The serialized segment is parsed on memory and compared with the IFD
+ * tables tag by tag, and the offsets of the IFDs and the thumbnail are
+ * checked. updateExifSegmentInJPEGFile() and
+ * updateExifSegmentInJPEGFileInPlace() return ERR_VERIFY_FAILED without
+ * writing the segment if they don't match.
+ */
+void setVerifyOutput(int v)
+{
+    VerifyOutput = v;
+}
+
+/**
+ * setOutputByteOrder()
+ *
+ * Set the byte order of the Exif segment written by the update functions
+ *
+ * parameters
+ *  [in] order : OUTPUT_BYTE_ORDER_KEEP (same as the original file),
+ *               OUTPUT_BYTE_ORDER_LITTLE, OUTPUT_BYTE_ORDER_BIG or
+ *               OUTPUT_BYTE_ORDER_HOST
+ *
+ * note
+ * If the byte order is changed, the whole segment is rebuilt and all
+ * the numeric values and offsets are converted. The data of the
+ * UNDEFINED type (e.g. MakerNote) is written as it is.
+ */
+void setOutputByteOrder(int order)
+{
+    OutputByteOrder = order;
+}
+
 /**
  * removeExifSegmentFromJPEGFile()
  *
@@ -236,126 +1034,39 @@ DONE:
  * return
  *   NULL: error or no Exif segment
  *  !NULL: pointer array of the IFD tables
+ *
+ * note
+ * The TIFF-structured file (e.g. DNG, CR2, NEF, ARW) is also accepted.
+ * The IFDs after the 1st IFD in its chain are read as IFD_NTH tables,
+ * and the SubIFDs of the IFDs in the chain as IFD_SUB tables. Only the
+ * IFDs and the tag values are read, and the image data including the
+ * thumbnail of the 1st IFD are not read.
+ * The IFD tables of the TIFF file can't be written to the file, but
+ * the tags can be copied to the Exif segment of JPEG. The tags locating
+ * the data in the TIFF file (StripOffsets, StripByteCounts, TileOffsets,
+ * TileByteCounts, SubIFDs, and JPEGInterchangeFormat and its length
+ * without the thumbnail data) are dropped when the segment is written,
+ * and all the other tags are written as they are.
+ * The IFDs in the chain of the TIFF file (e.g. the pages of the scanned
+ * document) are decoded by the threads set by setBatchThreads(), each
+ * reading the file with its own file pointer. The chain is walked first
+ * reading only the tag count and the next offset of each IFD, and it stops
+ * at the circular chain with ERR_INVALID_IFD.
+ * BigTIFF with the 64-bit offsets is accepted in the same way. The values
+ * of the LONG8, SLONG8 and IFD8 types are read as LONG or SLONG, and the
+ * tag is treated as an error if a value doesn't fit in 32 bits.
  */
 void **createIfdTableArray(const char *JPEGFileName, int *result)
 {
-    #define FMT_ERR "critical error in %s IFD\n"
-
-    int i, sts = 1, ifdCount = 0;
-    unsigned int ifdOffset;
-    FILE *fp = NULL;
-    TagNode *tag;
-    void **ppIfdArray = NULL;
-    void *ifdArray[32];
-    IfdTable *ifd_0th, *ifd_exif, *ifd_gps, *ifd_io, *ifd_1st;
-
-    ifd_0th = ifd_exif = ifd_gps = ifd_io = ifd_1st = NULL;
-    memset(ifdArray, 0, sizeof(ifdArray));
-
-    fp = fopen(JPEGFileName, "rb");
+    void **ifdArray;
+    FILE *fp = fopen(JPEGFileName, "rb");
     if (!fp) {
-        sts = ERR_READ_FILE;
-        goto DONE;
-    }
-    sts = init(fp);
-    if (sts <= 0) {
-        goto DONE;
-    }
-    if (Verbose) {
-        printf("system: %s-endian\n  data: %s-endian\n", 
-            systemIsLittleEndian() ? "little" : "big",
-            dataIsLittleEndian() ? "little" : "big");
-    }
-
-    // for 0th IFD
-    ifd_0th = parseIFD(fp, App1Header.tiff.Ifd0thOffset, IFD_0TH);
-    if (!ifd_0th) {
-        if (Verbose) {
-            printf(FMT_ERR, "0th");
-        }
-        sts = ERR_INVALID_IFD;
-        goto DONE; // non-continuable
-    }
-    ifdArray[ifdCount++] = ifd_0th;
-
-    // for Exif IFD 
-    tag = getTagNodePtrFromIfd(ifd_0th, TAG_ExifIFDPointer);
-    if (tag && !tag->error) {
-        ifdOffset = tag->numData[0];
-        if (ifdOffset != 0) {
-            ifd_exif = parseIFD(fp, ifdOffset, IFD_EXIF);
-            if (ifd_exif) {
-                ifdArray[ifdCount++] = ifd_exif;
-                // for InteroperabilityIFDPointer IFD
-                tag = getTagNodePtrFromIfd(ifd_exif, TAG_InteroperabilityIFDPointer);
-                if (tag && !tag->error) {
-                    ifdOffset = tag->numData[0];
-                    if (ifdOffset != 0) {
-                        ifd_io = parseIFD(fp, ifdOffset, IFD_IO);
-                        if (ifd_io) {
-                            ifdArray[ifdCount++] = ifd_io;
-                        } else {
-                            if (Verbose) {
-                                printf(FMT_ERR, "Interoperability");
-                            }
-                            sts = ERR_INVALID_IFD;
-                        }
-                    }
-                }
-            } else {
-                if (Verbose) {
-                    printf(FMT_ERR, "Exif");
-                }
-                sts = ERR_INVALID_IFD;
-            }
-        }
-    }
-
-    // for GPS IFD
-    tag = getTagNodePtrFromIfd(ifd_0th, TAG_GPSInfoIFDPointer);
-    if (tag && !tag->error) {
-        ifdOffset = tag->numData[0];
-        if (ifdOffset != 0) {
-            ifd_gps = parseIFD(fp, ifdOffset, IFD_GPS);
-            if (ifd_gps) {
-                ifdArray[ifdCount++] = ifd_gps;
-            } else {
-                if (Verbose) {
-                    printf(FMT_ERR, "GPS");
-                }
-                sts = ERR_INVALID_IFD;
-            }
-        }
-    }
-
-    // for 1st IFD
-    ifdOffset = ifd_0th->nextIfdOffset;
-    if (ifdOffset != 0) {
-        ifd_1st = parseIFD(fp, ifdOffset, IFD_1ST);
-        if (ifd_1st) {
-            ifdArray[ifdCount++] = ifd_1st;
-        } else {
-            if (Verbose) {
-                printf(FMT_ERR, "1st");
-            }
-            sts = ERR_INVALID_IFD;
-        }
-    }
-
-DONE:
-    *result = (sts <= 0) ? sts : ifdCount;
-    if (ifdCount > 0) {
-        // +1 extra NULL element to the array 
-        ppIfdArray = (void**)malloc(sizeof(void*)*(ifdCount+1));
-        memset(ppIfdArray, 0, sizeof(void*)*(ifdCount+1));
-        for (i = 0; ifdArray[i] != NULL; i++) {
-            ppIfdArray[i] = ifdArray[i];
-        }
-    }
-    if (fp) {
-        fclose(fp);
+        *result = ERR_READ_FILE;
+        return NULL;
     }
-    return ppIfdArray;
+    ifdArray = createIfdTableArrayFromFile(fp, JPEGFileName, result);
+    fclose(fp);
+    return ifdArray;
 }
 
 /**
@@ -436,7 +1147,10 @@ static void _dumpIfdTable(void *pIfd, char **p)
         (ifd->ifdType == IFD_1ST)  ? "1ST" :
         (ifd->ifdType == IFD_EXIF) ? "EXIF" :
         (ifd->ifdType == IFD_GPS)  ? "GPS" :
-        (ifd->ifdType == IFD_IO)   ? "Interoperability" : "");
+        (ifd->ifdType == IFD_IO)   ? "Interoperability" :
+        (ifd->ifdType == IFD_MAKERNOTE) ? "MakerNote" :
+        (ifd->ifdType == IFD_SUB)  ? "Sub" :
+        (ifd->ifdType == IFD_NTH)  ? "NTH" : "");
 
     if (Verbose) {
         PRINTF(p, " tags=%u\n", ifd->tagCount);
@@ -572,6 +1286,9 @@ void dumpIfdTableArray(void **ifdArray)
  * return
  *   NULL: tag is not found
  *  !NULL: address of the TagNodeInfo structure
+ *
+ * note
+ * IFD_MAKERNOTE gets the tag in the MakerNote (see getMakerNoteVendor()).
  */
 TagNodeInfo *getTagInfo(void **ifdArray,
                        IFD_TYPE ifdType,
@@ -581,6 +1298,10 @@ TagNodeInfo *getTagInfo(void **ifdArray,
     if (!ifdArray) {
         return NULL;
     }
+    if (ifdType == IFD_MAKERNOTE) {
+        void *targetTag = getTagNodePtrFromIfd(getMakerNoteIfd(ifdArray), tagId);
+        return (targetTag) ? (TagNodeInfo*)duplicateTagNode(targetTag) : NULL;
+    }
     for (i = 0; ifdArray[i] != NULL; i++) {
         if (getIfdType(ifdArray[i]) == ifdType) {
             void *targetTag = getTagNodePtrFromIfd(ifdArray[i], tagId);
@@ -647,19 +1368,81 @@ int queryTagNodeIsExist(void **ifdTableArray,
                         unsigned short tagId)
 {
     IfdTable *ifd;
-    TagNode *tag;
     if (!ifdTableArray) {
         return 0;
     }
-    ifd = getIfdTableFromIfdTableArray(ifdTableArray, ifdType);
+    if (ifdType == IFD_MAKERNOTE) {
+        ifd = getMakerNoteIfd(ifdTableArray);
+    } else {
+        ifd = getIfdTableFromIfdTableArray(ifdTableArray, ifdType);
+    }
     if (!ifd) {
         return 0;
     }
-    tag = getTagNodePtrFromIfd(ifd, tagId);
-    if (!tag) {
+    return tagIsPresent(ifd, tagId);
+}
+
+/**
+ * queryTagNodesExist()
+ *
+ * Query if each of the specified tag nodes is exist in the IFD table
+ *
+ * parameters
+ *  [in] ifdTableArray: address of the IFD tables array
+ *  [in] ifdType : target IFD type
+ *  [in] tagIds : array of the target tag IDs
+ *  [in] count : number of the tag IDs
+ *  [out] results : (optional) array to receive 1 (exist) or 0 (not exist)
+ *                  for each tag ID
+ *
+ * return
+ *  number of the existing tags (count if all of them exist)
+ */
+int queryTagNodesExist(void **ifdTableArray,
+                       IFD_TYPE ifdType,
+                       const unsigned short *tagIds,
+                       int count,
+                       int *results)
+{
+    IfdTable *ifd;
+    unsigned int query[TAG_PRESENCE_WORDS];
+    int i, w, bit, num = 0, exist;
+
+    if (ifdType == IFD_MAKERNOTE) {
+        ifd = getMakerNoteIfd(ifdTableArray);
+    } else {
+        ifd = getIfdTableFromIfdTableArray(ifdTableArray, ifdType);
+    }
+    if (!ifd || !tagIds || count <= 0) {
+        if (results && count > 0) {
+            memset(results, 0, sizeof(int) * count);
+        }
         return 0;
     }
-    return 1;
+    // the known tags are answered by the bitmap at once
+    memset(query, 0, sizeof(query));
+    for (i = 0; i < count; i++) {
+        bit = getTagPresenceBit(ifdType, tagIds[i]);
+        if (bit >= 0) {
+            query[bit >> 5] |= 1u << (bit & 31);
+        }
+    }
+    for (w = 0; w < TAG_PRESENCE_WORDS; w++) {
+        query[w] &= ifd->presence[w];
+    }
+    for (i = 0; i < count; i++) {
+        bit = getTagPresenceBit(ifdType, tagIds[i]);
+        if (bit >= 0) {
+            exist = (query[bit >> 5] >> (bit & 31)) & 1;
+        } else {
+            exist = tagIsPresent(ifd, tagIds[i]);
+        }
+        if (results) {
+            results[i] = exist;
+        }
+        num += exist;
+    }
+    return num;
 }
 
 /**
@@ -767,7 +1550,7 @@ int removeIfdTableFromIfdTableArray(void **ifdTableArray, IFD_TYPE ifdType)
             break; // no more found
         }
         // left justify the array
-        memcpy(&ifdTableArray[i], &ifdTableArray[i+1], (num-i) * sizeof(void*));
+        memmove(&ifdTableArray[i], &ifdTableArray[i+1], (num-i) * sizeof(void*));
         num--;
     }
     return ret;
@@ -784,6 +1567,7 @@ int removeIfdTableFromIfdTableArray(void **ifdTableArray, IFD_TYPE ifdType)
  *  [out] pResult : error status
  *   0: OK
  *  -n: error
+ *      ERR_INVALID_IFD
  *      ERR_ALREADY_EXIST
  *      ERR_MEMALLOC
  *
@@ -801,6 +1585,13 @@ void **insertIfdTableToIfdTableArray(void **ifdTableArray,
     void *newIfd;
     void **newIfdTableArray;
     int num = 0;
+    if (ifdType < IFD_0TH || ifdType > IFD_IO) {
+        // the MakerNote IFD is decoded from the tag and is not in the array
+        if (pResult) {
+            *pResult = ERR_INVALID_IFD;
+        }
+        return NULL;
+    }
     if (!ifdTableArray) {
         num = 0;
     } else {
@@ -918,6 +1709,7 @@ int insertTagNodeToIfdTableArray(void **ifdTableArray,
         return ERR_UNKNOWN;
     }
     ifd->tagCount++;
+    ifd->modified = 1;
     return 0;
 }
 
@@ -1032,6 +1824,7 @@ int setThumbnailDataOnIfdTableArray(void **ifdTableArray,
     if (ifd->p) {
         free(ifd->p);
     }
+    ifd->modified = 1;
     // set thumbnail length;
     tag = getTagNodePtrFromIfd(ifd, TAG_JPEGInterchangeFormatLength);
     if (tag) {
@@ -1076,7 +1869,16 @@ int setThumbnailDataOnIfdTableArray(void **ifdTableArray,
  *      ERR_INVALID_JPEG
  *      ERR_INVALID_APP1HEADER
  *      ERR_INVALID_POINTER
+ *      ERR_VERIFY_FAILED
  *      ERROR_UNKNOWN:
+ *
+ * note
+ * If the IFD tables are created by createIfdTableArray(), the original
+ * data of the unmodified IFD tables and tag values are written as they
+ * are. The modified IFD tables are rewritten at the original offset, or
+ * appended to the segment only if they have grown.
+ * The whole segment is rebuilt if an IFD table is added or removed, or
+ * the segment would be too large.
  */
 int updateExifSegmentInJPEGFile(const char *inJPEGFileName,
                                 const char *outJPGEFileName,
@@ -1085,13 +1887,12 @@ int updateExifSegmentInJPEGFile(const char *inJPEGFileName,
     int ofs;
     int i, sts = 1, hasExifSegment;
     size_t readLen, writeLen;
-    unsigned char buf[8192], *p;
+    unsigned char buf[8192], *p, *segment = NULL;
+    unsigned int segmentLength = 0;
     FILE *fpr = NULL, *fpw = NULL;
 
-    // refresh the length and offset variables in the IFD table
-    sts = fixLengthAndOffsetInIfdTables(ifdTableArray);
-    if (sts != 0) {
-        goto DONE;
+    if (!ifdTableArray) {
+        return ERR_INVALID_POINTER;
     }
     fpr = fopen(inJPEGFileName, "rb");
     if (!fpr) {
@@ -1102,10 +1903,52 @@ int updateExifSegmentInJPEGFile(const char *inJPEGFileName,
     if (sts < 0) {
         goto DONE;
     }
-    if (sts == 0) {
-        hasExifSegment = 0;
-        ofs = JpegDQTOffset;
-    } else {
+    setOutputByteOrderToHeader();
+    // copy the original data of the unmodified IFD tables if possible
+    i = buildExifSegmentFromRawData(ifdTableArray, &segment, &segmentLength);
+    if (i < 0) {
+        sts = i;
+        goto DONE;
+    }
+    if (i == 0) {
+        // refresh the length and offset variables in the IFD table
+        for (i = 0; ifdTableArray[i] != NULL; i++) {
+            releaseRawSegment(ifdTableArray[i]);
+        }
+        i = fixLengthAndOffsetInIfdTables(ifdTableArray);
+        if (i != 0) {
+            sts = i;
+            goto DONE;
+        }
+        if ((CloneOutput && sts > 0) || VerifyOutput) {
+            segment = writeExifSegmentToMemory(ifdTableArray, &segmentLength, &i);
+            if (!segment && i < 0) {
+                sts = i;
+                goto DONE;
+            }
+        }
+    }
+    if (VerifyOutput && segment) {
+        i = verifyExifSegment(segment, segmentLength, ifdTableArray);
+        if (i < 0) {
+            sts = i;
+            goto DONE;
+        }
+    }
+    if (CloneOutput && sts > 0 && segment &&
+        segmentLength == sizeof(App1Header.marker) + App1Header.length) {
+        // the layout of the file is not changed
+        // (the modified IFD tables are rewritten in place in the segment)
+        fclose(fpr);
+        fpr = NULL;
+        sts = writeSegmentToClonedFile(inJPEGFileName, outJPGEFileName,
+                                       segment, segmentLength);
+        goto DONE;
+    }
+    if (sts == 0) {
+        hasExifSegment = 0;
+        ofs = JpegDQTOffset;
+    } else {
         hasExifSegment = 1;
         ofs = App1StartOffset;
     }
@@ -1140,9 +1983,16 @@ int updateExifSegmentInJPEGFile(const char *inJPEGFileName,
         }
     }
     // write new Exif segment
-    sts = writeExifSegment(fpw, ifdTableArray);
-    if (sts != 0) {
-        goto DONE;
+    if (segment) {
+        if (fwrite(segment, 1, segmentLength, fpw) != segmentLength) {
+            sts = ERR_WRITE_FILE;
+            goto DONE;
+        }
+    } else {
+        sts = writeExifSegment(fpw, ifdTableArray);
+        if (sts != 0) {
+            goto DONE;
+        }
     }
     sts = 1;
     if (hasExifSegment) {
@@ -1165,175 +2015,7868 @@ int updateExifSegmentInJPEGFile(const char *inJPEGFileName,
             goto DONE;
         }
     }
-DONE:
-    if (fpw) {
-        fclose(fpw);
+DONE:
+    if (segment) {
+        free(segment);
+    }
+    if (fpw) {
+        fclose(fpw);
+    }
+    if (fpr) {
+        fclose(fpr);
+    }
+    return sts;
+}
+
+/**
+ * removeAdobeMetadataSegmentFromJPEGFile()
+ *
+ * Remove Adobe's XMP metadata segment from a JPEG file
+ *
+ * parameters
+ *  [in] inJPEGFileName : original JPEG file
+ *  [in] outJPGEFileName : output JPEG file
+ *
+ * return
+ *   1: OK
+ *   0: Adobe's metadata segment is not found
+ *  -n: error
+ *      ERR_READ_FILE
+ *      ERR_WRITE_FILE
+ *      ERR_INVALID_JPEG
+ *      ERR_INVALID_APP1HEADER
+ */
+int removeAdobeMetadataSegmentFromJPEGFile(const char *inJPEGFileName,
+                                           const char *outJPGEFileName)
+{
+#define ADOBE_METADATA_ID     "http://ns.adobe.com/xap/"
+#define ADOBE_METADATA_ID_LEN 24
+
+    typedef struct _SegmentHeader {
+        unsigned short marker;
+        unsigned short length;
+    } SEGMENT_HEADER;
+
+    SEGMENT_HEADER hdr;
+    int i, sts = 1;
+    size_t readLen, writeLen;
+    unsigned int ofs;
+    unsigned char buf[8192], *p;
+    FILE *fpr = NULL, *fpw = NULL;
+
+    fpr = fopen(inJPEGFileName, "rb");
+    if (!fpr) {
+        sts = ERR_READ_FILE;
+        goto DONE;
+    }
+    sts = getApp1StartOffset(fpr, ADOBE_METADATA_ID, ADOBE_METADATA_ID_LEN, NULL);
+    if (sts <= 0) { // target segment is not exist or something error
+        goto DONE;
+    }
+    ofs = sts;
+    sts = 1;
+    fpw = fopen(outJPGEFileName, "wb");
+    if (!fpw) {
+        sts = ERR_WRITE_FILE;
+        goto DONE;
+    }
+    // copy the data in front of the App1 segment
+    rewind(fpr);
+    p = buf;
+    if (ofs > sizeof(buf)) {
+        // allocate new buffer if needed
+        p = (unsigned char*)malloc(ofs);
+    }
+    if (!p) {
+        for (i = 0; i < (int)ofs; i++) {
+            fread(buf, 1, sizeof(char), fpr);
+            fwrite(buf, 1, sizeof(char), fpw);
+        }
+    } else {
+        if (fread(p, 1, ofs, fpr) < (size_t)ofs) {
+            sts = ERR_READ_FILE;
+            goto DONE;
+        }
+        if (fwrite(p, 1, ofs, fpw) < (size_t)ofs) {
+            sts = ERR_WRITE_FILE;
+            goto DONE;
+        }
+        if (p != &buf[0]) {
+            free(p);
+        }
+    }
+    if (fread(&hdr, 1, sizeof(SEGMENT_HEADER), fpr) != sizeof(SEGMENT_HEADER)) {
+        sts = ERR_READ_FILE;
+        goto DONE;
+    }
+    if (systemIsLittleEndian()) {
+        // the segment length value is always in big-endian order
+        hdr.length = swab16(hdr.length);
+    }
+    // seek to the end of the App1 segment
+    if (fseek(fpr, hdr.length - sizeof(hdr.length), SEEK_CUR) != 0) {
+        sts = ERR_READ_FILE;
+        goto DONE;
+    }
+    // read & write
+    for (;;) {
+        readLen = fread(buf, 1, sizeof(buf), fpr);
+        if (readLen <= 0) {
+            break;
+        }
+        writeLen = fwrite(buf, 1, readLen, fpw);
+        if (writeLen != readLen) {
+            sts = ERR_WRITE_FILE;
+            goto DONE;
+        }
+    }
+DONE:
+    if (fpw) {
+        fclose(fpw);
+    }
+    if (fpr) {
+        fclose(fpr);
+    }
+    return sts;
+}
+
+/**
+ * removeGPSIfdFromJPEGFileInPlace()
+ *
+ * Remove the GPS IFD from a JPEG file without rewriting the file
+ *
+ * parameters
+ *  [in] JPEGFileName : target JPEG file (overwritten)
+ *
+ * return
+ *   1: OK
+ *   0: the Exif segment or the GPS IFD is not found
+ *  -n: error
+ *      ERR_READ_FILE
+ *      ERR_WRITE_FILE
+ *      ERR_INVALID_JPEG
+ *      ERR_INVALID_APP1HEADER
+ *      ERR_INVALID_IFD
+ *      ERR_MEMALLOC
+ *
+ * note
+ * The bytes of the GPS IFD and its values are cleared with zero, and
+ * the GPSInfoIFDPointer tag is removed from the 0th IFD by shifting the
+ * following tag fields and the offset of the next IFD up by a field.
+ * The 12 bytes freed at the end of the 0th IFD are cleared with zero.
+ * The size of the Exif segment and the offsets of the other data are
+ * not changed, so calling this function again for the same file simply
+ * returns 0.
+ */
+int removeGPSIfdFromJPEGFileInPlace(const char *JPEGFileName)
+{
+    int sts;
+    unsigned short tagCount;
+    unsigned int fieldOfs, ifdOfs, ifdSize, index;
+    unsigned char *dir = NULL;
+    IFD_TAG tagField;
+    FILE *fp = NULL;
+
+    fp = fopen(JPEGFileName, "r+b");
+    if (!fp) {
+        sts = ERR_READ_FILE;
+        goto DONE;
+    }
+    sts = init(fp);
+    if (sts <= 0) {
+        goto DONE;
+    }
+    // find the GPSInfoIFDPointer tag field in the 0th IFD
+    sts = findTagFieldInIfd(fp, App1Header.tiff.Ifd0thOffset,
+                            TAG_GPSInfoIFDPointer, &tagField, &fieldOfs);
+    if (sts <= 0) {
+        goto DONE;
+    }
+    if (tagField.type != TYPE_LONG || tagField.count != 1) {
+        sts = ERR_INVALID_IFD;
+        goto DONE;
+    }
+    // read the whole 0th IFD (the tag count, the fields and the offset
+    // of the next IFD)
+    ifdOfs = App1Header.tiff.Ifd0thOffset;
+    if (seekToRelativeOffset(fp, ifdOfs) != 0 ||
+        fread(&tagCount, 1, sizeof(short), fp) < sizeof(short)) {
+        sts = ERR_READ_FILE;
+        goto DONE;
+    }
+    tagCount = fix_short(tagCount);
+    ifdSize = sizeof(short) + sizeof(IFD_TAG) * tagCount + sizeof(int);
+    index = (fieldOfs - ifdOfs - sizeof(short)) / sizeof(IFD_TAG);
+    dir = (unsigned char*)malloc(ifdSize);
+    if (!dir) {
+        sts = ERR_MEMALLOC;
+        goto DONE;
+    }
+    if (index >= tagCount || seekToRelativeOffset(fp, ifdOfs) != 0 ||
+        fread(dir, 1, ifdSize, fp) < ifdSize) {
+        sts = ERR_READ_FILE;
+        goto DONE;
+    }
+    // clear the GPS IFD first, so that the pointer never refers to
+    // the partially cleared data. the 0th IFD is kept untouched
+    if (tagField.offset != 0) {
+        sts = clearIfdInFile(fp, tagField.offset, ifdOfs, ifdSize);
+        if (sts != 0) {
+            goto DONE;
+        }
+    }
+    // remove the field and write the 0th IFD at once
+    memmove(dir + fieldOfs - ifdOfs, dir + fieldOfs - ifdOfs + sizeof(IFD_TAG),
+            ifdSize - (fieldOfs - ifdOfs) - sizeof(IFD_TAG));
+    memset(dir + ifdSize - sizeof(IFD_TAG), 0, sizeof(IFD_TAG));
+    tagCount = fix_short((unsigned short)(tagCount - 1));
+    memcpy(dir, &tagCount, sizeof(short));
+    if (seekToRelativeOffset(fp, ifdOfs) != 0 ||
+        fwrite(dir, 1, ifdSize, fp) != ifdSize) {
+        sts = ERR_WRITE_FILE;
+        goto DONE;
+    }
+    sts = 1;
+DONE:
+    free(dir);
+    if (fp) {
+        if (fclose(fp) != 0 && sts > 0) {
+            sts = ERR_WRITE_FILE;
+        }
+    }
+    return sts;
+}
+
+/**
+ * updateTagDataInJPEGFileInPlace()
+ *
+ * Overwrite the value of the existing tag in a JPEG file without
+ * rewriting the file
+ *
+ * parameters
+ *  [in] JPEGFileName : target JPEG file (overwritten)
+ *  [in] ifdType : target IFD type
+ *  [in] tagNodeInfo : address of the TagNodeInfo holding the new value
+ *
+ * return
+ *   1: OK
+ *   0: the Exif segment is not found
+ *  -n: error
+ *      ERR_READ_FILE
+ *      ERR_WRITE_FILE
+ *      ERR_INVALID_JPEG
+ *      ERR_INVALID_APP1HEADER
+ *      ERR_INVALID_IFD
+ *      ERR_INVALID_ID      : the tag holds an offset to other data
+ *      ERR_INVALID_TYPE    : the type differs from the existing tag
+ *      ERR_INVALID_COUNT   : the count differs from the existing tag
+ *      ERR_INVALID_POINTER
+ *      ERR_NOT_EXIST       : the IFD or the tag is not found
+ *      ERR_MEMALLOC
+ *
+ * note
+ * Only the value whose size is not changed can be updated by this
+ * function. The value is written in the byte order of the file.
+ */
+int updateTagDataInJPEGFileInPlace(const char *JPEGFileName,
+                                   IFD_TYPE ifdType,
+                                   TagNodeInfo *tagNodeInfo)
+{
+    int sts;
+    FILE *fp = NULL;
+
+    if (!tagNodeInfo || tagNodeInfo->error) {
+        return ERR_INVALID_POINTER;
+    }
+    if (isOffsetTag(ifdType, tagNodeInfo->tagId)) {
+        return ERR_INVALID_ID;
+    }
+    fp = fopen(JPEGFileName, "r+b");
+    if (!fp) {
+        return ERR_READ_FILE;
+    }
+    sts = init(fp);
+    if (sts > 0) {
+        sts = updateTagDataInFile(fp, ifdType, (TagNode*)tagNodeInfo, 0);
+    }
+    if (fclose(fp) != 0 && sts > 0) {
+        sts = ERR_WRITE_FILE;
+    }
+    return sts;
+}
+
+/**
+ * shiftDateTimeInJPEGFile()
+ *
+ * Shift the date and time tags in a JPEG file by the specified seconds
+ *
+ * parameters
+ *  [in] JPEGFileName : target JPEG file (overwritten)
+ *  [in] seconds : seconds to add (negative value to go back)
+ *  [in] flags : combination of the following values
+ *      SHIFT_DATETIME_GPS    : also shift GPSDateStamp and GPSTimeStamp
+ *      SHIFT_DATETIME_DRYRUN : only report, do not modify the file
+ *  [in] make : target Make string, or NULL for any camera
+ *  [in] model : target Model string, or NULL for any camera
+ *  [in] serial : target BodySerialNumber string, or NULL for any camera
+ *  [in] reportFileName : file to write the shifted values,
+ *                        or NULL to write to stdout
+ *
+ * return
+ *   n: number of the shifted tags
+ *   0: the Exif segment or the tags are not found, or the camera
+ *      does not match
+ *  -n: error
+ *      ERR_READ_FILE
+ *      ERR_WRITE_FILE
+ *      ERR_INVALID_JPEG
+ *      ERR_INVALID_APP1HEADER
+ *      ERR_INVALID_IFD
+ *      ERR_MEMALLOC
+ *
+ * note
+ * DateTime, DateTimeOriginal and DateTimeDigitized are updated in place
+ * as the values keep their length. Only if the value is shorter than
+ * the standard format, the whole file is rewritten.
+ * The report has a line for each shifted tag in dry-run mode (or if
+ * setVerbose() is on):
+ *   "[path] name: old value -> new value"
+ */
+int shiftDateTimeInJPEGFile(const char *JPEGFileName,
+                            long seconds,
+                            int flags,
+                            const char *make,
+                            const char *model,
+                            const char *serial,
+                            const char *reportFileName)
+{
+    int sts, result;
+    REPORT_TEXT report;
+
+    memset(&report, 0, sizeof(report));
+    sts = shiftDateTimeToReport(JPEGFileName, seconds, flags,
+                                make, model, serial, &report);
+    result = writeReportText(&report, reportFileName);
+    if (result < 0 && sts >= 0) {
+        sts = result;
+    }
+    free(report.text);
+    return sts;
+}
+
+// shiftDateTimeInJPEGFile() appending the shifted values to the report
+static int shiftDateTimeToReport(const char *JPEGFileName,
+                                 long seconds,
+                                 int flags,
+                                 const char *make,
+                                 const char *model,
+                                 const char *serial,
+                                 REPORT_TEXT *report)
+{
+    static const struct {
+        IFD_TYPE ifdType;
+        unsigned short tagId;
+    } targets[] = {
+        { IFD_0TH,  TAG_DateTime },
+        { IFD_EXIF, TAG_DateTimeOriginal },
+        { IFD_EXIF, TAG_DateTimeDigitized },
+    };
+    #define DATETIME_TARGETS (sizeof(targets) / sizeof(targets[0]))
+
+    int i, sts, num = 0, rewrite = 0;
+    unsigned int ifdOfs, fieldOfs, valueOfs;
+    char value[32], newValue[DATETIME_TARGETS][32];
+    IFD_TAG tagField;
+    FILE *fp = NULL;
+
+    memset(newValue, 0, sizeof(newValue));
+    fp = fopen(JPEGFileName, (flags & SHIFT_DATETIME_DRYRUN) ? "rb" : "r+b");
+    if (!fp) {
+        sts = ERR_READ_FILE;
+        goto DONE;
+    }
+    sts = init(fp);
+    if (sts <= 0) {
+        goto DONE;
+    }
+    // check the camera
+    if (!asciiTagInFileMatches(fp, IFD_0TH, TAG_Make, make) ||
+        !asciiTagInFileMatches(fp, IFD_0TH, TAG_Model, model) ||
+        !asciiTagInFileMatches(fp, IFD_EXIF, TAG_BodySerialNumber, serial)) {
+        sts = 0;
+        goto DONE;
+    }
+    for (i = 0; i < (int)DATETIME_TARGETS; i++) {
+        if (getIfdOffsetInFile(fp, targets[i].ifdType, &ifdOfs) <= 0 ||
+            findTagFieldInIfd(fp, ifdOfs, targets[i].tagId,
+                              &tagField, &fieldOfs) <= 0 ||
+            tagField.type != TYPE_ASCII || tagField.count <= 4) {
+            continue;
+        }
+        valueOfs = tagField.offset;
+        if (readAsciiValueInFile(fp, valueOfs, tagField.count,
+                                 value, sizeof(value)) != 0 ||
+            !shiftDateTimeString(value, seconds, newValue[i])) {
+            continue;
+        }
+        num++;
+        if (reportShiftedValue(report, JPEGFileName, targets[i].ifdType,
+                        targets[i].tagId, value, newValue[i], flags) != 0) {
+            sts = ERR_MEMALLOC;
+            goto DONE;
+        }
+        if (flags & SHIFT_DATETIME_DRYRUN) {
+            newValue[i][0] = '\0';
+            continue;
+        }
+        // the standard format "YYYY:MM:DD HH:MM:SS" can be overwritten
+        // as long as the value has enough length
+        if (tagField.count >= DATETIME_LENGTH - 1) {
+            if (seekToRelativeOffset(fp, valueOfs) != 0 ||
+                fwrite(newValue[i], 1, DATETIME_LENGTH - 1, fp) != DATETIME_LENGTH - 1) {
+                sts = ERR_WRITE_FILE;
+                goto DONE;
+            }
+            newValue[i][0] = '\0';
+        } else {
+            rewrite = 1;
+        }
+    }
+    if (flags & SHIFT_DATETIME_GPS) {
+        sts = shiftGPSDateTimeInFile(fp, JPEGFileName, seconds, flags, report);
+        if (sts < 0) {
+            goto DONE;
+        }
+        num += sts;
+    }
+    sts = num;
+    if (fclose(fp) != 0) {
+        fp = NULL;
+        sts = ERR_WRITE_FILE;
+        goto DONE;
+    }
+    fp = NULL;
+
+    // rewrite the file for the values which have the irregular length
+    if (rewrite) {
+        IFD_TYPE ifdTypes[DATETIME_TARGETS];
+        TagNode *tags[DATETIME_TARGETS];
+        int result, cnt = 0;
+        for (i = 0; i < (int)DATETIME_TARGETS; i++) {
+            if (newValue[i][0] == '\0') {
+                continue;
+            }
+            tags[cnt] = (TagNode*)createTagInfo(targets[i].tagId, TYPE_ASCII,
+                                                DATETIME_LENGTH, &result);
+            if (!tags[cnt]) {
+                sts = result;
+                break;
+            }
+            memcpy(tags[cnt]->byteData, newValue[i], DATETIME_LENGTH);
+            ifdTypes[cnt++] = targets[i].ifdType;
+        }
+        if (sts >= 0) {
+            result = rewriteTagsInJPEGFile(JPEGFileName, ifdTypes, tags, cnt);
+            if (result < 0) {
+                sts = result;
+            }
+        }
+        for (i = 0; i < cnt; i++) {
+            freeTagNode(tags[i]);
+        }
+    }
+DONE:
+    if (fp) {
+        fclose(fp);
+    }
+    return sts;
+}
+
+/**
+ * shiftDateTimeInJPEGFiles()
+ *
+ * Shift the date and time tags in the JPEG files by the specified seconds
+ *
+ * parameters
+ *  [in] JPEGFileNames : array of the target JPEG files
+ *  [in] count : number of the files
+ *  [in] seconds, flags, make, model, serial :
+ *       same as shiftDateTimeInJPEGFile()
+ *  [out] results : (optional) array to receive the result of each file.
+ *                  see shiftDateTimeInJPEGFile()
+ *  [in] reportFileName : file to write the shifted values,
+ *                        or NULL to write to stdout
+ *
+ * return
+ *   n: number of the files which have the shifted tags
+ *  -n: error
+ *      ERR_WRITE_FILE
+ *      ERR_MEMALLOC
+ *
+ * note
+ * The files are processed by the threads set by setBatchThreads(), and
+ * the report is written in the order of the files.
+ */
+int shiftDateTimeInJPEGFiles(const char **JPEGFileNames,
+                             int count,
+                             long seconds,
+                             int flags,
+                             const char *make,
+                             const char *model,
+                             const char *serial,
+                             int *results,
+                             const char *reportFileName)
+{
+    int i, num = 0;
+    SHIFT_DATETIME_BATCH batch;
+    FILE *fpw;
+
+    if (!JPEGFileNames || count <= 0) {
+        return 0;
+    }
+    batch.fileNames = JPEGFileNames;
+    batch.seconds = seconds;
+    batch.flags = flags;
+    batch.make = make;
+    batch.model = model;
+    batch.serial = serial;
+    batch.results = (int*)malloc(sizeof(int) * count);
+    batch.reports = (REPORT_TEXT*)calloc(count, sizeof(REPORT_TEXT));
+    batch.durable = NULL;
+    if (!batch.results || !batch.reports ||
+        createDurableGroup(count, &batch.durable) != 0) {
+        num = ERR_MEMALLOC;
+        goto DONE;
+    }
+    runBatch(shiftDateTimeBatchFunc, &batch, count);
+    finishDurableGroup(batch.durable);
+    for (i = 0; i < count; i++) {
+        if (batch.results[i] > 0) {
+            num++;
+        }
+        if (results) {
+            results[i] = batch.results[i];
+        }
+    }
+    // write the report
+    fpw = (reportFileName) ? fopen(reportFileName, "w") : stdout;
+    if (!fpw) {
+        num = ERR_WRITE_FILE;
+        goto DONE;
+    }
+    for (i = 0; i < count; i++) {
+        fwrite(batch.reports[i].text, 1, batch.reports[i].length, fpw);
+    }
+    if (fpw != stdout && fclose(fpw) != 0) {
+        num = ERR_WRITE_FILE;
+    }
+DONE:
+    if (batch.reports) {
+        for (i = 0; i < count; i++) {
+            free(batch.reports[i].text);
+        }
+    }
+    free(batch.reports);
+    free(batch.results);
+    return num;
+}
+
+/**
+ * updateTagDataInJPEGFilesFromManifest()
+ *
+ * Update the tags in the JPEG files listed in the manifest file
+ *
+ * parameters
+ *  [in] manifestFileName : manifest file (CSV)
+ *  [in] reportFileName : file to write the result of each JPEG file,
+ *                        or NULL to write to stdout
+ *
+ * return
+ *   n: number of the successfully updated JPEG files
+ *  -n: error
+ *      ERR_READ_FILE  : failed to read the manifest file
+ *      ERR_WRITE_FILE : failed to create the report file
+ *      ERR_MEMALLOC
+ *
+ * note
+ * Each line of the manifest is "path,ifd,tag,type,value".
+ *   ifd   : 0th, 1st, exif, gps or io
+ *   tag   : tag ID (e.g. 0x8298)
+ *   type  : byte, ascii, short, long, rational, sbyte, undefined,
+ *           sshort, slong, srational or the type number
+ *   value : string for ascii and undefined. numbers separated by spaces
+ *           for the others ("n/d" for rational)
+ * The path and the value can be quoted with '"'. Empty lines and
+ * lines beginning with '#' are ignored.
+ * The edits are grouped per JPEG file. All the edits of a file are
+ * checked before writing. The values are overwritten in place if none
+ * of their sizes is changed, otherwise the file is rewritten once with
+ * all the edits, so that a failed file keeps none of them (except for
+ * a write error in the middle of the in-place update).
+ * Lines of any length are accepted. The files are processed by the
+ * threads set by setBatchThreads().
+ * The report has a line for each JPEG file:
+ *   "path<TAB>OK<TAB>in-place=n<TAB>rewritten=n"
+ *   "path<TAB>ERROR(n)<TAB>line=n"
+ */
+int updateTagDataInJPEGFilesFromManifest(const char *manifestFileName,
+                                         const char *reportFileName)
+{
+    int i, sts = 0, num = 0, editCount = 0, editMax = 0;
+    char *line = NULL;
+    size_t lineMax = 0;
+    MANIFEST_EDIT *edits = NULL, *wk;
+    MANIFEST_BATCH batch;
+    FILE *fp, *fpw;
+
+    memset(&batch, 0, sizeof(batch));
+    fp = fopen(manifestFileName, "rb");
+    if (!fp) {
+        return ERR_READ_FILE;
+    }
+    // read all edits
+    while ((sts = readManifestLine(fp, &line, &lineMax)) > 0) {
+        if (editCount == editMax) {
+            editMax = (editMax == 0) ? 64 : editMax * 2;
+            wk = (MANIFEST_EDIT*)realloc(edits, sizeof(MANIFEST_EDIT) * editMax);
+            if (!wk) {
+                sts = ERR_MEMALLOC;
+                break;
+            }
+            edits = wk;
+        }
+        sts = parseManifestLine(line, &edits[editCount]);
+        if (sts < 0) {
+            break;
+        }
+        if (sts > 0) {
+            edits[editCount].line = ++num;
+            editCount++;
+        } else {
+            num++; // empty or comment line
+        }
+        sts = 0;
+    }
+    fclose(fp);
+    free(line);
+    if (sts < 0) {
+        goto DONE;
+    }
+    // group the edits per JPEG file, keeping the order in the manifest
+    qsort(edits, editCount, sizeof(MANIFEST_EDIT), compareManifestEdit);
+    batch.edits = edits;
+    batch.groupStart = (int*)malloc(sizeof(int) * (editCount + 1));
+    batch.results = (MANIFEST_RESULT*)malloc(sizeof(MANIFEST_RESULT) * (editCount + 1));
+    if (!batch.groupStart || !batch.results) {
+        sts = ERR_MEMALLOC;
+        goto DONE;
+    }
+    memset(batch.results, 0, sizeof(MANIFEST_RESULT) * (editCount + 1));
+    for (i = 0; i < editCount; i++) {
+        if (i == 0 || strcmp(edits[i].fileName, edits[i-1].fileName) != 0) {
+            batch.groupStart[batch.groupCount++] = i;
+        }
+    }
+    batch.groupStart[batch.groupCount] = editCount;
+    sts = createDurableGroup(batch.groupCount, &batch.durable);
+    if (sts < 0) {
+        goto DONE;
+    }
+    runBatch(updateTagDataBatchFunc, &batch, batch.groupCount);
+    finishDurableGroup(batch.durable);
+
+    // write the report
+    fpw = (reportFileName) ? fopen(reportFileName, "w") : stdout;
+    if (!fpw) {
+        sts = ERR_WRITE_FILE;
+        goto DONE;
+    }
+    for (i = 0; i < batch.groupCount; i++) {
+        MANIFEST_RESULT *res = &batch.results[i];
+        const char *fileName = edits[batch.groupStart[i]].fileName;
+        if (res->sts < 0) {
+            fprintf(fpw, "%s\tERROR(%d)\tline=%d\n", fileName, res->sts, res->errorLine);
+        } else {
+            fprintf(fpw, "%s\tOK\tin-place=%d\trewritten=%d\n",
+                    fileName, res->inPlace, res->rewritten);
+            sts++;
+        }
+    }
+    if (fpw != stdout && fclose(fpw) != 0) {
+        sts = ERR_WRITE_FILE;
+    }
+DONE:
+    for (i = 0; i < editCount; i++) {
+        free(edits[i].fileName);
+        freeTagNode(edits[i].tag);
+    }
+    free(edits);
+    free(batch.groupStart);
+    free(batch.results);
+    return sts;
+}
+
+/**
+ * getExifSegmentFromJPEGFile()
+ *
+ * Get a copy of the raw Exif segment (APP1) in a JPEG file
+ *
+ * parameters
+ *  [in] JPEGFileName : target JPEG file
+ *  [out] pLength : returns the length of the segment
+ *  [out] pResult : result status
+ *   0: OK
+ *  -n: error
+ *      ERR_READ_FILE
+ *      ERR_INVALID_JPEG
+ *      ERR_INVALID_APP1HEADER
+ *      ERR_INVALID_POINTER
+ *      ERR_NOT_EXIST
+ *      ERR_MEMALLOC
+ *
+ * return
+ *  NULL: error
+ * !NULL: the segment data from the APP1 marker (0xFFE1)
+ *
+ * note
+ * The segment is not parsed and the data is returned as it is in the file.
+ * The caller must free it.
+ */
+unsigned char *getExifSegmentFromJPEGFile(const char *JPEGFileName,
+                                          unsigned int *pLength,
+                                          int *pResult)
+{
+    int sts;
+    unsigned int len;
+    unsigned char *p = NULL;
+    FILE *fp;
+
+    if (!pLength) {
+        sts = ERR_INVALID_POINTER;
+        goto DONE;
+    }
+    fp = fopen(JPEGFileName, "rb");
+    if (!fp) {
+        sts = ERR_READ_FILE;
+        goto DONE;
+    }
+    sts = init(fp);
+    if (sts <= 0) {
+        fclose(fp);
+        if (sts == 0) {
+            sts = ERR_NOT_EXIST;
+        }
+        goto DONE;
+    }
+    len = sizeof(App1Header.marker) + App1Header.length;
+    p = (unsigned char*)malloc(len);
+    if (!p) {
+        fclose(fp);
+        sts = ERR_MEMALLOC;
+        goto DONE;
+    }
+    if (fseek(fp, App1StartOffset, SEEK_SET) != 0 ||
+        fread(p, 1, len, fp) < len) {
+        free(p);
+        p = NULL;
+        fclose(fp);
+        sts = ERR_READ_FILE;
+        goto DONE;
+    }
+    fclose(fp);
+    *pLength = len;
+    sts = 0;
+DONE:
+    if (pResult) {
+        *pResult = sts;
+    }
+    return p;
+}
+
+/**
+ * insertExifSegmentToJPEGFile()
+ *
+ * Insert the raw Exif segment (APP1) to a JPEG file
+ *
+ * parameters
+ *  [in] inJPEGFileName : original JPEG file
+ *  [in] outJPGEFileName : output JPEG file
+ *  [in] segment : the segment data from the APP1 marker (0xFFE1)
+ *  [in] length : length of the segment data
+ *
+ * return
+ *   1: OK
+ *  -n: error
+ *      ERR_READ_FILE
+ *      ERR_WRITE_FILE
+ *      ERR_INVALID_JPEG
+ *      ERR_INVALID_APP1HEADER
+ *      ERR_INVALID_POINTER
+ *
+ * note
+ * The Exif segment of the original JPEG file is replaced if it exists.
+ * The segment data is written as it is, without parsing and rebuilding
+ * the IFD tables. Use getExifSegmentFromJPEGFile() to get the segment
+ * from another JPEG file.
+ */
+int insertExifSegmentToJPEGFile(const char *inJPEGFileName,
+                                const char *outJPGEFileName,
+                                const unsigned char *segment,
+                                unsigned int length)
+{
+    int sts, ofs, littleEndian;
+    FILE *fpr = NULL, *fpw = NULL;
+
+    if (!segment) {
+        return ERR_INVALID_POINTER;
+    }
+    if (!checkExifSegment(segment, length, &littleEndian)) {
+        return ERR_INVALID_APP1HEADER;
+    }
+    fpr = fopen(inJPEGFileName, "rb");
+    if (!fpr) {
+        sts = ERR_READ_FILE;
+        goto DONE;
+    }
+    sts = init(fpr);
+    if (sts < 0) {
+        goto DONE;
+    }
+    if (CloneOutput && sts > 0 &&
+        length == sizeof(App1Header.marker) + App1Header.length) {
+        // the layout of the file is not changed
+        fclose(fpr);
+        fpr = NULL;
+        sts = writeSegmentToClonedFile(inJPEGFileName, outJPGEFileName,
+                                       segment, length);
+        goto DONE;
+    }
+    if (sts > 0) {
+        ofs = App1StartOffset;
+    } else {
+        // insert just after SOI if DQT is not found
+        ofs = (JpegDQTOffset > 0) ? JpegDQTOffset : 2;
+    }
+    fpw = fopen(outJPGEFileName, "wb");
+    if (!fpw) {
+        sts = ERR_WRITE_FILE;
+        goto DONE;
+    }
+    // copy the data in front of the Exif segment
+    rewind(fpr);
+    sts = copyFileData(fpr, fpw, ofs);
+    if (sts < 0) {
+        goto DONE;
+    }
+    if (fwrite(segment, 1, length, fpw) < length) {
+        sts = ERR_WRITE_FILE;
+        goto DONE;
+    }
+    if (App1StartOffset > 0) {
+        // skip the original Exif segment
+        ofs = App1StartOffset + sizeof(App1Header.marker) + App1Header.length;
+        if (fseek(fpr, ofs, SEEK_SET) != 0) {
+            sts = ERR_READ_FILE;
+            goto DONE;
+        }
+    }
+    sts = copyFileData(fpr, fpw, -1);
+    if (sts < 0) {
+        goto DONE;
+    }
+    sts = 1;
+DONE:
+    if (fpw) {
+        if (fclose(fpw) != 0 && sts > 0) {
+            sts = ERR_WRITE_FILE;
+        }
+    }
+    if (fpr) {
+        fclose(fpr);
+    }
+    return sts;
+}
+
+/**
+ * transformExifSegment()
+ *
+ * Update the raw Exif segment for the derivative image (e.g. resized JPEG)
+ *
+ * parameters
+ *  [in/out] segment : the segment data from the APP1 marker (0xFFE1)
+ *  [in/out] pLength : length of the segment data
+ *  [in] width : new PixelXDimension (0=not changed)
+ *  [in] height : new PixelYDimension (0=not changed)
+ *  [in] flags : combination of the following values
+ *      TRANSFORM_EXIF_DROP_THUMBNAIL : remove the 1st IFD and the thumbnail
+ *
+ * return
+ *   1: OK
+ *  -n: error
+ *      ERR_INVALID_POINTER
+ *      ERR_INVALID_APP1HEADER
+ *      ERR_INVALID_IFD
+ *
+ * note
+ * The segment is updated on memory without rebuilding the IFD tables.
+ * PixelXDimension and PixelYDimension are updated only if they exist.
+ * When the thumbnail is dropped, the length is reduced if the 1st IFD
+ * and the thumbnail are placed after the other IFDs, otherwise they are
+ * cleared with zero.
+ * ERR_INVALID_IFD is returned if the pointers to the IFDs are circular.
+ */
+int transformExifSegment(unsigned char *segment,
+                         unsigned int *pLength,
+                         unsigned int width,
+                         unsigned int height,
+                         int flags)
+{
+    int i, le;
+    unsigned char *tiff, *field;
+    unsigned int tiffLen, ofs, exifOfs, ofs1st, start, end, len, ifdEnd;
+    unsigned short type;
+    unsigned short tagIds[2] = { TAG_PixelXDimension, TAG_PixelYDimension };
+    unsigned int values[2];
+
+    if (!segment || !pLength) {
+        return ERR_INVALID_POINTER;
+    }
+    if (!checkExifSegment(segment, *pLength, &le)) {
+        return ERR_INVALID_APP1HEADER;
+    }
+    tiff = segment + 10;
+    tiffLen = *pLength - 10;
+    ofs = getIntInSegment(tiff + 4, le);
+    if (ofs < 8 || ofs + 2 > tiffLen) {
+        return ERR_INVALID_IFD;
+    }
+    // PixelXDimension and PixelYDimension in the Exif IFD
+    values[0] = width;
+    values[1] = height;
+    field = findTagInSegment(tiff, tiffLen, le, ofs, TAG_ExifIFDPointer);
+    exifOfs = (field) ? getIntInSegment(field + 8, le) : 0;
+    for (i = 0; i < 2 && exifOfs != 0; i++) {
+        if (values[i] == 0) {
+            continue;
+        }
+        field = findTagInSegment(tiff, tiffLen, le, exifOfs, tagIds[i]);
+        if (!field || getIntInSegment(field + 4, le) != 1) {
+            continue;
+        }
+        type = getShortInSegment(field + 2, le);
+        if (type == TYPE_SHORT && values[i] <= 0xFFFF) {
+            setShortInSegment(field + 8, (unsigned short)values[i], le);
+            setShortInSegment(field + 10, 0, le);
+        } else if (type == TYPE_SHORT || type == TYPE_LONG) {
+            setShortInSegment(field + 2, TYPE_LONG, le);
+            setIntInSegment(field + 8, values[i], le);
+        }
+    }
+    if (!(flags & TRANSFORM_EXIF_DROP_THUMBNAIL)) {
+        return 1;
+    }
+    // unlink the 1st IFD from the 0th IFD
+    ofs += 2 + getShortInSegment(tiff + ofs, le) * sizeof(IFD_TAG);
+    if (ofs + 4 > tiffLen) {
+        return ERR_INVALID_IFD;
+    }
+    field = tiff + ofs;
+    ofs1st = getIntInSegment(field, le);
+    if (ofs1st == 0) {
+        return 1;
+    }
+    // the data referenced from the 0th IFD (the next offset is not followed)
+    ifdEnd = getIfdEndInSegment(tiff, tiffLen, le, getIntInSegment(tiff + 4, le), 1);
+    if (ifdEnd == IFD_END_CIRCULAR) {
+        return ERR_INVALID_IFD;
+    }
+    setIntInSegment(field, 0, le);
+    if (ofs1st < 8 || ofs1st + 2 > tiffLen) {
+        return 1;
+    }
+    // the range of the 1st IFD and its data
+    start = ofs1st;
+    end = getIfdEndInSegment(tiff, tiffLen, le, ofs1st, 0);
+    for (i = 0; i < 2; i++) {
+        field = findTagInSegment(tiff, tiffLen, le, ofs1st,
+                    (i == 0) ? TAG_JPEGInterchangeFormat : TAG_StripOffsets);
+        if (!field) {
+            continue;
+        }
+        ofs = getIntInSegment(field + 8, le);
+        field = findTagInSegment(tiff, tiffLen, le, ofs1st,
+                    (i == 0) ? TAG_JPEGInterchangeFormatLength : TAG_StripByteCounts);
+        len = (field) ? getIntInSegment(field + 8, le) : 0;
+        if (ofs < 8 || ofs > tiffLen || len > tiffLen - ofs) {
+            continue;
+        }
+        if (ofs < start) {
+            start = ofs;
+        }
+        if (ofs + len > end) {
+            end = ofs + len;
+        }
+    }
+    if (start >= ifdEnd) {
+        // nothing is referenced after the 1st IFD and the thumbnail
+        *pLength = 10 + start;
+        segment[2] = (unsigned char)((*pLength - 2) >> 8);
+        segment[3] = (unsigned char)((*pLength - 2) & 0xFF);
+    } else {
+        memset(tiff + start, 0, ((end < tiffLen) ? end : tiffLen) - start);
+    }
+    return 1;
+}
+
+
+/**
+ * updateExifSegmentInJPEGFileInPlace()
+ *
+ * Update the Exif segment in a JPEG file without creating a new file
+ *
+ * parameters
+ *  [in] JPEGFileName : target JPEG file (overwritten)
+ *  [in] ifdTableArray : address of the IFD tables array
+ *
+ * return
+ *   1: OK
+ *  -n: error
+ *      ERR_READ_FILE
+ *      ERR_WRITE_FILE
+ *      ERR_INVALID_JPEG
+ *      ERR_INVALID_APP1HEADER
+ *      ERR_INVALID_POINTER
+ *      ERR_MEMALLOC
+ *      ERR_VERIFY_FAILED
+ *      ERROR_UNKNOWN:
+ *
+ * note
+ * If the new segment is larger than the old one, the space is inserted
+ * with fallocate(FALLOC_FL_INSERT_RANGE) on Linux and the alignment slack
+ * is kept in a padding segment (APP15) for the later updates. If it is
+ * not supported, the rest of the file is shifted with a fixed size buffer.
+ * The file may be broken if the process is interrupted while shifting.
+ */
+int updateExifSegmentInJPEGFileInPlace(const char *JPEGFileName,
+                                       void **ifdTableArray)
+{
+    int sts;
+    unsigned int newLen, oldLen, padLen, len;
+    long ofs, end, need;
+    unsigned char buf[PADDING_SEGMENT_MIN], *segment = NULL;
+    FILE *fp;
+
+    if (!ifdTableArray) {
+        return ERR_INVALID_POINTER;
+    }
+    fp = fopen(JPEGFileName, "r+b");
+    if (!fp) {
+        return ERR_READ_FILE;
+    }
+    sts = init(fp);
+    if (sts < 0) {
+        goto DONE;
+    }
+    if (sts > 0) {
+        ofs = App1StartOffset;
+        oldLen = sizeof(App1Header.marker) + App1Header.length;
+    } else {
+        ofs = (JpegDQTOffset > 0) ? JpegDQTOffset : 2;
+        oldLen = 0;
+    }
+    setOutputByteOrderToHeader();
+    segment = createExifSegment(ifdTableArray, &newLen, &sts);
+    if (!segment) {
+        if (sts == 0) {
+            sts = ERR_INVALID_POINTER; // no 0th IFD
+        }
+        goto DONE;
+    }
+    if (newLen - sizeof(App1Header.marker) > 0xFFFF) {
+        sts = ERR_INVALID_APP1HEADER;
+        goto DONE;
+    }
+    if (VerifyOutput) {
+        sts = verifyExifSegment(segment, newLen, ifdTableArray);
+        if (sts < 0) {
+            goto DONE;
+        }
+    }
+    // the padding segment after the Exif segment can be used
+    end = ofs + oldLen;
+    if (fseek(fp, end, SEEK_SET) == 0 &&
+        fread(buf, 1, PADDING_SEGMENT_MIN, fp) == PADDING_SEGMENT_MIN &&
+        buf[0] == 0xFF && buf[1] == 0xEF &&
+        memcmp(buf + 4, PADDING_SEGMENT_ID, PADDING_SEGMENT_ID_LEN) == 0) {
+        end += 2 + ((buf[2] << 8) | buf[3]);
+    }
+    need = ofs + (long)newLen - end;
+    if (need > 0 || (need < 0 && -need < PADDING_SEGMENT_MIN)) {
+        // make the space after the segment
+        sts = insertSpaceToFile(fp, ofs, end, need + PADDING_SEGMENT_MIN, &len);
+        if (sts < 0) {
+            goto DONE;
+        }
+        end += len;
+    }
+    padLen = (unsigned int)(end - ofs - newLen);
+    if (fseek(fp, ofs, SEEK_SET) != 0 ||
+        fwrite(segment, 1, newLen, fp) != newLen) {
+        sts = ERR_WRITE_FILE;
+        goto DONE;
+    }
+    sts = writePaddingSegments(fp, padLen);
+    if (sts < 0) {
+        goto DONE;
+    }
+    sts = 1;
+DONE:
+    if (segment) {
+        free(segment);
+    }
+    if (fclose(fp) != 0 && sts > 0) {
+        sts = ERR_WRITE_FILE;
+    }
+    return sts;
+}
+
+/**
+ * validateJPEGFile()
+ *
+ * Check the structure of a JPEG file and its Exif segment
+ *
+ * parameters
+ *  [in] JPEGFileName : target JPEG file
+ *  [out] pReason : (optional) receives the description of the first
+ *                  failed check ("OK" if valid). must not be freed
+ *
+ * return
+ *   1: valid (the Exif segment is found)
+ *   0: valid (the Exif segment is not found)
+ *  -n: error
+ *      ERR_READ_FILE
+ *      ERR_INVALID_JPEG
+ *      ERR_INVALID_APP1HEADER
+ *      ERR_INVALID_IFD
+ *
+ * note
+ * The SOI marker, the markers in front of the Exif segment, the APP1
+ * header and the entries of the 0th, Exif, GPS, Interoperability and
+ * 1st IFDs are checked to be in the segment. No memory is allocated
+ * and no tag node is created, so this is much cheaper than
+ * createIfdTableArray().
+ */
+int validateJPEGFile(const char *JPEGFileName, const char **pReason)
+{
+    static const IFD_TYPE order[] = {
+        IFD_0TH, IFD_EXIF, IFD_IO, IFD_GPS, IFD_1ST
+    };
+    int i, sts;
+    unsigned char buf[4096];
+    unsigned short marker;
+    unsigned int tiffLen, offsets[IFD_IO + 1];
+    const char *reason = "OK";
+    long fileSize;
+    FILE *fp;
+
+    fp = fopen(JPEGFileName, "rb");
+    if (!fp) {
+        sts = ERR_READ_FILE;
+        reason = "failed to open the file";
+        goto END;
+    }
+    // use the buffer on the stack
+    setvbuf(fp, (char*)buf, _IOFBF, sizeof(buf));
+    if (fread(&marker, 1, sizeof(short), fp) < sizeof(short)) {
+        sts = ERR_READ_FILE;
+        reason = "the file is too short";
+        goto DONE;
+    }
+    if (systemIsLittleEndian()) {
+        marker = swab16(marker);
+    }
+    if (marker != 0xFFD8) {
+        sts = ERR_INVALID_JPEG;
+        reason = "SOI marker is not found";
+        goto DONE;
+    }
+    sts = init(fp);
+    if (sts == ERR_INVALID_APP1HEADER) {
+        reason = "invalid byte order or TIFF version in the APP1 header";
+        goto DONE;
+    }
+    if (sts < 0) {
+        reason = "broken marker before the Exif segment";
+        goto DONE;
+    }
+    if (sts == 0) {
+        goto DONE;
+    }
+    if (fseek(fp, 0, SEEK_END) != 0 || (fileSize = ftell(fp)) < 0 ||
+        App1StartOffset + sizeof(App1Header.marker) + App1Header.length >
+                                                (unsigned long)fileSize) {
+        sts = ERR_INVALID_APP1HEADER;
+        reason = "the Exif segment exceeds the file";
+        goto DONE;
+    }
+    tiffLen = getTiffDataLength();
+    if (tiffLen < sizeof(TIFF_HEADER)) {
+        sts = ERR_INVALID_APP1HEADER;
+        reason = "the Exif segment is too short";
+        goto DONE;
+    }
+    memset(offsets, 0, sizeof(offsets));
+    offsets[IFD_0TH] = App1Header.tiff.Ifd0thOffset;
+    for (i = 0; i < (int)(sizeof(order) / sizeof(order[0])); i++) {
+        if (order[i] != IFD_0TH && offsets[order[i]] == 0) {
+            continue;
+        }
+        sts = validateIfdInFile(fp, order[i], offsets, &reason);
+        if (sts < 0) {
+            goto DONE;
+        }
+    }
+    sts = 1;
+DONE:
+    fclose(fp);
+END:
+    if (pReason) {
+        *pReason = reason;
+    }
+    return sts;
+}
+
+/**
+ * createStringPool()
+ *
+ * Create the pool to share the ASCII tag values
+ *
+ * return
+ *  the pool, or NULL if failed to allocate
+ */
+void *createStringPool(void)
+{
+    int i;
+    StringPool *pool = (StringPool*)malloc(sizeof(StringPool));
+    if (!pool) {
+        return NULL;
+    }
+    memset(pool, 0, sizeof(StringPool));
+    for (i = 0; i <= STRING_POOL_LOCKS; i++) {
+#ifdef _MSC_VER
+        InitializeCriticalSection(&pool->locks[i]);
+#else
+        pthread_mutex_init(&pool->locks[i], NULL);
+#endif
+    }
+    return pool;
+}
+
+/**
+ * freeStringPool()
+ *
+ * Free the pool created by createStringPool()
+ *
+ * parameters
+ *  [in] pool : the pool
+ *
+ * note
+ * The IFD tables and the TagNodeInfo created while the pool is set by
+ * setStringPool() must be freed before.
+ */
+void freeStringPool(void *pool)
+{
+    StringPool *sp = (StringPool*)pool;
+    int i;
+    if (!sp) {
+        return;
+    }
+    if (CurrentStringPool == sp) {
+        CurrentStringPool = NULL;
+    }
+    for (i = 0; i < sp->count; i++) {
+        free(sp->strings[i]);
+    }
+    for (i = 0; i <= STRING_POOL_LOCKS; i++) {
+#ifdef _MSC_VER
+        DeleteCriticalSection(&sp->locks[i]);
+#else
+        pthread_mutex_destroy(&sp->locks[i]);
+#endif
+    }
+    free(sp->strings);
+    free(sp);
+}
+
+/**
+ * setStringPool()
+ *
+ * Set the pool to share the ASCII tag values
+ *
+ * parameters
+ *  [in] pool : the pool (NULL=off)
+ *
+ * note
+ * While the pool is set, the ASCII values of the tag nodes created by
+ * the library (e.g. by createIfdTableArray()) are interned in the pool,
+ * so the same strings share the storage across the files. The pool can
+ * be used by multiple threads at the same time.
+ * The interned values must not be modified. The values of TagNodeInfo
+ * created by createTagInfo() are not interned.
+ */
+void setStringPool(void *pool)
+{
+    CurrentStringPool = (StringPool*)pool;
+}
+
+/**
+ * getTagValueCode()
+ *
+ * Get the dictionary code of the interned ASCII value of the tag
+ *
+ * parameters
+ *  [in] tag : target TagNodeInfo
+ *
+ * return
+ *  n: the code (the index of the string in the pool)
+ *  -1: the value is not interned
+ */
+int getTagValueCode(TagNodeInfo *tag)
+{
+    TagNode *node = (TagNode*)tag;
+    if (!node || !node->interned || !node->byteData) {
+        return -1;
+    }
+    return getPoolString(node->byteData)->code;
+}
+
+/**
+ * getStringPoolValue()
+ *
+ * Get the string of the dictionary code
+ *
+ * parameters
+ *  [in] pool : the pool
+ *  [in] code : the code returned by getTagValueCode()
+ *  [out] pLength : (optional) length of the value (the count of the tag)
+ *
+ * return
+ *  the value, or NULL if the code is invalid
+ */
+const unsigned char *getStringPoolValue(void *pool, int code,
+                                        unsigned int *pLength)
+{
+    StringPool *sp = (StringPool*)pool;
+    PoolString *s = NULL;
+    if (!sp || code < 0) {
+        return NULL;
+    }
+    lockStringPool(sp, STRING_POOL_LOCKS);
+    if (code < sp->count) {
+        s = sp->strings[code];
+    }
+    unlockStringPool(sp, STRING_POOL_LOCKS);
+    if (!s) {
+        return NULL;
+    }
+    if (pLength) {
+        *pLength = s->length;
+    }
+    return s->data;
+}
+
+/**
+ * getStringPoolCount()
+ *
+ * Get the number of the strings in the pool (the codes are 0 to n-1)
+ *
+ * parameters
+ *  [in] pool : the pool
+ */
+int getStringPoolCount(void *pool)
+{
+    StringPool *sp = (StringPool*)pool;
+    int count;
+    if (!sp) {
+        return 0;
+    }
+    lockStringPool(sp, STRING_POOL_LOCKS);
+    count = sp->count;
+    unlockStringPool(sp, STRING_POOL_LOCKS);
+    return count;
+}
+
+/**
+ * minifyExifSegmentInJPEGFile()
+ *
+ * Rewrite the Exif segment of a JPEG file into the smallest one
+ *
+ * parameters
+ *  [in] inJPEGFileName : original JPEG file
+ *  [in] outJPEGFileName : output JPEG file, or NULL to overwrite the
+ *                         original file
+ *  [in] flags : combination of the following values
+ *      MINIFY_REMOVE_THUMBNAIL : remove the 1st IFD and the thumbnail
+ *      MINIFY_REMOVE_INTEROP   : remove the Interoperability IFD
+ *      MINIFY_ESSENTIAL_ONLY   : remove all the tags except the essential
+ *                                ones
+ *  [in] keepTagIds : the essential tag IDs, or NULL for the default set
+ *                    (Make, Model, Orientation, the resolutions,
+ *                    DateTime, DateTimeOriginal and the tags required
+ *                    by the Exif standard)
+ *  [in] keepCount : number of keepTagIds
+ *  [out] pSavedBytes : (optional) the decrease of the file size
+ *
+ * return
+ *   1: OK
+ *   0: the Exif segment is not found (the file is not written)
+ *  -n: error
+ *      ERR_READ_FILE
+ *      ERR_WRITE_FILE
+ *      ERR_INVALID_JPEG
+ *      ERR_INVALID_APP1HEADER
+ *      ERR_INVALID_IFD
+ *      ERR_MEMALLOC
+ *      ERR_VERIFY_FAILED
+ *
+ * note
+ * The tags with the error and the tags with an empty value (an ASCII
+ * string of spaces, UNDEFINED data of zeros or a UserComment without
+ * the text) are removed, unless they are essential. The empty ASCII
+ * value of an essential tag is shortened to a null character. The
+ * IFDs left empty and their pointer tags are removed, and the whole
+ * segment is rebuilt without the unused area.
+ */
+int minifyExifSegmentInJPEGFile(const char *inJPEGFileName,
+                                const char *outJPEGFileName,
+                                int flags,
+                                const unsigned short *keepTagIds,
+                                int keepCount,
+                                long *pSavedBytes)
+{
+    int i, sts, result;
+    long before, after = -1;
+    void **ifdArray;
+    char *tmpName = NULL;
+
+    if (pSavedBytes) {
+        *pSavedBytes = 0;
+    }
+    ifdArray = createIfdTableArray(inJPEGFileName, &result);
+    if (!ifdArray) {
+        return result;
+    }
+    minifyIfdTableArray(ifdArray, flags, keepTagIds, keepCount);
+    // rebuild the whole segment to discard the unused area
+    for (i = 0; ifdArray[i] != NULL; i++) {
+        releaseRawSegment(ifdArray[i]);
+    }
+    before = getFileSize(inJPEGFileName);
+    if (outJPEGFileName) {
+        sts = updateExifSegmentInJPEGFile(inJPEGFileName, outJPEGFileName, ifdArray);
+        if (sts > 0) {
+            after = getFileSize(outJPEGFileName);
+        }
+    } else {
+        tmpName = createTempFile(inJPEGFileName);
+        if (!tmpName) {
+            sts = ERR_WRITE_FILE;
+            goto DONE;
+        }
+        sts = updateExifSegmentInJPEGFile(inJPEGFileName, tmpName, ifdArray);
+        if (sts < 0) {
+            remove(tmpName);
+            goto DONE;
+        }
+        after = getFileSize(tmpName);
+        if (DurableEntry) {
+            // renamed after the group is synced
+            DurableEntry->tmpName = tmpName;
+            tmpName = NULL;
+        } else if (replaceFile(tmpName, inJPEGFileName) != 0) {
+            remove(tmpName);
+            sts = ERR_WRITE_FILE;
+        }
+    }
+    if (sts > 0 && pSavedBytes && before >= 0 && after >= 0) {
+        *pSavedBytes = before - after;
+    }
+DONE:
+    free(tmpName);
+    freeIfdTableArray(ifdArray);
+    return sts;
+}
+
+/**
+ * minifyExifSegmentInJPEGFiles()
+ *
+ * Rewrite the Exif segments of the JPEG files into the smallest ones
+ *
+ * parameters
+ *  [in] inJPEGFileNames : array of the original JPEG files
+ *  [in] outJPEGFileNames : array of the output JPEG files, or NULL to
+ *                          overwrite the original files
+ *  [in] count : number of the files
+ *  [in] flags, keepTagIds, keepCount : same as minifyExifSegmentInJPEGFile()
+ *  [in] reportFileName : file to write the result of each JPEG file,
+ *                        or NULL to write to stdout
+ *
+ * return
+ *   n: number of the minified JPEG files
+ *  -n: error
+ *      ERR_WRITE_FILE : failed to create the report file
+ *      ERR_MEMALLOC
+ *
+ * note
+ * The files are processed by the threads set by setBatchThreads().
+ * The report has a line for each JPEG file and the total:
+ *   "path<TAB>OK<TAB>saved=n"
+ *   "path<TAB>NO-EXIF"
+ *   "path<TAB>ERROR(n)"
+ *   "total<TAB>files=n<TAB>saved=n"
+ */
+int minifyExifSegmentInJPEGFiles(const char **inJPEGFileNames,
+                                 const char **outJPEGFileNames,
+                                 int count,
+                                 int flags,
+                                 const unsigned short *keepTagIds,
+                                 int keepCount,
+                                 const char *reportFileName)
+{
+    int i, sts = 0;
+    long total = 0;
+    MINIFY_BATCH batch;
+    FILE *fpw;
+
+    memset(&batch, 0, sizeof(batch));
+    if (!inJPEGFileNames || count <= 0) {
+        return 0;
+    }
+    batch.inFileNames = inJPEGFileNames;
+    batch.outFileNames = outJPEGFileNames;
+    batch.flags = flags;
+    batch.keepTagIds = keepTagIds;
+    batch.keepCount = keepCount;
+    batch.results = (int*)malloc(sizeof(int) * count);
+    batch.savedBytes = (long*)malloc(sizeof(long) * count);
+    if (!batch.results || !batch.savedBytes) {
+        sts = ERR_MEMALLOC;
+        goto DONE;
+    }
+    sts = createDurableGroup(count, &batch.durable);
+    if (sts < 0) {
+        goto DONE;
+    }
+    runBatch(minifyBatchFunc, &batch, count);
+    finishDurableGroup(batch.durable);
+
+    // write the report
+    fpw = (reportFileName) ? fopen(reportFileName, "w") : stdout;
+    if (!fpw) {
+        sts = ERR_WRITE_FILE;
+        goto DONE;
+    }
+    for (i = 0; i < count; i++) {
+        if (batch.results[i] < 0) {
+            fprintf(fpw, "%s\tERROR(%d)\n", inJPEGFileNames[i], batch.results[i]);
+        } else if (batch.results[i] == 0) {
+            fprintf(fpw, "%s\tNO-EXIF\n", inJPEGFileNames[i]);
+        } else {
+            fprintf(fpw, "%s\tOK\tsaved=%ld\n", inJPEGFileNames[i], batch.savedBytes[i]);
+            total += batch.savedBytes[i];
+            sts++;
+        }
+    }
+    fprintf(fpw, "total\tfiles=%d\tsaved=%ld\n", sts, total);
+    if (fpw != stdout && fclose(fpw) != 0) {
+        sts = ERR_WRITE_FILE;
+    }
+DONE:
+    free(batch.results);
+    free(batch.savedBytes);
+    return sts;
+}
+
+/**
+ * splitExifSegmentToSidecar()
+ *
+ * Move the Exif segment of a JPEG file into a sidecar file
+ *
+ * parameters
+ *  [in] inJPEGFileName : original JPEG file
+ *  [in] outJPEGFileName : output JPEG file without the Exif segment
+ *  [in] sidecarFileName : output sidecar file
+ *
+ * return
+ *   1: OK
+ *   0: the Exif segment is not found (the files are not written)
+ *  -n: error
+ *      ERR_READ_FILE
+ *      ERR_WRITE_FILE
+ *      ERR_INVALID_JPEG
+ *      ERR_INVALID_APP1HEADER
+ *      ERR_MEMALLOC
+ *
+ * note
+ * The sidecar has a small header (the offset of the segment in the
+ * original file, the size and the identity of the output JPEG file)
+ * followed by the raw segment data. The image data is copied in the
+ * kernel by copy_file_range() if possible.
+ */
+int splitExifSegmentToSidecar(const char *inJPEGFileName,
+                              const char *outJPEGFileName,
+                              const char *sidecarFileName)
+{
+    int sts;
+    unsigned int length;
+    unsigned char header[SIDECAR_HEADER_SIZE], *segment = NULL;
+    FILE *fps;
+
+    sts = stripExifSegmentToFile(inJPEGFileName, outJPEGFileName,
+                                 &segment, header);
+    if (sts <= 0) {
+        return sts;
+    }
+    memcpy(header, SIDECAR_ID, SIDECAR_ID_LEN);
+    length = getIntInSegment(header + 12, 1);
+    fps = fopen(sidecarFileName, "wb");
+    if (!fps) {
+        sts = ERR_WRITE_FILE;
+    } else {
+        if (fwrite(header, 1, sizeof(header), fps) != sizeof(header) ||
+            fwrite(segment, 1, length, fps) != length) {
+            sts = ERR_WRITE_FILE;
+        }
+        if (fclose(fps) != 0) {
+            sts = ERR_WRITE_FILE;
+        }
+    }
+    free(segment);
+    return sts;
+}
+
+/**
+ * joinExifSegmentFromSidecar()
+ *
+ * Put the Exif segment in the sidecar file back to the JPEG file
+ *
+ * parameters
+ *  [in] inJPEGFileName : JPEG file created by splitExifSegmentToSidecar()
+ *  [in] sidecarFileName : sidecar file created by splitExifSegmentToSidecar()
+ *  [in] outJPEGFileName : output JPEG file
+ *
+ * return
+ *   1: OK
+ *  -n: error
+ *      ERR_READ_FILE
+ *      ERR_WRITE_FILE
+ *      ERR_INVALID_SIDECAR : the sidecar is broken or not for the JPEG file
+ *      ERR_MEMALLOC
+ *
+ * note
+ * The segment is inserted at the original position without parsing, so
+ * the output is the same as the original file byte for byte.
+ */
+int joinExifSegmentFromSidecar(const char *inJPEGFileName,
+                               const char *sidecarFileName,
+                               const char *outJPEGFileName)
+{
+    int sts;
+    long fileSize;
+    unsigned int length;
+    unsigned char header[SIDECAR_HEADER_SIZE], *segment = NULL;
+    FILE *fpr = NULL, *fps = NULL;
+
+    fps = fopen(sidecarFileName, "rb");
+    fpr = fopen(inJPEGFileName, "rb");
+    if (!fps || !fpr) {
+        sts = ERR_READ_FILE;
+        goto DONE;
+    }
+    if (fread(header, 1, sizeof(header), fps) != sizeof(header)) {
+        sts = ERR_INVALID_SIDECAR;
+        goto DONE;
+    }
+    sts = checkSidecarHeader(header, SIDECAR_ID, fpr, &fileSize);
+    if (sts < 0) {
+        goto DONE;
+    }
+    length = getIntInSegment(header + 12, 1);
+    segment = (unsigned char*)malloc(length);
+    if (!segment) {
+        sts = ERR_MEMALLOC;
+        goto DONE;
+    }
+    if (fseek(fps, getShortInSegment(header + 6, 1), SEEK_SET) != 0 ||
+        fread(segment, 1, length, fps) != length ||
+        segment[0] != 0xFF || segment[1] != 0xE1) {
+        sts = ERR_INVALID_SIDECAR;
+        goto DONE;
+    }
+    sts = insertSegmentAtOffset(fpr, fileSize, header, segment, outJPEGFileName);
+DONE:
+    if (fpr) {
+        fclose(fpr);
+    }
+    if (fps) {
+        fclose(fps);
+    }
+    free(segment);
+    return sts;
+}
+
+/**
+ * splitExifSegmentToStore()
+ *
+ * Move the Exif segment of a JPEG file into the content-addressed store
+ *
+ * parameters
+ *  [in] inJPEGFileName : original JPEG file
+ *  [in] outJPEGFileName : output JPEG file without the Exif segment
+ *  [in] storeDirName : directory of the store (must exist)
+ *  [in] referenceFileName : output file which refers to the segment
+ *  [out] key : (optional) buffer to receive the key of the segment in
+ *              the store (EXIF_STORE_KEY_LEN + 1 bytes)
+ *
+ * return
+ *   2: OK (the same segment already exists in the store)
+ *   1: OK (the segment is added to the store)
+ *   0: the Exif segment is not found (the files are not written)
+ *  -n: error
+ *      ERR_READ_FILE
+ *      ERR_WRITE_FILE
+ *      ERR_INVALID_JPEG
+ *      ERR_INVALID_APP1HEADER
+ *      ERR_MEMALLOC
+ *
+ * note
+ * The segment is stored as "<storeDirName>/<key>", where the key is the
+ * XXH64 hash of the segment data in hexadecimal. It is written only
+ * once for the files which have the same segment. The data of the
+ * existing segment is compared, and it is replaced if it differs. The
+ * output JPEG file is written after the segment is stored. The reference
+ * file is a sidecar without the segment data (see
+ * splitExifSegmentToSidecar()) and has the key instead.
+ */
+int splitExifSegmentToStore(const char *inJPEGFileName,
+                            const char *outJPEGFileName,
+                            const char *storeDirName,
+                            const char *referenceFileName,
+                            char *key)
+{
+    int sts, result;
+    unsigned int length;
+    unsigned long long hash;
+    char name[EXIF_STORE_KEY_LEN + 1], *path = NULL, *tmpPath = NULL;
+    unsigned char header[STORE_REFERENCE_SIZE], *segment = NULL, *stripped = NULL;
+    XXH64_STATE state;
+    FILE *fp;
+
+    segment = getExifSegmentFromJPEGFile(inJPEGFileName, &length, &sts);
+    if (!segment) {
+        return (sts == ERR_NOT_EXIST) ? 0 : sts;
+    }
+    xxh64Reset(&state);
+    xxh64Update(&state, segment, length);
+    hash = xxh64Digest(&state);
+    sprintf(name, "%08x%08x", (unsigned int)(hash >> 32), (unsigned int)hash);
+    if (key) {
+        strcpy(key, name);
+    }
+    path = getStorePath(storeDirName, name);
+    if (!path) {
+        sts = ERR_MEMALLOC;
+        goto DONE;
+    }
+    if (getFileSize(path) == (long)length &&
+        storeObjectMatches(path, segment, length)) {
+        sts = 2; // already stored
+    } else {
+        // write the segment to the temporary file and rename it not to
+        // leave a broken segment in the store (a different object with
+        // the same key is replaced)
+        tmpPath = createTempFile(path);
+        fp = (tmpPath) ? fopen(tmpPath, "wb") : NULL;
+        if (!fp) {
+            if (tmpPath) {
+                remove(tmpPath);
+            }
+            sts = ERR_WRITE_FILE;
+            goto DONE;
+        }
+        sts = (fwrite(segment, 1, length, fp) == length) ? 1 : ERR_WRITE_FILE;
+        if (fclose(fp) != 0) {
+            sts = ERR_WRITE_FILE;
+        }
+        if (sts < 0 || replaceFile(tmpPath, path) != 0) {
+            remove(tmpPath);
+            sts = ERR_WRITE_FILE;
+            goto DONE;
+        }
+    }
+    // the output JPEG file is written after the segment is stored
+    result = stripExifSegmentToFile(inJPEGFileName, outJPEGFileName,
+                                    &stripped, header);
+    if (result <= 0 || getIntInSegment(header + 12, 1) != length ||
+        memcmp(stripped, segment, length) != 0) {
+        // the file is changed after the segment is read
+        sts = (result < 0) ? result : ERR_READ_FILE;
+        goto DONE;
+    }
+    // the reference
+    memcpy(header, STORE_REFERENCE_ID, SIDECAR_ID_LEN);
+    setShortInSegment(header + 6, STORE_REFERENCE_SIZE, 1);
+    setIntInSegment(header + SIDECAR_HEADER_SIZE, (unsigned int)hash, 1);
+    setIntInSegment(header + SIDECAR_HEADER_SIZE + 4, (unsigned int)(hash >> 32), 1);
+    fp = fopen(referenceFileName, "wb");
+    if (!fp) {
+        sts = ERR_WRITE_FILE;
+        goto DONE;
+    }
+    if (fwrite(header, 1, sizeof(header), fp) != sizeof(header)) {
+        sts = ERR_WRITE_FILE;
+    }
+    if (fclose(fp) != 0) {
+        sts = ERR_WRITE_FILE;
+    }
+DONE:
+    free(path);
+    free(tmpPath);
+    free(segment);
+    free(stripped);
+    return sts;
+}
+
+/**
+ * joinExifSegmentFromStore()
+ *
+ * Put the Exif segment in the content-addressed store back to the JPEG file
+ *
+ * parameters
+ *  [in] inJPEGFileName : JPEG file created by splitExifSegmentToStore()
+ *  [in] referenceFileName : reference file created by splitExifSegmentToStore()
+ *  [in] storeDirName : directory of the store
+ *  [in] outJPEGFileName : output JPEG file
+ *
+ * return
+ *   1: OK
+ *  -n: error
+ *      ERR_READ_FILE
+ *      ERR_WRITE_FILE
+ *      ERR_INVALID_SIDECAR : the reference is broken or not for the JPEG
+ *                            file, or the segment in the store is broken
+ *      ERR_MEMALLOC
+ */
+int joinExifSegmentFromStore(const char *inJPEGFileName,
+                             const char *referenceFileName,
+                             const char *storeDirName,
+                             const char *outJPEGFileName)
+{
+    int sts;
+    long fileSize;
+    unsigned int length;
+    unsigned long long hash;
+    char name[EXIF_STORE_KEY_LEN + 1], *path = NULL;
+    unsigned char header[STORE_REFERENCE_SIZE], *segment = NULL;
+    XXH64_STATE state;
+    FILE *fpr = NULL, *fps = NULL;
+
+    fps = fopen(referenceFileName, "rb");
+    fpr = fopen(inJPEGFileName, "rb");
+    if (!fps || !fpr) {
+        sts = ERR_READ_FILE;
+        goto DONE;
+    }
+    if (fread(header, 1, sizeof(header), fps) != sizeof(header)) {
+        sts = ERR_INVALID_SIDECAR;
+        goto DONE;
+    }
+    fclose(fps);
+    fps = NULL;
+    sts = checkSidecarHeader(header, STORE_REFERENCE_ID, fpr, &fileSize);
+    if (sts < 0) {
+        goto DONE;
+    }
+    length = getIntInSegment(header + 12, 1);
+    hash = ((unsigned long long)getIntInSegment(header + SIDECAR_HEADER_SIZE + 4, 1) << 32) |
+           getIntInSegment(header + SIDECAR_HEADER_SIZE, 1);
+    sprintf(name, "%08x%08x", (unsigned int)(hash >> 32), (unsigned int)hash);
+    path = getStorePath(storeDirName, name);
+    segment = (unsigned char*)malloc(length);
+    if (!path || !segment) {
+        sts = ERR_MEMALLOC;
+        goto DONE;
+    }
+    fps = fopen(path, "rb");
+    if (!fps) {
+        sts = ERR_READ_FILE;
+        goto DONE;
+    }
+    if (fread(segment, 1, length, fps) != length) {
+        sts = ERR_INVALID_SIDECAR;
+        goto DONE;
+    }
+    // check the segment in the store by the key
+    xxh64Reset(&state);
+    xxh64Update(&state, segment, length);
+    if (xxh64Digest(&state) != hash) {
+        sts = ERR_INVALID_SIDECAR;
+        goto DONE;
+    }
+    sts = insertSegmentAtOffset(fpr, fileSize, header, segment, outJPEGFileName);
+DONE:
+    if (fpr) {
+        fclose(fpr);
+    }
+    if (fps) {
+        fclose(fps);
+    }
+    free(path);
+    free(segment);
+    return sts;
+}
+
+/**
+ * getImageHashOfJPEGFile()
+ *
+ * Get the hash of the image data of a JPEG file excluding the metadata
+ *
+ * parameters
+ *  [in] JPEGFileName : target JPEG file
+ *  [out] pHash : the XXH64 hash of the image data
+ *  [out] pIfdTableArray : (optional) receives the IFD tables array
+ *                         (see createIfdTableArray()), or NULL if the
+ *                         Exif segment is not found or broken
+ *
+ * return
+ *   1: OK
+ *  -n: error
+ *      ERR_READ_FILE
+ *      ERR_INVALID_JPEG
+ *      ERR_MEMALLOC
+ *
+ * note
+ * The marker segments are walked from SOI to EOI, and all of them
+ * except APPn and COM are hashed with the scan data. The files which
+ * differ only in the metadata have the same hash.
+ * The file is read only once for both the hash and the IFD tables.
+ */
+int getImageHashOfJPEGFile(const char *JPEGFileName,
+                           unsigned long long *pHash,
+                           void ***pIfdTableArray)
+{
+    int sts, result;
+    FILE *fp;
+
+    if (pIfdTableArray) {
+        *pIfdTableArray = NULL;
+    }
+    if (!pHash) {
+        return ERR_INVALID_POINTER;
+    }
+    fp = fopen(JPEGFileName, "rb");
+    if (!fp) {
+        return ERR_READ_FILE;
+    }
+    if (pIfdTableArray) {
+        // the Exif segment is read by the stdio buffer, and skipped by
+        // hashImageData() without reading it again
+        *pIfdTableArray = createIfdTableArrayFromFile(fp, NULL, &result);
+    }
+    sts = hashImageData(fp, pHash);
+    fclose(fp);
+    return sts;
+}
+
+/**
+ * getImageHashOfJPEGFiles()
+ *
+ * Get the hashes of the image data of the JPEG files excluding the metadata
+ *
+ * parameters
+ *  [in] JPEGFileNames : array of the target JPEG files
+ *  [in] count : number of the files
+ *  [out] hashes : array to receive the hash of each file
+ *  [out] ifdTableArrays : (optional) array to receive the IFD tables
+ *                         array of each file. see getImageHashOfJPEGFile()
+ *  [out] results : (optional) array to receive the result of each file.
+ *                  see getImageHashOfJPEGFile()
+ *
+ * return
+ *  number of the hashed files
+ *
+ * note
+ * The files are processed by the threads set by setBatchThreads().
+ */
+int getImageHashOfJPEGFiles(const char **JPEGFileNames,
+                            int count,
+                            unsigned long long *hashes,
+                            void ***ifdTableArrays,
+                            int *results)
+{
+    int i, num = 0;
+    IMAGE_HASH_BATCH batch;
+
+    if (!JPEGFileNames || !hashes || count <= 0) {
+        return 0;
+    }
+    batch.fileNames = JPEGFileNames;
+    batch.hashes = hashes;
+    batch.ifdTableArrays = ifdTableArrays;
+    batch.results = (int*)malloc(sizeof(int) * count);
+    if (!batch.results) {
+        return 0;
+    }
+    runBatch(imageHashBatchFunc, &batch, count);
+    for (i = 0; i < count; i++) {
+        if (batch.results[i] > 0) {
+            num++;
+        }
+        if (results) {
+            results[i] = batch.results[i];
+        }
+    }
+    free(batch.results);
+    return num;
+}
+
+/**
+ * groupJPEGFilesByFingerprint()
+ *
+ * Group the JPEG files into the burst sequences and the likely duplicates
+ * by the fingerprint of the Exif
+ *
+ * parameters
+ *  [in] listFileName : file listing the paths of the target JPEG files,
+ *                      one path per line
+ *  [in] reportFileName : file to write the groups,
+ *                        or NULL to write to stdout
+ *  [in] burstGap : maximum interval of the shots in a burst sequence
+ *                  in msec (1000 if 0)
+ *
+ * return
+ *   n: number of the groups
+ *  -n: error
+ *      ERR_READ_FILE
+ *      ERR_WRITE_FILE
+ *      ERR_MEMALLOC
+ *
+ * note
+ * The fingerprint of a file consists of the camera (Make, Model and
+ * BodySerialNumber), the capture time (DateTimeOriginal and
+ * SubSecTimeOriginal), the settings (FocalLength and ExposureTime) and
+ * ImageUniqueID. The files without the Exif segment are ignored.
+ * The files of the same camera are "duplicates" if the capture time and
+ * the settings or ImageUniqueID are the same, and a "burst" if the
+ * capture times of the consecutive shots are within burstGap.
+ * The fingerprints are extracted and sorted by the threads set by
+ * setBatchThreads() in runs of a fixed number of files, and the runs
+ * are merged from a temporary file, so that the memory does not grow
+ * with the number of the files.
+ * The report has a line for each file of the groups:
+ *   "DUPLICATE<TAB>group<TAB>path"
+ *   "BURST<TAB>group<TAB>path"
+ * and the last line:
+ *   "total<TAB>files=n<TAB>bursts=n<TAB>duplicates=n"
+ */
+int groupJPEGFilesByFingerprint(const char *listFileName,
+                                const char *reportFileName,
+                                long burstGap)
+{
+    int sts = 0, i, count, runCount = 0, runMax = 0;
+    long files = 0, bursts = 0, duplicates = 0;
+    FINGERPRINT *records = NULL;
+    FINGERPRINT_RUN *runs = NULL, *run;
+    PATH_LIST list;
+    FILE *fp, *fpTmp = NULL, *fpw = NULL;
+
+    if (burstGap <= 0) {
+        burstGap = 1000;
+    }
+    fp = fopen(listFileName, "rb");
+    if (!fp) {
+        return ERR_READ_FILE;
+    }
+    sts = initPathList(&list, fp, FINGERPRINT_RUN_SIZE, 1);
+    records = (FINGERPRINT*)malloc(sizeof(FINGERPRINT) * FINGERPRINT_RUN_SIZE);
+    if (sts < 0 || !records) {
+        sts = ERR_MEMALLOC;
+        goto DONE;
+    }
+    // make the sorted runs of the fingerprints
+    while (!list.eof) {
+        count = extractFingerprints(&list, records);
+        if (count < 0) {
+            sts = count;
+            goto DONE;
+        }
+        if (count == 0) {
+            continue;
+        }
+        sts = sortFingerprints(records, count);
+        if (sts < 0) {
+            goto DONE;
+        }
+        files += count;
+        if (runCount == runMax) {
+            runMax = (runMax == 0) ? 16 : runMax * 2;
+            run = (FINGERPRINT_RUN*)realloc(runs, sizeof(FINGERPRINT_RUN) * runMax);
+            if (!run) {
+                sts = ERR_MEMALLOC;
+                goto DONE;
+            }
+            runs = run;
+        }
+        run = &runs[runCount++];
+        memset(run, 0, sizeof(FINGERPRINT_RUN));
+        if (list.eof && runCount == 1) {
+            // all fingerprints are in the memory
+            run->buf = records;
+            run->count = count;
+            break;
+        }
+        if (!fpTmp) {
+            fpTmp = tmpfile();
+            if (!fpTmp) {
+                sts = ERR_WRITE_FILE;
+                goto DONE;
+            }
+        }
+        run->pos = ftell(fpTmp);
+        if (fwrite(records, sizeof(FINGERPRINT), count, fpTmp) != (size_t)count) {
+            sts = ERR_WRITE_FILE;
+            goto DONE;
+        }
+        run->end = ftell(fpTmp);
+    }
+    if (fpTmp) {
+        // the buffers of the runs to merge them
+        free(records);
+        records = NULL;
+        if (fflush(fpTmp) != 0) {
+            sts = ERR_WRITE_FILE;
+            goto DONE;
+        }
+        for (i = 0; i < runCount; i++) {
+            runs[i].buf = (FINGERPRINT*)malloc(sizeof(FINGERPRINT) *
+                                               FINGERPRINT_MERGE_BUFFER);
+            if (!runs[i].buf) {
+                sts = ERR_MEMALLOC;
+                goto DONE;
+            }
+        }
+    }
+    fpw = (reportFileName) ? fopen(reportFileName, "w") : stdout;
+    if (!fpw) {
+        sts = ERR_WRITE_FILE;
+        goto DONE;
+    }
+    sts = groupFingerprintRuns(runs, runCount, fpTmp, fp, fpw, burstGap,
+                               &bursts, &duplicates);
+    if (sts < 0) {
+        goto DONE;
+    }
+    fprintf(fpw, "total\tfiles=%ld\tbursts=%ld\tduplicates=%ld\n",
+        files, bursts, duplicates);
+    sts = (int)(bursts + duplicates);
+DONE:
+    if (fpw && fpw != stdout) {
+        if (fclose(fpw) != 0 && sts >= 0) {
+            sts = ERR_WRITE_FILE;
+        }
+    }
+    if (fpTmp) {
+        for (i = 0; i < runCount; i++) {
+            free(runs[i].buf);
+        }
+        fclose(fpTmp);
+    }
+    free(runs);
+    free(records);
+    freePathList(&list);
+    fclose(fp);
+    return sts;
+}
+
+/**
+ * getTagStatisticsOfJPEGFiles()
+ *
+ * Get the statistics of the tags of the JPEG files
+ *
+ * parameters
+ *  [in] listFileName : file listing the paths of the target JPEG files,
+ *                      one path per line
+ *  [in] reportFileName : file to write the statistics,
+ *                        or NULL to write to stdout
+ *  [in] sampleRate : read 1 of n files at random, or 0 to read all files
+ *
+ * return
+ *   n: number of the files read
+ *  -n: error
+ *      ERR_READ_FILE
+ *      ERR_WRITE_FILE
+ *      ERR_MEMALLOC
+ *
+ * note
+ * The files are read by the threads set by setBatchThreads(). Each thread
+ * counts into its own partial statistics, and they are merged at the end.
+ * The number of the distinct values is estimated by HyperLogLog, and the
+ * percentiles of the sizes by a histogram of the logarithmic buckets
+ * (within 1/16 of the value).
+ * With the sample rate, the files are sampled with a fixed seed, and the
+ * percents estimate those of all the listed files. The distinct values
+ * are those of the sampled files.
+ * The report has the following lines:
+ *   "files<TAB>listed=n<TAB>read=n<TAB>exif=n<TAB>errors=n<TAB>sample=1/n"
+ *   "tag<TAB>ifd<TAB>tagId<TAB>name<TAB>count<TAB>percent"
+ *   "value<TAB>Make|Model|ExposureProgram<TAB>value<TAB>count<TAB>percent"
+ *   "distinct<TAB>Make|Model|ExposureProgram|Camera<TAB>n"
+ *   "size<TAB>Exif|Thumbnail|MakerNote<TAB>count=n<TAB>min=n<TAB>p50=n
+ *    <TAB>p90=n<TAB>p99=n<TAB>max=n"
+ * The percents are of the files with the Exif segment.
+ */
+int getTagStatisticsOfJPEGFiles(const char *listFileName,
+                                const char *reportFileName,
+                                unsigned int sampleRate)
+{
+    int sts = 0, i, count;
+    STATS_BATCH batch;
+    PATH_LIST list;
+    FILE *fp, *fpw = NULL;
+
+    if (sampleRate == 0) {
+        sampleRate = 1;
+    }
+    fp = fopen(listFileName, "rb");
+    if (!fp) {
+        return ERR_READ_FILE;
+    }
+    batch.slices = (BatchThreads > 1) ? BatchThreads : 1;
+    sts = initPathList(&list, fp, STATS_CHUNK_SIZE, sampleRate);
+    batch.partials = (TAG_STATISTICS*)calloc(batch.slices, sizeof(TAG_STATISTICS));
+    if (sts < 0 || !batch.partials) {
+        sts = ERR_MEMALLOC;
+        goto DONE;
+    }
+    while (!list.eof) {
+        count = readPathList(&list);
+        if (count < 0) {
+            sts = count;
+            goto DONE;
+        }
+        batch.paths = list.paths;
+        batch.count = count;
+        runBatch(statsBatchFunc, &batch, batch.slices);
+    }
+    for (i = 1; i < batch.slices; i++) {
+        mergeTagStatistics(&batch.partials[0], &batch.partials[i]);
+    }
+    fpw = (reportFileName) ? fopen(reportFileName, "w") : stdout;
+    if (!fpw) {
+        sts = ERR_WRITE_FILE;
+        goto DONE;
+    }
+    writeTagStatistics(fpw, &batch.partials[0], list.listed, sampleRate);
+    sts = (int)batch.partials[0].files;
+DONE:
+    if (fpw && fpw != stdout) {
+        if (fclose(fpw) != 0 && sts >= 0) {
+            sts = ERR_WRITE_FILE;
+        }
+    }
+    free(batch.partials);
+    freePathList(&list);
+    fclose(fp);
+    return sts;
+}
+
+/**
+ * diffIfdTableArrays()
+ *
+ * Compare the tags of two IFD table arrays
+ *
+ * parameters
+ *  [in] ifdTableArrayA : the first IFD table array (NULL if no Exif)
+ *  [in] ifdTableArrayB : the second IFD table array (NULL if no Exif)
+ *  [out] pDiffs : (optional) receives the array of the differences.
+ *                 The caller must free it.
+ *
+ * return
+ *   n: number of the differences (0 if the same)
+ *  -n: error
+ *      ERR_MEMALLOC
+ *
+ * note
+ * The differences are sorted by the IFD type and the tag ID. The pointer
+ * tags (e.g. ExifIFDPointer) are not compared because their values
+ * depend on the layout, while the thumbnail data is compared as the
+ * value of JPEGInterchangeFormat. It is reported as added or removed if
+ * only one of them has the thumbnail data.
+ * If the IFD tables are not changed after parsing the same data, they
+ * are the same without comparing the tags.
+ */
+int diffIfdTableArrays(void **ifdTableArrayA,
+                       void **ifdTableArrayB,
+                       TagDiffInfo **pDiffs)
+{
+    int sts = 0, ifdType;
+    TAG_DIFF_LIST list;
+
+    if (pDiffs) {
+        *pDiffs = NULL;
+    }
+    if (ifdTableArraysHaveSameRawData(ifdTableArrayA, ifdTableArrayB)) {
+        return 0;
+    }
+    memset(&list, 0, sizeof(list));
+    for (ifdType = IFD_0TH; ifdType <= IFD_IO && sts >= 0; ifdType++) {
+        sts = diffIfdTables(getIfdTableFromIfdTableArray(ifdTableArrayA, ifdType),
+                            getIfdTableFromIfdTableArray(ifdTableArrayB, ifdType),
+                            ifdType, &list);
+    }
+    if (sts < 0) {
+        free(list.diffs);
+        return sts;
+    }
+    if (pDiffs) {
+        *pDiffs = list.diffs;
+    } else {
+        free(list.diffs);
+    }
+    return list.count;
+}
+
+/**
+ * diffExifSegmentOfJPEGFiles()
+ *
+ * Compare the tags of the Exif segments of two JPEG files
+ *
+ * parameters
+ *  [in] JPEGFileNameA : the first JPEG file
+ *  [in] JPEGFileNameB : the second JPEG file
+ *  [out] pDiffs : (optional) receives the array of the differences.
+ *                 The caller must free it.
+ *
+ * return
+ *   n: number of the differences (0 if the same)
+ *  -n: error
+ *      ERR_READ_FILE
+ *      ERR_INVALID_JPEG
+ *      ERR_INVALID_APP1HEADER
+ *      ERR_INVALID_IFD
+ *      ERR_MEMALLOC
+ *
+ * note
+ * If the raw bytes of the Exif segments are the same, the segments are
+ * not parsed. A file without the Exif segment has no tags.
+ * see diffIfdTableArrays()
+ */
+int diffExifSegmentOfJPEGFiles(const char *JPEGFileNameA,
+                               const char *JPEGFileNameB,
+                               TagDiffInfo **pDiffs)
+{
+    int sts;
+    void **ifdArrayA, **ifdArrayB;
+
+    sts = diffExifSegmentOfFiles(JPEGFileNameA, JPEGFileNameB, pDiffs,
+                                 &ifdArrayA, &ifdArrayB);
+    if (ifdArrayA) {
+        freeIfdTableArray(ifdArrayA);
+    }
+    if (ifdArrayB) {
+        freeIfdTableArray(ifdArrayB);
+    }
+    return sts;
+}
+
+/**
+ * diffExifSegmentOfJPEGFilePairs()
+ *
+ * Compare the tags of the Exif segments of the pairs of the JPEG files
+ *
+ * parameters
+ *  [in] JPEGFileNamesA : array of the first JPEG file of each pair
+ *  [in] JPEGFileNamesB : array of the second JPEG file of each pair
+ *  [in] count : number of the pairs
+ *  [in] reportFileName : file to write the differences,
+ *                        or NULL to write to stdout
+ *
+ * return
+ *   n: number of the pairs which differ
+ *  -n: error
+ *      ERR_INVALID_POINTER
+ *      ERR_WRITE_FILE
+ *      ERR_MEMALLOC
+ *
+ * note
+ * The pairs are compared by the threads set by setBatchThreads(), and
+ * the report is written in the order of the pairs.
+ * The report has a line for each difference, or a line for the pair if
+ * there is no difference or an error:
+ *   "pathA<TAB>pathB<TAB>ADDED|REMOVED|VALUE|TYPE<TAB>ifd<TAB>tagId
+ *    <TAB>name<TAB>old value<TAB>new value"
+ *   "pathA<TAB>pathB<TAB>SAME"
+ *   "pathA<TAB>pathB<TAB>ERROR(n)"
+ * and the last line:
+ *   "total<TAB>pairs=n<TAB>same=n<TAB>diff=n<TAB>errors=n"
+ * The values of TYPE have the type and the count, e.g. "short[1] 6".
+ */
+int diffExifSegmentOfJPEGFilePairs(const char **JPEGFileNamesA,
+                                   const char **JPEGFileNamesB,
+                                   int count,
+                                   const char *reportFileName)
+{
+    int sts = 0, i, n, start, same = 0, diff = 0, errors = 0;
+    DIFF_BATCH batch;
+    FILE *fpw;
+
+    if (!JPEGFileNamesA || !JPEGFileNamesB || count < 0) {
+        return ERR_INVALID_POINTER;
+    }
+    fpw = (reportFileName) ? fopen(reportFileName, "w") : stdout;
+    if (!fpw) {
+        return ERR_WRITE_FILE;
+    }
+    batch.results = (int*)malloc(sizeof(int) * DIFF_CHUNK_SIZE);
+    batch.reports = (REPORT_TEXT*)calloc(DIFF_CHUNK_SIZE, sizeof(REPORT_TEXT));
+    if (!batch.results || !batch.reports) {
+        sts = ERR_MEMALLOC;
+        goto DONE;
+    }
+    for (start = 0; start < count; start += n) {
+        n = (count - start < DIFF_CHUNK_SIZE) ? count - start : DIFF_CHUNK_SIZE;
+        batch.fileNamesA = JPEGFileNamesA + start;
+        batch.fileNamesB = JPEGFileNamesB + start;
+        runBatch(diffBatchFunc, &batch, n);
+        for (i = 0; i < n; i++) {
+            if (batch.results[i] < 0) {
+                fprintf(fpw, "%s\t%s\tERROR(%d)\n", batch.fileNamesA[i],
+                    batch.fileNamesB[i], batch.results[i]);
+                errors++;
+            } else {
+                fwrite(batch.reports[i].text, 1, batch.reports[i].length, fpw);
+                if (batch.results[i] == 0) {
+                    same++;
+                } else {
+                    diff++;
+                }
+            }
+            batch.reports[i].length = 0; // the buffer is reused
+        }
+    }
+    fprintf(fpw, "total\tpairs=%d\tsame=%d\tdiff=%d\terrors=%d\n",
+        count, same, diff, errors);
+    sts = diff;
+DONE:
+    if (fpw != stdout) {
+        if (fclose(fpw) != 0 && sts >= 0) {
+            sts = ERR_WRITE_FILE;
+        }
+    }
+    if (batch.reports) {
+        for (i = 0; i < DIFF_CHUNK_SIZE; i++) {
+            free(batch.reports[i].text);
+        }
+    }
+    free(batch.reports);
+    free(batch.results);
+    return sts;
+}
+
+/**
+ * getMakerNoteVendor()
+ *
+ * Get the vendor of the MakerNote in the IFD tables array
+ *
+ * parameters
+ *  [in] ifdTableArray: address of the IFD tables array
+ *
+ * return
+ *  MAKERNOTE_xxx
+ *
+ * note
+ * The MakerNote tag of the Exif IFD is decoded as the IFD_MAKERNOTE
+ * table on the first call of this function, getTagInfo(),
+ * queryTagNodeIsExist() or queryTagNodesExist() with IFD_MAKERNOTE.
+ * The IFD-structured MakerNotes of Canon, Nikon, Sony, Fujifilm and
+ * Olympus are supported. The decoded table is read-only and is not
+ * included in the array, so it can't be updated nor written.
+ * The formats whose offsets are relative to the TIFF header (Canon,
+ * Sony, Olympus without the version) can be decoded only while the
+ * MakerNote tag is the same as the one in the file.
+ * The array must not be queried from multiple threads at the same time
+ * because the decoded table is cached in it.
+ */
+int getMakerNoteVendor(void **ifdTableArray)
+{
+    IfdTable *exif = getIfdTableFromIfdTableArray(ifdTableArray, IFD_EXIF);
+    getMakerNoteIfd(ifdTableArray);
+    return (exif && exif->makerNoteVendor > 0) ? exif->makerNoteVendor : MAKERNOTE_NONE;
+}
+
+// private functions
+
+
+static int dataIsLittleEndian()
+{
+    return (App1Header.tiff.byteOrder == 0x4949) ? 1 : 0;
+}
+
+static int systemIsLittleEndian()
+{
+    static int i = 1;
+    return (int)(*(char*)&i);
+}
+
+static unsigned short swab16(unsigned short us)
+{
+    return (us << 8) | ((us >> 8) & 0x00FF);
+}
+
+static unsigned int swab32(unsigned int ui)
+{
+    return
+    ((ui << 24) & 0xFF000000) | ((ui << 8)  & 0x00FF0000) |
+    ((ui >> 8)  & 0x0000FF00) | ((ui >> 24) & 0x000000FF);
+}
+
+static unsigned short fix_short(unsigned short us)
+{
+    return (dataIsLittleEndian() !=
+        systemIsLittleEndian()) ? swab16(us) : us;
+}
+
+static unsigned int fix_int(unsigned int ui)
+{
+    return (dataIsLittleEndian() !=
+        systemIsLittleEndian()) ? swab32(ui) : ui;
+}
+
+static int seekToRelativeOffset(FILE *fp, unsigned long long ofs)
+{
+    static int start = offsetof(APP1_HEADER, tiff);
+    if (TiffFile.length > 0) {
+        // TIFF file or MakerNote
+        return fseeko(fp, (long long)(TiffFile.base + ofs), SEEK_SET);
+    }
+    return fseeko(fp, (long long)(App1StartOffset + start) + (long long)ofs, SEEK_SET);
+}
+
+// length of the TIFF data (from the TIFF header to the end of the segment)
+static unsigned long long getTiffDataLength()
+{
+    unsigned int len = App1Header.length;
+    if (TiffFile.length > 0) {
+        return TiffFile.length;
+    }
+    unsigned int hdr = offsetof(APP1_HEADER, tiff) - sizeof(App1Header.marker);
+    return (len > hdr) ? len - hdr : 0;
+}
+
+// get the byte size of the tag's value
+static unsigned int getTagValueSize(unsigned short type, unsigned int count)
+{
+    if (count > 0x0FFFFFFF) { // too large for the Exif segment anyway
+        return 0xFFFFFFFF;
+    }
+    switch (type) {
+    case TYPE_BYTE:
+    case TYPE_ASCII:
+    case TYPE_SBYTE:
+    case TYPE_UNDEFINED:
+        return count;
+    case TYPE_SHORT:
+    case TYPE_SSHORT:
+        return count * sizeof(short);
+    case TYPE_LONG:
+    case TYPE_SLONG:
+        return count * sizeof(int);
+    case TYPE_RATIONAL:
+    case TYPE_SRATIONAL:
+        return count * sizeof(int) * 2;
+    }
+    return 0;
+}
+
+/**
+ * Find the tag field in the IFD of the current opened file
+ *
+ * parameters
+ *  [in] fp: file pointer of opened file
+ *  [in] ifdOffset: offset of the target IFD
+ *  [in] tagId: target tag ID
+ *  [out] pTagField: the tag field (converted to the system byte order)
+ *  [out] pFieldOffset: offset of the tag field
+ *
+ * return
+ *   1: found
+ *   0: not found
+ *  ERR_INVALID_IFD
+ */
+static int findTagFieldInIfd(FILE *fp,
+                             unsigned int ifdOffset,
+                             unsigned short tagId,
+                             IFD_TAG *pTagField,
+                             unsigned int *pFieldOffset)
+{
+    int cnt;
+    unsigned short tagCount;
+    unsigned int tiffLen = getTiffDataLength();
+    IFD_TAG tag;
+
+    if (ifdOffset == 0 || ifdOffset + sizeof(short) > tiffLen ||
+        seekToRelativeOffset(fp, ifdOffset) != 0 ||
+        fread(&tagCount, 1, sizeof(short), fp) < sizeof(short)) {
+        return ERR_INVALID_IFD;
+    }
+    tagCount = fix_short(tagCount);
+    if (ifdOffset + sizeof(short) + sizeof(IFD_TAG) * tagCount > tiffLen) {
+        return ERR_INVALID_IFD;
+    }
+    for (cnt = 0; cnt < tagCount; cnt++) {
+        if (fread(&tag, 1, sizeof(tag), fp) < sizeof(tag)) {
+            return ERR_INVALID_IFD;
+        }
+        if (fix_short(tag.tag) == tagId) {
+            pTagField->tag = tagId;
+            pTagField->type = fix_short(tag.type);
+            pTagField->count = fix_int(tag.count);
+            pTagField->offset = fix_int(tag.offset);
+            *pFieldOffset = ifdOffset + sizeof(short) + sizeof(IFD_TAG) * cnt;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Get the offset of the IFD in the current opened file
+ *
+ * parameters
+ *  [in] fp: file pointer of opened file
+ *  [in] ifdType: target IFD type
+ *  [out] pOffset: offset of the IFD
+ *
+ * return
+ *   1: found
+ *   0: not found
+ *  ERR_INVALID_IFD
+ */
+static int getIfdOffsetInFile(FILE *fp, IFD_TYPE ifdType, unsigned int *pOffset)
+{
+    int sts;
+    unsigned int fieldOfs, ifdOfs = App1Header.tiff.Ifd0thOffset;
+    unsigned long long nextOfs;
+    IFD_TAG tagField;
+
+    switch (ifdType) {
+    case IFD_0TH:
+        break;
+    case IFD_EXIF:
+    case IFD_GPS:
+    case IFD_IO:
+        sts = findTagFieldInIfd(fp, ifdOfs,
+                (ifdType == IFD_GPS) ? TAG_GPSInfoIFDPointer : TAG_ExifIFDPointer,
+                &tagField, &fieldOfs);
+        if (sts <= 0) {
+            return sts;
+        }
+        ifdOfs = tagField.offset;
+        if (ifdType == IFD_IO && ifdOfs != 0) {
+            sts = findTagFieldInIfd(fp, ifdOfs, TAG_InteroperabilityIFDPointer,
+                                    &tagField, &fieldOfs);
+            if (sts <= 0) {
+                return sts;
+            }
+            ifdOfs = tagField.offset;
+        }
+        break;
+    case IFD_1ST:
+        // the offset of the 1st IFD is placed at the tail of the 0th IFD
+        if (getNextIfdOffsetInFile(fp, ifdOfs, &nextOfs) != 0) {
+            return ERR_INVALID_IFD;
+        }
+        ifdOfs = (unsigned int)nextOfs;
+        break;
+    default:
+        return 0;
+    }
+    if (ifdOfs == 0) {
+        return 0;
+    }
+    *pOffset = ifdOfs;
+    return 1;
+}
+
+/**
+ * Get the offset of the next IFD in the current opened file
+ *
+ * parameters
+ *  [in] fp: file pointer of opened file
+ *  [in] ifdOffset: offset of the IFD
+ *  [out] pNextOffset: offset of the next IFD (0 if none)
+ *
+ * return
+ *   0: OK
+ *  ERR_INVALID_IFD
+ *
+ * note
+ * Only the tag count and the offset at the tail of the IFD are read.
+ */
+static int getNextIfdOffsetInFile(FILE *fp, unsigned long long ifdOffset,
+                                  unsigned long long *pNextOffset)
+{
+    unsigned char buf[8];
+    unsigned long long tagCount, ofs;
+
+    if (readIfdTagCount(fp, ifdOffset, &tagCount) != 0) {
+        return ERR_INVALID_IFD;
+    }
+    ofs = ifdOffset + IFD_COUNT_SIZE + IFD_FIELD_SIZE * tagCount;
+    if (tagCount > getTiffDataLength() ||
+        ofs + IFD_OFFSET_SIZE > getTiffDataLength() ||
+        seekToRelativeOffset(fp, ofs) != 0 ||
+        fread(buf, 1, IFD_OFFSET_SIZE, fp) < (size_t)IFD_OFFSET_SIZE) {
+        return ERR_INVALID_IFD;
+    }
+    *pNextOffset = (TiffFile.big) ? getInt64InSegment(buf, dataIsLittleEndian())
+                                  : getIntInSegment(buf, dataIsLittleEndian());
+    return 0;
+}
+
+/**
+ * Get the offsets of the SubIFDs of the IFD in the current opened file
+ *
+ * parameters
+ *  [in] fp: file pointer of opened file
+ *  [in] ifdOffset: offset of the IFD
+ *  [out] offsets: offsets of the SubIFDs
+ *  [in] max: max number of the offsets
+ *
+ * return
+ *   n: number of the SubIFDs
+ *  ERR_INVALID_IFD
+ */
+static int getSubIfdOffsetsInFile(FILE *fp, unsigned long long ifdOffset,
+                                  unsigned long long *offsets, int max)
+{
+    int sts;
+    TIFF_FIELD field;
+
+    sts = findTiffFieldInIfd(fp, ifdOffset, TAG_SubIFDs, &field);
+    if (sts <= 0) {
+        return sts;
+    }
+    return readTiffOffsets(fp, &field, offsets, max);
+}
+
+// read the number of the tags in the IFD of the TIFF data
+static int readIfdTagCount(FILE *fp, unsigned long long ifdOffset,
+                           unsigned long long *pCount)
+{
+    unsigned char buf[8];
+
+    if (seekToRelativeOffset(fp, ifdOffset) != 0 ||
+        fread(buf, 1, IFD_COUNT_SIZE, fp) < (size_t)IFD_COUNT_SIZE) {
+        return ERR_INVALID_IFD;
+    }
+    *pCount = (TiffFile.big) ? getInt64InSegment(buf, dataIsLittleEndian())
+                             : getShortInSegment(buf, dataIsLittleEndian());
+    return 0;
+}
+
+// read the tag field of classic TIFF or BigTIFF at the current position
+static int readTiffField(FILE *fp, TIFF_FIELD *field)
+{
+    unsigned char buf[20];
+    int le = dataIsLittleEndian();
+
+    if (fread(buf, 1, IFD_FIELD_SIZE, fp) < (size_t)IFD_FIELD_SIZE) {
+        return ERR_READ_FILE;
+    }
+    field->tag = getShortInSegment(buf, le);
+    field->type = getShortInSegment(buf + 2, le);
+    memset(field->data, 0, sizeof(field->data));
+    if (TiffFile.big) {
+        field->count = getInt64InSegment(buf + 4, le);
+        field->offset = getInt64InSegment(buf + 12, le);
+        memcpy(field->data, buf + 12, 8);
+    } else {
+        field->count = getIntInSegment(buf + 4, le);
+        field->offset = getIntInSegment(buf + 8, le);
+        memcpy(field->data, buf + 8, 4);
+    }
+    return 0;
+}
+
+/**
+ * Find the tag field in the IFD of the TIFF data in the current opened file
+ *
+ * parameters
+ *  [in] fp: file pointer of opened file
+ *  [in] ifdOffset: offset of the IFD
+ *  [in] tagId: tag ID
+ *  [out] field: the tag field
+ *
+ * return
+ *   1: found
+ *   0: not found
+ *  ERR_INVALID_IFD
+ */
+static int findTiffFieldInIfd(FILE *fp, unsigned long long ifdOffset,
+                              unsigned short tagId, TIFF_FIELD *field)
+{
+    unsigned long long tagCount, i;
+
+    if (readIfdTagCount(fp, ifdOffset, &tagCount) != 0 ||
+        tagCount > getTiffDataLength()) {
+        return ERR_INVALID_IFD;
+    }
+    // the fields follow the count
+    for (i = 0; i < tagCount; i++) {
+        if (readTiffField(fp, field) != 0) {
+            return ERR_INVALID_IFD;
+        }
+        if (field->tag == tagId) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Read the offsets in the LONG, IFD, LONG8 or IFD8 tag field
+ *
+ * parameters
+ *  [in] fp: file pointer of opened file
+ *  [in] field: the tag field
+ *  [out] offsets: the offsets
+ *  [in] max: max number of the offsets
+ *
+ * return
+ *   n: number of the offsets
+ *  ERR_INVALID_IFD
+ */
+static int readTiffOffsets(FILE *fp, const TIFF_FIELD *field,
+                           unsigned long long *offsets, int max)
+{
+    unsigned char buf[8];
+    const unsigned char *p;
+    unsigned int size;
+    int i, n;
+
+    if (field->type == TYPE_LONG || field->type == TYPE_IFD) {
+        size = 4;
+    } else if (field->type == TYPE_LONG8 || field->type == TYPE_IFD8) {
+        size = 8;
+    } else {
+        return ERR_INVALID_IFD;
+    }
+    if (field->count == 0 || max <= 0) {
+        return (field->count == 0) ? ERR_INVALID_IFD : 0;
+    }
+    n = (field->count < (unsigned long long)max) ? (int)field->count : max;
+    if (field->count * size > (unsigned long long)IFD_OFFSET_SIZE &&
+        (field->count > getTiffDataLength() ||
+         seekToRelativeOffset(fp, field->offset) != 0)) {
+        return ERR_INVALID_IFD;
+    }
+    for (i = 0; i < n; i++) {
+        if (field->count * size <= (unsigned long long)IFD_OFFSET_SIZE) {
+            p = field->data + i * size; // stored in the field
+        } else if (fread(buf, 1, size, fp) == size) {
+            p = buf;
+        } else {
+            return ERR_INVALID_IFD;
+        }
+        offsets[i] = (size == 8) ? getInt64InSegment(p, dataIsLittleEndian())
+                                 : getIntInSegment(p, dataIsLittleEndian());
+    }
+    return n;
+}
+
+/**
+ * Get the offset of the IFD pointed by the tag in the IFD
+ *
+ * parameters
+ *  [in] fp: file pointer of opened file
+ *  [in] ifd: the IFD table parsed at 'ifdOffset'
+ *  [in] ifdOffset: offset of the IFD
+ *  [in] tagId: tag ID of the pointer
+ *  [out] pOffset: offset of the IFD (0 if none)
+ *
+ * note
+ * The pointer of the TIFF file is read out of the file again since
+ * it may be of the 64-bit or IFD type.
+ */
+static void getIfdPointer(FILE *fp, IfdTable *ifd, unsigned long long ifdOffset,
+                          unsigned short tagId, unsigned long long *pOffset)
+{
+    TagNode *tag;
+    TIFF_FIELD field;
+
+    *pOffset = 0;
+    if (TiffFile.length > 0) {
+        if (findTiffFieldInIfd(fp, ifdOffset, tagId, &field) > 0 &&
+            readTiffOffsets(fp, &field, pOffset, 1) != 1) {
+            *pOffset = 0;
+        }
+        return;
+    }
+    tag = getTagNodePtrFromIfd(ifd, tagId);
+    if (tag && !tag->error && tag->numData) {
+        *pOffset = tag->numData[0];
+    }
+}
+
+/**
+ * Overwrite the value of the existing tag in the current opened file
+ *
+ * parameters
+ *  [in] fp: file pointer of opened file ("r+b")
+ *  [in] ifdType: target IFD type
+ *  [in] tag: the tag holding the new value
+ *  [in] checkOnly: 1 to check if the value can be overwritten
+ *                  without writing it
+ *
+ * return
+ *  1: OK
+ *  -n: error (see updateTagDataInJPEGFileInPlace())
+ */
+static int updateTagDataInFile(FILE *fp, IFD_TYPE ifdType, TagNode *tag,
+                               int checkOnly)
+{
+    int sts;
+    unsigned int ifdOfs, fieldOfs, valueOfs, size;
+    unsigned char buf[64], *p = buf;
+    IFD_TAG tagField;
+
+    if (isOffsetTag(ifdType, tag->tagId)) {
+        return ERR_INVALID_ID;
+    }
+    sts = getIfdOffsetInFile(fp, ifdType, &ifdOfs);
+    if (sts <= 0) {
+        return (sts == 0) ? ERR_NOT_EXIST : sts;
+    }
+    sts = findTagFieldInIfd(fp, ifdOfs, tag->tagId, &tagField, &fieldOfs);
+    if (sts <= 0) {
+        return (sts == 0) ? ERR_NOT_EXIST : sts;
+    }
+    // the size of the value must not be changed
+    if (tagField.type != tag->type) {
+        return ERR_INVALID_TYPE;
+    }
+    if (tagField.count != tag->count) {
+        return ERR_INVALID_COUNT;
+    }
+    size = getTagValueSize(tagField.type, tagField.count);
+    if (size <= 4) {
+        valueOfs = fieldOfs + offsetof(IFD_TAG, offset);
+    } else {
+        valueOfs = tagField.offset;
+        if (valueOfs < sizeof(TIFF_HEADER) || valueOfs > getTiffDataLength() ||
+            size > getTiffDataLength() - valueOfs) {
+            return ERR_INVALID_IFD;
+        }
+        if (size > sizeof(buf)) {
+            p = (unsigned char*)malloc(size);
+            if (!p) {
+                return ERR_MEMALLOC;
+            }
+        }
+    }
+    sts = 1;
+    if (!packTagValue(tag, p)) {
+        sts = ERR_INVALID_POINTER;
+    } else if (!checkOnly &&
+               (seekToRelativeOffset(fp, valueOfs) != 0 ||
+                fwrite(p, 1, size, fp) != size)) {
+        sts = ERR_WRITE_FILE;
+    }
+    if (p != &buf[0]) {
+        free(p);
+    }
+    return sts;
+}
+
+// check if the tag's value is an offset to other data in the Exif segment
+static int isOffsetTag(IFD_TYPE ifdType, unsigned short tagId)
+{
+    if (ifdType == IFD_0TH || ifdType == IFD_1ST || ifdType == IFD_EXIF) {
+        return (tagId == TAG_ExifIFDPointer ||
+                tagId == TAG_GPSInfoIFDPointer ||
+                tagId == TAG_InteroperabilityIFDPointer ||
+                tagId == TAG_JPEGInterchangeFormat ||
+                tagId == TAG_StripOffsets) ? 1 : 0;
+    }
+    return 0;
+}
+
+// check if the tag's value locates the data in the TIFF file, which is
+// not copied to the Exif segment of JPEG
+static int isTiffFileOffsetTag(IfdTable *ifd, unsigned short tagId)
+{
+    if (!ifd->tiffFile || ifd->ifdType == IFD_EXIF || ifd->ifdType == IFD_GPS ||
+        ifd->ifdType == IFD_IO || ifd->ifdType == IFD_MAKERNOTE) {
+        return 0;
+    }
+    if (tagId == TAG_JPEGInterchangeFormat ||
+        tagId == TAG_JPEGInterchangeFormatLength) {
+        // the thumbnail is not read from the TIFF file
+        return (ifd->p) ? 0 : 1;
+    }
+    return (tagId == TAG_StripOffsets ||
+            tagId == TAG_StripByteCounts ||
+            tagId == TAG_TileOffsets ||
+            tagId == TAG_TileByteCounts ||
+            tagId == TAG_SubIFDs) ? 1 : 0;
+}
+
+/**
+ * Pack the value of the tag into the buffer in the byte order of the data
+ *
+ * parameters
+ *  [in] tag: the tag
+ *  [out] p: the buffer (getTagValueSize() bytes at least)
+ *
+ * return
+ *  1: OK
+ *  0: the tag has no value
+ */
+static int packTagValue(TagNode *tag, unsigned char *p)
+{
+    int i;
+    unsigned short us;
+    unsigned int ui, num = tag->count;
+
+    switch (tag->type) {
+    case TYPE_ASCII:
+    case TYPE_UNDEFINED:
+        if (!tag->byteData) {
+            return 0;
+        }
+        memcpy(p, tag->byteData, tag->count);
+        return 1;
+    case TYPE_BYTE:
+    case TYPE_SBYTE:
+        if (!tag->numData) {
+            return 0;
+        }
+        for (i = 0; i < (int)num; i++) {
+            p[i] = (unsigned char)tag->numData[i];
+        }
+        return 1;
+    case TYPE_SHORT:
+    case TYPE_SSHORT:
+        if (!tag->numData) {
+            return 0;
+        }
+        for (i = 0; i < (int)num; i++) {
+            us = fix_short((unsigned short)tag->numData[i]);
+            memcpy(p + i * sizeof(short), &us, sizeof(short));
+        }
+        return 1;
+    case TYPE_RATIONAL:
+    case TYPE_SRATIONAL:
+        num *= 2;
+        // fall through
+    case TYPE_LONG:
+    case TYPE_SLONG:
+        if (!tag->numData) {
+            return 0;
+        }
+        for (i = 0; i < (int)num; i++) {
+            ui = fix_int(tag->numData[i]);
+            memcpy(p + i * sizeof(int), &ui, sizeof(int));
+        }
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Read the ASCII value in the current opened file
+ *
+ * parameters
+ *  [in] fp: file pointer of opened file
+ *  [in] ofs: offset of the value
+ *  [in] count: count of the value
+ *  [out] buf: buffer to receive the null-terminated string
+ *  [in] bufSize: size of the buffer
+ *
+ * return
+ *  0: OK
+ *  ERR_READ_FILE
+ */
+static int readAsciiValueInFile(FILE *fp, unsigned int ofs, unsigned int count,
+                                char *buf, size_t bufSize)
+{
+    size_t len = (count < bufSize) ? count : bufSize - 1;
+    if (ofs > getTiffDataLength() || len > getTiffDataLength() - ofs ||
+        seekToRelativeOffset(fp, ofs) != 0 ||
+        fread(buf, 1, len, fp) < len) {
+        return ERR_READ_FILE;
+    }
+    buf[len] = '\0';
+    return 0;
+}
+
+// check if the ASCII tag's value matches the string (NULL matches any)
+static int asciiTagInFileMatches(FILE *fp, IFD_TYPE ifdType,
+                                 unsigned short tagId, const char *str)
+{
+    char value[128];
+    size_t len;
+    unsigned int ifdOfs, fieldOfs, valueOfs;
+    IFD_TAG tagField;
+
+    if (!str) {
+        return 1;
+    }
+    if (getIfdOffsetInFile(fp, ifdType, &ifdOfs) <= 0 ||
+        findTagFieldInIfd(fp, ifdOfs, tagId, &tagField, &fieldOfs) <= 0 ||
+        tagField.type != TYPE_ASCII) {
+        return 0;
+    }
+    // 4 bytes or less data is placed in the tag field directly
+    valueOfs = (tagField.count <= 4) ?
+                fieldOfs + offsetof(IFD_TAG, offset) : tagField.offset;
+    if (readAsciiValueInFile(fp, valueOfs, tagField.count,
+                             value, sizeof(value)) != 0) {
+        return 0;
+    }
+    // ignore the trailing spaces
+    len = strlen(value);
+    while (len > 0 && value[len-1] == ' ') {
+        value[--len] = '\0';
+    }
+    return (strcmp(value, str) == 0) ? 1 : 0;
+}
+
+// days from 0000-03-01 of the date
+static long daysFromCivil(int y, int m, int d)
+{
+    long era, yoe, doy;
+    y -= (m <= 2) ? 1 : 0;
+    era = (y >= 0 ? y : y - 399) / 400;
+    yoe = y - era * 400;
+    doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+    return era * 146097 + yoe * 365 + yoe / 4 - yoe / 100 + doy;
+}
+
+// the date of the days from 0000-03-01
+static void civilFromDays(long days, int *y, int *m, int *d)
+{
+    long era, doe, yoe, doy, mp;
+    era = (days >= 0 ? days : days - 146096) / 146097;
+    doe = days - era * 146097;
+    yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    mp = (5 * doy + 2) / 153;
+    *d = (int)(doy - (153 * mp + 2) / 5 + 1);
+    *m = (int)(mp < 10 ? mp + 3 : mp - 9);
+    *y = (int)(yoe + era * 400 + (*m <= 2 ? 1 : 0));
+}
+
+/**
+ * Shift the date and time string "YYYY:MM:DD HH:MM[:SS]"
+ *
+ * parameters
+ *  [in] value: the original value
+ *  [in] seconds: seconds to add
+ *  [out] newValue: "YYYY:MM:DD HH:MM:SS" (DATETIME_LENGTH bytes at least)
+ *
+ * return
+ *  1: OK
+ *  0: the value is not a date and time
+ */
+static int shiftDateTimeString(const char *value, long seconds, char *newValue)
+{
+    int y, mo, d, h, mi, sec = 0, n;
+    long days, sod;
+
+    n = sscanf(value, "%4d:%2d:%2d %2d:%2d:%2d", &y, &mo, &d, &h, &mi, &sec);
+    if (n < 5 || mo < 1 || mo > 12 || d < 1 || d > 31 ||
+        h < 0 || h > 23 || mi < 0 || mi > 59 || sec < 0 || sec > 60) {
+        return 0;
+    }
+    days = daysFromCivil(y, mo, d) + seconds / 86400;
+    sod = h * 3600L + mi * 60L + sec + seconds % 86400;
+    if (sod < 0) {
+        sod += 86400;
+        days--;
+    } else if (sod >= 86400) {
+        sod -= 86400;
+        days++;
+    }
+    civilFromDays(days, &y, &mo, &d);
+    if (y < 0 || y > 9999) {
+        return 0;
+    }
+    sprintf(newValue, "%04d:%02d:%02d %02ld:%02ld:%02ld",
+            y, mo, d, sod / 3600, (sod / 60) % 60, sod % 60);
+    return 1;
+}
+
+/**
+ * Shift GPSDateStamp and GPSTimeStamp tags in the current opened file
+ *
+ * return
+ *  n: number of the shifted tags
+ *  ERR_WRITE_FILE
+ */
+static int shiftGPSDateTimeInFile(FILE *fp, const char *fileName,
+                                  long seconds, int flags, REPORT_TEXT *report)
+{
+    int i, num = 0, hasDate = 0;
+    int y = 0, mo = 0, d = 0;
+    unsigned int ifdOfs, fieldOfs, dateOfs = 0, r[6];
+    long days = 0, sod, sec;
+    char value[32], newValue[32], from[64], to[64];
+    IFD_TAG tagField;
+
+    if (getIfdOffsetInFile(fp, IFD_GPS, &ifdOfs) <= 0) {
+        return 0;
+    }
+    // GPSDateStamp "YYYY:MM:DD"
+    if (findTagFieldInIfd(fp, ifdOfs, TAG_GPSDateStamp, &tagField, &fieldOfs) > 0 &&
+        tagField.type == TYPE_ASCII && tagField.count > 10 &&
+        readAsciiValueInFile(fp, tagField.offset, tagField.count,
+                             value, sizeof(value)) == 0 &&
+        sscanf(value, "%4d:%2d:%2d", &y, &mo, &d) == 3 &&
+        mo >= 1 && mo <= 12 && d >= 1 && d <= 31) {
+        hasDate = 1;
+        dateOfs = tagField.offset;
+        days = daysFromCivil(y, mo, d);
+    }
+    // GPSTimeStamp hour, minute and second in RATIONAL
+    if (findTagFieldInIfd(fp, ifdOfs, TAG_GPSTimeStamp, &tagField, &fieldOfs) <= 0 ||
+        tagField.type != TYPE_RATIONAL || tagField.count != 3 ||
+        tagField.offset > getTiffDataLength() ||
+        getTiffDataLength() - tagField.offset < sizeof(r) ||
+        seekToRelativeOffset(fp, tagField.offset) != 0 ||
+        fread(r, 1, sizeof(r), fp) < sizeof(r)) {
+        return 0;
+    }
+    for (i = 0; i < 6; i++) {
+        r[i] = fix_int(r[i]);
+    }
+    if (r[1] == 0 || r[3] == 0 || r[5] == 0) {
+        return 0;
+    }
+    sec = (long)(r[4] / r[5]);
+    sod = (long)(r[0] / r[1]) * 3600 + (long)(r[2] / r[3]) * 60 + sec;
+    sprintf(from, "%u/%u %u/%u %u/%u", r[0], r[1], r[2], r[3], r[4], r[5]);
+    days += seconds / 86400;
+    sod += seconds % 86400;
+    if (sod < 0) {
+        sod += 86400;
+        days--;
+    } else if (sod >= 86400) {
+        sod -= 86400;
+        days++;
+    }
+    // keep the fraction of the second
+    r[4] = (unsigned int)((sod % 60) * r[5] + r[4] % r[5]);
+    r[0] = (unsigned int)(sod / 3600);
+    r[1] = 1;
+    r[2] = (unsigned int)((sod / 60) % 60);
+    r[3] = 1;
+    sprintf(to, "%u/%u %u/%u %u/%u", r[0], r[1], r[2], r[3], r[4], r[5]);
+    if (reportShiftedValue(report, fileName, IFD_GPS, TAG_GPSTimeStamp,
+                           from, to, flags) != 0) {
+        return ERR_MEMALLOC;
+    }
+    num++;
+    if (!(flags & SHIFT_DATETIME_DRYRUN)) {
+        for (i = 0; i < 6; i++) {
+            r[i] = fix_int(r[i]);
+        }
+        if (seekToRelativeOffset(fp, tagField.offset) != 0 ||
+            fwrite(r, 1, sizeof(r), fp) != sizeof(r)) {
+            return ERR_WRITE_FILE;
+        }
+    }
+    if (hasDate) {
+        civilFromDays(days, &y, &mo, &d);
+        if (y >= 0 && y <= 9999) {
+            sprintf(newValue, "%04d:%02d:%02d", y, mo, d);
+            value[10] = '\0';
+            if (reportShiftedValue(report, fileName, IFD_GPS, TAG_GPSDateStamp,
+                                   value, newValue, flags) != 0) {
+                return ERR_MEMALLOC;
+            }
+            num++;
+            if (!(flags & SHIFT_DATETIME_DRYRUN)) {
+                if (seekToRelativeOffset(fp, dateOfs) != 0 ||
+                    fwrite(newValue, 1, 10, fp) != 10) {
+                    return ERR_WRITE_FILE;
+                }
+            }
+        }
+    }
+    return num;
+}
+
+// append the shifted value to the report (always in dry-run mode)
+static int reportShiftedValue(REPORT_TEXT *report, const char *fileName,
+                    IFD_TYPE ifdType, unsigned short tagId,
+                    const char *from, const char *to, int flags)
+{
+    if (!Verbose && !(flags & SHIFT_DATETIME_DRYRUN)) {
+        return 0;
+    }
+    return appendReportText(report, "[%s] %s: %.40s -> %.40s\n",
+                            fileName, getTagName(ifdType, tagId), from, to);
+}
+
+// write the report to the file, or to stdout if the file is NULL
+static int writeReportText(const REPORT_TEXT *report, const char *reportFileName)
+{
+    int sts = 0;
+    FILE *fpw = (reportFileName) ? fopen(reportFileName, "w") : stdout;
+    if (!fpw) {
+        return ERR_WRITE_FILE;
+    }
+    if (report->length > 0 &&
+        fwrite(report->text, 1, report->length, fpw) != report->length) {
+        sts = ERR_WRITE_FILE;
+    }
+    if (fpw != stdout && fclose(fpw) != 0) {
+        sts = ERR_WRITE_FILE;
+    }
+    return sts;
+}
+
+// worker function of shiftDateTimeInJPEGFiles()
+static void shiftDateTimeBatchFunc(void *ctx, int index)
+{
+    SHIFT_DATETIME_BATCH *batch = (SHIFT_DATETIME_BATCH*)ctx;
+    beginDurableOutput(batch->durable, index, batch->fileNames[index],
+                       &batch->results[index]);
+    batch->results[index] = shiftDateTimeToReport(batch->fileNames[index],
+                                batch->seconds, batch->flags, batch->make,
+                                batch->model, batch->serial,
+                                &batch->reports[index]);
+    endDurableOutput(batch->durable, index, batch->results[index] > 0 &&
+                     !(batch->flags & SHIFT_DATETIME_DRYRUN));
+}
+
+/**
+ * Rewrite the JPEG file with the tags replaced or added
+ *
+ * parameters
+ *  [in] fileName: target JPEG file (overwritten)
+ *  [in] ifdTypes: IFD type of each tag
+ *  [in] tags: the tags to set
+ *  [in] count: number of the tags
+ *
+ * return
+ *  1: OK
+ *  -n: error
+ */
+static int rewriteTagsInJPEGFile(const char *fileName, const IFD_TYPE *ifdTypes,
+                                 TagNode **tags, int count)
+{
+    int i, sts = 1, result;
+    void **ifdArray, **newArray;
+    char *tmpName;
+
+    ifdArray = createIfdTableArray(fileName, &result);
+    if (!ifdArray && result < 0) {
+        return result;
+    }
+    for (i = 0; i < count && sts > 0; i++) {
+        // create the IFD tables if not exist
+        IFD_TYPE need[3];
+        int k, n = 0;
+        need[n++] = IFD_0TH;
+        if (ifdTypes[i] == IFD_IO) {
+            need[n++] = IFD_EXIF;
+        }
+        need[n++] = ifdTypes[i];
+        for (k = 0; k < n; k++) {
+            IFD_TYPE t = need[k];
+            if (ifdArray && getIfdTableFromIfdTableArray(ifdArray, t)) {
+                continue;
+            }
+            newArray = insertIfdTableToIfdTableArray(ifdArray, t, &result);
+            if (!newArray) {
+                sts = result;
+                break;
+            }
+            ifdArray = newArray;
+        }
+        if (sts > 0) {
+            removeTagNodeFromIfdTableArray(ifdArray, ifdTypes[i], tags[i]->tagId);
+            result = insertTagNodeToIfdTableArray(ifdArray, ifdTypes[i],
+                                                  (TagNodeInfo*)tags[i]);
+            if (result != 0) {
+                sts = result;
+            }
+        }
+    }
+    if (sts > 0) {
+        tmpName = createTempFile(fileName);
+        if (!tmpName) {
+            sts = ERR_WRITE_FILE;
+        } else {
+            sts = updateExifSegmentInJPEGFile(fileName, tmpName, ifdArray);
+            if (sts < 0) {
+                remove(tmpName);
+            } else if (DurableEntry) {
+                // renamed after the group is synced
+                DurableEntry->tmpName = tmpName;
+                tmpName = NULL;
+            } else if (replaceFile(tmpName, fileName) != 0) {
+                remove(tmpName);
+                sts = ERR_WRITE_FILE;
+            }
+            free(tmpName);
+        }
+    }
+    if (ifdArray) {
+        freeIfdTableArray(ifdArray);
+    }
+    return sts;
+}
+
+// compare the strings ignoring the case
+static int strEqualsIgnoreCase(const char *a, const char *b)
+{
+    while (*a && tolower((unsigned char)*a) == tolower((unsigned char)*b)) {
+        a++;
+        b++;
+    }
+    return (*a == '\0' && *b == '\0') ? 1 : 0;
+}
+
+/**
+ * Get the next field of the CSV line
+ *
+ * parameters
+ *  [in/out] pp: current position in the line (NULL at the end)
+ *  [in] last: 1 if the field is the last one (may contain ',')
+ *
+ * return
+ *  the null-terminated field
+ */
+static char *nextCsvField(char **pp, int last)
+{
+    char *p = *pp, *field, *w;
+    if (!p) {
+        return NULL;
+    }
+    while (*p == ' ' || *p == '\t') {
+        p++;
+    }
+    if (*p == '"') {
+        // quoted field. "" means a double quote character
+        field = w = ++p;
+        while (*p) {
+            if (*p == '"') {
+                if (*(p+1) != '"') {
+                    break;
+                }
+                p++;
+            }
+            *w++ = *p++;
+        }
+        if (*p == '"') {
+            p++;
+        }
+        *w = '\0';
+        p = strchr(p, ',');
+        *pp = (p) ? p + 1 : NULL;
+        return field;
+    }
+    field = p;
+    p = (last) ? NULL : strchr(p, ',');
+    if (p) {
+        *p = '\0';
+        *pp = p + 1;
+    } else {
+        *pp = NULL;
+    }
+    return field;
+}
+
+// create the tag from the string of the manifest
+static TagNode *createTagNodeFromString(unsigned short tagId,
+                                        unsigned short type,
+                                        const char *value)
+{
+    int result, i;
+    unsigned int count = 0, num;
+    const char *p;
+    char *end;
+    TagNode *tag;
+
+    if (type == TYPE_ASCII || type == TYPE_UNDEFINED) {
+        count = (unsigned int)strlen(value) + ((type == TYPE_ASCII) ? 1 : 0);
+        tag = (TagNode*)createTagInfo(tagId, type, count, &result);
+        if (tag) {
+            memcpy(tag->byteData, value, count);
+        }
+        return tag;
+    }
+    // count the numbers separated by spaces
+    for (p = value; *p; ) {
+        while (*p && isspace((unsigned char)*p)) {
+            p++;
+        }
+        if (*p) {
+            count++;
+        }
+        while (*p && !isspace((unsigned char)*p)) {
+            p++;
+        }
+    }
+    tag = (TagNode*)createTagInfo(tagId, type, count, &result);
+    if (!tag || !tag->numData) {
+        freeTagNode(tag);
+        return NULL;
+    }
+    num = (type == TYPE_RATIONAL || type == TYPE_SRATIONAL) ? count * 2 : count;
+    p = value;
+    for (i = 0; i < (int)num; i++) {
+        if (type == TYPE_SBYTE || type == TYPE_SSHORT ||
+            type == TYPE_SLONG || type == TYPE_SRATIONAL) {
+            tag->numData[i] = (unsigned int)strtol(p, &end, 0);
+        } else {
+            tag->numData[i] = (unsigned int)strtoul(p, &end, 0);
+        }
+        if (end == p) {
+            freeTagNode(tag);
+            return NULL;
+        }
+        p = end;
+        if ((type == TYPE_RATIONAL || type == TYPE_SRATIONAL) && i % 2 == 0) {
+            if (*p != '/') {
+                freeTagNode(tag);
+                return NULL;
+            }
+            p++;
+        }
+    }
+    return tag;
+}
+
+// read a whole line of the manifest into the buffer growing as needed
+// (1: OK, 0: end of the file, ERR_MEMALLOC)
+static int readManifestLine(FILE *fp, char **pLine, size_t *pMax)
+{
+    size_t len = 0;
+    char *wk;
+
+    for (;;) {
+        if (*pMax - len < 2) {
+            wk = (char*)realloc(*pLine, (*pMax == 0) ? 4096 : *pMax * 2);
+            if (!wk) {
+                return ERR_MEMALLOC;
+            }
+            *pLine = wk;
+            *pMax = (*pMax == 0) ? 4096 : *pMax * 2;
+        }
+        if (!fgets(*pLine + len, (int)(*pMax - len), fp)) {
+            return (len > 0) ? 1 : 0;
+        }
+        len += strlen(*pLine + len);
+        if (len > 0 && (*pLine)[len-1] == '\n') {
+            return 1;
+        }
+    }
+}
+
+/**
+ * Parse a line of the manifest of updateTagDataInJPEGFilesFromManifest()
+ *
+ * return
+ *  1: OK (edit->tag is NULL if the line is invalid)
+ *  0: empty or comment line
+ *  ERR_MEMALLOC
+ */
+static int parseManifestLine(char *line, MANIFEST_EDIT *edit)
+{
+    static const char *typeNames[] = {
+        "byte", "ascii", "short", "long", "rational",
+        "sbyte", "undefined", "sshort", "slong", "srational"
+    };
+    static const struct {
+        const char *name;
+        IFD_TYPE ifdType;
+    } ifdNames[] = {
+        { "0th", IFD_0TH }, { "1st", IFD_1ST }, { "exif", IFD_EXIF },
+        { "gps", IFD_GPS }, { "io", IFD_IO },
+    };
+    char *p = line, *path, *ifd, *tagId, *type, *value, *end;
+    unsigned long ul;
+    unsigned short tagType = 0;
+    int i;
+    size_t len = strlen(line);
+
+    // remove the new line
+    while (len > 0 && (line[len-1] == '\n' || line[len-1] == '\r')) {
+        line[--len] = '\0';
+    }
+    while (*p == ' ' || *p == '\t') {
+        p++;
+    }
+    if (*p == '\0' || *p == '#') {
+        return 0;
+    }
+    memset(edit, 0, sizeof(MANIFEST_EDIT));
+    path = nextCsvField(&p, 0);
+    ifd = nextCsvField(&p, 0);
+    tagId = nextCsvField(&p, 0);
+    type = nextCsvField(&p, 0);
+    value = nextCsvField(&p, 1);
+    edit->fileName = (char*)malloc(strlen(path) + 1);
+    if (!edit->fileName) {
+        return ERR_MEMALLOC;
+    }
+    strcpy(edit->fileName, path);
+    if (!value) {
+        return 1; // invalid line
+    }
+    for (i = 0; i < (int)(sizeof(ifdNames) / sizeof(ifdNames[0])); i++) {
+        if (strEqualsIgnoreCase(ifd, ifdNames[i].name)) {
+            edit->ifdType = ifdNames[i].ifdType;
+        }
+    }
+    ul = strtoul(tagId, &end, 0);
+    if (edit->ifdType == IFD_UNKNOWN || end == tagId || ul > 0xFFFF) {
+        return 1;
+    }
+    for (i = 0; i < (int)(sizeof(typeNames) / sizeof(typeNames[0])); i++) {
+        if (strEqualsIgnoreCase(type, typeNames[i])) {
+            tagType = (unsigned short)(TYPE_BYTE + i);
+        }
+    }
+    if (tagType == 0) {
+        unsigned long t = strtoul(type, &end, 0);
+        if (end != type && t >= TYPE_BYTE && t <= TYPE_SRATIONAL) {
+            tagType = (unsigned short)t;
+        }
+    }
+    if (tagType != 0) {
+        edit->tag = createTagNodeFromString((unsigned short)ul, tagType, value);
+    }
+    return 1;
+}
+
+// compare the edits by the file name and the line number
+static int compareManifestEdit(const void *a, const void *b)
+{
+    const MANIFEST_EDIT *ea = (const MANIFEST_EDIT*)a;
+    const MANIFEST_EDIT *eb = (const MANIFEST_EDIT*)b;
+    int c = strcmp(ea->fileName, eb->fileName);
+    return (c != 0) ? c : ea->line - eb->line;
+}
+
+// worker function of updateTagDataInJPEGFilesFromManifest()
+static void updateTagDataBatchFunc(void *ctx, int index)
+{
+    MANIFEST_BATCH *batch = (MANIFEST_BATCH*)ctx;
+    MANIFEST_EDIT *edits = &batch->edits[batch->groupStart[index]];
+    MANIFEST_RESULT *res = &batch->results[index];
+    int count = batch->groupStart[index+1] - batch->groupStart[index];
+    int i, sts, rewrite = 0;
+    IFD_TYPE *ifdTypes;
+    TagNode **tags;
+    FILE *fp;
+
+    beginDurableOutput(batch->durable, index, edits[0].fileName, &res->sts);
+    ifdTypes = (IFD_TYPE*)malloc(sizeof(IFD_TYPE) * count);
+    tags = (TagNode**)malloc(sizeof(TagNode*) * count);
+    if (!ifdTypes || !tags) {
+        res->sts = ERR_MEMALLOC;
+        goto DONE;
+    }
+    for (i = 0; i < count; i++) {
+        if (!edits[i].tag) {
+            res->sts = ERR_INVALID_POINTER;
+            res->errorLine = edits[i].line;
+            goto DONE;
+        }
+        ifdTypes[i] = edits[i].ifdType;
+        tags[i] = edits[i].tag;
+    }
+    fp = fopen(edits[0].fileName, "r+b");
+    if (!fp) {
+        res->sts = ERR_READ_FILE;
+        res->errorLine = edits[0].line;
+        goto DONE;
+    }
+    sts = init(fp);
+    if (sts == 0) {
+        rewrite = 1; // the Exif segment is not found
+    } else if (sts < 0) {
+        res->errorLine = edits[0].line;
+    }
+    // check all the edits before writing anything not to leave the file
+    // with a part of them
+    for (i = 0; i < count && sts > 0; i++) {
+        sts = updateTagDataInFile(fp, ifdTypes[i], tags[i], 1);
+        if (sts == ERR_INVALID_TYPE || sts == ERR_INVALID_COUNT ||
+            sts == ERR_NOT_EXIST) {
+            // the size of the value is changed or the tag is not found
+            rewrite = 1;
+            break;
+        }
+        if (sts < 0) {
+            res->errorLine = edits[i].line;
+            break;
+        }
+    }
+    for (i = 0; i < count && sts > 0 && !rewrite; i++) {
+        sts = updateTagDataInFile(fp, ifdTypes[i], tags[i], 0);
+        if (sts < 0) {
+            res->errorLine = edits[i].line;
+            break;
+        }
+    }
+    if (fclose(fp) != 0 && sts >= 0) {
+        sts = ERR_WRITE_FILE;
+    }
+    if (!rewrite) {
+        if (sts < 0) {
+            res->sts = sts;
+            goto DONE;
+        }
+        res->inPlace = count;
+    } else {
+        // apply all the edits in one rewrite
+        sts = rewriteTagsInJPEGFile(edits[0].fileName, ifdTypes, tags, count);
+        if (sts < 0) {
+            res->sts = sts;
+            res->errorLine = edits[0].line;
+            goto DONE;
+        }
+        res->rewritten = count;
+    }
+    res->sts = 1;
+DONE:
+    endDurableOutput(batch->durable, index, res->sts > 0);
+    free(ifdTypes);
+    free(tags);
+}
+
+// copy the data of the file (length < 0: to the end of the file)
+static int copyFileData(FILE *fpr, FILE *fpw, long length)
+{
+    unsigned char buf[8192];
+    size_t readLen, len;
+    for (;;) {
+        len = sizeof(buf);
+        if (length >= 0 && (size_t)length < len) {
+            len = (size_t)length;
+        }
+        if (len == 0) {
+            break;
+        }
+        readLen = fread(buf, 1, len, fpr);
+        if (readLen == 0) {
+            if (length > 0) {
+                return ERR_READ_FILE;
+            }
+            break;
+        }
+        if (fwrite(buf, 1, readLen, fpw) != readLen) {
+            return ERR_WRITE_FILE;
+        }
+        if (length > 0) {
+            length -= (long)readLen;
+        }
+    }
+    return 0;
+}
+
+// read/write the value in the raw Exif segment on memory
+static unsigned short getShortInSegment(const unsigned char *p, int littleEndian)
+{
+    if (littleEndian) {
+        return (unsigned short)(p[0] | (p[1] << 8));
+    }
+    return (unsigned short)((p[0] << 8) | p[1]);
+}
+
+static unsigned int getIntInSegment(const unsigned char *p, int littleEndian)
+{
+    if (littleEndian) {
+        return (unsigned int)p[0] | ((unsigned int)p[1] << 8) |
+               ((unsigned int)p[2] << 16) | ((unsigned int)p[3] << 24);
+    }
+    return ((unsigned int)p[0] << 24) | ((unsigned int)p[1] << 16) |
+           ((unsigned int)p[2] << 8) | (unsigned int)p[3];
+}
+
+static unsigned long long getInt64InSegment(const unsigned char *p, int littleEndian)
+{
+    unsigned long long hi, lo;
+    if (littleEndian) {
+        lo = getIntInSegment(p, 1);
+        hi = getIntInSegment(p + 4, 1);
+    } else {
+        hi = getIntInSegment(p, 0);
+        lo = getIntInSegment(p + 4, 0);
+    }
+    return (hi << 32) | lo;
+}
+
+static void setShortInSegment(unsigned char *p, unsigned short us, int littleEndian)
+{
+    if (littleEndian) {
+        p[0] = (unsigned char)(us & 0xFF);
+        p[1] = (unsigned char)(us >> 8);
+    } else {
+        p[0] = (unsigned char)(us >> 8);
+        p[1] = (unsigned char)(us & 0xFF);
+    }
+}
+
+static void setIntInSegment(unsigned char *p, unsigned int ui, int littleEndian)
+{
+    if (littleEndian) {
+        setShortInSegment(p, (unsigned short)(ui & 0xFFFF), 1);
+        setShortInSegment(p + 2, (unsigned short)(ui >> 16), 1);
+    } else {
+        setShortInSegment(p, (unsigned short)(ui >> 16), 0);
+        setShortInSegment(p + 2, (unsigned short)(ui & 0xFFFF), 0);
+    }
+}
+
+/**
+ * Check the header of the raw Exif segment on memory
+ *
+ * return
+ *  1: OK
+ *  0: invalid segment
+ */
+static int checkExifSegment(const unsigned char *segment, unsigned int length,
+                            int *pLittleEndian)
+{
+    if (length < 18 || segment[0] != 0xFF || segment[1] != 0xE1) {
+        return 0;
+    }
+    if (((segment[2] << 8) | segment[3]) + 2 != (int)length) {
+        return 0;
+    }
+    if (memcmp(segment + 4, "Exif\0\0", 6) != 0) {
+        return 0;
+    }
+    if (segment[10] == 'I' && segment[11] == 'I') {
+        *pLittleEndian = 1;
+    } else if (segment[10] == 'M' && segment[11] == 'M') {
+        *pLittleEndian = 0;
+    } else {
+        return 0;
+    }
+    return (getShortInSegment(segment + 12, *pLittleEndian) == 0x002A) ? 1 : 0;
+}
+
+// find the tag field in the IFD of the TIFF data on memory
+static unsigned char *findTagInSegment(unsigned char *tiff, unsigned int tiffLen,
+                                       int littleEndian, unsigned int ifdOffset,
+                                       unsigned short tagId)
+{
+    unsigned int i, num;
+    unsigned char *p;
+    if (ifdOffset < 8 || ifdOffset > tiffLen - 2) {
+        return NULL;
+    }
+    num = getShortInSegment(tiff + ifdOffset, littleEndian);
+    if (num * sizeof(IFD_TAG) > tiffLen - ifdOffset - 2) {
+        return NULL;
+    }
+    p = tiff + ifdOffset + 2;
+    for (i = 0; i < num; i++, p += sizeof(IFD_TAG)) {
+        if (getShortInSegment(p, littleEndian) == tagId) {
+            return p;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Get the end offset of the IFD and the values outside the IFD
+ *
+ * parameters
+ *  [in] followPointers : 1 to include the IFDs pointed by the Exif, GPS
+ *                        and Interoperability pointer tags
+ *
+ * return
+ *  end offset, 0 if the IFD offset is invalid, or IFD_END_CIRCULAR
+ *  if the pointers lead back to an IFD already followed
+ */
+static unsigned int getIfdEndInSegment(unsigned char *tiff, unsigned int tiffLen,
+                                       int littleEndian, unsigned int ifdOffset,
+                                       int followPointers)
+{
+    unsigned int path[IFD_PATH_MAX];
+    return getIfdEndOnPath(tiff, tiffLen, littleEndian, ifdOffset,
+                           followPointers, path, 0);
+}
+
+// get the end offset of the IFD reached through the IFDs in 'path'
+static unsigned int getIfdEndOnPath(unsigned char *tiff, unsigned int tiffLen,
+                                    int littleEndian, unsigned int ifdOffset,
+                                    int followPointers, unsigned int *path, int depth)
+{
+    unsigned int i, num, end, ofs, size, e;
+    unsigned short tagId;
+    unsigned char *p;
+    if (ifdOffset < 8 || ifdOffset > tiffLen - 2) {
+        return 0;
+    }
+    for (i = 0; i < (unsigned int)depth; i++) {
+        if (path[i] == ifdOffset) {
+            return IFD_END_CIRCULAR;
+        }
+    }
+    if (depth >= IFD_PATH_MAX) {
+        return IFD_END_CIRCULAR; // nested deeper than the Exif structure
+    }
+    path[depth] = ifdOffset;
+    num = getShortInSegment(tiff + ifdOffset, littleEndian);
+    end = ifdOffset + 2 + num * sizeof(IFD_TAG) + 4;
+    if (end > tiffLen) {
+        return tiffLen;
+    }
+    p = tiff + ifdOffset + 2;
+    for (i = 0; i < num; i++, p += sizeof(IFD_TAG)) {
+        tagId = getShortInSegment(p, littleEndian);
+        ofs = getIntInSegment(p + 8, littleEndian);
+        if (followPointers && (tagId == TAG_ExifIFDPointer ||
+            tagId == TAG_GPSInfoIFDPointer || tagId == TAG_InteroperabilityIFDPointer)) {
+            e = getIfdEndOnPath(tiff, tiffLen, littleEndian, ofs,
+                                (tagId == TAG_ExifIFDPointer) ? 1 : 0, path, depth + 1);
+        } else {
+            size = getTagValueSize(getShortInSegment(p + 2, littleEndian),
+                                   getIntInSegment(p + 4, littleEndian));
+            if (size <= 4 || ofs > tiffLen) {
+                continue;
+            }
+            e = (size > tiffLen - ofs) ? tiffLen : ofs + size;
+        }
+        // IFD_END_CIRCULAR is kept as the largest
+        if (e > end) {
+            end = e;
+        }
+    }
+    return end;
+}
+
+// load the TIFF data of the current opened Exif segment
+static RawSegment *loadRawSegment(FILE *fp)
+{
+    RawSegment *raw;
+    unsigned int len = getTiffDataLength();
+    if (len < sizeof(TIFF_HEADER)) {
+        return NULL;
+    }
+    raw = (RawSegment*)malloc(sizeof(RawSegment));
+    if (!raw) {
+        return NULL;
+    }
+    memset(raw, 0, sizeof(RawSegment));
+    raw->data = (unsigned char*)malloc(len);
+    if (!raw->data) {
+        free(raw);
+        return NULL;
+    }
+    if (seekToRelativeOffset(fp, 0) != 0 ||
+        fread(raw->data, 1, len, fp) < len) {
+        free(raw->data);
+        free(raw);
+        return NULL;
+    }
+    raw->length = len;
+    raw->byteOrder = App1Header.tiff.byteOrder;
+    return raw;
+}
+
+// link the IFD table and its tags to the original data
+static void setRawSegmentToIfd(IfdTable *ifd, RawSegment *raw, unsigned int ifdOffset)
+{
+    unsigned int i, num, ofs;
+    unsigned short type;
+    int le;
+    TagNode *tag;
+    if (!raw || ifdOffset < sizeof(TIFF_HEADER) || ifdOffset > raw->length - 2) {
+        return;
+    }
+    le = (raw->byteOrder == 0x4949) ? 1 : 0;
+    num = getShortInSegment(raw->data + ifdOffset, le);
+    if (num * sizeof(IFD_TAG) > raw->length - ifdOffset - 2) {
+        return;
+    }
+    // parseIFD() adds a tag node for each field of the valid type
+    tag = ifd->tags;
+    for (i = 0; i < num && tag; i++) {
+        ofs = ifdOffset + sizeof(short) + i * sizeof(IFD_TAG);
+        type = getShortInSegment(raw->data + ofs + 2, le);
+        if (type < TYPE_BYTE || type > TYPE_SRATIONAL) {
+            continue;
+        }
+        tag->rawOffset = ofs;
+        tag = tag->next;
+    }
+    ifd->raw = raw;
+    ifd->rawOffset = ifdOffset;
+    raw->refCount++;
+    raw->ifdCount++;
+}
+
+// unlink the IFD table from the original data
+static void releaseRawSegment(IfdTable *ifd)
+{
+    TagNode *tag;
+    if (!ifd || !ifd->raw) {
+        return;
+    }
+    if (--ifd->raw->refCount == 0) {
+        free(ifd->raw->data);
+        free(ifd->raw);
+    }
+    ifd->raw = NULL;
+    for (tag = ifd->tags; tag; tag = tag->next) {
+        tag->rawOffset = 0;
+    }
+}
+
+// check if the value of the tag is the same as the original data
+static int tagMatchesRawData(TagNode *tag, RawSegment *raw)
+{
+    if (tag->rawOffset == 0 || tag->rawOffset > raw->length - sizeof(IFD_TAG)) {
+        return 0;
+    }
+    return tagMatchesField(tag, raw->data, raw->length,
+                           (raw->byteOrder == 0x4949) ? 1 : 0,
+                           raw->data + tag->rawOffset);
+}
+
+// check if the tag field in the TIFF data on memory has the same value
+static int tagMatchesField(TagNode *tag, const unsigned char *tiff,
+                           unsigned int tiffLen, int le,
+                           const unsigned char *field)
+{
+    unsigned char buf[256], *p;
+    unsigned int size, ofs;
+    int ret;
+
+    if (getShortInSegment(field, le) != tag->tagId ||
+        getShortInSegment(field + 2, le) != tag->type ||
+        getIntInSegment(field + 4, le) != tag->count) {
+        return 0;
+    }
+    size = getTagValueSize(tag->type, tag->count);
+    if (size == 0 || size == 0xFFFFFFFF) {
+        return 0;
+    }
+    if (size <= 4) {
+        memset(buf, 0, 4);
+        return (packTagValue(tag, buf) && memcmp(buf, field + 8, size) == 0) ? 1 : 0;
+    }
+    ofs = getIntInSegment(field + 8, le);
+    if (ofs > tiffLen || size > tiffLen - ofs) {
+        return 0;
+    }
+    p = (size > sizeof(buf)) ? (unsigned char*)malloc(size) : buf;
+    if (!p) {
+        return 0;
+    }
+    ret = (packTagValue(tag, p) && memcmp(p, tiff + ofs, size) == 0) ? 1 : 0;
+    if (p != buf) {
+        free(p);
+    }
+    return ret;
+}
+
+// get the offset of the IFD in the TIFF data on memory (0 if not found)
+static unsigned int getIfdOffsetInSegment(unsigned char *tiff, unsigned int tiffLen,
+                                          int littleEndian, IFD_TYPE ifdType)
+{
+    unsigned int num, ifdOfs = getIntInSegment(tiff + 4, littleEndian);
+    unsigned char *field;
+
+    switch (ifdType) {
+    case IFD_0TH:
+        break;
+    case IFD_EXIF:
+    case IFD_GPS:
+    case IFD_IO:
+        field = findTagInSegment(tiff, tiffLen, littleEndian, ifdOfs,
+                (ifdType == IFD_GPS) ? TAG_GPSInfoIFDPointer : TAG_ExifIFDPointer);
+        if (!field) {
+            return 0;
+        }
+        ifdOfs = getIntInSegment(field + 8, littleEndian);
+        if (ifdType == IFD_IO) {
+            field = findTagInSegment(tiff, tiffLen, littleEndian, ifdOfs,
+                                     TAG_InteroperabilityIFDPointer);
+            if (!field) {
+                return 0;
+            }
+            ifdOfs = getIntInSegment(field + 8, littleEndian);
+        }
+        break;
+    case IFD_1ST:
+        // the offset of the 1st IFD is placed at the tail of the 0th IFD
+        if (ifdOfs < sizeof(TIFF_HEADER) || ifdOfs > tiffLen - 2) {
+            return 0;
+        }
+        num = getShortInSegment(tiff + ifdOfs, littleEndian);
+        if (num * sizeof(IFD_TAG) + sizeof(short) + sizeof(int) > tiffLen - ifdOfs) {
+            return 0;
+        }
+        ifdOfs = getIntInSegment(tiff + ifdOfs + sizeof(short) +
+                                 num * sizeof(IFD_TAG), littleEndian);
+        break;
+    default:
+        return 0;
+    }
+    if (ifdOfs < sizeof(TIFF_HEADER) || ifdOfs > tiffLen - 2) {
+        return 0;
+    }
+    return ifdOfs;
+}
+
+/**
+ * Verify the serialized Exif segment against the IFD tables
+ *
+ * parameters
+ *  [in] segment: the Exif segment (begins with the APP1 marker)
+ *  [in] length: length of the segment
+ *  [in] ifdTableArray: the IFD tables written to the segment
+ *
+ * return
+ *  0: OK
+ *  ERR_VERIFY_FAILED
+ *
+ * note
+ * The IFDs are found by following the offsets in the segment, and each
+ * tag must have the same type, count and value as the IFD table. For
+ * the offset tags, the IFD or the thumbnail pointed by the value must
+ * be found in the segment instead.
+ */
+static int verifyExifSegment(const unsigned char *segment, unsigned int length,
+                             void **ifdTableArray)
+{
+    unsigned int ofs, num, total, valid, len;
+    unsigned char *tiff, *field;
+    IfdTable *ifd;
+    TagNode *tag;
+    int le, t;
+
+    if (!checkExifSegment(segment, length, &le) ||
+        le != ((App1Header.tiff.byteOrder == 0x4949) ? 1 : 0)) {
+        return ERR_VERIFY_FAILED;
+    }
+    tiff = (unsigned char*)segment + sizeof(App1Header.marker) +
+           sizeof(App1Header.length) + sizeof(App1Header.id);
+    length -= (unsigned int)(tiff - segment);
+    for (t = IFD_0TH; t <= IFD_IO; t++) {
+        ifd = getIfdTableFromIfdTableArray(ifdTableArray, (IFD_TYPE)t);
+        ofs = getIfdOffsetInSegment(tiff, length, le, (IFD_TYPE)t);
+        if (!ifd || ofs == 0) {
+            if (ifd || ofs != 0) {
+                return ERR_VERIFY_FAILED; // the IFD is lost or added
+            }
+            continue;
+        }
+        num = getShortInSegment(tiff + ofs, le);
+        if (num * sizeof(IFD_TAG) + sizeof(short) + sizeof(int) > length - ofs) {
+            return ERR_VERIFY_FAILED;
+        }
+        total = valid = 0;
+        for (tag = ifd->tags; tag; tag = tag->next) {
+            total++;
+            if (tag->error) {
+                continue; // may be dropped
+            }
+            valid++;
+            field = findTagInSegment(tiff, length, le, ofs, tag->tagId);
+            if (!field) {
+                return ERR_VERIFY_FAILED;
+            }
+            if (isOffsetTag(ifd->ifdType, tag->tagId)) {
+                if (getShortInSegment(field + 2, le) != tag->type ||
+                    getIntInSegment(field + 4, le) != tag->count) {
+                    return ERR_VERIFY_FAILED;
+                }
+            } else if (!tagMatchesField(tag, tiff, length, le, field)) {
+                return ERR_VERIFY_FAILED;
+            }
+        }
+        if (num < valid || num > total) {
+            return ERR_VERIFY_FAILED;
+        }
+        if (ifd->ifdType == IFD_1ST && ifd->p) {
+            // the thumbnail
+            tag = getTagNodePtrFromIfd(ifd, TAG_JPEGInterchangeFormatLength);
+            field = findTagInSegment(tiff, length, le, ofs, TAG_JPEGInterchangeFormat);
+            if (!tag || !tag->numData || !field) {
+                return ERR_VERIFY_FAILED;
+            }
+            len = tag->numData[0];
+            ofs = getIntInSegment(field + 8, le);
+            if (ofs < sizeof(TIFF_HEADER) || ofs > length || len > length - ofs ||
+                memcmp(tiff + ofs, ifd->p, len) != 0) {
+                return ERR_VERIFY_FAILED;
+            }
+        }
+    }
+    return 0;
+}
+
+// get the offset of the thumbnail in the original data if it is not changed
+static unsigned int getRawThumbnailOffset(IfdTable *ifd)
+{
+    RawSegment *raw = ifd->raw;
+    unsigned char *field;
+    unsigned int ofs, len;
+    TagNode *tag;
+    int le;
+    if (!raw || !ifd->p) {
+        return 0;
+    }
+    tag = getTagNodePtrFromIfd(ifd, TAG_JPEGInterchangeFormatLength);
+    if (!tag || !tag->numData) {
+        return 0;
+    }
+    len = tag->numData[0];
+    le = (raw->byteOrder == 0x4949) ? 1 : 0;
+    field = findTagInSegment(raw->data, raw->length, le, ifd->rawOffset,
+                             TAG_JPEGInterchangeFormat);
+    if (!field) {
+        return 0;
+    }
+    ofs = getIntInSegment(field + 8, le);
+    if (ofs < sizeof(TIFF_HEADER) || ofs > raw->length || len > raw->length - ofs ||
+        memcmp(raw->data + ofs, ifd->p, len) != 0) {
+        return 0;
+    }
+    return ofs;
+}
+
+// check if the IFD table is changed from the original data
+static int ifdIsModified(IfdTable *ifd)
+{
+    TagNode *tag;
+    unsigned int num = 0;
+    if (ifd->modified) {
+        return 1;
+    }
+    // the tags may be changed through getTagInfoFromIfd()
+    for (tag = ifd->tags; tag; tag = tag->next) {
+        if (tag->rawOffset == 0) {
+            return 1;
+        }
+        if (!tag->error && !tagMatchesRawData(tag, ifd->raw)) {
+            return 1;
+        }
+        num++;
+    }
+    if (num != getShortInSegment(ifd->raw->data + ifd->rawOffset,
+                                 ifd->raw->byteOrder == 0x4949)) {
+        return 1;
+    }
+    if (ifd->ifdType == IFD_1ST && ifd->p && getRawThumbnailOffset(ifd) == 0) {
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Write the IFD table to the TIFF data
+ *
+ * parameters
+ *  [in] ifd: the IFD table linked to the original data
+ *  [out] tiff: TIFF data to write (NULL to get the size only)
+ *  [in] ofs: offset to write the IFD table
+ *
+ * return
+ *  the end offset of the IFD table and the values
+ *
+ * note
+ * The values that are not changed are not written and the original
+ * offset is used. The pointer tags must be updated by the caller.
+ */
+static unsigned int writeIfdToRawData(IfdTable *ifd, unsigned char *tiff,
+                                      unsigned int ofs)
+{
+    RawSegment *raw = ifd->raw;
+    int le = (raw->byteOrder == 0x4949) ? 1 : 0;
+    unsigned int num = 0, size, valueOfs, thumbnailOfs, len, slot;
+    unsigned char *field;
+    TagNode *tag;
+
+    for (tag = ifd->tags; tag; tag = tag->next) {
+        if (!tag->error || tag->rawOffset != 0) {
+            num++;
+        }
+    }
+    valueOfs = ofs + sizeof(short) + sizeof(IFD_TAG) * num + sizeof(int);
+    if (tiff) {
+        setShortInSegment(tiff + ofs, (unsigned short)num, le);
+        // keep the link to the next IFD
+        len = getShortInSegment(raw->data + ifd->rawOffset, le);
+        memcpy(tiff + ofs + sizeof(short) + sizeof(IFD_TAG) * num,
+               raw->data + ifd->rawOffset + sizeof(short) + sizeof(IFD_TAG) * len,
+               sizeof(int));
+    }
+    field = (tiff) ? tiff + ofs + sizeof(short) : NULL;
+    for (tag = ifd->tags; tag; tag = tag->next) {
+        if (tag->error) {
+            // the original field is kept as it is
+            if (tag->rawOffset != 0) {
+                if (field) {
+                    memcpy(field, raw->data + tag->rawOffset, sizeof(IFD_TAG));
+                    field += sizeof(IFD_TAG);
+                }
+            }
+            continue;
+        }
+        size = getTagValueSize(tag->type, tag->count);
+        if (field) {
+            setShortInSegment(field, tag->tagId, le);
+            setShortInSegment(field + 2, tag->type, le);
+            setIntInSegment(field + 4, tag->count, le);
+            memset(field + 8, 0, 4);
+        }
+        if (size <= 4) {
+            if (field) {
+                packTagValue(tag, field + 8);
+            }
+        } else if (tagMatchesRawData(tag, raw)) {
+            // use the original value
+            if (field) {
+                memcpy(field + 8, raw->data + tag->rawOffset + 8, 4);
+            }
+        } else if ((slot = getRawValueSlot(ifd, tag)) != 0) {
+            // overwrite the original value not to grow the segment
+            if (field) {
+                setIntInSegment(field + 8, slot, le);
+                packTagValue(tag, tiff + slot);
+            }
+        } else {
+            if (field) {
+                setIntInSegment(field + 8, valueOfs, le);
+                packTagValue(tag, tiff + valueOfs);
+            }
+            valueOfs += size + (size % 2);
+        }
+        if (field) {
+            field += sizeof(IFD_TAG);
+        }
+    }
+    // thumbnail data in the 1st IFD
+    if (ifd->ifdType == IFD_1ST && ifd->p) {
+        thumbnailOfs = getRawThumbnailOffset(ifd);
+        tag = getTagNodePtrFromIfd(ifd, TAG_JPEGInterchangeFormatLength);
+        len = (tag && tag->numData) ? tag->numData[0] : 0;
+        if (thumbnailOfs == 0 && len > 0) {
+            thumbnailOfs = valueOfs;
+            if (tiff) {
+                memcpy(tiff + valueOfs, ifd->p, len);
+            }
+            valueOfs += len + (len % 2);
+        }
+        if (tiff) {
+            setPointerInRawData(tiff, valueOfs, le, ofs,
+                                TAG_JPEGInterchangeFormat, thumbnailOfs);
+        }
+    }
+    return valueOfs;
+}
+
+// clear the IFD table and the values no longer used in the original data
+static void clearOldIfdInRawData(IfdTable *ifd, unsigned char *tiff)
+{
+    RawSegment *raw = ifd->raw;
+    int le = (raw->byteOrder == 0x4949) ? 1 : 0, reused;
+    unsigned int i, num, size, ofs, len;
+    unsigned char *field;
+    TagNode *tag;
+
+    num = getShortInSegment(raw->data + ifd->rawOffset, le);
+    for (i = 0; i < num; i++) {
+        ofs = ifd->rawOffset + sizeof(short) + i * sizeof(IFD_TAG);
+        field = raw->data + ofs;
+        size = getTagValueSize(getShortInSegment(field + 2, le),
+                               getIntInSegment(field + 4, le));
+        if (size <= 4) {
+            continue;
+        }
+        reused = 0;
+        for (tag = ifd->tags; tag && !reused; tag = tag->next) {
+            if (tag->rawOffset == ofs) {
+                reused = (tag->error || tagMatchesRawData(tag, raw)) ? 1 : 0;
+            }
+        }
+        ofs = getIntInSegment(field + 8, le);
+        if (!reused && ofs <= raw->length && size <= raw->length - ofs) {
+            memset(tiff + ofs, 0, size);
+        }
+    }
+    if (ifd->ifdType == IFD_1ST && getRawThumbnailOffset(ifd) == 0) {
+        field = findTagInSegment(raw->data, raw->length, le, ifd->rawOffset,
+                                 TAG_JPEGInterchangeFormat);
+        ofs = (field) ? getIntInSegment(field + 8, le) : 0;
+        field = findTagInSegment(raw->data, raw->length, le, ifd->rawOffset,
+                                 TAG_JPEGInterchangeFormatLength);
+        len = (field) ? getIntInSegment(field + 8, le) : 0;
+        if (ofs >= sizeof(TIFF_HEADER) && ofs <= raw->length && len <= raw->length - ofs) {
+            memset(tiff + ofs, 0, len);
+        }
+    }
+    memset(tiff + ifd->rawOffset, 0, sizeof(short) + sizeof(IFD_TAG) * num + sizeof(int));
+}
+
+/**
+ * Get the end offset of the area owned by the IFD table in the original data
+ *
+ * The area starts at the IFD table and is extended by the values placed
+ * just behind it that are cleared by clearOldIfdInRawData() and not
+ * overwritten by the new values (see getRawValueSlot()).
+ * The IFD table can be rewritten in place if it fits in this area.
+ */
+static unsigned int getOldIfdEndInRawData(IfdTable *ifd)
+{
+    RawSegment *raw = ifd->raw;
+    int le = (raw->byteOrder == 0x4949) ? 1 : 0, reused, extended;
+    unsigned int i, num, size, ofs, end;
+    unsigned char *field;
+    TagNode *tag;
+
+    num = getShortInSegment(raw->data + ifd->rawOffset, le);
+    end = ifd->rawOffset + sizeof(short) + sizeof(IFD_TAG) * num + sizeof(int);
+    do {
+        extended = 0;
+        for (i = 0; i < num; i++) {
+            ofs = ifd->rawOffset + sizeof(short) + i * sizeof(IFD_TAG);
+            field = raw->data + ofs;
+            size = getTagValueSize(getShortInSegment(field + 2, le),
+                                   getIntInSegment(field + 4, le));
+            if (size <= 4) {
+                continue;
+            }
+            reused = 0;
+            for (tag = ifd->tags; tag && !reused; tag = tag->next) {
+                if (tag->rawOffset == ofs) {
+                    reused = (tag->error || tagMatchesRawData(tag, raw)) ? 1 : 0;
+                }
+            }
+            ofs = getIntInSegment(field + 8, le);
+            // the value overwritten by the new value is not available
+            for (tag = ifd->tags; tag && !reused; tag = tag->next) {
+                reused = (getRawValueSlot(ifd, tag) == ofs) ? 1 : 0;
+            }
+            // the value may be aligned to the word boundary
+            if (!reused && (ofs == end || ofs == end + 1) &&
+                ofs <= raw->length && size <= raw->length - ofs) {
+                end = ofs + size;
+                extended = 1;
+            }
+        }
+    } while (extended);
+    return end;
+}
+/**
+ * Get the offset of the original value to be overwritten by the new value
+ *
+ * return
+ *  the offset of the original value of the same tag in the IFD table,
+ *  or 0 if the value is not changed, stored in the tag field, or
+ *  larger than the original one
+ */
+static unsigned int getRawValueSlot(IfdTable *ifd, TagNode *tag)
+{
+    RawSegment *raw = ifd->raw;
+    int le = (raw->byteOrder == 0x4949) ? 1 : 0;
+    unsigned int size, oldSize, ofs;
+    unsigned char *field;
+
+    size = getTagValueSize(tag->type, tag->count);
+    if (tag->error || size <= 4 || size == 0xFFFFFFFF ||
+        tagMatchesRawData(tag, raw)) {
+        return 0;
+    }
+    // the tag may be removed and inserted again
+    if (tag->rawOffset != 0 && tag->rawOffset <= raw->length - sizeof(IFD_TAG)) {
+        field = raw->data + tag->rawOffset;
+    } else {
+        field = findTagInSegment(raw->data, raw->length, le, ifd->rawOffset,
+                                 tag->tagId);
+    }
+    if (!field || getShortInSegment(field, le) != tag->tagId) {
+        return 0;
+    }
+    oldSize = getTagValueSize(getShortInSegment(field + 2, le),
+                              getIntInSegment(field + 4, le));
+    ofs = getIntInSegment(field + 8, le);
+    if (oldSize <= 4 || oldSize == 0xFFFFFFFF || size > oldSize ||
+        ofs < sizeof(TIFF_HEADER) || ofs > raw->length ||
+        oldSize > raw->length - ofs) {
+        return 0;
+    }
+    return ofs;
+}
+// set the value of the pointer tag (LONG) in the TIFF data
+static int setPointerInRawData(unsigned char *tiff, unsigned int tiffLen,
+                               int littleEndian, unsigned int ifdOffset,
+                               unsigned short tagId, unsigned int value)
+{
+    unsigned char *field = findTagInSegment(tiff, tiffLen, littleEndian,
+                                            ifdOffset, tagId);
+    if (!field || getShortInSegment(field + 2, littleEndian) != TYPE_LONG ||
+        getIntInSegment(field + 4, littleEndian) != 1) {
+        return 0;
+    }
+    setIntInSegment(field + 8, value, littleEndian);
+    return 1;
+}
+
+/**
+ * Build the Exif segment from the original data
+ *
+ * The unmodified IFD tables and values are copied as they are.
+ * The modified IFD tables are rewritten at the original offset if they
+ * have not grown, otherwise they are appended to the end of the segment.
+ *
+ * parameters
+ *  [in] ifdTableArray: address of the IFD tables array
+ *  [out] pSegment: the segment data from the APP1 marker (must be freed)
+ *  [out] pLength: length of the segment data
+ *
+ * return
+ *  1: OK
+ *  0: the segment must be rebuilt from the IFD tables
+ *  ERR_MEMALLOC
+ */
+static int buildExifSegmentFromRawData(void **ifdTableArray,
+                                       unsigned char **pSegment,
+                                       unsigned int *pLength)
+{
+    #define RAW_IFDMAX 5
+    IfdTable *ifds[RAW_IFDMAX];
+    unsigned int newOffset[RAW_IFDMAX], ofs, len;
+    int modified[RAW_IFDMAX];
+    int i, num = 0, le;
+    RawSegment *raw;
+    unsigned char *segment, *tiff;
+
+    *pSegment = NULL;
+    ifds[0] = getIfdTableFromIfdTableArray(ifdTableArray, IFD_0TH);
+    ifds[1] = getIfdTableFromIfdTableArray(ifdTableArray, IFD_EXIF);
+    ifds[2] = getIfdTableFromIfdTableArray(ifdTableArray, IFD_IO);
+    ifds[3] = getIfdTableFromIfdTableArray(ifdTableArray, IFD_GPS);
+    ifds[4] = getIfdTableFromIfdTableArray(ifdTableArray, IFD_1ST);
+    raw = (ifds[0]) ? ifds[0]->raw : NULL;
+    // the IFD tables must be the same as the parsed ones
+    if (!raw || raw->byteOrder != App1Header.tiff.byteOrder) {
+        return 0;
+    }
+    for (i = 0; ifdTableArray[i] != NULL; i++) {
+        if (((IfdTable*)ifdTableArray[i])->raw != raw) {
+            return 0;
+        }
+        num++;
+    }
+    if (num != raw->ifdCount) {
+        return 0;
+    }
+    le = (raw->byteOrder == 0x4949) ? 1 : 0;
+
+    // layout of the modified IFD tables appended to the original data
+    ofs = raw->length;
+    for (i = 0; i < RAW_IFDMAX; i++) {
+        modified[i] = (ifds[i]) ? ifdIsModified(ifds[i]) : 0;
+        newOffset[i] = (ifds[i]) ? ifds[i]->rawOffset : 0;
+        // rewrite the IFD table in place if it has not grown
+        if (modified[i] && writeIfdToRawData(ifds[i], NULL, newOffset[i]) >
+                           getOldIfdEndInRawData(ifds[i])) {
+            ofs += ofs % 2;
+            newOffset[i] = ofs;
+            ofs = writeIfdToRawData(ifds[i], NULL, ofs);
+        }
+    }
+    len = sizeof(App1Header.marker) + sizeof(App1Header.length) +
+          sizeof(App1Header.id) + ofs;
+    if (len - sizeof(App1Header.marker) > 0xFFFF) {
+        return 0; // too large. rebuild and pack the segment
+    }
+    segment = (unsigned char*)malloc(len);
+    if (!segment) {
+        return ERR_MEMALLOC;
+    }
+    memset(segment, 0, len);
+    segment[0] = 0xFF;
+    segment[1] = 0xE1;
+    segment[2] = (unsigned char)((len - 2) >> 8);
+    segment[3] = (unsigned char)((len - 2) & 0xFF);
+    memcpy(segment + 4, "Exif\0\0", 6);
+    tiff = segment + 10;
+    memcpy(tiff, raw->data, raw->length);
+    for (i = 0; i < RAW_IFDMAX; i++) {
+        if (modified[i]) {
+            clearOldIfdInRawData(ifds[i], tiff);
+        }
+    }
+    for (i = 0; i < RAW_IFDMAX; i++) {
+        if (modified[i]) {
+            writeIfdToRawData(ifds[i], tiff, newOffset[i]);
+        }
+    }
+    // update the links to the IFD tables
+    setIntInSegment(tiff + 4, newOffset[0], le);
+    if ((ifds[1] && !setPointerInRawData(tiff, ofs, le, newOffset[0],
+                                         TAG_ExifIFDPointer, newOffset[1])) ||
+        (ifds[2] && !setPointerInRawData(tiff, ofs, le, newOffset[1],
+                                         TAG_InteroperabilityIFDPointer, newOffset[2])) ||
+        (ifds[3] && !setPointerInRawData(tiff, ofs, le, newOffset[0],
+                                         TAG_GPSInfoIFDPointer, newOffset[3]))) {
+        free(segment);
+        return 0; // the pointer tag was removed
+    }
+    if (ifds[4]) {
+        num = getShortInSegment(tiff + newOffset[0], le);
+        setIntInSegment(tiff + newOffset[0] + sizeof(short) + sizeof(IFD_TAG) * num,
+                        newOffset[4], le);
+    }
+    *pSegment = segment;
+    *pLength = len;
+    return 1;
+}
+
+// write the Exif segment rebuilt from the IFD tables to the memory
+static unsigned char *writeExifSegmentToMemory(void **ifdTableArray,
+                                               unsigned int *pLength, int *pResult)
+{
+    FILE *fp;
+    long len;
+    int sts;
+    unsigned char *p = NULL;
+
+    fp = tmpfile();
+    if (!fp) {
+        *pResult = ERR_WRITE_FILE;
+        return NULL;
+    }
+    sts = writeExifSegment(fp, ifdTableArray);
+    if (sts == 0) {
+        len = ftell(fp);
+        if (len <= 0) {
+            // no 0th IFD
+            fclose(fp);
+            *pResult = 0;
+            return NULL;
+        }
+        p = (unsigned char*)malloc(len);
+        if (!p) {
+            sts = ERR_MEMALLOC;
+        } else {
+            rewind(fp);
+            if (fread(p, 1, len, fp) != (size_t)len) {
+                free(p);
+                p = NULL;
+                sts = ERR_READ_FILE;
+            } else {
+                *pLength = (unsigned int)len;
+            }
+        }
+    }
+    fclose(fp);
+    *pResult = sts;
+    return p;
+}
+
+/**
+ * Copy the range of the file to the current position of another file
+ *
+ * On Linux, the data is copied in the kernel by copy_file_range() if
+ * possible. Otherwise it is copied with stdio.
+ *
+ * parameters
+ *  [in] fpr: source file
+ *  [in] srcOffset: offset of the range in the source file
+ *  [in] fpw: destination file (the position is moved to the end of the copy)
+ *  [in] length: length of the range
+ *
+ * return
+ *  0: OK
+ *  -n: error
+ */
+static int copyFileRange(FILE *fpr, long srcOffset, FILE *fpw, long length)
+{
+    if (length <= 0) {
+        return 0;
+    }
+#if defined(__linux__) && defined(__GLIBC__) && \
+    (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 27))
+    {
+        ssize_t n;
+        off_t in = srcOffset, out, remain = length;
+        if (fflush(fpw) == 0 && (out = ftell(fpw)) >= 0) {
+            while (remain > 0) {
+                n = copy_file_range(fileno(fpr), &in, fileno(fpw), &out,
+                                    (size_t)remain, 0);
+                if (n <= 0) {
+                    break;
+                }
+                remain -= n;
+            }
+            if (fseek(fpw, (long)out, SEEK_SET) != 0) {
+                return ERR_WRITE_FILE;
+            }
+            // copy the rest with stdio if not supported
+            srcOffset = (long)in;
+            length = (long)remain;
+            if (length == 0) {
+                return 0;
+            }
+        }
+    }
+#endif
+    if (fseek(fpr, srcOffset, SEEK_SET) != 0) {
+        return ERR_READ_FILE;
+    }
+    return copyFileData(fpr, fpw, length);
+}
+
+// get the identity of the JPEG file of the sidecar from its head and tail
+static unsigned int getSidecarIdentity(FILE *fp, long size)
+{
+    unsigned char buf[SIDECAR_IDENTITY_LEN];
+    unsigned int i, hash = 2166136261u; // FNV-1a
+    size_t len;
+    long ofs[2];
+    int k;
+
+    ofs[0] = 0;
+    ofs[1] = (size > SIDECAR_IDENTITY_LEN) ? size - SIDECAR_IDENTITY_LEN : 0;
+    for (k = 0; k < 2; k++) {
+        if (fflush(fp) != 0 || fseek(fp, ofs[k], SEEK_SET) != 0) {
+            return 0;
+        }
+        len = fread(buf, 1, sizeof(buf), fp);
+        for (i = 0; i < (unsigned int)len; i++) {
+            hash = (hash ^ buf[i]) * 16777619u;
+        }
+    }
+    return hash;
+}
+
+/**
+ * Copy the JPEG file without the Exif segment and read the segment
+ *
+ * parameters
+ *  [in] inJPEGFileName: original JPEG file
+ *  [in] outJPEGFileName: output JPEG file without the Exif segment
+ *  [out] pSegment: the segment data (must be freed)
+ *  [out] header: the sidecar header except the ID (SIDECAR_HEADER_SIZE bytes)
+ *
+ * return
+ *  1: OK
+ *  0: the Exif segment is not found
+ *  -n: error
+ */
+static int stripExifSegmentToFile(const char *inJPEGFileName,
+                                  const char *outJPEGFileName,
+                                  unsigned char **pSegment,
+                                  unsigned char *header)
+{
+    int sts;
+    long fileSize, segmentEnd, outSize;
+    unsigned int length;
+    unsigned char *segment = NULL;
+    FILE *fpr = NULL, *fpw = NULL;
+
+    *pSegment = NULL;
+    fpr = fopen(inJPEGFileName, "rb");
+    if (!fpr) {
+        sts = ERR_READ_FILE;
+        goto DONE;
+    }
+    sts = init(fpr);
+    if (sts <= 0) {
+        goto DONE;
+    }
+    length = sizeof(App1Header.marker) + App1Header.length;
+    segmentEnd = App1StartOffset + (long)length;
+    if (fseek(fpr, 0, SEEK_END) != 0 || (fileSize = ftell(fpr)) < segmentEnd) {
+        sts = ERR_READ_FILE;
+        goto DONE;
+    }
+    segment = (unsigned char*)malloc(length);
+    if (!segment) {
+        sts = ERR_MEMALLOC;
+        goto DONE;
+    }
+    if (fseek(fpr, App1StartOffset, SEEK_SET) != 0) {
+        sts = ERR_READ_FILE;
+        goto DONE;
+    }
+    if (fread(segment, 1, length, fpr) != length) {
+        sts = ERR_READ_FILE;
+        goto DONE;
+    }
+    fpw = fopen(outJPEGFileName, "w+b");
+    if (!fpw) {
+        sts = ERR_WRITE_FILE;
+        goto DONE;
+    }
+    sts = copyFileRange(fpr, 0, fpw, App1StartOffset);
+    if (sts == 0) {
+        sts = copyFileRange(fpr, segmentEnd, fpw, fileSize - segmentEnd);
+    }
+    if (sts < 0) {
+        goto DONE;
+    }
+    outSize = fileSize - (long)length;
+    memset(header, 0, SIDECAR_HEADER_SIZE);
+    setShortInSegment(header + 4, SIDECAR_VERSION, 1);
+    setShortInSegment(header + 6, SIDECAR_HEADER_SIZE, 1);
+    setIntInSegment(header + 8, (unsigned int)App1StartOffset, 1);
+    setIntInSegment(header + 12, length, 1);
+    setIntInSegment(header + 16, (unsigned int)outSize, 1);
+    setIntInSegment(header + 20, getSidecarIdentity(fpw, outSize), 1);
+    *pSegment = segment;
+    segment = NULL;
+    sts = 1;
+DONE:
+    if (fpw && fclose(fpw) != 0 && sts > 0) {
+        free(*pSegment);
+        *pSegment = NULL;
+        sts = ERR_WRITE_FILE;
+    }
+    if (fpr) {
+        fclose(fpr);
+    }
+    free(segment);
+    return sts;
+}
+
+/**
+ * Check the header of the sidecar for the JPEG file
+ *
+ * parameters
+ *  [in] header: the sidecar header
+ *  [in] id: SIDECAR_ID or STORE_REFERENCE_ID
+ *  [in] fpr: the JPEG file without the Exif segment
+ *  [out] pFileSize: size of the JPEG file
+ *
+ * return
+ *  0: OK
+ *  ERR_INVALID_SIDECAR
+ */
+static int checkSidecarHeader(const unsigned char *header, const char *id,
+                              FILE *fpr, long *pFileSize)
+{
+    long fileSize;
+    if (memcmp(header, id, SIDECAR_ID_LEN) != 0 ||
+        getShortInSegment(header + 4, 1) != SIDECAR_VERSION ||
+        getShortInSegment(header + 6, 1) < SIDECAR_HEADER_SIZE ||
+        getIntInSegment(header + 12, 1) < 4) {
+        return ERR_INVALID_SIDECAR;
+    }
+    if (fseek(fpr, 0, SEEK_END) != 0 || (fileSize = ftell(fpr)) < 0 ||
+        (unsigned int)fileSize != getIntInSegment(header + 16, 1) ||
+        getIntInSegment(header + 8, 1) > (unsigned int)fileSize ||
+        getSidecarIdentity(fpr, fileSize) != getIntInSegment(header + 20, 1)) {
+        return ERR_INVALID_SIDECAR;
+    }
+    *pFileSize = fileSize;
+    return 0;
+}
+
+// write the JPEG file with the Exif segment at the offset in the sidecar header
+static int insertSegmentAtOffset(FILE *fpr, long fileSize, const unsigned char *header,
+                                 const unsigned char *segment,
+                                 const char *outJPEGFileName)
+{
+    int sts;
+    long ofs = (long)getIntInSegment(header + 8, 1);
+    unsigned int length = getIntInSegment(header + 12, 1);
+    FILE *fpw;
+
+    fpw = fopen(outJPEGFileName, "wb");
+    if (!fpw) {
+        return ERR_WRITE_FILE;
+    }
+    sts = copyFileRange(fpr, 0, fpw, ofs);
+    if (sts == 0 && fwrite(segment, 1, length, fpw) != length) {
+        sts = ERR_WRITE_FILE;
+    }
+    if (sts == 0) {
+        sts = copyFileRange(fpr, ofs, fpw, fileSize - ofs);
+    }
+    if (fclose(fpw) != 0 && sts == 0) {
+        sts = ERR_WRITE_FILE;
+    }
+    return (sts < 0) ? sts : 1;
+}
+
+// get the path of the segment in the store (must be freed)
+static char *getStorePath(const char *storeDirName, const char *key)
+{
+    char *path = (char*)malloc(strlen(storeDirName) + strlen(key) + 2);
+    if (path) {
+        sprintf(path, "%s/%s", storeDirName, key);
+    }
+    return path;
+}
+
+// check if the file in the store has the same data as the segment
+static int storeObjectMatches(const char *path, const unsigned char *segment,
+                              unsigned int length)
+{
+    unsigned char buf[8192];
+    unsigned int pos, len;
+    int same = 1;
+    FILE *fp = fopen(path, "rb");
+
+    if (!fp) {
+        return 0;
+    }
+    for (pos = 0; pos < length && same; pos += len) {
+        len = (length - pos < sizeof(buf)) ? length - pos : sizeof(buf);
+        same = (fread(buf, 1, len, fp) == len &&
+                memcmp(buf, segment + pos, len) == 0) ? 1 : 0;
+    }
+    if (same && fgetc(fp) != EOF) {
+        same = 0; // longer than the segment
+    }
+    fclose(fp);
+    return same;
+}
+
+#define XXH_PRIME64_1 0x9E3779B185EBCA87ULL
+#define XXH_PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME64_3 0x165667B19E3779F9ULL
+#define XXH_PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME64_5 0x27D4EB2F165667C5ULL
+#define XXH_ROTL64(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+// read the 64bit little-endian value
+static unsigned long long xxh64Read64(const unsigned char *p)
+{
+    return (unsigned long long)getIntInSegment(p, 1) |
+           ((unsigned long long)getIntInSegment(p + 4, 1) << 32);
+}
+
+static unsigned long long xxh64Round(unsigned long long acc, unsigned long long input)
+{
+    acc += input * XXH_PRIME64_2;
+    acc = XXH_ROTL64(acc, 31);
+    return acc * XXH_PRIME64_1;
+}
+
+static unsigned long long xxh64Merge(unsigned long long acc, unsigned long long v)
+{
+    acc ^= xxh64Round(0, v);
+    return acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+// start the XXH64 hash (seed = 0)
+static void xxh64Reset(XXH64_STATE *state)
+{
+    memset(state, 0, sizeof(XXH64_STATE));
+    state->v[0] = XXH_PRIME64_1 + XXH_PRIME64_2;
+    state->v[1] = XXH_PRIME64_2;
+    state->v[2] = 0;
+    state->v[3] = 0 - XXH_PRIME64_1;
+}
+
+// add the data to the XXH64 hash
+static void xxh64Update(XXH64_STATE *state, const unsigned char *data, unsigned int len)
+{
+    const unsigned char *end = data + len;
+    int i;
+
+    state->total += len;
+    if (state->memSize + len < 32) {
+        memcpy(state->mem + state->memSize, data, len);
+        state->memSize += len;
+        return;
+    }
+    if (state->memSize > 0) {
+        // fill the 32 bytes stripe
+        memcpy(state->mem + state->memSize, data, 32 - state->memSize);
+        data += 32 - state->memSize;
+        for (i = 0; i < 4; i++) {
+            state->v[i] = xxh64Round(state->v[i], xxh64Read64(state->mem + i * 8));
+        }
+        state->memSize = 0;
+    }
+    while (data + 32 <= end) {
+        for (i = 0; i < 4; i++) {
+            state->v[i] = xxh64Round(state->v[i], xxh64Read64(data + i * 8));
+        }
+        data += 32;
+    }
+    if (data < end) {
+        memcpy(state->mem, data, end - data);
+        state->memSize = (unsigned int)(end - data);
+    }
+}
+
+// get the XXH64 hash of the data
+static unsigned long long xxh64Digest(const XXH64_STATE *state)
+{
+    const unsigned char *p = state->mem, *end = state->mem + state->memSize;
+    unsigned long long h;
+    int i;
+
+    if (state->total >= 32) {
+        h = XXH_ROTL64(state->v[0], 1) + XXH_ROTL64(state->v[1], 7) +
+            XXH_ROTL64(state->v[2], 12) + XXH_ROTL64(state->v[3], 18);
+        for (i = 0; i < 4; i++) {
+            h = xxh64Merge(h, state->v[i]);
+        }
+    } else {
+        h = state->v[2] + XXH_PRIME64_5; // seed + PRIME64_5
+    }
+    h += state->total;
+    for (; p + 8 <= end; p += 8) {
+        h ^= xxh64Round(0, xxh64Read64(p));
+        h = XXH_ROTL64(h, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+    }
+    if (p + 4 <= end) {
+        h ^= (unsigned long long)getIntInSegment(p, 1) * XXH_PRIME64_1;
+        h = XXH_ROTL64(h, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+        p += 4;
+    }
+    for (; p < end; p++) {
+        h ^= (*p) * XXH_PRIME64_5;
+        h = XXH_ROTL64(h, 11) * XXH_PRIME64_1;
+    }
+    h ^= h >> 33;
+    h *= XXH_PRIME64_2;
+    h ^= h >> 29;
+    h *= XXH_PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
+
+/**
+ * Hash the image data of the JPEG file excluding APPn and COM segments
+ *
+ * parameters
+ *  [in] fp: the JPEG file
+ *  [out] pHash: the XXH64 hash
+ *
+ * return
+ *  1: OK
+ *  -n: error
+ */
+static int hashImageData(FILE *fp, unsigned long long *pHash)
+{
+    int sts = 1;
+    unsigned char *buf, *p, hdr[4];
+    unsigned int marker, len, n, i;
+    int found;
+    long base;
+    XXH64_STATE state;
+
+    buf = (unsigned char*)malloc(IMAGE_HASH_BUFFER_SIZE);
+    if (!buf) {
+        return ERR_MEMALLOC;
+    }
+    xxh64Reset(&state);
+    rewind(fp);
+    if (fread(hdr, 1, 2, fp) != 2 || hdr[0] != 0xFF || hdr[1] != 0xD8) {
+        sts = ERR_INVALID_JPEG;
+        goto DONE;
+    }
+    xxh64Update(&state, hdr, 2);
+    for (;;) {
+        // the marker (skip the fill bytes)
+        do {
+            if (fread(hdr, 1, 1, fp) != 1 || hdr[0] != 0xFF) {
+                sts = ERR_INVALID_JPEG;
+                goto DONE;
+            }
+            if (fread(hdr + 1, 1, 1, fp) != 1) {
+                sts = ERR_INVALID_JPEG;
+                goto DONE;
+            }
+            marker = hdr[1];
+        } while (marker == 0xFF && fseek(fp, -1, SEEK_CUR) == 0);
+        if (marker == 0xD9) { // EOI
+            xxh64Update(&state, hdr, 2);
+            break;
+        }
+        if ((marker >= 0xD0 && marker <= 0xD7) || marker == 0x01) {
+            xxh64Update(&state, hdr, 2); // RSTn and TEM have no length
+            continue;
+        }
+        if (fread(hdr + 2, 1, 2, fp) != 2) {
+            sts = ERR_INVALID_JPEG;
+            goto DONE;
+        }
+        len = (hdr[2] << 8) | hdr[3];
+        if (len < 2) {
+            sts = ERR_INVALID_JPEG;
+            goto DONE;
+        }
+        len -= 2;
+        if ((marker >= 0xE0 && marker <= 0xEF) || marker == 0xFE) {
+            // APPn or COM
+            if (fseek(fp, len, SEEK_CUR) != 0) {
+                sts = ERR_INVALID_JPEG;
+                goto DONE;
+            }
+            continue;
+        }
+        xxh64Update(&state, hdr, 4);
+        for (; len > 0; len -= n) {
+            n = (len < IMAGE_HASH_BUFFER_SIZE) ? len : IMAGE_HASH_BUFFER_SIZE;
+            if (fread(buf, 1, n, fp) != n) {
+                sts = ERR_INVALID_JPEG;
+                goto DONE;
+            }
+            xxh64Update(&state, buf, n);
+        }
+        if (marker != 0xDA) { // SOS
+            continue;
+        }
+        // the scan data ends at a marker except 0xFF00 and RSTn
+        for (;;) {
+            base = ftell(fp);
+            n = (unsigned int)fread(buf, 1, IMAGE_HASH_BUFFER_SIZE, fp);
+            if (n == 0) {
+                goto END; // no EOI
+            }
+            found = 0;
+            for (i = 0; i < n; ) {
+                p = (unsigned char*)memchr(buf + i, 0xFF, n - i);
+                if (!p) {
+                    break;
+                }
+                if (p + 1 == buf + n) {
+                    found = 1; // 0xFF at the end of the buffer
+                    break;
+                }
+                if (p[1] == 0x00 || (p[1] >= 0xD0 && p[1] <= 0xD7)) {
+                    i = (unsigned int)(p - buf) + 2;
+                } else if (p[1] == 0xFF) {
+                    i = (unsigned int)(p - buf) + 1; // fill byte
+                } else {
+                    found = 2; // the next marker
+                    break;
+                }
+            }
+            if (found == 0 || (found == 1 && n == 1)) {
+                xxh64Update(&state, buf, n);
+                continue;
+            }
+            // read again from 0xFF (with the next byte if it is at the end)
+            xxh64Update(&state, buf, (unsigned int)(p - buf));
+            if (fseek(fp, base + (long)(p - buf), SEEK_SET) != 0) {
+                sts = ERR_READ_FILE;
+                goto DONE;
+            }
+            if (found == 2) {
+                break;
+            }
+        }
+    }
+END:
+    *pHash = xxh64Digest(&state);
+DONE:
+    free(buf);
+    return sts;
+}
+
+// worker function of getImageHashOfJPEGFiles()
+static void imageHashBatchFunc(void *ctx, int index)
+{
+    IMAGE_HASH_BATCH *batch = (IMAGE_HASH_BATCH*)ctx;
+    batch->hashes[index] = 0;
+    batch->results[index] = getImageHashOfJPEGFile(batch->fileNames[index],
+                                &batch->hashes[index],
+                                (batch->ifdTableArrays) ?
+                                &batch->ifdTableArrays[index] : NULL);
+}
+
+// prepare to read the paths from the list file
+static int initPathList(PATH_LIST *list, FILE *fp, int max, unsigned int sampleRate)
+{
+    memset(list, 0, sizeof(PATH_LIST));
+    list->fp = fp;
+    list->max = max;
+    list->sampleRate = sampleRate;
+    list->random = 0x9E3779B97F4A7C15ULL; // fixed seed for the same sample
+    list->nameOffsets = (size_t*)malloc(sizeof(size_t) * max);
+    list->paths = (char**)malloc(sizeof(char*) * max);
+    list->offsets = (long*)malloc(sizeof(long) * max);
+    if (!list->nameOffsets || !list->paths || !list->offsets) {
+        return ERR_MEMALLOC;
+    }
+    return 0;
+}
+
+static void freePathList(PATH_LIST *list)
+{
+    free(list->names);
+    free(list->nameOffsets);
+    free(list->paths);
+    free(list->offsets);
+    memset(list, 0, sizeof(PATH_LIST));
+}
+
+/**
+ * Read the next chunk of the paths from the list file
+ *
+ * Empty lines are skipped. If the sample rate is more than 1, each path
+ * is taken with the probability 1/rate by xorshift64*, and the others
+ * are only counted.
+ * Returns the number of the paths in list->paths, or ERR_MEMALLOC.
+ */
+static int readPathList(PATH_LIST *list)
+{
+    int i, count = 0;
+    long pos;
+    size_t len, nameLen = 0;
+    char line[4096], *wk;
+
+    while (count < list->max) {
+        pos = ftell(list->fp);
+        if (!fgets(line, sizeof(line), list->fp)) {
+            list->eof = 1;
+            break;
+        }
+        len = strlen(line);
+        while (len > 0 && (line[len-1] == '\n' || line[len-1] == '\r')) {
+            line[--len] = '\0';
+        }
+        if (len == 0) {
+            continue;
+        }
+        list->listed++;
+        if (list->sampleRate > 1) {
+            list->random ^= list->random >> 12;
+            list->random ^= list->random << 25;
+            list->random ^= list->random >> 27;
+            if (((list->random * 0x2545F4914F6CDD1DULL) >> 32) % list->sampleRate != 0) {
+                continue;
+            }
+        }
+        if (nameLen + len + 1 > list->nameMax) {
+            wk = (char*)realloc(list->names, (list->nameMax == 0) ? 64 * 1024 :
+                                             list->nameMax * 2);
+            if (!wk) {
+                return ERR_MEMALLOC;
+            }
+            list->names = wk;
+            list->nameMax = (list->nameMax == 0) ? 64 * 1024 : list->nameMax * 2;
+        }
+        memcpy(list->names + nameLen, line, len + 1);
+        list->nameOffsets[count] = nameLen;
+        list->offsets[count++] = pos;
+        nameLen += len + 1;
+    }
+    for (i = 0; i < count; i++) {
+        list->paths[i] = list->names + list->nameOffsets[i];
+    }
+    return count;
+}
+
+// hash the tag ID and the value of the tag
+static void hashTagValue(XXH64_STATE *state, IfdTable *ifd, unsigned short tagId)
+{
+    TagNode *tag = getTagNodePtrFromIfd(ifd, tagId);
+    unsigned int len;
+
+    xxh64Update(state, (const unsigned char*)&tagId, sizeof(tagId));
+    if (!tag || tag->error) {
+        return;
+    }
+    if (tag->byteData) {
+        len = tag->count;
+        if (tag->type == TYPE_ASCII) {
+            // ignore the trailing NULs and spaces
+            while (len > 0 && (tag->byteData[len-1] == '\0' ||
+                               tag->byteData[len-1] == ' ')) {
+                len--;
+            }
+        }
+        xxh64Update(state, tag->byteData, len);
+    } else if (tag->numData) {
+        len = tag->count;
+        if (tag->type == TYPE_RATIONAL || tag->type == TYPE_SRATIONAL) {
+            len *= 2;
+        }
+        xxh64Update(state, (const unsigned char*)tag->numData,
+                    len * sizeof(unsigned int));
+    }
+}
+
+// get the capture time of DateTimeOriginal and SubSecTimeOriginal in msec
+// (0 if not exist)
+static unsigned long long getCaptureTime(IfdTable *exif)
+{
+    int y, mo, d, h, mi, s, ms = 0, digits = 1;
+    unsigned int i;
+    char buf[20];
+    TagNode *tag;
+
+    tag = getTagNodePtrFromIfd(exif, TAG_DateTimeOriginal);
+    if (!tag || tag->error || !tag->byteData || tag->count < 19) {
+        return 0;
+    }
+    memcpy(buf, tag->byteData, 19);
+    buf[19] = '\0';
+    if (sscanf(buf, "%4d:%2d:%2d %2d:%2d:%2d", &y, &mo, &d, &h, &mi, &s) != 6 ||
+        y <= 0 || mo < 1 || mo > 12 || d < 1 || d > 31) {
+        return 0; // unknown, e.g. "    :  :     :  :  "
+    }
+    // the first 3 digits of the fraction of the second
+    tag = getTagNodePtrFromIfd(exif, TAG_SubSecTimeOriginal);
+    for (i = 0; i < 3; i++) {
+        ms *= 10;
+        if (digits && tag && !tag->error && tag->byteData && i < tag->count &&
+            tag->byteData[i] >= '0' && tag->byteData[i] <= '9') {
+            ms += tag->byteData[i] - '0';
+        } else {
+            digits = 0;
+        }
+    }
+    return ((unsigned long long)daysFromCivil(y, mo, d) * 86400 +
+            h * 3600 + mi * 60 + s) * 1000 + ms;
+}
+
+// get the fingerprint of the JPEG file (pathOffset is not set)
+static int getFingerprintOfFile(const char *fileName, FINGERPRINT *fingerprint)
+{
+    int result;
+    void **ifdArray;
+    IfdTable *ifd0th, *exif;
+    XXH64_STATE state;
+
+    ifdArray = createIfdTableArray(fileName, &result);
+    if (!ifdArray) {
+        return (result < 0) ? result : 0;
+    }
+    ifd0th = getIfdTableFromIfdTableArray(ifdArray, IFD_0TH);
+    exif = getIfdTableFromIfdTableArray(ifdArray, IFD_EXIF);
+
+    xxh64Reset(&state);
+    hashTagValue(&state, ifd0th, TAG_Make);
+    hashTagValue(&state, ifd0th, TAG_Model);
+    hashTagValue(&state, exif, TAG_BodySerialNumber);
+    fingerprint->camera = xxh64Digest(&state);
+
+    xxh64Reset(&state);
+    hashTagValue(&state, exif, TAG_FocalLength);
+    hashTagValue(&state, exif, TAG_ExposureTime);
+    fingerprint->settings = xxh64Digest(&state);
+
+    fingerprint->uniqueId = 0;
+    if (getTagNodePtrFromIfd(exif, TAG_ImageUniqueID)) {
+        xxh64Reset(&state);
+        hashTagValue(&state, exif, TAG_ImageUniqueID);
+        fingerprint->uniqueId = xxh64Digest(&state);
+    }
+    fingerprint->time = getCaptureTime(exif);
+    freeIfdTableArray(ifdArray);
+    return 1;
+}
+
+// worker function of the fingerprint extraction
+static void fingerprintBatchFunc(void *ctx, int index)
+{
+    FINGERPRINT_BATCH *batch = (FINGERPRINT_BATCH*)ctx;
+    batch->results[index] = getFingerprintOfFile(batch->paths[index],
+                                                 &batch->records[index]);
+}
+
+// get the fingerprints of the next paths of the list file
+// (returns the number of the fingerprints, the files without the Exif
+// segment are dropped)
+static int extractFingerprints(PATH_LIST *list, FINGERPRINT *records)
+{
+    int sts = 0, i, count;
+    FINGERPRINT_BATCH batch;
+
+    count = readPathList(list);
+    if (count < 0) {
+        return count;
+    }
+    batch.paths = list->paths;
+    batch.records = records;
+    batch.results = (int*)malloc(sizeof(int) * (count + 1));
+    if (!batch.results) {
+        return ERR_MEMALLOC;
+    }
+    for (i = 0; i < count; i++) {
+        records[i].pathOffset = list->offsets[i];
+    }
+    runBatch(fingerprintBatchFunc, &batch, count);
+    for (i = 0; i < count; i++) {
+        if (batch.results[i] > 0) {
+            records[sts++] = records[i];
+        }
+    }
+    free(batch.results);
+    return sts;
+}
+
+// get the sort key of the column of the fingerprint
+static unsigned long long getFingerprintKey(const FINGERPRINT *fingerprint, int column)
+{
+    switch (column) {
+    case 0:  return fingerprint->settings;
+    case 1:  return fingerprint->time;
+    default: return fingerprint->camera;
+    }
+}
+
+// count the digits of the keys in the slice of the radix sort
+static void radixCountFunc(void *ctx, int index)
+{
+    RADIX_BATCH *batch = (RADIX_BATCH*)ctx;
+    size_t i, *counts = batch->counts[index];
+    size_t from = batch->count * index / batch->slices;
+    size_t to = batch->count * (index + 1) / batch->slices;
+
+    memset(counts, 0, sizeof(size_t) * 256);
+    for (i = from; i < to; i++) {
+        counts[(getFingerprintKey(&batch->src[i], batch->column) >> batch->shift) & 0xFF]++;
+    }
+}
+
+// scatter the slice to the offsets of the digits of the radix sort
+static void radixScatterFunc(void *ctx, int index)
+{
+    RADIX_BATCH *batch = (RADIX_BATCH*)ctx;
+    size_t i, *offsets = batch->counts[index];
+    size_t from = batch->count * index / batch->slices;
+    size_t to = batch->count * (index + 1) / batch->slices;
+
+    for (i = from; i < to; i++) {
+        batch->dst[offsets[(getFingerprintKey(&batch->src[i], batch->column) >>
+                            batch->shift) & 0xFF]++] = batch->src[i];
+    }
+}
+
+/**
+ * Sort the fingerprints by the camera, the time and the settings
+ *
+ * LSD radix sort of 8 bits digits. Each pass counts the digits of the
+ * slices in parallel, and then scatters the slices to the offsets of
+ * the digits in parallel, keeping the order of the previous pass.
+ * The pass is skipped if all keys have the same digit, e.g. the upper
+ * bytes of the time.
+ */
+static int sortFingerprints(FINGERPRINT *records, size_t count)
+{
+    int pass, s, k, skip;
+    size_t total, offset, c;
+    FINGERPRINT *tmp, *wk;
+    RADIX_BATCH batch;
+
+    if (count < 2) {
+        return 0;
+    }
+    tmp = (FINGERPRINT*)malloc(sizeof(FINGERPRINT) * count);
+    batch.slices = (BatchThreads > 1) ? BatchThreads : 1;
+    if ((size_t)batch.slices > count / 4096 + 1) {
+        // too small to sort in parallel
+        batch.slices = (int)(count / 4096 + 1);
+    }
+    batch.counts = (size_t(*)[256])malloc(sizeof(size_t) * 256 * batch.slices);
+    if (!tmp || !batch.counts) {
+        free(tmp);
+        free(batch.counts);
+        return ERR_MEMALLOC;
+    }
+    batch.src = records;
+    batch.dst = tmp;
+    batch.count = count;
+    for (pass = 0; pass < 24; pass++) {
+        batch.column = pass / 8;
+        batch.shift = (pass % 8) * 8;
+        runBatch(radixCountFunc, &batch, batch.slices);
+        skip = 0;
+        for (k = 0; k < 256; k++) {
+            for (total = 0, s = 0; s < batch.slices; s++) {
+                total += batch.counts[s][k];
+            }
+            if (total == count) {
+                skip = 1;
+                break;
+            }
+        }
+        if (skip) {
+            continue;
+        }
+        // offsets to scatter each digit of each slice
+        for (offset = 0, k = 0; k < 256; k++) {
+            for (s = 0; s < batch.slices; s++) {
+                c = batch.counts[s][k];
+                batch.counts[s][k] = offset;
+                offset += c;
+            }
+        }
+        runBatch(radixScatterFunc, &batch, batch.slices);
+        wk = batch.src;
+        batch.src = batch.dst;
+        batch.dst = wk;
+    }
+    if (batch.src != records) {
+        memcpy(records, batch.src, sizeof(FINGERPRINT) * count);
+    }
+    free(tmp);
+    free(batch.counts);
+    return 0;
+}
+
+// compare the fingerprints in the order of sortFingerprints()
+static int compareFingerprint(const FINGERPRINT *a, const FINGERPRINT *b)
+{
+    if (a->camera != b->camera) {
+        return (a->camera < b->camera) ? -1 : 1;
+    }
+    if (a->time != b->time) {
+        return (a->time < b->time) ? -1 : 1;
+    }
+    if (a->settings != b->settings) {
+        return (a->settings < b->settings) ? -1 : 1;
+    }
+    return 0;
+}
+
+// read the next fingerprints of the run from the temporary file
+// (returns the number of the fingerprints read, 0 if the run is over)
+static int readFingerprintRun(FILE *fp, FINGERPRINT_RUN *run)
+{
+    size_t n;
+
+    run->index = 0;
+    run->count = 0;
+    if (run->pos >= run->end) {
+        return 0;
+    }
+    n = (size_t)(run->end - run->pos) / sizeof(FINGERPRINT);
+    if (n > FINGERPRINT_MERGE_BUFFER) {
+        n = FINGERPRINT_MERGE_BUFFER;
+    }
+    if (fseek(fp, run->pos, SEEK_SET) != 0 ||
+        fread(run->buf, sizeof(FINGERPRINT), n, fp) != n) {
+        return ERR_READ_FILE;
+    }
+    run->pos += (long)(n * sizeof(FINGERPRINT));
+    run->count = (int)n;
+    return run->count;
+}
+
+// add the file to the group
+static int addToFingerprintGroup(FINGERPRINT_GROUP *group, long pathOffset)
+{
+    long *wk;
+    if (group->count == group->max) {
+        group->max = (group->max == 0) ? 16 : group->max * 2;
+        wk = (long*)realloc(group->offsets, sizeof(long) * group->max);
+        if (!wk) {
+            return ERR_MEMALLOC;
+        }
+        group->offsets = wk;
+    }
+    group->offsets[group->count++] = pathOffset;
+    return 0;
+}
+
+// write the paths of the files of the group to the report
+static int reportFingerprintGroup(FILE *fpw, FILE *fpList, const char *kind,
+                                  long groupNo, const FINGERPRINT_GROUP *group)
+{
+    int i;
+    size_t len;
+    char line[4096];
+
+    for (i = 0; i < group->count; i++) {
+        if (fseek(fpList, group->offsets[i], SEEK_SET) != 0 ||
+            !fgets(line, sizeof(line), fpList)) {
+            return ERR_READ_FILE;
+        }
+        len = strlen(line);
+        while (len > 0 && (line[len-1] == '\n' || line[len-1] == '\r')) {
+            line[--len] = '\0';
+        }
+        fprintf(fpw, "%s\t%ld\t%s\n", kind, groupNo, line);
+    }
+    return 0;
+}
+
+// restore the heap of the runs from the top by the next fingerprints
+static void siftFingerprintRunHeap(FINGERPRINT_RUN *runs, int *heap, int heapCount)
+{
+    int parent = 0, child, top = heap[0];
+    const FINGERPRINT *key = &runs[top].buf[runs[top].index];
+
+    while ((child = parent * 2 + 1) < heapCount) {
+        if (child + 1 < heapCount &&
+            compareFingerprint(&runs[heap[child+1]].buf[runs[heap[child+1]].index],
+                               &runs[heap[child]].buf[runs[heap[child]].index]) < 0) {
+            child++;
+        }
+        if (compareFingerprint(key, &runs[heap[child]].buf[runs[heap[child]].index]) <= 0) {
+            break;
+        }
+        heap[parent] = heap[child];
+        parent = child;
+    }
+    heap[parent] = top;
+}
+
+/**
+ * Merge the sorted runs of the fingerprints and report the groups
+ *
+ * The runs are merged by a heap of the runs, and the groups are found
+ * while streaming because the files of a group are consecutive in the
+ * order of the camera and the time. Only the offsets of the paths of
+ * the current groups are kept.
+ */
+static int groupFingerprintRuns(FINGERPRINT_RUN *runs, int runCount, FILE *fpTmp,
+                                FILE *fpList, FILE *fpw, long burstGap,
+                                long *pBursts, long *pDuplicates)
+{
+    int sts = 0, i, parent, child, heapCount = 0, hasPrev = 0, sameCamera, shots = 0;
+    int *heap;
+    FINGERPRINT cur, prev;
+    FINGERPRINT_RUN *run;
+    FINGERPRINT_GROUP dup, burst;
+
+    memset(&dup, 0, sizeof(dup));
+    memset(&burst, 0, sizeof(burst));
+    memset(&prev, 0, sizeof(prev));
+    heap = (int*)malloc(sizeof(int) * (runCount + 1));
+    if (!heap) {
+        return ERR_MEMALLOC;
+    }
+    for (i = 0; i < runCount; i++) {
+        if (runs[i].index >= runs[i].count) {
+            sts = readFingerprintRun(fpTmp, &runs[i]);
+            if (sts < 0) {
+                goto DONE;
+            }
+            if (sts == 0) {
+                continue;
+            }
+        }
+        // sift up the run by the first fingerprint
+        child = heapCount++;
+        while (child > 0) {
+            parent = (child - 1) / 2;
+            if (compareFingerprint(&runs[heap[parent]].buf[runs[heap[parent]].index],
+                                   &runs[i].buf[runs[i].index]) <= 0) {
+                break;
+            }
+            heap[child] = heap[parent];
+            child = parent;
+        }
+        heap[child] = i;
+    }
+    sts = 0;
+    while (heapCount > 0) {
+        run = &runs[heap[0]];
+        cur = run->buf[run->index++];
+        if (run->index >= run->count) {
+            sts = readFingerprintRun(fpTmp, run);
+            if (sts < 0) {
+                goto DONE;
+            }
+            if (sts == 0) {
+                heap[0] = heap[--heapCount];
+            }
+            sts = 0;
+        }
+        if (heapCount > 0) {
+            siftFingerprintRunHeap(runs, heap, heapCount);
+        }
+
+        sameCamera = (hasPrev && cur.camera == prev.camera) ? 1 : 0;
+        // the same shot
+        if (sameCamera &&
+            ((cur.time != 0 && cur.time == prev.time && cur.settings == prev.settings) ||
+             (cur.uniqueId != 0 && cur.uniqueId == prev.uniqueId))) {
+            sts = addToFingerprintGroup(&dup, cur.pathOffset);
+        } else {
+            if (dup.count > 1) {
+                sts = reportFingerprintGroup(fpw, fpList, "DUPLICATE", ++(*pDuplicates), &dup);
+            }
+            dup.count = 0;
+            if (sts == 0) {
+                sts = addToFingerprintGroup(&dup, cur.pathOffset);
+            }
+        }
+        if (sts < 0) {
+            goto DONE;
+        }
+        // the next shot of the burst sequence
+        if (sameCamera && cur.time != 0 && prev.time != 0 &&
+            cur.time - prev.time <= (unsigned long long)burstGap) {
+            if (cur.time != prev.time) {
+                shots++;
+            }
+            sts = addToFingerprintGroup(&burst, cur.pathOffset);
+        } else {
+            if (shots > 1) {
+                sts = reportFingerprintGroup(fpw, fpList, "BURST", ++(*pBursts), &burst);
+            }
+            burst.count = 0;
+            shots = 1;
+            if (sts == 0) {
+                sts = addToFingerprintGroup(&burst, cur.pathOffset);
+            }
+        }
+        if (sts < 0) {
+            goto DONE;
+        }
+        prev = cur;
+        hasPrev = 1;
+    }
+    if (dup.count > 1) {
+        sts = reportFingerprintGroup(fpw, fpList, "DUPLICATE", ++(*pDuplicates), &dup);
+    }
+    if (sts == 0 && shots > 1) {
+        sts = reportFingerprintGroup(fpw, fpList, "BURST", ++(*pBursts), &burst);
+    }
+DONE:
+    free(heap);
+    free(dup.offsets);
+    free(burst.offsets);
+    return sts;
+}
+
+// the names of the IFD types in the reports (same as the manifest)
+static const char *IfdTypeNames[] = {
+    "", "0th", "1st", "exif", "gps", "io", "makernote", "sub", "nth"
+};
+
+// the tags of the value histograms of getTagStatisticsOfJPEGFiles()
+static const struct {
+    IFD_TYPE ifdType;
+    unsigned short tagId;
+    const char *name;
+} StatsValueFields[STATS_VALUE_FIELDS] = {
+    { IFD_0TH, TAG_Make, "Make" },
+    { IFD_0TH, TAG_Model, "Model" },
+    { IFD_EXIF, TAG_ExposureProgram, "ExposureProgram" },
+};
+
+// the sizes of the histograms of getTagStatisticsOfJPEGFiles()
+static const char *StatsSizeNames[STATS_SIZE_FIELDS] = {
+    "Exif", "Thumbnail", "MakerNote"
+};
+
+// count the tag (the table is open addressing)
+static void addStatsTag(TAG_STATISTICS *stats, unsigned int key, long count)
+{
+    unsigned int i, h = key * 2654435761U;
+    STATS_TAG *entry;
+
+    for (i = 0; i < STATS_TAG_TABLE_SIZE; i++) {
+        entry = &stats->tags[(h + i) & (STATS_TAG_TABLE_SIZE - 1)];
+        if (entry->key == key || entry->key == 0) {
+            entry->key = key;
+            entry->count += count;
+            return;
+        }
+    }
+    stats->tagOverflow += count;
+}
+
+// count the value of the field (the table is open addressing)
+static void addStatsValue(TAG_STATISTICS *stats, int field, unsigned long long hash,
+                          const char *value, long count)
+{
+    unsigned int i;
+    STATS_VALUE *entry;
+
+    for (i = 0; i < STATS_VALUE_TABLE_SIZE; i++) {
+        entry = &stats->values[field][(hash + i) & (STATS_VALUE_TABLE_SIZE - 1)];
+        if (entry->hash == hash) {
+            entry->count += count;
+            return;
+        }
+        if (entry->hash == 0) {
+            entry->hash = hash;
+            entry->count = count;
+            strcpy(entry->value, value);
+            return;
+        }
+    }
+    stats->valueOverflow[field] += count;
+}
+
+// add the hash of a value to the HyperLogLog registers
+static void addHyperLogLog(unsigned char *registers, unsigned long long hash)
+{
+    unsigned int index = (unsigned int)(hash >> (64 - STATS_HLL_BITS));
+    unsigned long long bits = hash << STATS_HLL_BITS;
+    unsigned char rank = 1;
+
+    // position of the first 1 bit after the index
+    while (rank <= 64 - STATS_HLL_BITS && !(bits & 0x8000000000000000ULL)) {
+        rank++;
+        bits <<= 1;
+    }
+    if (registers[index] < rank) {
+        registers[index] = rank;
+    }
+}
+
+// estimate the number of the distinct values by the HyperLogLog registers
+static double estimateHyperLogLog(const unsigned char *registers)
+{
+    const int m = 1 << STATS_HLL_BITS;
+    int i, zeros = 0;
+    double sum = 0, estimate;
+
+    for (i = 0; i < m; i++) {
+        sum += 1.0 / (double)(1ULL << registers[i]);
+        if (registers[i] == 0) {
+            zeros++;
+        }
+    }
+    estimate = 0.7213 / (1 + 1.079 / m) * m * m / sum;
+    if (estimate <= 2.5 * m && zeros > 0) {
+        // linear counting for the small number
+        estimate = m * log((double)m / zeros);
+    }
+    return estimate;
+}
+
+// add the size to the histogram
+// (0-7: the exact size, then 8 buckets for each power of 2)
+static void addStatsSize(STATS_SIZE *sizes, unsigned int size)
+{
+    int shift = 0, bucket = (int)size;
+
+    if (size >= 8) {
+        while ((size >> shift) >= 16) {
+            shift++;
+        }
+        bucket = (shift + 1) * 8 + (int)((size >> shift) & 7);
+    }
+    if (sizes->count == 0 || size < sizes->min) {
+        sizes->min = size;
+    }
+    if (size > sizes->max) {
+        sizes->max = size;
+    }
+    sizes->count++;
+    sizes->buckets[bucket]++;
+}
+
+// get the percentile of the sizes (the middle of the bucket)
+static unsigned int getStatsSizePercentile(const STATS_SIZE *sizes, int percent)
+{
+    int bucket, shift;
+    long rank, total = 0;
+    unsigned int size;
+
+    if (sizes->count == 0) {
+        return 0;
+    }
+    rank = (sizes->count * percent + 99) / 100;
+    for (bucket = 0; bucket < STATS_SIZE_BUCKETS - 1; bucket++) {
+        total += sizes->buckets[bucket];
+        if (total >= rank) {
+            break;
+        }
+    }
+    if (bucket < 8) {
+        size = (unsigned int)bucket;
+    } else {
+        shift = bucket / 8 - 1;
+        size = ((8U + (bucket & 7)) << shift) + ((1U << shift) >> 1);
+    }
+    if (size < sizes->min) {
+        size = sizes->min;
+    }
+    if (size > sizes->max) {
+        size = sizes->max;
+    }
+    return size;
+}
+
+// format the value of the tag to count it (returns 0 if empty)
+static int formatStatsValue(TagNode *tag, char *buf)
+{
+    unsigned int i, len = 0;
+
+    buf[0] = '\0';
+    if (tag->type == TYPE_ASCII && tag->byteData) {
+        for (i = 0; i < tag->count && tag->byteData[i] != '\0' &&
+                    len < STATS_VALUE_LEN - 1; i++) {
+            // keep the report tab separated
+            buf[len++] = (tag->byteData[i] < ' ') ? ' ' : (char)tag->byteData[i];
+        }
+        while (len > 0 && buf[len-1] == ' ') {
+            len--;
+        }
+        buf[len] = '\0';
+    } else if (tag->numData && tag->count > 0) {
+        if (tag->type == TYPE_RATIONAL || tag->type == TYPE_SRATIONAL) {
+            sprintf(buf, "%u/%u", tag->numData[0], tag->numData[1]);
+        } else {
+            sprintf(buf, "%u", tag->numData[0]);
+        }
+    }
+    return (buf[0] != '\0') ? 1 : 0;
+}
+
+// add the tags of the JPEG file to the statistics
+static void addFileToTagStatistics(TAG_STATISTICS *stats, const char *fileName)
+{
+    int i, result;
+    unsigned long long hash;
+    char value[STATS_VALUE_LEN];
+    void **ifdArray;
+    IfdTable *ifd;
+    TagNode *tag;
+    XXH64_STATE state;
+
+    stats->files++;
+    ifdArray = createIfdTableArray(fileName, &result);
+    if (!ifdArray) {
+        if (result < 0) {
+            stats->errors++;
+        }
+        return;
+    }
+    stats->exif++;
+    for (i = 0; ifdArray[i] != NULL; i++) {
+        ifd = (IfdTable*)ifdArray[i];
+        for (tag = ifd->tags; tag; tag = tag->next) {
+            if (!tag->error) {
+                addStatsTag(stats, ((unsigned int)ifd->ifdType << 16 | tag->tagId) + 1, 1);
+            }
+        }
+    }
+    for (i = 0; i < STATS_VALUE_FIELDS; i++) {
+        ifd = getIfdTableFromIfdTableArray(ifdArray, StatsValueFields[i].ifdType);
+        tag = getTagNodePtrFromIfd(ifd, StatsValueFields[i].tagId);
+        if (tag && !tag->error && formatStatsValue(tag, value)) {
+            xxh64Reset(&state);
+            xxh64Update(&state, (const unsigned char*)value, (unsigned int)strlen(value));
+            hash = xxh64Digest(&state);
+            if (hash == 0) {
+                hash = 1; // 0 is the empty entry
+            }
+            addStatsValue(stats, i, hash, value, 1);
+            addHyperLogLog(stats->hll[i], hash);
+        }
+    }
+    // the camera is distinguished by the serial number
+    ifd = getIfdTableFromIfdTableArray(ifdArray, IFD_0TH);
+    xxh64Reset(&state);
+    hashTagValue(&state, ifd, TAG_Make);
+    hashTagValue(&state, ifd, TAG_Model);
+    hashTagValue(&state, getIfdTableFromIfdTableArray(ifdArray, IFD_EXIF),
+                 TAG_BodySerialNumber);
+    addHyperLogLog(stats->hll[STATS_VALUE_FIELDS], xxh64Digest(&state));
+
+    addStatsSize(&stats->sizes[0], sizeof(App1Header.marker) + App1Header.length);
+    tag = getTagNodePtrFromIfd(getIfdTableFromIfdTableArray(ifdArray, IFD_1ST),
+                               TAG_JPEGInterchangeFormatLength);
+    if (tag && !tag->error && tag->numData && tag->count > 0) {
+        addStatsSize(&stats->sizes[1], tag->numData[0]);
+    }
+    tag = getTagNodePtrFromIfd(getIfdTableFromIfdTableArray(ifdArray, IFD_EXIF),
+                               TAG_MakerNote);
+    if (tag && !tag->error) {
+        addStatsSize(&stats->sizes[2], tag->count);
+    }
+    freeIfdTableArray(ifdArray);
+}
+
+// worker function of getTagStatisticsOfJPEGFiles()
+// (the slices take the files in turn not to wait for a slow part of the list)
+static void statsBatchFunc(void *ctx, int index)
+{
+    STATS_BATCH *batch = (STATS_BATCH*)ctx;
+    int i;
+    for (i = index; i < batch->count; i += batch->slices) {
+        addFileToTagStatistics(&batch->partials[index], batch->paths[i]);
+    }
+}
+
+// merge the partial statistics
+static void mergeTagStatistics(TAG_STATISTICS *dst, const TAG_STATISTICS *src)
+{
+    int i, j;
+
+    dst->files += src->files;
+    dst->exif += src->exif;
+    dst->errors += src->errors;
+    for (i = 0; i < STATS_TAG_TABLE_SIZE; i++) {
+        if (src->tags[i].key != 0) {
+            addStatsTag(dst, src->tags[i].key, src->tags[i].count);
+        }
+    }
+    dst->tagOverflow += src->tagOverflow;
+    for (i = 0; i < STATS_VALUE_FIELDS; i++) {
+        for (j = 0; j < STATS_VALUE_TABLE_SIZE; j++) {
+            if (src->values[i][j].hash != 0) {
+                addStatsValue(dst, i, src->values[i][j].hash,
+                              src->values[i][j].value, src->values[i][j].count);
+            }
+        }
+        dst->valueOverflow[i] += src->valueOverflow[i];
+    }
+    for (i = 0; i < STATS_DISTINCT_FIELDS; i++) {
+        for (j = 0; j < (1 << STATS_HLL_BITS); j++) {
+            if (dst->hll[i][j] < src->hll[i][j]) {
+                dst->hll[i][j] = src->hll[i][j];
+            }
+        }
+    }
+    for (i = 0; i < STATS_SIZE_FIELDS; i++) {
+        if (src->sizes[i].count == 0) {
+            continue;
+        }
+        if (dst->sizes[i].count == 0 || src->sizes[i].min < dst->sizes[i].min) {
+            dst->sizes[i].min = src->sizes[i].min;
+        }
+        if (src->sizes[i].max > dst->sizes[i].max) {
+            dst->sizes[i].max = src->sizes[i].max;
+        }
+        dst->sizes[i].count += src->sizes[i].count;
+        for (j = 0; j < STATS_SIZE_BUCKETS; j++) {
+            dst->sizes[i].buckets[j] += src->sizes[i].buckets[j];
+        }
+    }
+}
+
+// compare the tags by the IFD type and the tag ID (the empty ones last)
+static int compareStatsTag(const void *a, const void *b)
+{
+    unsigned int ka = ((const STATS_TAG*)a)->key - 1;
+    unsigned int kb = ((const STATS_TAG*)b)->key - 1;
+    return (ka < kb) ? -1 : (ka > kb) ? 1 : 0;
+}
+
+// compare the values by the count in descending order (the empty ones last)
+static int compareStatsValue(const void *a, const void *b)
+{
+    const STATS_VALUE *va = (const STATS_VALUE*)a;
+    const STATS_VALUE *vb = (const STATS_VALUE*)b;
+    if (va->count != vb->count) {
+        return (va->count > vb->count) ? -1 : 1;
+    }
+    return strcmp(va->value, vb->value);
+}
+
+// write the statistics to the report (the tables are sorted)
+static void writeTagStatistics(FILE *fpw, TAG_STATISTICS *stats, long listed,
+                               unsigned int sampleRate)
+{
+    int i, j;
+    unsigned int key;
+    long other;
+    double base = (stats->exif > 0) ? (double)stats->exif : 1.0;
+    STATS_SIZE *sizes;
+
+    fprintf(fpw, "files\tlisted=%ld\tread=%ld\texif=%ld\terrors=%ld\tsample=1/%u\n",
+        listed, stats->files, stats->exif, stats->errors, sampleRate);
+    qsort(stats->tags, STATS_TAG_TABLE_SIZE, sizeof(STATS_TAG), compareStatsTag);
+    for (i = 0; i < STATS_TAG_TABLE_SIZE && stats->tags[i].key != 0; i++) {
+        key = stats->tags[i].key - 1;
+        fprintf(fpw, "tag\t%s\t0x%04X\t%s\t%ld\t%.1f%%\n",
+            IfdTypeNames[key >> 16], key & 0xFFFF, getTagName(key >> 16, key & 0xFFFF),
+            stats->tags[i].count, stats->tags[i].count * 100 / base);
+    }
+    if (stats->tagOverflow > 0) {
+        fprintf(fpw, "tag\t(other)\t\t\t%ld\t\n", stats->tagOverflow);
+    }
+    for (i = 0; i < STATS_VALUE_FIELDS; i++) {
+        qsort(stats->values[i], STATS_VALUE_TABLE_SIZE, sizeof(STATS_VALUE),
+              compareStatsValue);
+        other = stats->valueOverflow[i];
+        for (j = 0; j < STATS_VALUE_TABLE_SIZE && stats->values[i][j].count > 0; j++) {
+            if (j >= STATS_TOP_VALUES) {
+                other += stats->values[i][j].count;
+                continue;
+            }
+            fprintf(fpw, "value\t%s\t%s\t%ld\t%.1f%%\n",
+                StatsValueFields[i].name, stats->values[i][j].value,
+                stats->values[i][j].count, stats->values[i][j].count * 100 / base);
+        }
+        if (other > 0) {
+            fprintf(fpw, "value\t%s\t(other)\t%ld\t%.1f%%\n",
+                StatsValueFields[i].name, other, other * 100 / base);
+        }
+    }
+    for (i = 0; i < STATS_DISTINCT_FIELDS; i++) {
+        fprintf(fpw, "distinct\t%s\t%.0f\n",
+            (i < STATS_VALUE_FIELDS) ? StatsValueFields[i].name : "Camera",
+            (stats->exif > 0) ? estimateHyperLogLog(stats->hll[i]) : 0.0);
+    }
+    for (i = 0; i < STATS_SIZE_FIELDS; i++) {
+        sizes = &stats->sizes[i];
+        fprintf(fpw, "size\t%s\tcount=%ld\tmin=%u\tp50=%u\tp90=%u\tp99=%u\tmax=%u\n",
+            StatsSizeNames[i], sizes->count, sizes->min,
+            getStatsSizePercentile(sizes, 50), getStatsSizePercentile(sizes, 90),
+            getStatsSizePercentile(sizes, 99), sizes->max);
+    }
+}
+
+// check if the IFD tables are not changed after parsing the same data
+static int ifdTableArraysHaveSameRawData(void **ifdTableArrayA, void **ifdTableArrayB)
+{
+    int i;
+    IfdTable *a, *b;
+
+    if (!ifdTableArrayA || !ifdTableArrayB) {
+        return 0;
+    }
+    for (i = 0; ifdTableArrayA[i] != NULL && ifdTableArrayB[i] != NULL; i++) {
+        a = (IfdTable*)ifdTableArrayA[i];
+        b = (IfdTable*)ifdTableArrayB[i];
+        if (a->ifdType != b->ifdType || !a->raw || !b->raw ||
+            a->raw != ((IfdTable*)ifdTableArrayA[0])->raw ||
+            b->raw != ((IfdTable*)ifdTableArrayB[0])->raw ||
+            ifdIsModified(a) || ifdIsModified(b)) {
+            return 0;
+        }
+    }
+    if (i == 0 || ifdTableArrayA[i] != NULL || ifdTableArrayB[i] != NULL) {
+        return 0;
+    }
+    a = (IfdTable*)ifdTableArrayA[0];
+    b = (IfdTable*)ifdTableArrayB[0];
+    return (a->raw == b->raw ||
+            (a->raw->length == b->raw->length &&
+             a->raw->byteOrder == b->raw->byteOrder &&
+             memcmp(a->raw->data, b->raw->data, a->raw->length) == 0)) ? 1 : 0;
+}
+
+// get the tags of the IFD sorted by the tag ID (the caller must free it)
+static int getSortedTagNodes(IfdTable *ifd, TagNode ***pTags)
+{
+    int i, j, count = 0;
+    TagNode *tag, **tags;
+
+    *pTags = NULL;
+    if (!ifd) {
+        return 0;
+    }
+    for (tag = ifd->tags; tag; tag = tag->next) {
+        count++;
+    }
+    tags = (TagNode**)malloc(sizeof(TagNode*) * (count + 1));
+    if (!tags) {
+        return ERR_MEMALLOC;
+    }
+    // insertion sort, as the tags are usually sorted already
+    for (i = 0, tag = ifd->tags; tag; tag = tag->next, i++) {
+        for (j = i; j > 0 && tags[j-1]->tagId > tag->tagId; j--) {
+            tags[j] = tags[j-1];
+        }
+        tags[j] = tag;
+    }
+    *pTags = tags;
+    return count;
+}
+
+// compare the type, the count and the value of the tags
+// (returns 0 if the same, or TAG_DIFF_TYPE or TAG_DIFF_VALUE)
+static int compareTagNodeValues(TagNode *a, TagNode *b)
+{
+    unsigned int n;
+
+    if (a->type != b->type || a->count != b->count) {
+        return TAG_DIFF_TYPE;
+    }
+    if (a->error || b->error) {
+        return (a->error && b->error) ? 0 : TAG_DIFF_VALUE;
+    }
+    if (a->numData && b->numData) {
+        n = a->count;
+        if (a->type == TYPE_RATIONAL || a->type == TYPE_SRATIONAL) {
+            n *= 2;
+        }
+        return (memcmp(a->numData, b->numData, sizeof(unsigned int) * n) == 0) ?
+               0 : TAG_DIFF_VALUE;
+    }
+    if (a->byteData && b->byteData) {
+        return (memcmp(a->byteData, b->byteData, a->count) == 0) ? 0 : TAG_DIFF_VALUE;
+    }
+    return ((a->numData || a->byteData) == (b->numData || b->byteData)) ?
+           0 : TAG_DIFF_VALUE;
+}
+
+static int addTagDiff(TAG_DIFF_LIST *list, IFD_TYPE ifdType, unsigned short tagId, int kind)
+{
+    TagDiffInfo *wk;
+    if (list->count == list->max) {
+        list->max = (list->max == 0) ? 16 : list->max * 2;
+        wk = (TagDiffInfo*)realloc(list->diffs, sizeof(TagDiffInfo) * list->max);
+        if (!wk) {
+            return ERR_MEMALLOC;
+        }
+        list->diffs = wk;
+    }
+    list->diffs[list->count].ifdType = ifdType;
+    list->diffs[list->count].tagId = tagId;
+    list->diffs[list->count].kind = kind;
+    list->count++;
+    return 0;
+}
+
+// compare the tags of the IFD tables of the same type (NULL if not exist)
+static int diffIfdTables(IfdTable *a, IfdTable *b, IFD_TYPE ifdType, TAG_DIFF_LIST *list)
+{
+    int sts = 0, i = 0, j = 0, countA, countB, kind, thumbnailKind = 0;
+    unsigned int lenA, lenB;
+    TagNode **tagsA = NULL, **tagsB = NULL, *tag, *tagA, *tagB;
+
+    // the thumbnail data
+    if (ifdType == IFD_1ST && (a && a->p) != (b && b->p)) {
+        thumbnailKind = (b && b->p) ? TAG_DIFF_ADDED : TAG_DIFF_REMOVED;
+    } else if (ifdType == IFD_1ST && a && b && a->p && b->p) {
+        tagA = getTagNodePtrFromIfd(a, TAG_JPEGInterchangeFormatLength);
+        tagB = getTagNodePtrFromIfd(b, TAG_JPEGInterchangeFormatLength);
+        if (tagA && tagB && !tagA->error && !tagB->error) {
+            lenA = tagA->numData[0];
+            lenB = tagB->numData[0];
+            if (lenA != lenB || memcmp(a->p, b->p, lenA) != 0) {
+                thumbnailKind = TAG_DIFF_VALUE;
+            }
+        }
+    }
+    countA = getSortedTagNodes(a, &tagsA);
+    countB = getSortedTagNodes(b, &tagsB);
+    if (countA < 0 || countB < 0) {
+        sts = ERR_MEMALLOC;
+        goto DONE;
+    }
+    // merge the tags sorted by the tag ID
+    while (i < countA || j < countB) {
+        if (j >= countB || (i < countA && tagsA[i]->tagId < tagsB[j]->tagId)) {
+            tag = tagsA[i++];
+            kind = TAG_DIFF_REMOVED;
+        } else if (i >= countA || tagsB[j]->tagId < tagsA[i]->tagId) {
+            tag = tagsB[j++];
+            kind = TAG_DIFF_ADDED;
+        } else {
+            tag = tagsA[i];
+            kind = compareTagNodeValues(tagsA[i++], tagsB[j++]);
+        }
+        if (kind == 0 || isOffsetTag(ifdType, tag->tagId)) {
+            continue;
+        }
+        // keep the order of the tag ID
+        if (thumbnailKind && tag->tagId > TAG_JPEGInterchangeFormat) {
+            sts = addTagDiff(list, ifdType, TAG_JPEGInterchangeFormat, thumbnailKind);
+            if (sts < 0) {
+                goto DONE;
+            }
+            thumbnailKind = 0;
+        }
+        sts = addTagDiff(list, ifdType, tag->tagId, kind);
+        if (sts < 0) {
+            goto DONE;
+        }
+    }
+    if (thumbnailKind) {
+        sts = addTagDiff(list, ifdType, TAG_JPEGInterchangeFormat, thumbnailKind);
+    }
+DONE:
+    free(tagsA);
+    free(tagsB);
+    return sts;
+}
+
+/**
+ * Compare the Exif segments of the JPEG files
+ *
+ * The raw bytes of the segments are compared first, and the IFD tables
+ * are created only if they differ. The IFD tables are returned to
+ * format the values, and must be freed by the caller.
+ */
+static int diffExifSegmentOfFiles(const char *JPEGFileNameA, const char *JPEGFileNameB,
+                                  TagDiffInfo **pDiffs, void ***pIfdArrayA,
+                                  void ***pIfdArrayB)
+{
+    int same, resultA, resultB;
+    unsigned int lenA = 0, lenB = 0;
+    unsigned char *segmentA, *segmentB;
+
+    *pIfdArrayA = NULL;
+    *pIfdArrayB = NULL;
+    if (pDiffs) {
+        *pDiffs = NULL;
+    }
+    segmentA = getExifSegmentFromJPEGFile(JPEGFileNameA, &lenA, &resultA);
+    if (!segmentA && resultA != ERR_NOT_EXIST) {
+        return resultA;
+    }
+    segmentB = getExifSegmentFromJPEGFile(JPEGFileNameB, &lenB, &resultB);
+    if (!segmentB && resultB != ERR_NOT_EXIST) {
+        free(segmentA);
+        return resultB;
+    }
+    if (!segmentA || !segmentB) {
+        same = (!segmentA && !segmentB) ? 1 : 0;
+    } else {
+        same = (lenA == lenB && memcmp(segmentA, segmentB, lenA) == 0) ? 1 : 0;
+    }
+    free(segmentA);
+    free(segmentB);
+    if (same) {
+        return 0;
+    }
+    *pIfdArrayA = createIfdTableArray(JPEGFileNameA, &resultA);
+    if (!*pIfdArrayA && resultA < 0) {
+        return resultA;
+    }
+    *pIfdArrayB = createIfdTableArray(JPEGFileNameB, &resultB);
+    if (!*pIfdArrayB && resultB < 0) {
+        return resultB;
+    }
+    return diffIfdTableArrays(*pIfdArrayA, *pIfdArrayB, pDiffs);
+}
+
+// format the value of the tag for the report (truncated by "...")
+static void formatDiffValue(TagNode *tag, int withType, char *buf, size_t size)
+{
+    static const char *typeNames[] = {
+        "", "byte", "ascii", "short", "long", "rational",
+        "sbyte", "undefined", "sshort", "slong", "srational"
+    };
+    unsigned int i;
+    size_t len = 0, n;
+    char item[32];
+
+    buf[0] = '\0';
+    if (!tag) {
+        return;
+    }
+    if (withType) {
+        sprintf(buf, "%s[%u] ", (tag->type <= TYPE_SRATIONAL) ? typeNames[tag->type] : "",
+            tag->count);
+        len = strlen(buf);
+    }
+    if (tag->error) {
+        strcpy(buf + len, "(error)");
+        return;
+    }
+    for (i = 0; i < tag->count; i++) {
+        if (tag->type == TYPE_ASCII || tag->type == TYPE_UNDEFINED) {
+            if (!tag->byteData || (tag->type == TYPE_ASCII && tag->byteData[i] == '\0')) {
+                break;
+            }
+        } else if (!tag->numData) {
+            break;
+        }
+        switch (tag->type) {
+        case TYPE_ASCII:
+            // keep the report tab separated
+            sprintf(item, "%c", (tag->byteData[i] < ' ') ? ' ' : tag->byteData[i]);
+            break;
+        case TYPE_UNDEFINED:
+            sprintf(item, "%02X", tag->byteData[i]);
+            break;
+        case TYPE_RATIONAL:
+            sprintf(item, "%s%u/%u", i ? "," : "", tag->numData[i*2], tag->numData[i*2+1]);
+            break;
+        case TYPE_SRATIONAL:
+            sprintf(item, "%s%d/%d", i ? "," : "",
+                (int)tag->numData[i*2], (int)tag->numData[i*2+1]);
+            break;
+        case TYPE_SBYTE:
+            sprintf(item, "%s%d", i ? "," : "", (char)tag->numData[i]);
+            break;
+        case TYPE_SSHORT:
+            sprintf(item, "%s%d", i ? "," : "", (short)tag->numData[i]);
+            break;
+        case TYPE_SLONG:
+            sprintf(item, "%s%d", i ? "," : "", (int)tag->numData[i]);
+            break;
+        default:
+            sprintf(item, "%s%u", i ? "," : "", tag->numData[i]);
+            break;
+        }
+        n = strlen(item);
+        if (len + n + 4 > size) {
+            strcpy(buf + len, "...");
+            return;
+        }
+        memcpy(buf + len, item, n + 1);
+        len += n;
+    }
+}
+
+// append the formatted text to the report
+static int appendReportText(REPORT_TEXT *report, const char *fmt, ...)
+{
+    int n;
+    size_t max;
+    char *wk;
+    va_list args;
+
+    for (;;) {
+        va_start(args, fmt);
+        n = vsnprintf(report->text ? report->text + report->length : NULL,
+                      report->max - report->length, fmt, args);
+        va_end(args);
+        if (n < 0) {
+            return ERR_MEMALLOC;
+        }
+        if (report->length + n < report->max) {
+            report->length += n;
+            return 0;
+        }
+        for (max = (report->max == 0) ? 1024 : report->max * 2;
+             max <= report->length + n; max *= 2) {
+            ;
+        }
+        wk = (char*)realloc(report->text, max);
+        if (!wk) {
+            return ERR_MEMALLOC;
+        }
+        report->text = wk;
+        report->max = max;
+    }
+}
+
+// worker function of diffExifSegmentOfJPEGFilePairs()
+static void diffBatchFunc(void *ctx, int index)
+{
+    static const char *kindNames[] = { "", "ADDED", "REMOVED", "VALUE", "TYPE" };
+    DIFF_BATCH *batch = (DIFF_BATCH*)ctx;
+    const char *fileNameA = batch->fileNamesA[index];
+    const char *fileNameB = batch->fileNamesB[index];
+    REPORT_TEXT *report = &batch->reports[index];
+    TagDiffInfo *diffs, *d;
+    void **ifdArrayA, **ifdArrayB;
+    char oldValue[DIFF_VALUE_LEN], newValue[DIFF_VALUE_LEN];
+    int i, sts;
+
+    sts = diffExifSegmentOfFiles(fileNameA, fileNameB, &diffs, &ifdArrayA, &ifdArrayB);
+    if (sts == 0 && appendReportText(report, "%s\t%s\tSAME\n", fileNameA, fileNameB) < 0) {
+        sts = ERR_MEMALLOC;
+    }
+    for (i = 0; i < sts; i++) {
+        d = &diffs[i];
+        if (d->ifdType == IFD_1ST && d->tagId == TAG_JPEGInterchangeFormat) {
+            strcpy(oldValue, "(thumbnail)");
+            strcpy(newValue, "(thumbnail)");
+        } else {
+            formatDiffValue(getTagNodePtrFromIfd(getIfdTableFromIfdTableArray(
+                                ifdArrayA, d->ifdType), d->tagId),
+                            d->kind == TAG_DIFF_TYPE, oldValue, sizeof(oldValue));
+            formatDiffValue(getTagNodePtrFromIfd(getIfdTableFromIfdTableArray(
+                                ifdArrayB, d->ifdType), d->tagId),
+                            d->kind == TAG_DIFF_TYPE, newValue, sizeof(newValue));
+        }
+        if (d->kind == TAG_DIFF_ADDED) {
+            oldValue[0] = '\0';
+        } else if (d->kind == TAG_DIFF_REMOVED) {
+            newValue[0] = '\0';
+        }
+        if (appendReportText(report, "%s\t%s\t%s\t%s\t0x%04X\t%s\t%s\t%s\n",
+                fileNameA, fileNameB, kindNames[d->kind], IfdTypeNames[d->ifdType],
+                d->tagId, getTagName(d->ifdType, d->tagId), oldValue, newValue) < 0) {
+            sts = ERR_MEMALLOC;
+        }
+    }
+    batch->results[index] = sts;
+    free(diffs);
+    if (ifdArrayA) {
+        freeIfdTableArray(ifdArrayA);
+    }
+    if (ifdArrayB) {
+        freeIfdTableArray(ifdArrayB);
+    }
+}
+
+// get the MakerNote IFD table decoded from the Exif IFD (NULL if none)
+static IfdTable *getMakerNoteIfd(void **ifdTableArray)
+{
+    IfdTable *exif = getIfdTableFromIfdTableArray(ifdTableArray, IFD_EXIF);
+    TagNode *tag = getTagNodePtrFromIfd(exif, TAG_MakerNote);
+    if (!tag || tag->error) {
+        return NULL;
+    }
+    if (exif->makerNoteVendor < 0) {
+        exif->makerNoteVendor = decodeMakerNote(ifdTableArray, exif, tag,
+                                                &exif->makerNote);
+    }
+    return exif->makerNote;
+}
+
+// discard the decoded MakerNote IFD table to decode the tag again
+static void resetMakerNote(IfdTable *ifd)
+{
+    freeIfdTable(ifd->makerNote);
+    ifd->makerNote = NULL;
+    ifd->makerNoteVendor = -1;
+}
+
+// get the byte order of "II" or "MM" (0 if neither)
+static unsigned short getByteOrderInSegment(const unsigned char *p)
+{
+    if (p[0] == 'I' && p[1] == 'I') {
+        return 0x4949;
+    }
+    if (p[0] == 'M' && p[1] == 'M') {
+        return 0x4D4D;
+    }
+    return 0;
+}
+
+// get the layout of the MakerNote from its header or the Make tag
+static int getMakerNoteFormat(const unsigned char *p, unsigned int len,
+                              TagNode *make, MAKERNOTE_FORMAT *fmt)
+{
+    const char *maker = "";
+    if (make && !make->error && make->type == TYPE_ASCII &&
+        make->byteData && make->count >= 5) {
+        maker = (const char*)make->byteData;
+    }
+    memset(fmt, 0, sizeof(MAKERNOTE_FORMAT));
+    if (len >= 18 && memcmp(p, "Nikon\0", 6) == 0) {
+        fmt->vendor = MAKERNOTE_NIKON;
+        if (p[6] == 0x02) {
+            // type 3 has its own TIFF header after the version
+            fmt->byteOrder = getByteOrderInSegment(p + 10);
+            if (fmt->byteOrder == 0) {
+                return MAKERNOTE_NONE;
+            }
+            fmt->selfContained = 1;
+            fmt->base = 10;
+            fmt->ifdOffset = getIntInSegment(p + 14, fmt->byteOrder == 0x4949);
+        } else {
+            fmt->ifdOffset = 8;
+        }
+    } else if (len >= 14 && (memcmp(p, "SONY DSC \0\0\0", 12) == 0 ||
+                             memcmp(p, "SONY CAM \0\0\0", 12) == 0)) {
+        fmt->vendor = MAKERNOTE_SONY;
+        fmt->ifdOffset = 12;
+    } else if (len >= 14 && memcmp(p, "FUJIFILM", 8) == 0) {
+        // always little-endian regardless of the Exif
+        fmt->vendor = MAKERNOTE_FUJIFILM;
+        fmt->selfContained = 1;
+        fmt->byteOrder = 0x4949;
+        fmt->ifdOffset = getIntInSegment(p + 8, 1);
+    } else if (len >= 18 && memcmp(p, "OM SYSTEM\0\0\0", 12) == 0) {
+        fmt->vendor = MAKERNOTE_OLYMPUS;
+        fmt->selfContained = 1;
+        fmt->byteOrder = getByteOrderInSegment(p + 12);
+        fmt->ifdOffset = 16;
+    } else if (len >= 14 && memcmp(p, "OLYMPUS\0", 8) == 0) {
+        fmt->vendor = MAKERNOTE_OLYMPUS;
+        fmt->selfContained = 1;
+        fmt->byteOrder = getByteOrderInSegment(p + 8);
+        fmt->ifdOffset = 12;
+    } else if (len >= 10 && memcmp(p, "OLYMP\0", 6) == 0) {
+        fmt->vendor = MAKERNOTE_OLYMPUS;
+        fmt->ifdOffset = 8;
+    } else if (strncmp(maker, "Canon", 5) == 0) {
+        fmt->vendor = MAKERNOTE_CANON;
+    } else if (strncmp(maker, "SONY", 4) == 0) {
+        fmt->vendor = MAKERNOTE_SONY;
+    } else if (strncmp(maker, "NIKON", 5) == 0) {
+        fmt->vendor = MAKERNOTE_NIKON; // type 1 without the header
+    }
+    if (fmt->selfContained && fmt->byteOrder == 0) {
+        return MAKERNOTE_NONE;
+    }
+    return fmt->vendor;
+}
+
+// decode the MakerNote tag of the Exif IFD with parseIFD()
+static int decodeMakerNote(void **ifdTableArray, IfdTable *exif, TagNode *tag,
+                           IfdTable **pIfd)
+{
+    MAKERNOTE_FORMAT fmt;
+    unsigned char *image;
+    unsigned int imageLen, top;
+    unsigned short byteOrder;
+    FILE *fp;
+
+    *pIfd = NULL;
+    if (tag->type != TYPE_UNDEFINED || !tag->byteData ||
+        getMakerNoteFormat(tag->byteData, tag->count,
+            getTagNodePtrFromIfd(getIfdTableFromIfdTableArray(ifdTableArray,
+                IFD_0TH), TAG_Make), &fmt) == MAKERNOTE_NONE) {
+        return MAKERNOTE_NONE;
+    }
+    if (exif->raw && tag->count > 4 && tagMatchesRawData(tag, exif->raw)) {
+        // in the original data to resolve the offsets from the TIFF header
+        image = exif->raw->data;
+        imageLen = exif->raw->length;
+        byteOrder = exif->raw->byteOrder;
+        top = getIntInSegment(image + tag->rawOffset + 8, byteOrder == 0x4949);
+        if (top > imageLen || tag->count > imageLen - top) {
+            return fmt.vendor;
+        }
+    } else if (fmt.selfContained) {
+        image = tag->byteData;
+        imageLen = tag->count;
+        byteOrder = 0;
+        top = 0;
+    } else {
+        return fmt.vendor; // the TIFF header is unknown
+    }
+    fp = openMemoryFile(image, imageLen);
+    if (!fp) {
+        return fmt.vendor;
+    }
+    *pIfd = parseMakerNote(fp, imageLen, top, tag->count, byteOrder, &fmt);
+    fclose(fp);
+    return fmt.vendor;
+}
+
+// parse the IFD of the MakerNote at the offset 'top' in the TIFF data
+static IfdTable *parseMakerNote(FILE *fp, unsigned long long tiffLen,
+                                unsigned long long top, unsigned int count,
+                                unsigned short byteOrder,
+                                const MAKERNOTE_FORMAT *fmt)
+{
+    APP1_HEADER app1Header;
+    TIFF_FILE_STATE tiffFile;
+    IfdTable *ifd;
+    unsigned long long base, ifdOffset;
+    unsigned short num;
+
+    if (fmt->selfContained) {
+        base = top + fmt->base;
+        ifdOffset = fmt->ifdOffset;
+        byteOrder = fmt->byteOrder;
+    } else {
+        base = 0;
+        ifdOffset = top + fmt->ifdOffset;
+    }
+    // the IFD must be in the MakerNote
+    if (base > top + count || ifdOffset > top + count - base ||
+        base + ifdOffset + sizeof(short) > top + count) {
+        return NULL;
+    }
+    // parseIFD() reads the offsets from the base in the byte order
+    app1Header = App1Header;
+    tiffFile = TiffFile;
+    App1Header.tiff.byteOrder = byteOrder;
+    TiffFile.base += base;
+    TiffFile.length = tiffLen - base;
+    TiffFile.big = 0;
+    ifd = NULL;
+    if (seekToRelativeOffset(fp, ifdOffset) == 0 &&
+        fread(&num, 1, sizeof(short), fp) == sizeof(short)) {
+        num = fix_short(num);
+        if (num > 0 && num * sizeof(IFD_TAG) <=
+                top + count - base - ifdOffset - sizeof(short)) {
+            ifd = (IfdTable*)parseIFD(fp, ifdOffset, IFD_MAKERNOTE);
+        }
+    }
+    App1Header = app1Header;
+    TiffFile = tiffFile;
+    return ifd;
+}
+
+// open the data on memory as a read-only file
+static FILE *openMemoryFile(unsigned char *data, unsigned int length)
+{
+#ifdef _MSC_VER
+    FILE *fp = tmpfile();
+    if (!fp) {
+        return NULL;
+    }
+    if (fwrite(data, 1, length, fp) != length) {
+        fclose(fp);
+        return NULL;
+    }
+    return fp;
+#else
+    return fmemopen(data, length, "rb");
+#endif
+}
+
+/**
+ * Copy the file sharing the data blocks if possible
+ *
+ * On Linux, the file is cloned by FICLONE (reflink) or copied in the
+ * kernel by copy_file_range(). Otherwise it is copied with stdio.
+ */
+static int cloneFile(const char *srcFileName, const char *dstFileName)
+{
+    int sts;
+    FILE *fpr, *fpw;
+
+    fpr = fopen(srcFileName, "rb");
+    if (!fpr) {
+        return ERR_READ_FILE;
+    }
+    fpw = fopen(dstFileName, "wb");
+    if (!fpw) {
+        fclose(fpr);
+        return ERR_WRITE_FILE;
+    }
+#ifdef __linux__
+#ifdef FICLONE
+    if (ioctl(fileno(fpw), FICLONE, fileno(fpr)) == 0) {
+        sts = 0;
+        goto DONE;
+    }
+#endif
+#endif
+    if (fseek(fpr, 0, SEEK_END) != 0) {
+        sts = ERR_READ_FILE;
+    } else {
+        sts = copyFileRange(fpr, 0, fpw, ftell(fpr));
+    }
+#ifdef __linux__
+DONE:
+#endif
+    fclose(fpr);
+    if (fclose(fpw) != 0 && sts == 0) {
+        sts = ERR_WRITE_FILE;
+    }
+    return sts;
+}
+
+/**
+ * Create the output file as a clone of the original file and overwrite
+ * the Exif segment of the same size
+ *
+ * return
+ *  1: OK
+ *  -n: error
+ */
+static int writeSegmentToClonedFile(const char *inJPEGFileName,
+                                    const char *outJPEGFileName,
+                                    const unsigned char *segment,
+                                    unsigned int length)
+{
+    int sts;
+    FILE *fp;
+    // App1StartOffset is the offset of the Exif segment in the original file
+    long ofs = App1StartOffset;
+
+    sts = cloneFile(inJPEGFileName, outJPEGFileName);
+    if (sts < 0) {
+        return sts;
+    }
+    fp = fopen(outJPEGFileName, "r+b");
+    if (!fp) {
+        return ERR_WRITE_FILE;
+    }
+    sts = 1;
+    if (fseek(fp, ofs, SEEK_SET) != 0 ||
+        fwrite(segment, 1, length, fp) != length) {
+        sts = ERR_WRITE_FILE;
+    }
+    if (fclose(fp) != 0) {
+        sts = ERR_WRITE_FILE;
+    }
+    return sts;
+}
+
+// create the Exif segment from the IFD tables on the memory
+static unsigned char *createExifSegment(void **ifdTableArray,
+                                        unsigned int *pLength, int *pResult)
+{
+    int i, sts;
+    unsigned char *segment = NULL;
+
+    sts = buildExifSegmentFromRawData(ifdTableArray, &segment, pLength);
+    if (sts != 0) {
+        *pResult = sts;
+        return segment;
+    }
+    // rebuild the segment
+    for (i = 0; ifdTableArray[i] != NULL; i++) {
+        releaseRawSegment(ifdTableArray[i]);
+    }
+    sts = fixLengthAndOffsetInIfdTables(ifdTableArray);
+    if (sts != 0) {
+        *pResult = sts;
+        return NULL;
+    }
+    return writeExifSegmentToMemory(ifdTableArray, pLength, pResult);
+}
+
+/**
+ * Insert the space to the current opened file
+ *
+ * parameters
+ *  [in] fp: file pointer of opened file
+ *  [in] regionStart: start offset of the area to be rewritten by the caller
+ *  [in] pos: offset to insert the space (the data after it is kept)
+ *  [in] minLength: length of the space at least
+ *  [out] pLength: length of the inserted space
+ *
+ * return
+ *  0: OK
+ *  -n: error
+ *
+ * note
+ * The data between regionStart and pos is not kept.
+ */
+static int insertSpaceToFile(FILE *fp, long regionStart, long pos,
+                             long minLength, unsigned int *pLength)
+{
+    long fileSize, remain, n, src;
+    unsigned char *buf;
+
+    if (fseek(fp, 0, SEEK_END) != 0 || (fileSize = ftell(fp)) < pos) {
+        return ERR_READ_FILE;
+    }
+#if defined(__linux__) && defined(FALLOC_FL_INSERT_RANGE)
+    {
+        struct stat st;
+        long blk, start, len;
+        unsigned char *head = NULL;
+        if (pos < fileSize && fflush(fp) == 0 &&
+            fstat(fileno(fp), &st) == 0 && st.st_blksize > 0) {
+            // the offset and the length must be aligned to the block size
+            blk = st.st_blksize;
+            start = (pos / blk) * blk;
+            len = ((minLength + blk - 1) / blk) * blk;
+            // keep the data in front of the region in the same block
+            if (start < regionStart) {
+                head = (unsigned char*)malloc(regionStart - start);
+                if (!head || fseek(fp, start, SEEK_SET) != 0 ||
+                    fread(head, 1, regionStart - start, fp) != (size_t)(regionStart - start)) {
+                    free(head);
+                    return ERR_READ_FILE;
+                }
+            }
+            if (fallocate(fileno(fp), FALLOC_FL_INSERT_RANGE, start, len) == 0) {
+                if (head) {
+                    if (fseek(fp, start, SEEK_SET) != 0 ||
+                        fwrite(head, 1, regionStart - start, fp) != (size_t)(regionStart - start)) {
+                        free(head);
+                        return ERR_WRITE_FILE;
+                    }
+                    free(head);
+                }
+                *pLength = (unsigned int)len;
+                return 0;
+            }
+            free(head);
+        }
+    }
+#endif
+    // shift the data after the position from the end of the file
+    buf = (unsigned char*)malloc(SHIFT_BUFFER_SIZE);
+    if (!buf) {
+        return ERR_MEMALLOC;
+    }
+    remain = fileSize - pos;
+    while (remain > 0) {
+        n = (remain > SHIFT_BUFFER_SIZE) ? SHIFT_BUFFER_SIZE : remain;
+        src = pos + remain - n;
+        if (fseek(fp, src, SEEK_SET) != 0 ||
+            fread(buf, 1, n, fp) != (size_t)n) {
+            free(buf);
+            return ERR_READ_FILE;
+        }
+        if (fseek(fp, src + minLength, SEEK_SET) != 0 ||
+            fwrite(buf, 1, n, fp) != (size_t)n) {
+            free(buf);
+            return ERR_WRITE_FILE;
+        }
+        remain -= n;
+    }
+    free(buf);
+    *pLength = (unsigned int)minLength;
+    return 0;
+}
+
+// write the padding segments (APP15) of the specified length
+static int writePaddingSegments(FILE *fp, unsigned int length)
+{
+    unsigned char header[PADDING_SEGMENT_MIN];
+    unsigned int len;
+    while (length > 0) {
+        len = length;
+        if (len > 0xFFFF + 2) {
+            len = 0xFFFF + 2;
+            if (length - len < PADDING_SEGMENT_MIN) {
+                len -= PADDING_SEGMENT_MIN;
+            }
+        }
+        header[0] = 0xFF;
+        header[1] = 0xEF;
+        header[2] = (unsigned char)((len - 2) >> 8);
+        header[3] = (unsigned char)((len - 2) & 0xFF);
+        memcpy(header + 4, PADDING_SEGMENT_ID, PADDING_SEGMENT_ID_LEN);
+        if (fwrite(header, 1, PADDING_SEGMENT_MIN, fp) != PADDING_SEGMENT_MIN ||
+            writeZeroToFile(fp, len - PADDING_SEGMENT_MIN) != 0) {
+            return ERR_WRITE_FILE;
+        }
+        length -= len;
+    }
+    return 0;
+}
+
+/**
+ * Check the entries of the IFD in the current opened file
+ *
+ * parameters
+ *  [in] fp: file pointer of opened file
+ *  [in] ifdType: type of the IFD
+ *  [in/out] offsets: offset of each IFD type. the offsets of the IFDs
+ *                    linked from this IFD are set
+ *  [out] pReason: description of the failed check
+ *
+ * return
+ *  0: OK
+ *  ERR_INVALID_IFD
+ */
+static int validateIfdInFile(FILE *fp, IFD_TYPE ifdType,
+                             unsigned int *offsets, const char **pReason)
+{
+    int cnt;
+    unsigned short tagCount, us;
+    unsigned int size, nextOffset, thumbnailOfs = 0, thumbnailLen = 0;
+    unsigned int ifdOffset = offsets[ifdType], tiffLen = getTiffDataLength();
+    IFD_TAG tag;
+
+    if (ifdOffset < sizeof(TIFF_HEADER) || ifdOffset > tiffLen - sizeof(short) ||
+        seekToRelativeOffset(fp, ifdOffset) != 0 ||
+        fread(&tagCount, 1, sizeof(short), fp) < sizeof(short)) {
+        *pReason = "IFD offset is out of the segment";
+        return ERR_INVALID_IFD;
+    }
+    tagCount = fix_short(tagCount);
+    if (sizeof(IFD_TAG) * tagCount + sizeof(int) >
+                                tiffLen - ifdOffset - sizeof(short)) {
+        *pReason = "IFD entries exceed the segment";
+        return ERR_INVALID_IFD;
+    }
+    for (cnt = 0; cnt < tagCount; cnt++) {
+        if (fread(&tag, 1, sizeof(tag), fp) < sizeof(tag)) {
+            *pReason = "failed to read the IFD entry";
+            return ERR_INVALID_IFD;
+        }
+        tag.tag = fix_short(tag.tag);
+        tag.type = fix_short(tag.type);
+        tag.count = fix_int(tag.count);
+        size = getTagValueSize(tag.type, tag.count);
+        if (tag.type == TYPE_SHORT && size <= 4) {
+            memcpy(&us, &tag.offset, sizeof(short));
+            tag.offset = fix_short(us);
+        } else {
+            tag.offset = fix_int(tag.offset);
+        }
+        if (size > 4 && (tag.offset < sizeof(TIFF_HEADER) ||
+                         tag.offset > tiffLen || size > tiffLen - tag.offset)) {
+            *pReason = "tag value is out of the segment";
+            return ERR_INVALID_IFD;
+        }
+        if ((ifdType == IFD_0TH && (tag.tag == TAG_ExifIFDPointer ||
+                                    tag.tag == TAG_GPSInfoIFDPointer)) ||
+            (ifdType == IFD_EXIF && tag.tag == TAG_InteroperabilityIFDPointer)) {
+            if (tag.type != TYPE_LONG || tag.count != 1) {
+                *pReason = "invalid type or count of the IFD pointer tag";
+                return ERR_INVALID_IFD;
+            }
+            offsets[(tag.tag == TAG_ExifIFDPointer) ? IFD_EXIF :
+                    (tag.tag == TAG_GPSInfoIFDPointer) ? IFD_GPS : IFD_IO] = tag.offset;
+        } else if (ifdType == IFD_1ST && tag.tag == TAG_JPEGInterchangeFormat) {
+            thumbnailOfs = tag.offset;
+        } else if (ifdType == IFD_1ST && tag.tag == TAG_JPEGInterchangeFormatLength) {
+            thumbnailLen = tag.offset;
+        }
+    }
+    if (ifdType == IFD_0TH) {
+        // the offset of the 1st IFD is placed at the tail of the 0th IFD
+        if (fread(&nextOffset, 1, sizeof(int), fp) < sizeof(int)) {
+            *pReason = "failed to read the next IFD offset";
+            return ERR_INVALID_IFD;
+        }
+        offsets[IFD_1ST] = fix_int(nextOffset);
+    }
+    if (thumbnailOfs != 0 && (thumbnailOfs > tiffLen ||
+                              thumbnailLen > tiffLen - thumbnailOfs)) {
+        *pReason = "thumbnail is out of the segment";
+        return ERR_INVALID_IFD;
+    }
+    return 0;
+}
+
+// lock/unlock the bucket or the strings of the string pool
+static void lockStringPool(StringPool *pool, int index)
+{
+#ifdef _MSC_VER
+    EnterCriticalSection(&pool->locks[index]);
+#else
+    pthread_mutex_lock(&pool->locks[index]);
+#endif
+}
+
+static void unlockStringPool(StringPool *pool, int index)
+{
+#ifdef _MSC_VER
+    LeaveCriticalSection(&pool->locks[index]);
+#else
+    pthread_mutex_unlock(&pool->locks[index]);
+#endif
+}
+
+// get the string pool entry of the interned value
+static PoolString *getPoolString(unsigned char *data)
+{
+    return (PoolString*)(data - offsetof(PoolString, data));
+}
+
+/**
+ * Intern the value in the string pool
+ *
+ * parameters
+ *  [in] pool: the string pool
+ *  [in] data: the value
+ *  [in] length: length of the value
+ *
+ * return
+ *  the shared value, or NULL if failed to allocate
+ */
+static unsigned char *internString(StringPool *pool, const unsigned char *data,
+                                   unsigned int length)
+{
+    unsigned int i, hash = 2166136261u; // FNV-1a
+    int bucket, lock;
+    PoolString *s, **strings;
+
+    for (i = 0; i < length; i++) {
+        hash = (hash ^ data[i]) * 16777619u;
+    }
+    bucket = (int)(hash & (STRING_POOL_BUCKETS - 1));
+    lock = bucket % STRING_POOL_LOCKS;
+    lockStringPool(pool, lock);
+    for (s = pool->buckets[bucket]; s; s = s->next) {
+        if (s->hash == hash && s->length == length &&
+            memcmp(s->data, data, length) == 0) {
+            unlockStringPool(pool, lock);
+            return s->data;
+        }
+    }
+    s = (PoolString*)malloc(offsetof(PoolString, data) + length);
+    if (!s) {
+        unlockStringPool(pool, lock);
+        return NULL;
+    }
+    s->hash = hash;
+    s->length = length;
+    memcpy(s->data, data, length);
+    // assign the code
+    lockStringPool(pool, STRING_POOL_LOCKS);
+    if (pool->count == pool->max) {
+        int max = (pool->max == 0) ? 256 : pool->max * 2;
+        strings = (PoolString**)realloc(pool->strings, sizeof(PoolString*) * max);
+        if (!strings) {
+            unlockStringPool(pool, STRING_POOL_LOCKS);
+            unlockStringPool(pool, lock);
+            free(s);
+            return NULL;
+        }
+        pool->strings = strings;
+        pool->max = max;
+    }
+    s->code = pool->count;
+    pool->strings[pool->count++] = s;
+    unlockStringPool(pool, STRING_POOL_LOCKS);
+    s->next = pool->buckets[bucket];
+    pool->buckets[bucket] = s;
+    unlockStringPool(pool, lock);
+    return s->data;
+}
+
+// set the byte order of the Exif segment to be written to the header
+static void setOutputByteOrderToHeader(void)
+{
+    switch (OutputByteOrder) {
+    case OUTPUT_BYTE_ORDER_LITTLE:
+        App1Header.tiff.byteOrder = 0x4949;
+        break;
+    case OUTPUT_BYTE_ORDER_BIG:
+        App1Header.tiff.byteOrder = 0x4D4D;
+        break;
+    case OUTPUT_BYTE_ORDER_HOST:
+        App1Header.tiff.byteOrder = systemIsLittleEndian() ? 0x4949 : 0x4D4D;
+        break;
+    }
+}
+
+// the default essential tags kept by minifyExifSegmentInJPEGFile()
+static const unsigned short MinifyEssentialTagIds[] = {
+    TAG_Compression, TAG_Make, TAG_Model, TAG_Orientation, TAG_XResolution,
+    TAG_YResolution, TAG_ResolutionUnit, TAG_DateTime, TAG_YCbCrPositioning,
+    TAG_ExifVersion, TAG_DateTimeOriginal, TAG_ComponentsConfiguration,
+    TAG_FlashPixVersion, TAG_ColorSpace, TAG_PixelXDimension,
+    TAG_PixelYDimension,
+};
+
+/**
+ * Remove the unnecessary tags and IFD tables for the smallest segment
+ *
+ * parameters
+ *  [in/out] ifdTableArray: address of the IFD tables array
+ *  [in] flags: MINIFY_XXX
+ *  [in] keepTagIds: the essential tag IDs (NULL for the default)
+ *  [in] keepCount: number of keepTagIds
+ *
+ * note
+ * The removed tags are marked as the error and disposed when the
+ * segment is written.
+ */
+static void minifyIfdTableArray(void **ifdTableArray, int flags,
+                                const unsigned short *keepTagIds, int keepCount)
+{
+    static const IFD_TYPE order[] = { IFD_IO, IFD_GPS, IFD_EXIF, IFD_1ST };
+    static const struct {
+        IFD_TYPE ifdType;   // IFD which has the pointer tag
+        unsigned short tagId;
+        IFD_TYPE target;    // IFD pointed by the tag
+    } pointers[] = {
+        { IFD_0TH,  TAG_ExifIFDPointer,             IFD_EXIF },
+        { IFD_0TH,  TAG_GPSInfoIFDPointer,          IFD_GPS  },
+        { IFD_EXIF, TAG_InteroperabilityIFDPointer, IFD_IO   },
+    };
+    int i, k, keep, num;
+    IfdTable *ifd;
+    TagNode *tag;
+    unsigned char *p;
+
+    if (!keepTagIds) {
+        keepTagIds = MinifyEssentialTagIds;
+        keepCount = sizeof(MinifyEssentialTagIds) / sizeof(unsigned short);
+    }
+    if (flags & MINIFY_REMOVE_THUMBNAIL) {
+        removeIfdTableFromIfdTableArray(ifdTableArray, IFD_1ST);
+    }
+    if (flags & MINIFY_REMOVE_INTEROP) {
+        removeIfdTableFromIfdTableArray(ifdTableArray, IFD_IO);
+    }
+    for (i = 0; ifdTableArray[i] != NULL; i++) {
+        ifd = (IfdTable*)ifdTableArray[i];
+        for (tag = ifd->tags; tag; tag = tag->next) {
+            if (tag->error) {
+                continue;
+            }
+            // the structure of the segment and the thumbnail
+            if (isOffsetTag(ifd->ifdType, tag->tagId) ||
+                tag->tagId == TAG_JPEGInterchangeFormatLength ||
+                tag->tagId == TAG_StripByteCounts) {
+                continue;
+            }
+            keep = 0;
+            for (k = 0; k < keepCount; k++) {
+                if (keepTagIds[k] == tag->tagId) {
+                    keep = 1;
+                    break;
+                }
+            }
+            if (!keep) {
+                if ((flags & MINIFY_ESSENTIAL_ONLY) || tagValueIsEmpty(tag)) {
+                    tag->error = 1;
+                    ifd->modified = 1;
+                }
+            } else if (tag->type == TYPE_ASCII && tag->count > 1 &&
+                       tagValueIsEmpty(tag)) {
+                // collapse the value to a null character
+                if (tag->interned) {
+                    p = (unsigned char*)malloc(1);
+                    if (!p) {
+                        continue;
+                    }
+                    tag->byteData = p;
+                    tag->interned = 0;
+                }
+                tag->byteData[0] = '\0';
+                tag->count = 1;
+                ifd->modified = 1;
+            }
+        }
+    }
+    // remove the empty IFD tables and the pointers to the removed ones
+    for (i = 0; i < (int)(sizeof(order) / sizeof(order[0])); i++) {
+        ifd = getIfdTableFromIfdTableArray(ifdTableArray, order[i]);
+        if (!ifd || (ifd->ifdType == IFD_1ST && ifd->p)) {
+            continue;
+        }
+        num = 0;
+        for (tag = ifd->tags; tag; tag = tag->next) {
+            if (!tag->error && !isOffsetTag(ifd->ifdType, tag->tagId)) {
+                num++;
+            }
+        }
+        if (num == 0) {
+            removeIfdTableFromIfdTableArray(ifdTableArray, order[i]);
+        }
+    }
+    for (i = 0; i < (int)(sizeof(pointers) / sizeof(pointers[0])); i++) {
+        if (getIfdTableFromIfdTableArray(ifdTableArray, pointers[i].target)) {
+            continue;
+        }
+        ifd = getIfdTableFromIfdTableArray(ifdTableArray, pointers[i].ifdType);
+        tag = (ifd) ? getTagNodePtrFromIfd(ifd, pointers[i].tagId) : NULL;
+        if (tag) {
+            tag->error = 1;
+            ifd->modified = 1;
+        }
+    }
+}
+
+// check if the tag has no information
+static int tagValueIsEmpty(TagNode *tag)
+{
+    unsigned int i = 0;
+    if (tag->count == 0) {
+        return 1;
+    }
+    if (!tag->byteData) {
+        return 0;
+    }
+    if (tag->type == TYPE_ASCII) {
+        for (i = 0; i < tag->count; i++) {
+            if (tag->byteData[i] != '\0' && tag->byteData[i] != ' ') {
+                return 0;
+            }
+        }
+        return 1;
+    }
+    if (tag->type == TYPE_UNDEFINED) {
+        if (tag->tagId == TAG_UserComment) {
+            // the text after the 8 bytes of the character code
+            for (i = 8; i < tag->count; i++) {
+                if (tag->byteData[i] != '\0' && tag->byteData[i] != ' ') {
+                    return 0;
+                }
+            }
+            return 1;
+        }
+        for (i = 0; i < tag->count; i++) {
+            if (tag->byteData[i] != 0) {
+                return 0;
+            }
+        }
+        return 1;
+    }
+    return 0;
+}
+
+// get the size of the file (-1 if failed)
+static long getFileSize(const char *fileName)
+{
+    long size = -1;
+    FILE *fp = fopen(fileName, "rb");
+    if (fp) {
+        if (fseek(fp, 0, SEEK_END) == 0) {
+            size = ftell(fp);
+        }
+        fclose(fp);
+    }
+    return size;
+}
+
+// worker function of minifyExifSegmentInJPEGFiles()
+static void minifyBatchFunc(void *ctx, int index)
+{
+    MINIFY_BATCH *batch = (MINIFY_BATCH*)ctx;
+    const char *outFileName = (batch->outFileNames) ?
+                              batch->outFileNames[index] : NULL;
+    beginDurableOutput(batch->durable, index,
+                       (outFileName) ? outFileName : batch->inFileNames[index],
+                       &batch->results[index]);
+    batch->results[index] = minifyExifSegmentInJPEGFile(batch->inFileNames[index],
+                                outFileName, batch->flags, batch->keepTagIds,
+                                batch->keepCount, &batch->savedBytes[index]);
+    endDurableOutput(batch->durable, index, batch->results[index] > 0);
+}
+
+// replace the file with another file
+static int replaceFile(const char *srcFileName, const char *dstFileName)
+{
+    if (rename(srcFileName, dstFileName) == 0) {
+        return 0;
+    }
+    // rename() fails if the destination exists on some systems
+    remove(dstFileName);
+    return rename(srcFileName, dstFileName);
+}
+
+// create a new empty temporary file next to the file and return its name
+// ("name.<pid>.<thread id>.<n>.tmp", the caller frees it)
+static char *createTempFile(const char *fileName)
+{
+    unsigned int n;
+    int fd;
+    char *tmpName = (char*)malloc(strlen(fileName) + 64);
+    if (!tmpName) {
+        return NULL;
+    }
+    for (n = 0; n < 100; n++) {
+#ifdef _MSC_VER
+        sprintf(tmpName, "%s.%lx.%lx.%u.tmp", fileName, (unsigned long)_getpid(),
+                (unsigned long)GetCurrentThreadId(), n);
+        fd = _open(tmpName, _O_WRONLY | _O_CREAT | _O_EXCL | _O_BINARY,
+                   _S_IREAD | _S_IWRITE);
+        if (fd >= 0) {
+            _close(fd);
+            return tmpName;
+        }
+#else
+        sprintf(tmpName, "%s.%lx.%lx.%u.tmp", fileName, (unsigned long)getpid(),
+                (unsigned long)pthread_self(), n);
+        fd = open(tmpName, O_WRONLY | O_CREAT | O_EXCL, 0644);
+        if (fd >= 0) {
+            close(fd);
+            return tmpName;
+        }
+#endif
+        if (errno != EEXIST) {
+            break;
+        }
+    }
+    free(tmpName);
+    return NULL;
+}
+
+// the state shared by the worker threads of runBatch()
+typedef struct {
+    BATCH_FUNC func;
+    void *ctx;
+    int count;
+#ifdef _MSC_VER
+    volatile LONG next;
+#else
+    int next;
+    pthread_mutex_t mutex;
+#endif
+} BATCH_STATE;
+
+#ifdef _MSC_VER
+static DWORD WINAPI batchWorker(LPVOID arg)
+{
+    BATCH_STATE *state = (BATCH_STATE*)arg;
+    int index;
+    while ((index = (int)InterlockedIncrement(&state->next) - 1) < state->count) {
+        state->func(state->ctx, index);
+    }
+    return 0;
+}
+#else
+static void *batchWorker(void *arg)
+{
+    BATCH_STATE *state = (BATCH_STATE*)arg;
+    int index;
+    for (;;) {
+        pthread_mutex_lock(&state->mutex);
+        index = state->next++;
+        pthread_mutex_unlock(&state->mutex);
+        if (index >= state->count) {
+            break;
+        }
+        state->func(state->ctx, index);
+    }
+    return NULL;
+}
+#endif
+
+/**
+ * Call the function for each index from 0 to count-1
+ * with the threads set by setBatchThreads()
+ */
+static void runBatch(BATCH_FUNC func, void *ctx, int count)
+{
+    int i, threads = (BatchThreads < count) ? BatchThreads : count;
+    BATCH_STATE state;
+
+    state.func = func;
+    state.ctx = ctx;
+    state.count = count;
+    state.next = 0;
+    if (threads <= 1) {
+        // no lock is needed (the mutex is not initialized yet)
+        for (i = 0; i < count; i++) {
+            func(ctx, i);
+        }
+        return;
+    }
+#ifdef _MSC_VER
+    {
+        HANDLE *th = (HANDLE*)malloc(sizeof(HANDLE) * threads);
+        if (!th) {
+            batchWorker(&state);
+            return;
+        }
+        for (i = 0; i < threads; i++) {
+            th[i] = CreateThread(NULL, 0, batchWorker, &state, 0, NULL);
+        }
+        for (i = 0; i < threads; i++) {
+            if (th[i]) {
+                WaitForSingleObject(th[i], INFINITE);
+                CloseHandle(th[i]);
+            }
+        }
+        free(th);
+        // in case no thread could be created
+        batchWorker(&state);
+    }
+#else
+    {
+        pthread_t *th = (pthread_t*)malloc(sizeof(pthread_t) * threads);
+        char *created = (char*)malloc(threads);
+        pthread_mutex_init(&state.mutex, NULL);
+        if (!th || !created) {
+            free(th);
+            free(created);
+            batchWorker(&state);
+            pthread_mutex_destroy(&state.mutex);
+            return;
+        }
+        for (i = 0; i < threads; i++) {
+            created[i] = (pthread_create(&th[i], NULL, batchWorker, &state) == 0);
+        }
+        for (i = 0; i < threads; i++) {
+            if (created[i]) {
+                pthread_join(th[i], NULL);
+            }
+        }
+        // in case no thread could be created
+        batchWorker(&state);
+        pthread_mutex_destroy(&state.mutex);
+        free(th);
+        free(created);
+    }
+#endif
+}
+
+// sync the written data of the file
+static int syncFile(const char *fileName)
+{
+    int fd, sts = 0;
+#ifdef _MSC_VER
+    fd = _open(fileName, _O_RDWR | _O_BINARY);
+    if (fd < 0) {
+        return ERR_WRITE_FILE;
+    }
+    if (_commit(fd) != 0) {
+        sts = ERR_WRITE_FILE;
+    }
+    _close(fd);
+#else
+    fd = open(fileName, O_RDONLY);
+    if (fd < 0) {
+        return ERR_WRITE_FILE;
+    }
+    if (fsync(fd) != 0) {
+        sts = ERR_WRITE_FILE;
+    }
+    close(fd);
+#endif
+    return sts;
+}
+
+#ifndef __linux__
+// parameters of the fsync() wave
+typedef struct {
+    const char **fileNames;
+    int *results;
+} SYNC_FILES_BATCH;
+
+// worker function of syncFiles()
+static void syncFileBatchFunc(void *ctx, int index)
+{
+    SYNC_FILES_BATCH *batch = (SYNC_FILES_BATCH*)ctx;
+    batch->results[index] = syncFile(batch->fileNames[index]);
+}
+#endif
+
+/**
+ * Sync the written data of the files
+ *
+ * parameters
+ *  [in] fileNames: the files to be synced
+ *  [in] count: number of the files
+ *
+ * return
+ *  0: OK
+ *  -n: error
+ *
+ * note
+ * On Linux, syncfs() is called once for each file system instead of
+ * fsync() for each file.
+ */
+static int syncFiles(const char **fileNames, int count)
+{
+    int i, sts = 0;
+#ifdef __linux__
+    int j, fd, devCount = 0;
+    struct stat st;
+    dev_t *devs = (dev_t*)malloc(sizeof(dev_t) * count);
+    if (!devs) {
+        return ERR_MEMALLOC;
+    }
+    for (i = 0; i < count && sts == 0; i++) {
+        fd = open(fileNames[i], O_RDONLY);
+        if (fd < 0) {
+            sts = ERR_WRITE_FILE;
+            break;
+        }
+        if (fstat(fd, &st) != 0) {
+            sts = ERR_WRITE_FILE;
+        } else {
+            for (j = 0; j < devCount && devs[j] != st.st_dev; j++);
+            if (j == devCount) {
+                devs[devCount++] = st.st_dev;
+                if (syncfs(fd) != 0) {
+                    sts = ERR_WRITE_FILE;
+                }
+            }
+        }
+        close(fd);
+    }
+    free(devs);
+#else
+    SYNC_FILES_BATCH batch;
+    batch.fileNames = fileNames;
+    batch.results = (int*)malloc(sizeof(int) * count);
+    if (!batch.results) {
+        return ERR_MEMALLOC;
+    }
+    runBatch(syncFileBatchFunc, &batch, count);
+    for (i = 0; i < count; i++) {
+        if (batch.results[i] < 0) {
+            sts = batch.results[i];
+        }
     }
-    if (fpr) {
-        fclose(fpr);
+    free(batch.results);
+#endif
+    return sts;
+}
+
+// sync the parent directory of the file to make the rename durable
+static int syncParentDirectory(const char *fileName)
+{
+#ifdef _MSC_VER
+    // the directory cannot be opened. NTFS journals the rename
+    return 0;
+#else
+    const char *p = strrchr(fileName, '/');
+    char *dir;
+    int sts;
+    size_t len;
+
+    if (!p) {
+        return syncFile(".");
+    }
+    len = (p == fileName) ? 1 : (size_t)(p - fileName);
+    dir = (char*)malloc(len + 1);
+    if (!dir) {
+        return ERR_MEMALLOC;
     }
+    memcpy(dir, fileName, len);
+    dir[len] = '\0';
+    sts = syncFile(dir);
+    free(dir);
     return sts;
+#endif
+}
+
+// length of the parent directory path of the file
+static size_t parentDirectoryLength(const char *fileName)
+{
+    const char *p = strrchr(fileName, '/');
+    return (p) ? (size_t)(p - fileName) : 0;
 }
 
 /**
- * removeAdobeMetadataSegmentFromJPEGFile()
- *
- * Remove Adobe's XMP metadata segment from a JPEG file
+ * Make the output files of the group durable
  *
  * parameters
- *  [in] inJPEGFileName : original JPEG file
- *  [in] outJPGEFileName : output JPEG file
+ *  [in] group: the output files of the batch function
+ *  [in] indexes: indexes of the entries to be synced
+ *  [in] count: number of the entries
  *
- * return
- *   1: OK
- *   0: Adobe's metadata segment is not found
- *  -n: error
- *      ERR_READ_FILE
- *      ERR_WRITE_FILE
- *      ERR_INVALID_JPEG
- *      ERR_INVALID_APP1HEADER
+ * note
+ * 1. sync the written data of all files
+ * 2. rename the temporary files to the target files
+ * 3. sync each parent directory of the renamed files once
+ * The result of the entry is set to ERR_WRITE_FILE if failed.
  */
-int removeAdobeMetadataSegmentFromJPEGFile(const char *inJPEGFileName,
-                                           const char *outJPGEFileName)
+static void flushDurableGroup(DURABLE_GROUP *group, const int *indexes, int count)
 {
-#define ADOBE_METADATA_ID     "http://ns.adobe.com/xap/"
-#define ADOBE_METADATA_ID_LEN 24
-
-    typedef struct _SegmentHeader {
-        unsigned short marker;
-        unsigned short length;
-    } SEGMENT_HEADER;
-
-    SEGMENT_HEADER hdr;
-    int i, sts = 1;
-    size_t readLen, writeLen;
-    unsigned int ofs;
-    unsigned char buf[8192], *p;
-    FILE *fpr = NULL, *fpw = NULL;
+    int i, j, sts, renamed = 0;
+    const char **names;
+    size_t len;
+    DURABLE_ENTRY *e;
 
-    fpr = fopen(inJPEGFileName, "rb");
-    if (!fpr) {
-        sts = ERR_READ_FILE;
-        goto DONE;
-    }
-    sts = getApp1StartOffset(fpr, ADOBE_METADATA_ID, ADOBE_METADATA_ID_LEN, NULL);
-    if (sts <= 0) { // target segment is not exist or something error
-        goto DONE;
-    }
-    ofs = sts;
-    sts = 1;
-    fpw = fopen(outJPGEFileName, "wb");
-    if (!fpw) {
-        sts = ERR_WRITE_FILE;
-        goto DONE;
-    }
-    // copy the data in front of the App1 segment
-    rewind(fpr);
-    p = buf;
-    if (ofs > sizeof(buf)) {
-        // allocate new buffer if needed
-        p = (unsigned char*)malloc(ofs);
-    }
-    if (!p) {
-        for (i = 0; i < (int)ofs; i++) {
-            fread(buf, 1, sizeof(char), fpr);
-            fwrite(buf, 1, sizeof(char), fpw);
-        }
+    names = (const char**)malloc(sizeof(char*) * count * 2);
+    if (!names) {
+        sts = ERR_MEMALLOC;
     } else {
-        if (fread(p, 1, ofs, fpr) < (size_t)ofs) {
-            sts = ERR_READ_FILE;
-            goto DONE;
-        }
-        if (fwrite(p, 1, ofs, fpw) < (size_t)ofs) {
-            sts = ERR_WRITE_FILE;
-            goto DONE;
+        for (i = 0; i < count; i++) {
+            e = &group->entries[indexes[i]];
+            names[i] = (e->tmpName) ? e->tmpName : e->fileName;
         }
-        if (p != &buf[0]) {
-            free(p);
+        sts = syncFiles(names, count);
+    }
+    for (i = 0; i < count; i++) {
+        e = &group->entries[indexes[i]];
+        if (e->tmpName) {
+            if (sts < 0 || replaceFile(e->tmpName, e->fileName) != 0) {
+                remove(e->tmpName);
+                *e->pResult = ERR_WRITE_FILE;
+            } else if (names) {
+                // the parent directories to be synced
+                names[count + renamed++] = e->fileName;
+            }
+            free(e->tmpName);
+            e->tmpName = NULL;
+        } else if (sts < 0) {
+            *e->pResult = ERR_WRITE_FILE;
         }
     }
-    if (fread(&hdr, 1, sizeof(SEGMENT_HEADER), fpr) != sizeof(SEGMENT_HEADER)) {
-        sts = ERR_READ_FILE;
-        goto DONE;
-    }
-    if (systemIsLittleEndian()) {
-        // the segment length value is always in big-endian order
-        hdr.length = swab16(hdr.length);
-    }
-    // seek to the end of the App1 segment
-    if (fseek(fpr, hdr.length - sizeof(hdr.length), SEEK_CUR) != 0) {
-        sts = ERR_READ_FILE;
-        goto DONE;
-    }
-    // read & write
-    for (;;) {
-        readLen = fread(buf, 1, sizeof(buf), fpr);
-        if (readLen <= 0) {
-            break;
+    for (i = 0; i < renamed && sts == 0; i++) {
+        const char *name = names[count + i];
+        len = parentDirectoryLength(name);
+        for (j = 0; j < i; j++) {
+            if (parentDirectoryLength(names[count + j]) == len &&
+                memcmp(names[count + j], name, len) == 0) {
+                break; // already synced
+            }
         }
-        writeLen = fwrite(buf, 1, readLen, fpw);
-        if (writeLen != readLen) {
-            sts = ERR_WRITE_FILE;
-            goto DONE;
+        if (j == i) {
+            sts = syncParentDirectory(name);
         }
     }
-DONE:
-    if (fpw) {
-        fclose(fpw);
+    if (names) {
+        for (i = 0; i < count; i++) {
+            e = &group->entries[indexes[i]];
+            names[i] = e->fileName;
+            if (sts < 0) {
+                *e->pResult = ERR_WRITE_FILE;
+            }
+        }
     }
-    if (fpr) {
-        fclose(fpr);
+    if (DurableCallback) {
+        DurableCallback(names, (names) ? count : 0, sts, DurableUserData);
     }
-    return sts;
+    free((void*)names);
 }
 
-// private functions
-
-static int dataIsLittleEndian()
+/**
+ * Create the group of the output files of the batch function
+ *
+ * parameters
+ *  [in] count: number of the indexes of the batch
+ *  [out] pGroup: the created group, or NULL if not durable output
+ *
+ * return
+ *  0: OK
+ *  ERR_MEMALLOC
+ */
+static int createDurableGroup(int count, DURABLE_GROUP **pGroup)
 {
-    return (App1Header.tiff.byteOrder == 0x4949) ? 1 : 0;
-}
+    DURABLE_GROUP *group;
 
-static int systemIsLittleEndian()
-{
-    static int i = 1;
-    return (int)(*(char*)&i);
+    *pGroup = NULL;
+    if (DurableGroupSize <= 0 || count <= 0) {
+        return 0;
+    }
+    group = (DURABLE_GROUP*)malloc(sizeof(DURABLE_GROUP));
+    if (!group) {
+        return ERR_MEMALLOC;
+    }
+    group->entries = (DURABLE_ENTRY*)calloc(count, sizeof(DURABLE_ENTRY));
+    group->pending = (int*)malloc(sizeof(int) * count);
+    group->pendingCount = 0;
+    if (!group->entries || !group->pending) {
+        free(group->entries);
+        free(group->pending);
+        free(group);
+        return ERR_MEMALLOC;
+    }
+#ifdef _MSC_VER
+    InitializeCriticalSection(&group->lock);
+#else
+    pthread_mutex_init(&group->lock, NULL);
+#endif
+    *pGroup = group;
+    return 0;
 }
 
-static unsigned short swab16(unsigned short us)
+// start to process the file of the batch function
+static void beginDurableOutput(DURABLE_GROUP *group, int index,
+                               const char *fileName, int *pResult)
 {
-    return (us << 8) | ((us >> 8) & 0x00FF);
+    DURABLE_ENTRY *e;
+    if (!group) {
+        return;
+    }
+    e = &group->entries[index];
+    e->fileName = fileName;
+    e->tmpName = NULL;
+    e->pResult = pResult;
+    DurableEntry = e;
 }
 
-static unsigned int swab32(unsigned int ui)
+/**
+ * Finish to process the file of the batch function
+ *
+ * parameters
+ *  [in] group: the output files of the batch function
+ *  [in] index: index of the file
+ *  [in] written: 1 if the file is written
+ *
+ * note
+ * The pending files are synced when the number reaches the group size.
+ */
+static void endDurableOutput(DURABLE_GROUP *group, int index, int written)
 {
-    return
-    ((ui << 24) & 0xFF000000) | ((ui << 8)  & 0x00FF0000) |
-    ((ui >> 8)  & 0x0000FF00) | ((ui >> 24) & 0x000000FF);
+    int *ready = NULL, count = 0;
+
+    if (!group) {
+        return;
+    }
+    DurableEntry = NULL;
+    if (!written) {
+        return;
+    }
+#ifdef _MSC_VER
+    EnterCriticalSection(&group->lock);
+#else
+    pthread_mutex_lock(&group->lock);
+#endif
+    group->pending[group->pendingCount++] = index;
+    if (group->pendingCount >= DurableGroupSize) {
+        // take the pending files to sync them out of the lock
+        // (synced at the end of the batch if failed to allocate)
+        ready = (int*)malloc(sizeof(int) * group->pendingCount);
+        if (ready) {
+            count = group->pendingCount;
+            memcpy(ready, group->pending, sizeof(int) * count);
+            group->pendingCount = 0;
+        }
+    }
+#ifdef _MSC_VER
+    LeaveCriticalSection(&group->lock);
+#else
+    pthread_mutex_unlock(&group->lock);
+#endif
+    if (ready) {
+        flushDurableGroup(group, ready, count);
+        free(ready);
+    }
 }
 
-static unsigned short fix_short(unsigned short us)
+// sync the rest of the files and free the group
+static void finishDurableGroup(DURABLE_GROUP *group)
 {
-    return (dataIsLittleEndian() !=
-        systemIsLittleEndian()) ? swab16(us) : us;
+    if (!group) {
+        return;
+    }
+    if (group->pendingCount > 0) {
+        flushDurableGroup(group, group->pending, group->pendingCount);
+    }
+#ifdef _MSC_VER
+    DeleteCriticalSection(&group->lock);
+#else
+    pthread_mutex_destroy(&group->lock);
+#endif
+    free(group->entries);
+    free(group->pending);
+    free(group);
 }
 
-static unsigned int fix_int(unsigned int ui)
+// write zero bytes to the current position of the file
+static int writeZeroToFile(FILE *fp, unsigned int len)
 {
-    return (dataIsLittleEndian() !=
-        systemIsLittleEndian()) ? swab32(ui) : ui;
+    static const unsigned char zero[256];
+    while (len > 0) {
+        unsigned int n = (len > sizeof(zero)) ? sizeof(zero) : len;
+        if (fwrite(zero, 1, n, fp) != n) {
+            return ERR_WRITE_FILE;
+        }
+        len -= n;
+    }
+    return 0;
 }
 
-static int seekToRelativeOffset(FILE *fp, unsigned int ofs)
+/**
+ * Clear the IFD and its values in the current opened file with zero
+ *
+ * parameters
+ *  [in] fp: file pointer of opened file ("r+b")
+ *  [in] ifdOffset: offset of the target IFD
+ *  [in] keepOffset: offset of the area which must not be cleared
+ *  [in] keepLength: length of the area which must not be cleared
+ *
+ * return
+ *  0: OK
+ *  ERR_INVALID_IFD
+ *  ERR_WRITE_FILE
+ */
+static int clearIfdInFile(FILE *fp, unsigned int ifdOffset,
+                          unsigned int keepOffset, unsigned int keepLength)
 {
-    static int start = offsetof(APP1_HEADER, tiff);
-    return fseek(fp, (App1StartOffset + start) + ofs, SEEK_SET);
+    int cnt;
+    unsigned short tagCount;
+    unsigned int tiffLen = getTiffDataLength();
+    unsigned int dirLen, pos, size;
+    IFD_TAG tag;
+
+    if (ifdOffset < sizeof(TIFF_HEADER) ||
+        ifdOffset + sizeof(short) > tiffLen ||
+        seekToRelativeOffset(fp, ifdOffset) != 0 ||
+        fread(&tagCount, 1, sizeof(short), fp) < sizeof(short)) {
+        return ERR_INVALID_IFD;
+    }
+    tagCount = fix_short(tagCount);
+    dirLen = sizeof(short) + sizeof(IFD_TAG) * tagCount + sizeof(int);
+    if (ifdOffset + dirLen > tiffLen ||
+        (ifdOffset < keepOffset + keepLength && keepOffset < ifdOffset + dirLen)) {
+        return ERR_INVALID_IFD;
+    }
+    // clear the values placed outside of the tag fields
+    pos = ifdOffset + sizeof(short);
+    for (cnt = 0; cnt < tagCount; cnt++, pos += sizeof(IFD_TAG)) {
+        if (seekToRelativeOffset(fp, pos) != 0 ||
+            fread(&tag, 1, sizeof(tag), fp) < sizeof(tag)) {
+            return ERR_INVALID_IFD;
+        }
+        size = getTagValueSize(fix_short(tag.type), fix_int(tag.count));
+        tag.offset = fix_int(tag.offset);
+        if (size <= 4) {
+            continue; // the value is in the tag field
+        }
+        // never touch the data outside of the TIFF data
+        if (tag.offset < sizeof(TIFF_HEADER) ||
+            tag.offset > tiffLen || size > tiffLen - tag.offset ||
+            (tag.offset < keepOffset + keepLength &&
+             keepOffset < tag.offset + size)) {
+            continue;
+        }
+        if (seekToRelativeOffset(fp, tag.offset) != 0 ||
+            writeZeroToFile(fp, size) != 0) {
+            return ERR_WRITE_FILE;
+        }
+    }
+    // clear the IFD itself
+    if (seekToRelativeOffset(fp, ifdOffset) != 0 ||
+        writeZeroToFile(fp, dirLen) != 0) {
+        return ERR_WRITE_FILE;
+    }
+    return 0;
 }
 
 static char *getTagName(int ifdType, unsigned short tagId)
 {
-    static char tagName[128];
-    if (ifdType == IFD_0TH || ifdType == IFD_1ST || ifdType == IFD_EXIF) {
+    static THREAD_LOCAL char tagName[128];
+    if (ifdType == IFD_0TH || ifdType == IFD_1ST || ifdType == IFD_EXIF ||
+        ifdType == IFD_SUB || ifdType == IFD_NTH) {
         strcpy(tagName,
             (tagId == 0x0100) ? "ImageWidth" :
             (tagId == 0x0101) ? "ImageLength" :
@@ -1354,6 +9897,7 @@ static char *getTagName(int ifdType, unsigned short tagId)
             (tagId == 0x0117) ? "StripByteCounts" :
             (tagId == 0x0201) ? "JPEGInterchangeFormat" :
             (tagId == 0x0202) ? "JPEGInterchangeFormatLength" :
+            (tagId == 0x014A) ? "SubIFDs" :
 
             (tagId == 0x012D) ? "TransferFunction" :
             (tagId == 0x013E) ? "WhitePoint" :
@@ -1493,6 +10037,8 @@ static char *getTagName(int ifdType, unsigned short tagId)
             (tagId == 0x0001) ? "InteroperabilityIndex" :
             (tagId == 0x0002) ? "InteroperabilityVersion" :
             "(unknown)");
+    } else {
+        strcpy(tagName, "(unknown)");
     }
     return tagName;
 }
@@ -1508,6 +10054,7 @@ static void *createIfdTable(IFD_TYPE IfdType, unsigned short tagCount, unsigned
     ifd->ifdType = IfdType;
     ifd->tagCount = tagCount;
     ifd->nextIfdOffset = nextOfs;
+    ifd->makerNoteVendor = -1;
     return ifd;
 }
 
@@ -1543,8 +10090,14 @@ static void *addTagNodeToIfd(void *pIfd,
                 tag->numData[i] = numData[i];
             }
         } else if (byteData != NULL) {
-            tag->byteData = (unsigned char*)malloc(count);
-            memcpy(tag->byteData, byteData, count);
+            if (type == TYPE_ASCII && CurrentStringPool) {
+                tag->byteData = internString(CurrentStringPool, byteData, count);
+                tag->interned = (tag->byteData) ? 1 : 0;
+            }
+            if (!tag->byteData) {
+                tag->byteData = (unsigned char*)malloc(count);
+                memcpy(tag->byteData, byteData, count);
+            }
         } else {
             tag->error = 1;
         }
@@ -1552,6 +10105,7 @@ static void *addTagNodeToIfd(void *pIfd,
         tag->error = 1;
     }
     
+    setTagPresence(ifd, tagId);
     // first tag
     if (!ifd->tags) {
         ifd->tags = tag;
@@ -1589,6 +10143,10 @@ static TagNode *duplicateTagNode(TagNode *src)
         }
         dup->numData = (unsigned int*)malloc(len);
         memcpy(dup->numData, src->numData, len);
+    } else if (src->interned) {
+        // share the immutable value
+        dup->byteData = src->byteData;
+        dup->interned = 1;
     } else if (src->byteData) {
         len = sizeof(char) * src->count;
         dup->byteData = (unsigned char*)malloc(len);
@@ -1607,7 +10165,7 @@ static void freeTagNode(void *pTag)
     if (tag->numData) {
         free(tag->numData);
     }
-    if (tag->byteData) {
+    if (tag->byteData && !tag->interned) {
         free(tag->byteData);
     }
     free(tag);
@@ -1625,6 +10183,8 @@ static void freeIfdTable(void *pIfd)
     if (ifd->p) {
         free(ifd->p);
     }
+    releaseRawSegment(ifd);
+    freeIfdTable(ifd->makerNote);
     free(ifd);
 
     if (tag) {
@@ -1640,21 +10200,77 @@ static void freeIfdTable(void *pIfd)
     return;
 }
 
-// search the specified tag's node from the IFD table
-static TagNode *getTagNodePtrFromIfd(IfdTable *ifd, unsigned short tagId)
+// search the specified tag's node from the IFD table
+static TagNode *getTagNodePtrFromIfd(IfdTable *ifd, unsigned short tagId)
+{
+    TagNode *tag;
+    if (!ifd) {
+        return NULL;
+    }
+    tag = ifd->tags;
+    while (tag) {
+        if (tag->tagId == tagId) {
+            return tag;
+        }
+        tag = tag->next;
+    }
+    return NULL;
+}
+
+// get the bit index of the tag in the presence bitmap (-1 if not known)
+static int getTagPresenceBit(IFD_TYPE ifdType, unsigned short tagId)
+{
+    int lo = 0, hi = (int)(sizeof(KnownTagIds) / sizeof(KnownTagIds[0])) - 1, mid;
+    if (ifdType == IFD_GPS || ifdType == IFD_IO) {
+        return (tagId < 32) ? tagId : -1;
+    }
+    while (lo <= hi) {
+        mid = (lo + hi) / 2;
+        if (KnownTagIds[mid] == tagId) {
+            return mid;
+        }
+        if (KnownTagIds[mid] < tagId) {
+            lo = mid + 1;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    return -1;
+}
+
+// set the bit of the tag in the presence bitmap of the IFD table
+static void setTagPresence(IfdTable *ifd, unsigned short tagId)
+{
+    int bit = getTagPresenceBit(ifd->ifdType, tagId);
+    if (bit >= 0) {
+        ifd->presence[bit >> 5] |= 1u << (bit & 31);
+    } else {
+        ifd->otherPresence |= 1u << (tagId & 31);
+    }
+}
+
+// recreate the presence bitmap of the IFD table after removing the tags
+static void refreshTagPresence(IfdTable *ifd)
+{
+    TagNode *tag;
+    memset(ifd->presence, 0, sizeof(ifd->presence));
+    ifd->otherPresence = 0;
+    for (tag = ifd->tags; tag; tag = tag->next) {
+        setTagPresence(ifd, tag->tagId);
+    }
+}
+
+// check if the tag exists in the IFD table with the presence bitmap
+static int tagIsPresent(IfdTable *ifd, unsigned short tagId)
 {
-    TagNode *tag;
-    if (!ifd) {
-        return NULL;
+    int bit = getTagPresenceBit(ifd->ifdType, tagId);
+    if (bit >= 0) {
+        return (ifd->presence[bit >> 5] >> (bit & 31)) & 1;
     }
-    tag = ifd->tags;
-    while (tag) {
-        if (tag->tagId == tagId) {
-            return tag;
-        }
-        tag = tag->next;
+    if (!(ifd->otherPresence & (1u << (tagId & 31)))) {
+        return 0;
     }
-    return NULL;
+    return (getTagNodePtrFromIfd(ifd, tagId) != NULL) ? 1 : 0;
 }
 
 // remove the TagNode entry from the IFD table
@@ -1682,6 +10298,13 @@ static int removeTagOnIfd(void *pIfd, unsigned short tagId)
         }
         freeTagNode(tag);
         ifd->tagCount--;
+        ifd->modified = 1;
+    }
+    if (num > 0) {
+        refreshTagPresence(ifd);
+        if (tagId == TAG_MakerNote) {
+            resetMakerNote(ifd);
+        }
     }
     return num;
 }
@@ -1791,7 +10414,8 @@ static int writeExifSegment(FILE *fp, void **ifdTableArray)
     }
     dupApp1Header.length = us;
     dupApp1Header.tiff.reserved = fix_short(dupApp1Header.tiff.reserved);
-    dupApp1Header.tiff.Ifd0thOffset = fix_int(dupApp1Header.tiff.Ifd0thOffset);
+    // the 0th IFD may not be at the head in the original data
+    dupApp1Header.tiff.Ifd0thOffset = fix_int(ifd0th->offset);
     // write Exif segment Header
     if (fwrite(&dupApp1Header, 1, sizeof(APP1_HEADER), fp) != sizeof(APP1_HEADER)) {
         return ERR_WRITE_FILE;
@@ -1881,7 +10505,7 @@ static int writeExifSegment(FILE *fp, void **ifdTableArray)
                     packed.ui = fix_int((unsigned int)tag->numData[0]);
                 } else {
                     packed.ui = fix_int(ofs);
-                    ofs += tag->count * sizeof(short);
+                    ofs += tag->count * sizeof(int);
                 }
                 break;
             case TYPE_RATIONAL:
@@ -2094,8 +10718,9 @@ AGAIN:
         tag = ifd->tags;
         num = 0;
         while (tag) {
-            // ignore and dispose the error tag
-            if (tag->error) {
+            // ignore and dispose the error tag, and the offsets in the
+            // TIFF file which are invalid in the segment
+            if (tag->error || isTiffFileOffsetTag(ifd, tag->tagId)) {
                 tagwk = tag->next;
                 if (tag->prev) {
                     tag->prev->next = tag->next;
@@ -2113,6 +10738,7 @@ AGAIN:
             tag = tag->next;
         }
         ifd->tagCount = num;
+        refreshTagPresence(ifd);
         ifd->length = calcIfdSize(ifd);
         ifd->nextIfdOffset = 0;
     }
@@ -2238,6 +10864,237 @@ AGAIN:
     return 0;
 }
 
+// decode the MakerNote of the TIFF file while the file is opened
+static void decodeMakerNoteInFile(FILE *fp, IfdTable *ifd0th, IfdTable *exif,
+                                  unsigned long long exifOffset)
+{
+    MAKERNOTE_FORMAT fmt;
+    TIFF_FIELD field;
+    TagNode *tag = getTagNodePtrFromIfd(exif, TAG_MakerNote);
+    if (!tag || tag->error || tag->type != TYPE_UNDEFINED || !tag->byteData) {
+        return;
+    }
+    exif->makerNoteVendor = getMakerNoteFormat(tag->byteData, tag->count,
+                                getTagNodePtrFromIfd(ifd0th, TAG_Make), &fmt);
+    if (exif->makerNoteVendor != MAKERNOTE_NONE && tag->count > 4 &&
+        findTiffFieldInIfd(fp, exifOffset, TAG_MakerNote, &field) > 0) {
+        exif->makerNote = parseMakerNote(fp, getTiffDataLength(), field.offset,
+                                         tag->count, App1Header.tiff.byteOrder, &fmt);
+    }
+}
+
+/**
+ * Parse the SubIFDs and the IFDs after the 1st IFD of the TIFF file
+ *
+ * parameters
+ *  [in] fp: file pointer of opened file
+ *  [in] fileName: name of the file, or NULL
+ *  [in/out] list: the IFD tables to add to
+ *
+ * return
+ *   0: OK
+ *  ERR_INVALID_IFD
+ *  ERR_MEMALLOC
+ *
+ * note
+ * The chain is walked first reading only the tag count and the next
+ * offset of each IFD, and then the IFDs are decoded by the threads set by
+ * setBatchThreads() if the file can be opened by the name for each thread.
+ * The tables are added in the order of the chain, and the SubIFDs follow
+ * the IFD pointing to them.
+ */
+static int parseTiffIfds(FILE *fp, const char *fileName, IFD_LIST *list)
+{
+    int i, j, sts;
+    TIFF_CHAIN_BATCH batch;
+    TIFF_CHAIN_ENTRY *entry;
+
+    memset(&batch, 0, sizeof(batch));
+    sts = getTiffChainOffsets(fp, &batch.chain, &batch.count);
+    if (batch.count == 0) {
+        return sts;
+    }
+    batch.entries = (TIFF_CHAIN_ENTRY*)calloc(batch.count, sizeof(TIFF_CHAIN_ENTRY));
+    if (!batch.entries) {
+        free(batch.chain);
+        return ERR_MEMALLOC;
+    }
+    batch.fileName = fileName;
+    batch.fp = fp;
+    batch.app1Header = App1Header;
+    batch.tiffFile = TiffFile;
+    batch.slices = (fileName && BatchThreads > 1) ? BatchThreads : 1;
+    if (batch.slices > batch.count) {
+        batch.slices = batch.count;
+    }
+    runBatch(tiffChainBatchFunc, &batch, batch.slices);
+
+    for (i = 0; i < batch.count; i++) {
+        entry = &batch.entries[i];
+        if (entry->sts < 0 && sts == 0) {
+            sts = entry->sts;
+        }
+        if (entry->nth && addIfdToList(list, entry->nth) != 0) {
+            sts = ERR_MEMALLOC;
+        }
+        for (j = 0; j < entry->subCount; j++) {
+            if (addIfdToList(list, entry->subs[j]) != 0) {
+                sts = ERR_MEMALLOC;
+            }
+        }
+        free(entry->subs);
+    }
+    free(batch.entries);
+    free(batch.chain);
+    return sts;
+}
+
+/**
+ * Get the offsets of the IFDs in the chain of the TIFF file
+ *
+ * parameters
+ *  [in] fp: file pointer of opened file
+ *  [out] pChain: offsets of the IFDs from the 0th IFD (to be freed)
+ *  [out] pCount: number of the IFDs
+ *
+ * return
+ *   0: OK
+ *  ERR_INVALID_IFD: the chain is circular
+ *  ERR_MEMALLOC
+ *
+ * note
+ * Only the tag count and the next offset of each IFD are read. The circular
+ * chain is detected by Brent's algorithm without looking up the offsets,
+ * and the IFDs before it comes back are returned.
+ */
+static int getTiffChainOffsets(FILE *fp, unsigned long long **pChain, int *pCount)
+{
+    unsigned long long *chain = NULL, *wk, ifdOffset, nextOffset, tortoise;
+    int i, count = 0, max = 0, power = 1, lam = 1, sts = 0;
+
+    ifdOffset = tortoise = TiffFile.ifd0thOffset;
+    while (ifdOffset != 0) {
+        if (count == max) {
+            max = (max == 0) ? 16 : max * 2;
+            wk = (unsigned long long*)realloc(chain, sizeof(long long) * max);
+            if (!wk) {
+                sts = ERR_MEMALLOC;
+                break;
+            }
+            chain = wk;
+        }
+        chain[count++] = ifdOffset;
+        if (getNextIfdOffsetInFile(fp, ifdOffset, &nextOffset) != 0) {
+            break; // the chain ends at the broken IFD
+        }
+        if (nextOffset == tortoise) {
+            // the circle of 'lam' IFDs, find where it starts
+            for (i = 0; i + lam < count && chain[i] != chain[i + lam]; i++) {
+                ;
+            }
+            count = i + lam;
+            if (Verbose) {
+                printf("circular IFD chain at %llu\n", nextOffset);
+            }
+            sts = ERR_INVALID_IFD;
+            break;
+        }
+        if (power == lam) {
+            tortoise = nextOffset;
+            power *= 2;
+            lam = 0;
+        }
+        lam++;
+        ifdOffset = nextOffset;
+    }
+    *pChain = chain;
+    *pCount = count;
+    return sts;
+}
+
+// worker function of parseTiffIfds()
+// (the slices take the IFDs in turn, each with its own file pointer)
+static void tiffChainBatchFunc(void *ctx, int index)
+{
+    TIFF_CHAIN_BATCH *batch = (TIFF_CHAIN_BATCH*)ctx;
+    unsigned long long subOffsets[TIFF_SUB_IFD_MAX], next;
+    TIFF_CHAIN_ENTRY *entry;
+    IfdTable *ifd;
+    FILE *fp = batch->fp;
+    int i, j, n;
+
+    // the state of the file is thread-local
+    App1Header = batch->app1Header;
+    TiffFile = batch->tiffFile;
+    if (batch->slices > 1) {
+        fp = fopen(batch->fileName, "rb");
+    }
+    for (i = index; i < batch->count; i += batch->slices) {
+        entry = &batch->entries[i];
+        if (!fp) {
+            entry->sts = ERR_READ_FILE;
+            continue;
+        }
+        // the 0th and 1st IFD are already parsed
+        if (i >= 2) {
+            entry->nth = parseIFD(fp, batch->chain[i], IFD_NTH);
+            if (!entry->nth) {
+                if (Verbose) {
+                    printf("critical error in nth IFD\n");
+                }
+                entry->sts = ERR_INVALID_IFD;
+                continue;
+            }
+            next = (i + 1 < batch->count) ? batch->chain[i + 1] : 0;
+            entry->nth->nextIfdOffset = (next > 0xFFFFFFFF) ? 0 : (unsigned int)next;
+        }
+        n = getSubIfdOffsetsInFile(fp, batch->chain[i], subOffsets, TIFF_SUB_IFD_MAX);
+        if (n < 0) {
+            entry->sts = n;
+        } else if (n > 0) {
+            entry->subs = (IfdTable**)malloc(sizeof(IfdTable*) * n);
+            if (!entry->subs) {
+                entry->sts = ERR_MEMALLOC;
+                n = 0;
+            }
+        }
+        for (j = 0; j < n; j++) {
+            ifd = parseIFD(fp, subOffsets[j], IFD_SUB);
+            if (!ifd) {
+                if (Verbose) {
+                    printf("critical error in Sub IFD\n");
+                }
+                entry->sts = ERR_INVALID_IFD;
+                continue;
+            }
+            entry->subs[entry->subCount++] = ifd;
+        }
+    }
+    if (fp && fp != batch->fp) {
+        fclose(fp);
+    }
+}
+
+// add the IFD table to the list (the table is freed if failed)
+static int addIfdToList(IFD_LIST *list, void *ifd)
+{
+    void **wk;
+    int max;
+    if (list->count + 1 >= list->max) {
+        max = (list->max == 0) ? 16 : list->max * 2;
+        wk = (void**)realloc(list->ifds, sizeof(void*) * max);
+        if (!wk) {
+            freeIfdTable(ifd);
+            return ERR_MEMALLOC;
+        }
+        list->ifds = wk;
+        list->max = max;
+    }
+    list->ifds[list->count++] = ifd;
+    list->ifds[list->count] = NULL;
+    return 0;
+}
+
 /**
  * Set the data of the IFD to the internal table
  *
@@ -2250,115 +11107,266 @@ AGAIN:
  *   NULL: critical error occurred
  *  !NULL: the address of the IFD table
  */
+// parse the JPEG file and create the pointer array of the IFD tables
+static void **createIfdTableArrayFromFile(FILE *fp, const char *fileName,
+                                          int *result)
+{
+    #define FMT_ERR "critical error in %s IFD\n"
+
+    int i, sts = 1;
+    unsigned long long ifd0thOffset, ifdOffset;
+    RawSegment *raw = NULL;
+    void **ppIfdArray = NULL;
+    IFD_LIST list;
+    IfdTable *ifd_0th, *ifd_exif, *ifd_gps, *ifd_io, *ifd_1st;
+
+    ifd_0th = ifd_exif = ifd_gps = ifd_io = ifd_1st = NULL;
+    memset(&list, 0, sizeof(list));
+
+    sts = init(fp);
+    if (sts == ERR_INVALID_JPEG) {
+        // the TIFF-structured file (e.g. DNG, CR2, NEF)
+        sts = initTiffFile(fp);
+    }
+    if (sts <= 0) {
+        goto DONE;
+    }
+    if (Verbose) {
+        printf("system: %s-endian\n  data: %s-endian\n", 
+            systemIsLittleEndian() ? "little" : "big",
+            dataIsLittleEndian() ? "little" : "big");
+    }
+
+    // keep the original data to copy the unmodified IFD tables as it is
+    // (not for the TIFF file, it would be the whole file)
+    if (TiffFile.length == 0) {
+        raw = loadRawSegment(fp);
+    }
+    ifd0thOffset = (TiffFile.length > 0) ? TiffFile.ifd0thOffset
+                                         : App1Header.tiff.Ifd0thOffset;
+
+    // for 0th IFD
+    ifd_0th = parseIFD(fp, ifd0thOffset, IFD_0TH);
+    if (!ifd_0th) {
+        if (Verbose) {
+            printf(FMT_ERR, "0th");
+        }
+        sts = ERR_INVALID_IFD;
+        goto DONE; // non-continuable
+    }
+    setRawSegmentToIfd(ifd_0th, raw, (unsigned int)ifd0thOffset);
+    if (addIfdToList(&list, ifd_0th) != 0) {
+        sts = ERR_MEMALLOC;
+        goto DONE;
+    }
+
+    // for Exif IFD 
+    getIfdPointer(fp, ifd_0th, ifd0thOffset, TAG_ExifIFDPointer, &ifdOffset);
+    if (ifdOffset != 0) {
+        ifd_exif = parseIFD(fp, ifdOffset, IFD_EXIF);
+        if (ifd_exif) {
+            setRawSegmentToIfd(ifd_exif, raw, (unsigned int)ifdOffset);
+            if (addIfdToList(&list, ifd_exif) != 0) {
+                sts = ERR_MEMALLOC;
+                goto DONE;
+            }
+            if (TiffFile.length > 0) {
+                // the offsets in the MakerNote can't be resolved later
+                decodeMakerNoteInFile(fp, ifd_0th, ifd_exif, ifdOffset);
+            }
+            // for InteroperabilityIFDPointer IFD
+            getIfdPointer(fp, ifd_exif, ifdOffset,
+                          TAG_InteroperabilityIFDPointer, &ifdOffset);
+            if (ifdOffset != 0) {
+                ifd_io = parseIFD(fp, ifdOffset, IFD_IO);
+                if (ifd_io) {
+                    setRawSegmentToIfd(ifd_io, raw, (unsigned int)ifdOffset);
+                    if (addIfdToList(&list, ifd_io) != 0) {
+                        sts = ERR_MEMALLOC;
+                        goto DONE;
+                    }
+                } else {
+                    if (Verbose) {
+                        printf(FMT_ERR, "Interoperability");
+                    }
+                    sts = ERR_INVALID_IFD;
+                }
+            }
+        } else {
+            if (Verbose) {
+                printf(FMT_ERR, "Exif");
+            }
+            sts = ERR_INVALID_IFD;
+        }
+    }
+
+    // for GPS IFD
+    getIfdPointer(fp, ifd_0th, ifd0thOffset, TAG_GPSInfoIFDPointer, &ifdOffset);
+    if (ifdOffset != 0) {
+        ifd_gps = parseIFD(fp, ifdOffset, IFD_GPS);
+        if (ifd_gps) {
+            setRawSegmentToIfd(ifd_gps, raw, (unsigned int)ifdOffset);
+            if (addIfdToList(&list, ifd_gps) != 0) {
+                sts = ERR_MEMALLOC;
+                goto DONE;
+            }
+        } else {
+            if (Verbose) {
+                printf(FMT_ERR, "GPS");
+            }
+            sts = ERR_INVALID_IFD;
+        }
+    }
+
+    // for 1st IFD
+    ifdOffset = ifd_0th->nextIfdOffset;
+    if (TiffFile.big && getNextIfdOffsetInFile(fp, ifd0thOffset, &ifdOffset) != 0) {
+        ifdOffset = 0; // the 64-bit offset of BigTIFF
+    }
+    if (ifdOffset != 0) {
+        ifd_1st = parseIFD(fp, ifdOffset, IFD_1ST);
+        if (ifd_1st) {
+            setRawSegmentToIfd(ifd_1st, raw, (unsigned int)ifdOffset);
+            if (addIfdToList(&list, ifd_1st) != 0) {
+                sts = ERR_MEMALLOC;
+                goto DONE;
+            }
+        } else {
+            if (Verbose) {
+                printf(FMT_ERR, "1st");
+            }
+            sts = ERR_INVALID_IFD;
+        }
+    }
+
+    // for the IFD chain and the SubIFDs of the TIFF file
+    if (TiffFile.length > 0) {
+        i = parseTiffIfds(fp, fileName, &list);
+        if (i < 0) {
+            sts = (i == ERR_MEMALLOC) ? ERR_MEMALLOC : ERR_INVALID_IFD;
+        }
+    }
+
+DONE:
+    *result = (sts <= 0) ? sts : list.count;
+    if (list.count > 0) {
+        // terminated by the extra NULL element
+        ppIfdArray = list.ifds;
+    } else {
+        free(list.ifds);
+    }
+    if (raw && raw->refCount == 0) {
+        free(raw->data);
+        free(raw);
+    }
+    memset(&TiffFile, 0, sizeof(TiffFile));
+    return ppIfdArray;
+}
+
 static void *parseIFD(FILE *fp,
-                      unsigned int startOffset,
+                      unsigned long long startOffset,
                       IFD_TYPE ifdType)
 {
     void *ifd;
     unsigned char buf[8192];
-    unsigned short tagCount, us;
-    unsigned int nextOffset = 0;
-    unsigned int *array, val, allocSize;
+    unsigned long long tagCount, nextOffset = 0, len;
+    unsigned int *array, val, count, inlineSize = IFD_OFFSET_SIZE;
+    unsigned short type;
     int size, cnt, i;
-    size_t len;
-    int pos;
     
     // get the count of the tags
-    if (seekToRelativeOffset(fp, startOffset) != 0 ||
-        fread(&tagCount, 1, sizeof(short), fp) < sizeof(short)) {
+    if (readIfdTagCount(fp, startOffset, &tagCount) != 0 ||
+        tagCount > 0xFFFF) {
         return NULL;
     }
-    tagCount = fix_short(tagCount);
-    pos = ftell(fp);
 
     // in case of the 0th IFD, check the offset of the 1st IFD
     if (ifdType == IFD_0TH) {
-        // next IFD's offset is at the tail of the segment
-        if (seekToRelativeOffset(fp,
-                sizeof(TIFF_HEADER) + sizeof(short) + sizeof(IFD_TAG) * tagCount) != 0 ||
-            fread(&nextOffset, 1, sizeof(int), fp) < sizeof(int)) {
+        // next IFD's offset is at the tail of the IFD
+        if (getNextIfdOffsetInFile(fp, startOffset, &nextOffset) != 0) {
             return NULL;
         }
-        nextOffset = fix_int(nextOffset);
-        fseek(fp, pos, SEEK_SET);
+        if (nextOffset > 0xFFFFFFFF) { // BigTIFF, kept in parseTiffIfds()
+            nextOffset = 0;
+        }
     }
     // create new IFD table
-    ifd = createIfdTable(ifdType, tagCount, nextOffset);
+    ifd = createIfdTable(ifdType, (unsigned short)tagCount, (unsigned int)nextOffset);
+    if (ifd && TiffFile.length > 0) {
+        ((IfdTable*)ifd)->tiffFile = 1;
+    }
 
     // parse all tags
-    for (cnt = 0; cnt < tagCount; cnt++) {
-        IFD_TAG tag;
-        unsigned char data[4];
-        if (fseek(fp, pos, SEEK_SET) != 0 ||
-            fread(&tag, 1, sizeof(tag), fp) < sizeof(tag)) {
+    for (cnt = 0; cnt < (int)tagCount; cnt++) {
+        TIFF_FIELD tag;
+        unsigned char *data = tag.data; // keep raw data temporary
+        if (seekToRelativeOffset(fp, startOffset + IFD_COUNT_SIZE +
+                                     (unsigned long long)cnt * IFD_FIELD_SIZE) != 0 ||
+            readTiffField(fp, &tag) != 0) {
             goto ERR;
         }
-        memcpy(data, &tag.offset, 4); // keep raw data temporary
-        tag.tag = fix_short(tag.tag);
-        tag.type = fix_short(tag.type);
-        tag.count = fix_int(tag.count);
-        tag.offset = fix_int(tag.offset);
-        pos = ftell(fp);
+        count = (tag.count > 0xFFFFFFFF) ? 0xFFFFFFFF : (unsigned int)tag.count;
 
-        //printf("tag=0x%04X type=%u count=%u offset=%u name=[%s]\n",
-        //  tag.tag, tag.type, tag.count, tag.offset, getTagName(ifdType, tag.tag));
+        //printf("tag=0x%04X type=%u count=%u offset=%llu name=[%s]\n",
+        //  tag.tag, tag.type, count, tag.offset, getTagName(ifdType, tag.tag));
 
         if (tag.type == TYPE_ASCII ||     // ascii = the null-terminated string
             tag.type == TYPE_UNDEFINED) { // undefined = the chunk data bytes
-            if (tag.count <= 4)  {
-                // 4 bytes or less data is placed in the 'offset' area directly
-                addTagNodeToIfd(ifd, tag.tag, tag.type, tag.count, NULL, data);
+            if (count <= inlineSize)  {
+                // 4 (8 in BigTIFF) bytes or less data is placed in the 'offset' area directly
+                addTagNodeToIfd(ifd, tag.tag, tag.type, count, NULL, data);
             } else {
-                // 5 bytes or more data is placed in the value area of the IFD
+                // more data is placed in the value area of the IFD
                 unsigned char *p = buf;
-                if (tag.count > sizeof(buf)) {
+                if (count > sizeof(buf)) {
                     // allocate new buffer if needed
-                    if (tag.count >= App1Header.length) { // illegal
+                    if (count >= getTiffDataLength()) { // illegal
                         p = NULL;
                     } else {
-                        p = (unsigned char*)malloc(tag.count);
+                        p = (unsigned char*)malloc(count);
                     }
                     if (!p) {
                         // treat as an error
-                        addTagNodeToIfd(ifd, tag.tag, tag.type, tag.count, NULL, NULL);
+                        addTagNodeToIfd(ifd, tag.tag, tag.type, count, NULL, NULL);
                         continue;
                     }
-                    memset(p, 0, tag.count);
+                    memset(p, 0, count);
                 }
                 if (seekToRelativeOffset(fp, tag.offset) != 0 ||
-                    fread(p, 1, tag.count, fp) < tag.count) {
+                    fread(p, 1, count, fp) < count) {
                     if (p != &buf[0]) {
                         free(p);
                     }
-                    addTagNodeToIfd(ifd, tag.tag, tag.type, tag.count, NULL, NULL);
+                    addTagNodeToIfd(ifd, tag.tag, tag.type, count, NULL, NULL);
                     continue;
                 }
-                addTagNodeToIfd(ifd, tag.tag, tag.type, tag.count, NULL, p);
+                addTagNodeToIfd(ifd, tag.tag, tag.type, count, NULL, p);
                 if (p != &buf[0]) {
                     free(p);
                 }
             }
         }
         else if (tag.type == TYPE_RATIONAL || tag.type == TYPE_SRATIONAL) {
-            unsigned int realCount = tag.count * 2; // need double the space
-            size_t len = realCount * sizeof(int);
-            if (len >= App1Header.length) { // illegal
+            unsigned int realCount = count * 2; // need double the space
+            len = (unsigned long long)count * 2 * sizeof(int);
+            if (len >= getTiffDataLength()) { // illegal
                 array = NULL;
             } else {
-                array = (unsigned int*)malloc(len);
+                array = (unsigned int*)malloc((size_t)len);
                 if (array) {
-                    if (seekToRelativeOffset(fp, tag.offset) != 0 ||
-                        fread(array, 1, len , fp) < len) {
+                    if (len <= inlineSize) { // a single value in BigTIFF
+                        memcpy(array, data, (size_t)len);
+                    } else if (seekToRelativeOffset(fp, tag.offset) != 0 ||
+                        fread(array, 1, (size_t)len, fp) < len) {
                         free(array);
                         array = NULL;
-                    } else {
-                        for (i = 0; i < (int)realCount; i++) {
-                            array[i] = fix_int(array[i]);
-                        }
+                    }
+                    for (i = 0; array && i < (int)realCount; i++) {
+                        array[i] = fix_int(array[i]);
                     }
                 }
             }
-            addTagNodeToIfd(ifd, tag.tag, tag.type, tag.count, array, NULL);
+            addTagNodeToIfd(ifd, tag.tag, tag.type, count, array, NULL);
             if (array) {
                 free(array);
             }
@@ -2368,80 +11376,91 @@ static void *parseIFD(FILE *fp,
                  tag.type == TYPE_LONG   ||
                  tag.type == TYPE_SBYTE  ||
                  tag.type == TYPE_SSHORT ||
-                 tag.type == TYPE_SLONG ) {
+                 tag.type == TYPE_SLONG  ||
+                 (TiffFile.length > 0 &&  // the types of the TIFF file
+                  (tag.type == TYPE_IFD    || tag.type == TYPE_LONG8 ||
+                   tag.type == TYPE_SLONG8 || tag.type == TYPE_IFD8))) {
+
+            size = sizeof(int);
+            type = tag.type;
+            if (tag.type == TYPE_BYTE || tag.type == TYPE_SBYTE) {
+                size = sizeof(char);
+            } else if (tag.type == TYPE_SHORT || tag.type == TYPE_SSHORT) {
+                size = sizeof(short);
+            } else if (tag.type == TYPE_IFD) {
+                type = TYPE_LONG;
+            } else if (tag.type != TYPE_LONG && tag.type != TYPE_SLONG) {
+                // the 64-bit values are kept only if they fit in 32 bits
+                size = sizeof(long long);
+                type = (tag.type == TYPE_SLONG8) ? TYPE_SLONG : TYPE_LONG;
+            }
 
             // the single value is always stored in tag.offset area directly
-            // # the data is Left-justified if less than 4 bytes
-            if (tag.count <= 1) {
-                val = tag.offset;
-                if (tag.type == TYPE_BYTE || tag.type == TYPE_SBYTE) {
-                    unsigned char uc = data[0];
-                    val = uc;
-                } else if (tag.type == TYPE_SHORT || tag.type == TYPE_SSHORT) {
-                    memcpy(&us, data, sizeof(short));
-                    us = fix_short(us);
-                    val = us;
+            // # the data is Left-justified if less than 4 (8 in BigTIFF) bytes
+            if (count <= 1 && (unsigned int)size <= inlineSize) {
+                val = 0;
+                if (!getTiffValue(data, size, tag.type, &val)) {
+                    addTagNodeToIfd(ifd, tag.tag, type, count, NULL, NULL);
+                    continue;
                 }
-                addTagNodeToIfd(ifd, tag.tag, tag.type, tag.count, &val, NULL);
+                addTagNodeToIfd(ifd, tag.tag, type, count, &val, NULL);
              }
              // multiple value
              else {
-                size = sizeof(int);
-                if (tag.type == TYPE_BYTE || tag.type == TYPE_SBYTE) {
-                    size = sizeof(char);
-                } else if (tag.type == TYPE_SHORT || tag.type == TYPE_SSHORT) {
-                    size = sizeof(short);
-                }
+                unsigned char *p = data;
                 // for the sake of simplicity, using the 4bytes area for
                 // each numeric data type 
-                allocSize = sizeof(int) * tag.count;
-                if (allocSize >= App1Header.length) { // illegal
+                len = (unsigned long long)sizeof(int) * count;
+                if (len >= getTiffDataLength()) { // illegal
                     array = NULL;
                 } else {
-                    array = (unsigned int*)malloc(allocSize);
+                    array = (unsigned int*)malloc((size_t)len);
                 }
                 if (!array) {
-                    addTagNodeToIfd(ifd, tag.tag, tag.type, tag.count, NULL, NULL);
+                    addTagNodeToIfd(ifd, tag.tag, type, count, NULL, NULL);
                     continue;
                 }
-                len = size * tag.count;
-                // if the total length of the value is less than or equal to 4bytes, 
-                // they have been stored in the tag.offset area
-                if (len <= 4) {
-                    if (size == 1) { // byte
-                        for (i = 0; i < (int)tag.count; i++) {
-                            array[i] = (unsigned int)data[i];
-                        }
-                    } else if (size == 2) { // short
-                        for (i = 0; i < 2; i++) {
-                            memcpy(&us, &data[i*2], sizeof(short));
-                            us = fix_short(us);
-                            array[i] = (unsigned int)us;
-                        }
+                len = (unsigned long long)size * count;
+                // if the total length of the value is less than or equal to
+                // 4 (8 in BigTIFF) bytes, they have been stored in the tag.offset area
+                if (len > inlineSize) {
+                    // the value may be longer than the buffer (e.g. in MakerNote)
+                    p = buf;
+                    if (len > sizeof(buf)) {
+                        p = (unsigned char*)malloc((size_t)len);
                     }
-                } else {
-                    if (seekToRelativeOffset(fp, tag.offset) != 0 ||
-                        fread(buf, 1, len , fp) < len) {
-                        addTagNodeToIfd(ifd, tag.tag, tag.type, tag.count, NULL, NULL);
+                    if (!p ||
+                        seekToRelativeOffset(fp, tag.offset) != 0 ||
+                        fread(p, 1, (size_t)len, fp) < len) {
+                        if (p != &buf[0]) {
+                            free(p);
+                        }
+                        free(array);
+                        addTagNodeToIfd(ifd, tag.tag, type, count, NULL, NULL);
                         continue;
                     }
-                    for (i = 0; i < (int)tag.count; i++) {
-                        memcpy(&val, &buf[i*size], size);
-                        if (size == sizeof(int)) {
-                            val = fix_int(val);
-                        } else if (size == sizeof(short)) {
-                            val = fix_short((unsigned short)val);
-                        }
-                        array[i] = (unsigned int)val;
+                }
+                for (i = 0; i < (int)count; i++) {
+                    if (!getTiffValue(&p[i*size], size, tag.type, &array[i])) {
+                        break;
                     }
                 }
-                addTagNodeToIfd(ifd, tag.tag, tag.type, tag.count, array, NULL);
-                free(array);
+                if (p != &buf[0] && p != data) {
+                    free(p);
+                }
+                if (i < (int)count) { // out of 32 bits
+                    free(array);
+                    array = NULL;
+                }
+                addTagNodeToIfd(ifd, tag.tag, type, count, array, NULL);
+                if (array) {
+                    free(array);
+                }
              }
          }
     }
-    if (ifdType == IFD_1ST) {
-        // get thumbnail data
+    if (ifdType == IFD_1ST && TiffFile.length == 0) {
+        // get thumbnail data (not in the TIFF file, it's the image data)
         unsigned int thumbnail_ofs = 0, thumbnail_len;
         IfdTable *ifdTable = (IfdTable*)ifd;
         TagNode *tag  = getTagNodePtrFromIfd(ifd, TAG_JPEGInterchangeFormat);
@@ -2483,6 +11502,34 @@ ERR:
     return NULL;
 }
 
+// get the numeric value of the size in the TIFF data (0: not in 32 bits)
+static int getTiffValue(const unsigned char *p, int size, unsigned short type,
+                        unsigned int *pVal)
+{
+    unsigned long long ull;
+    int le = dataIsLittleEndian();
+
+    if (size == sizeof(char)) {
+        *pVal = p[0];
+    } else if (size == sizeof(short)) {
+        *pVal = getShortInSegment(p, le);
+    } else if (size == sizeof(int)) {
+        *pVal = getIntInSegment(p, le);
+    } else {
+        ull = getInt64InSegment(p, le);
+        if (type == TYPE_SLONG8) {
+            // sign-extended 32-bit value
+            if (ull + 0x80000000ULL > 0xFFFFFFFFULL) {
+                return 0;
+            }
+        } else if (ull > 0xFFFFFFFFULL) {
+            return 0;
+        }
+        *pVal = (unsigned int)ull;
+    }
+    return 1;
+}
+
 
 void setDefaultApp1SegmentHader()
 {
@@ -2640,6 +11687,7 @@ static int init(FILE *fp)
 {
     int sts, dqtOffset = -1;;
     setDefaultApp1SegmentHader();
+    memset(&TiffFile, 0, sizeof(TiffFile));
     // get the offset of the Exif segment
     sts = getApp1StartOffset(fp, EXIF_ID_STR, EXIF_ID_STR_LEN, &dqtOffset);
     if (sts < 0) { // error
@@ -2657,6 +11705,64 @@ static int init(FILE *fp)
     return 1;
 }
 
+/**
+ * Initialize to read the TIFF file in the same way as the Exif segment
+ *
+ * return
+ *   1: OK
+ *  -n: error
+ *      ERR_INVALID_JPEG: not a TIFF file
+ *
+ * note
+ * Both of the classic TIFF (0x002A) and BigTIFF (0x002B) are accepted.
+ */
+static int initTiffFile(FILE *fp)
+{
+    unsigned char buf[16];
+    long long size;
+    int le;
+
+    setDefaultApp1SegmentHader();
+    memset(&TiffFile, 0, sizeof(TiffFile));
+    if (fseeko(fp, 0, SEEK_END) != 0 || (size = (long long)ftello(fp)) < 0 ||
+        fseeko(fp, 0, SEEK_SET) != 0) {
+        return ERR_READ_FILE;
+    }
+    if (size < (long long)sizeof(TIFF_HEADER) ||
+        fread(buf, 1, sizeof(TIFF_HEADER), fp) < sizeof(TIFF_HEADER)) {
+        return ERR_INVALID_JPEG;
+    }
+    if (memcmp(buf, "II", 2) != 0 && memcmp(buf, "MM", 2) != 0) {
+        return ERR_INVALID_JPEG;
+    }
+    le = (buf[0] == 'I') ? 1 : 0;
+    memcpy(&App1Header.tiff.byteOrder, buf, sizeof(short));
+    App1Header.tiff.reserved = getShortInSegment(buf + 2, le);
+    if (App1Header.tiff.reserved == 0x002A) {
+        App1Header.tiff.Ifd0thOffset = getIntInSegment(buf + 4, le);
+        TiffFile.ifd0thOffset = App1Header.tiff.Ifd0thOffset;
+    } else if (App1Header.tiff.reserved == 0x002B) {
+        // BigTIFF: the byte size of the offsets (8), reserved (0)
+        // and the 64-bit offset of the 0th IFD
+        if (size < (long long)sizeof(buf) ||
+            fread(buf + sizeof(TIFF_HEADER), 1, sizeof(buf) - sizeof(TIFF_HEADER), fp)
+                < sizeof(buf) - sizeof(TIFF_HEADER) ||
+            getShortInSegment(buf + 4, le) != 8 ||
+            getShortInSegment(buf + 6, le) != 0) {
+            return ERR_INVALID_JPEG;
+        }
+        TiffFile.ifd0thOffset = getInt64InSegment(buf + 8, le);
+        TiffFile.big = 1;
+    } else {
+        return ERR_INVALID_JPEG;
+    }
+    // the offsets are from the top of the file
+    App1StartOffset = -(int)offsetof(APP1_HEADER, tiff);
+    JpegDQTOffset = -1;
+    TiffFile.length = (unsigned long long)size;
+    return 1;
+}
+
 static void PRINTF(char **ms, const char *fmt, ...) {
     char buf[4096];
     char *p = NULL;
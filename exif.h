@@ -64,7 +64,10 @@ typedef enum {
     IFD_1ST,
     IFD_EXIF,
     IFD_GPS,
-    IFD_IO
+    IFD_IO,
+    IFD_MAKERNOTE,
+    IFD_SUB, // SubIFDs of the TIFF file
+    IFD_NTH  // IFDs after the 1st IFD in the TIFF file
 } IFD_TYPE;
 
 // Tag Type
@@ -130,6 +133,8 @@ struct _tagNodeInfo {
 #define ERR_ALREADY_EXIST       -11
 #define ERR_UNKNOWN             -12
 #define ERR_MEMALLOC            -13
+#define ERR_VERIFY_FAILED       -14
+#define ERR_INVALID_SIDECAR     -15
 
 // public funtions
 
@@ -143,6 +148,105 @@ struct _tagNodeInfo {
  */
 void setVerbose(int v);
 
+/**
+ * setBatchThreads()
+ *
+ * Set the number of the worker threads used by the batch functions
+ *
+ * parameters
+ *  [in] n : number of the threads (1=process the files sequentially)
+ */
+void setBatchThreads(int n);
+
+/**
+ * setCloneOutput()
+ *
+ * Clone the original JPEG file to create the output file on/off
+ *
+ * parameters
+ *  [in] v : 1=on  0=off
+ *
+ * note
+ * If the size of the Exif segment is not changed, the output file is
+ * created as a clone of the original file (reflink on Linux) and only
+ * the Exif segment is written to it.
+ * updateExifSegmentInJPEGFile() keeps the size if each changed value is
+ * not larger than the original one and no tag is added, since the values
+ * and the IFD tables are overwritten in place.
+ */
+void setCloneOutput(int v);
+
+// callback of setDurableOutput()
+typedef void (*DURABLE_CALLBACK)(const char **fileNames, int count,
+                                 int result, void *userData);
+
+/**
+ * setDurableOutput()
+ *
+ * Make the output files of the batch functions durable before returning
+ *
+ * parameters
+ *  [in] groupSize : number of the files synced at once (0=off)
+ *  [in] callback : (optional) function called when a group is durable
+ *  [in] userData : passed to the callback
+ *
+ * note
+ * The rewritten files are written to the new temporary files
+ * ("name.<pid>.<thread id>.<n>.tmp")
+ * and renamed after the whole group is synced (syncfs() for each file
+ * system on Linux, fsync() of the files in parallel on the others).
+ * The parent directories of the renamed files are synced once per
+ * group. The files updated in place are synced with the group.
+ * The callback receives the file names of the group and 0 or the error
+ * code, and may be called from the worker threads at the same time.
+ * If the group fails to be durable, the result of each file in it is
+ * ERR_WRITE_FILE.
+ * This affects shiftDateTimeInJPEGFiles() and
+ * updateTagDataInJPEGFilesFromManifest().
+ */
+void setDurableOutput(int groupSize, DURABLE_CALLBACK callback,
+                      void *userData);
+
+/**
+ * setVerifyOutput()
+ *
+ * Verify the Exif segment before writing it on/off
+ *
+ * parameters
+ *  [in] v : 1=on  0=off
+ *
+ * note
+ * The serialized segment is parsed on memory and compared with the IFD
+ * tables tag by tag, and the offsets of the IFDs and the thumbnail are
+ * checked. updateExifSegmentInJPEGFile() and
+ * updateExifSegmentInJPEGFileInPlace() return ERR_VERIFY_FAILED without
+ * writing the segment if they don't match.
+ */
+void setVerifyOutput(int v);
+
+// byte orders for setOutputByteOrder()
+#define OUTPUT_BYTE_ORDER_KEEP   0
+#define OUTPUT_BYTE_ORDER_LITTLE 1
+#define OUTPUT_BYTE_ORDER_BIG    2
+#define OUTPUT_BYTE_ORDER_HOST   3
+
+/**
+ * setOutputByteOrder()
+ *
+ * Set the byte order of the Exif segment written by the update functions
+ *
+ * parameters
+ *  [in] order : OUTPUT_BYTE_ORDER_KEEP (same as the original file),
+ *               OUTPUT_BYTE_ORDER_LITTLE, OUTPUT_BYTE_ORDER_BIG or
+ *               OUTPUT_BYTE_ORDER_HOST
+ *
+ * note
+ * If the byte order is changed, the whole segment is rebuilt and all
+ * the numeric values and offsets are converted. The data of the
+ * UNDEFINED type (e.g. MakerNote) is written as it is.
+ */
+void setOutputByteOrder(int order);
+
 /**
  * removeExifSegmentFromJPEGFile()
  *
@@ -183,6 +287,27 @@ int removeExifSegmentFromJPEGFile(const char *inJPEGFileName,
  * return
  *   NULL: error or no Exif segment
  *  !NULL: pointer array of the IFD tables
+ *
+ * note
+ * The TIFF-structured file (e.g. DNG, CR2, NEF, ARW) is also accepted.
+ * The IFDs after the 1st IFD in its chain are read as IFD_NTH tables,
+ * and the SubIFDs of the IFDs in the chain as IFD_SUB tables. Only the
+ * IFDs and the tag values are read, and the image data including the
+ * thumbnail of the 1st IFD are not read.
+ * The IFD tables of the TIFF file can't be written to the file, but
+ * the tags can be copied to the Exif segment of JPEG. The tags locating
+ * the data in the TIFF file (StripOffsets, StripByteCounts, TileOffsets,
+ * TileByteCounts, SubIFDs, and JPEGInterchangeFormat and its length
+ * without the thumbnail data) are dropped when the segment is written,
+ * and all the other tags are written as they are.
+ * The IFDs in the chain of the TIFF file (e.g. the pages of the scanned
+ * document) are decoded by the threads set by setBatchThreads(), each
+ * reading the file with its own file pointer. The chain is walked first
+ * reading only the tag count and the next offset of each IFD, and it stops
+ * at the circular chain with ERR_INVALID_IFD.
+ * BigTIFF with the 64-bit offsets is accepted in the same way. The values
+ * of the LONG8, SLONG8 and IFD8 types are read as LONG or SLONG, and the
+ * tag is treated as an error if a value doesn't fit in 32 bits.
  */
 void **createIfdTableArray(const char *JPEGFileName, int *result);
 
@@ -242,6 +367,9 @@ void dumpIfdTableArray(void **ifdArray);
  * return
  *   NULL: tag is not found
  *  !NULL: address of the TagNodeInfo structure
+ *
+ * note
+ * IFD_MAKERNOTE gets the tag in the MakerNote (see getMakerNoteVendor()).
  */
 TagNodeInfo *getTagInfo(void **ifdArray,
                        IFD_TYPE ifdType,
@@ -290,6 +418,28 @@ int queryTagNodeIsExist(void **ifdTableArray,
                         IFD_TYPE ifdType,
                         unsigned short tagId);
 
+/**
+ * queryTagNodesExist()
+ *
+ * Query if each of the specified tag nodes is exist in the IFD table
+ *
+ * parameters
+ *  [in] ifdTableArray: address of the IFD tables array
+ *  [in] ifdType : target IFD type
+ *  [in] tagIds : array of the target tag IDs
+ *  [in] count : number of the tag IDs
+ *  [out] results : (optional) array to receive 1 (exist) or 0 (not exist)
+ *                  for each tag ID
+ *
+ * return
+ *  number of the existing tags (count if all of them exist)
+ */
+int queryTagNodesExist(void **ifdTableArray,
+                       IFD_TYPE ifdType,
+                       const unsigned short *tagIds,
+                       int count,
+                       int *results);
+
 /**
  * createTagInfo()
  *
@@ -341,6 +491,7 @@ int removeIfdTableFromIfdTableArray(void **ifdTableArray, IFD_TYPE ifdType);
  *   0: OK
  *  -n: error
  *      ERR_INVALID_POINTER
+ *      ERR_INVALID_IFD
  *      ERR_ALREADY_EXIST
  *      ERR_MEMALLOC
  *
@@ -470,7 +621,16 @@ void getIfdTableDump(void *pIfd, char **pp);
  *      ERR_INVALID_JPEG
  *      ERR_INVALID_APP1HEADER
  *      ERR_INVALID_POINTER
+ *      ERR_VERIFY_FAILED
  *      ERROR_UNKNOWN:
+ *
+ * note
+ * If the IFD tables are created by createIfdTableArray(), the original
+ * data of the unmodified IFD tables and tag values are written as they
+ * are. The modified IFD tables are rewritten at the original offset, or
+ * appended to the segment only if they have grown.
+ * The whole segment is rebuilt if an IFD table is added or removed, or
+ * the segment would be too large.
  */
 int updateExifSegmentInJPEGFile(const char *inJPEGFileName,
                                 const char *outJPGEFileName,
@@ -499,6 +659,929 @@ void getIfdTableDump(void *pIfd, char **pp);
 int removeAdobeMetadataSegmentFromJPEGFile(const char *inJPEGFileName,
                                            const char *outJPGEFileName);
 
+/**
+ * removeGPSIfdFromJPEGFileInPlace()
+ *
+ * Remove the GPS IFD from a JPEG file without rewriting the file
+ *
+ * parameters
+ *  [in] JPEGFileName : target JPEG file (overwritten)
+ *
+ * return
+ *   1: OK
+ *   0: the Exif segment or the GPS IFD is not found
+ *  -n: error
+ *      ERR_READ_FILE
+ *      ERR_WRITE_FILE
+ *      ERR_INVALID_JPEG
+ *      ERR_INVALID_APP1HEADER
+ *      ERR_INVALID_IFD
+ *      ERR_MEMALLOC
+ *
+ * note
+ * The bytes of the GPS IFD and its values are cleared with zero, and
+ * the GPSInfoIFDPointer tag is removed from the 0th IFD by shifting the
+ * following tag fields and the offset of the next IFD up by a field.
+ * The 12 bytes freed at the end of the 0th IFD are cleared with zero.
+ * The size of the Exif segment and the offsets of the other data are
+ * not changed, so calling this function again for the same file simply
+ * returns 0.
+ */
+int removeGPSIfdFromJPEGFileInPlace(const char *JPEGFileName);
+
+/**
+ * updateTagDataInJPEGFileInPlace()
+ *
+ * Overwrite the value of the existing tag in a JPEG file without
+ * rewriting the file
+ *
+ * parameters
+ *  [in] JPEGFileName : target JPEG file (overwritten)
+ *  [in] ifdType : target IFD type
+ *  [in] tagNodeInfo : address of the TagNodeInfo holding the new value
+ *
+ * return
+ *   1: OK
+ *   0: the Exif segment is not found
+ *  -n: error
+ *      ERR_READ_FILE
+ *      ERR_WRITE_FILE
+ *      ERR_INVALID_JPEG
+ *      ERR_INVALID_APP1HEADER
+ *      ERR_INVALID_IFD
+ *      ERR_INVALID_ID      : the tag holds an offset to other data
+ *      ERR_INVALID_TYPE    : the type differs from the existing tag
+ *      ERR_INVALID_COUNT   : the count differs from the existing tag
+ *      ERR_INVALID_POINTER
+ *      ERR_NOT_EXIST       : the IFD or the tag is not found
+ *      ERR_MEMALLOC
+ *
+ * note
+ * Only the value whose size is not changed can be updated by this
+ * function. The value is written in the byte order of the file.
+ */
+int updateTagDataInJPEGFileInPlace(const char *JPEGFileName,
+                                   IFD_TYPE ifdType,
+                                   TagNodeInfo *tagNodeInfo);
+
+// flags for shiftDateTimeInJPEGFile()
+#define SHIFT_DATETIME_GPS       0x0001
+#define SHIFT_DATETIME_DRYRUN    0x0002
+
+/**
+ * shiftDateTimeInJPEGFile()
+ *
+ * Shift the date and time tags in a JPEG file by the specified seconds
+ *
+ * parameters
+ *  [in] JPEGFileName : target JPEG file (overwritten)
+ *  [in] seconds : seconds to add (negative value to go back)
+ *  [in] flags : combination of the following values
+ *      SHIFT_DATETIME_GPS    : also shift GPSDateStamp and GPSTimeStamp
+ *      SHIFT_DATETIME_DRYRUN : only report, do not modify the file
+ *  [in] make : target Make string, or NULL for any camera
+ *  [in] model : target Model string, or NULL for any camera
+ *  [in] serial : target BodySerialNumber string, or NULL for any camera
+ *  [in] reportFileName : file to write the shifted values,
+ *                        or NULL to write to stdout
+ *
+ * return
+ *   n: number of the shifted tags
+ *   0: the Exif segment or the tags are not found, or the camera
+ *      does not match
+ *  -n: error
+ *      ERR_READ_FILE
+ *      ERR_WRITE_FILE
+ *      ERR_INVALID_JPEG
+ *      ERR_INVALID_APP1HEADER
+ *      ERR_INVALID_IFD
+ *      ERR_MEMALLOC
+ *
+ * note
+ * DateTime, DateTimeOriginal and DateTimeDigitized are updated in place
+ * as the values keep their length. Only if the value is shorter than
+ * the standard format, the whole file is rewritten.
+ * The report has a line for each shifted tag in dry-run mode (or if
+ * setVerbose() is on):
+ *   "[path] name: old value -> new value"
+ */
+int shiftDateTimeInJPEGFile(const char *JPEGFileName,
+                            long seconds,
+                            int flags,
+                            const char *make,
+                            const char *model,
+                            const char *serial,
+                            const char *reportFileName);
+
+/**
+ * shiftDateTimeInJPEGFiles()
+ *
+ * Shift the date and time tags in the JPEG files by the specified seconds
+ *
+ * parameters
+ *  [in] JPEGFileNames : array of the target JPEG files
+ *  [in] count : number of the files
+ *  [in] seconds, flags, make, model, serial :
+ *       same as shiftDateTimeInJPEGFile()
+ *  [out] results : (optional) array to receive the result of each file.
+ *                  see shiftDateTimeInJPEGFile()
+ *  [in] reportFileName : file to write the shifted values,
+ *                        or NULL to write to stdout
+ *
+ * return
+ *   n: number of the files which have the shifted tags
+ *  -n: error
+ *      ERR_WRITE_FILE
+ *      ERR_MEMALLOC
+ *
+ * note
+ * The files are processed by the threads set by setBatchThreads(), and
+ * the report is written in the order of the files.
+ */
+int shiftDateTimeInJPEGFiles(const char **JPEGFileNames,
+                             int count,
+                             long seconds,
+                             int flags,
+                             const char *make,
+                             const char *model,
+                             const char *serial,
+                             int *results,
+                             const char *reportFileName);
+
+/**
+ * updateTagDataInJPEGFilesFromManifest()
+ *
+ * Update the tags in the JPEG files listed in the manifest file
+ *
+ * parameters
+ *  [in] manifestFileName : manifest file (CSV)
+ *  [in] reportFileName : file to write the result of each JPEG file,
+ *                        or NULL to write to stdout
+ *
+ * return
+ *   n: number of the successfully updated JPEG files
+ *  -n: error
+ *      ERR_READ_FILE  : failed to read the manifest file
+ *      ERR_WRITE_FILE : failed to create the report file
+ *      ERR_MEMALLOC
+ *
+ * note
+ * Each line of the manifest is "path,ifd,tag,type,value".
+ *   ifd   : 0th, 1st, exif, gps or io
+ *   tag   : tag ID (e.g. 0x8298)
+ *   type  : byte, ascii, short, long, rational, sbyte, undefined,
+ *           sshort, slong, srational or the type number
+ *   value : string for ascii and undefined. numbers separated by spaces
+ *           for the others ("n/d" for rational)
+ * The path and the value can be quoted with '"'. Empty lines and
+ * lines beginning with '#' are ignored.
+ * The edits are grouped per JPEG file. All the edits of a file are
+ * checked before writing. The values are overwritten in place if none
+ * of their sizes is changed, otherwise the file is rewritten once with
+ * all the edits, so that a failed file keeps none of them (except for
+ * a write error in the middle of the in-place update).
+ * Lines of any length are accepted. The files are processed by the
+ * threads set by setBatchThreads().
+ * The report has a line for each JPEG file:
+ *   "path<TAB>OK<TAB>in-place=n<TAB>rewritten=n"
+ *   "path<TAB>ERROR(n)<TAB>line=n"
+ */
+int updateTagDataInJPEGFilesFromManifest(const char *manifestFileName,
+                                         const char *reportFileName);
+
+/**
+ * getExifSegmentFromJPEGFile()
+ *
+ * Get a copy of the raw Exif segment (APP1) in a JPEG file
+ *
+ * parameters
+ *  [in] JPEGFileName : target JPEG file
+ *  [out] pLength : returns the length of the segment
+ *  [out] pResult : result status
+ *   0: OK
+ *  -n: error
+ *      ERR_READ_FILE
+ *      ERR_INVALID_JPEG
+ *      ERR_INVALID_APP1HEADER
+ *      ERR_INVALID_POINTER
+ *      ERR_NOT_EXIST
+ *      ERR_MEMALLOC
+ *
+ * return
+ *  NULL: error
+ * !NULL: the segment data from the APP1 marker (0xFFE1)
+ *
+ * note
+ * The segment is not parsed and the data is returned as it is in the file.
+ * The caller must free it.
+ */
+unsigned char *getExifSegmentFromJPEGFile(const char *JPEGFileName,
+                                          unsigned int *pLength,
+                                          int *pResult);
+
+/**
+ * insertExifSegmentToJPEGFile()
+ *
+ * Insert the raw Exif segment (APP1) to a JPEG file
+ *
+ * parameters
+ *  [in] inJPEGFileName : original JPEG file
+ *  [in] outJPGEFileName : output JPEG file
+ *  [in] segment : the segment data from the APP1 marker (0xFFE1)
+ *  [in] length : length of the segment data
+ *
+ * return
+ *   1: OK
+ *  -n: error
+ *      ERR_READ_FILE
+ *      ERR_WRITE_FILE
+ *      ERR_INVALID_JPEG
+ *      ERR_INVALID_APP1HEADER
+ *      ERR_INVALID_POINTER
+ *
+ * note
+ * The Exif segment of the original JPEG file is replaced if it exists.
+ * The segment data is written as it is, without parsing and rebuilding
+ * the IFD tables. Use getExifSegmentFromJPEGFile() to get the segment
+ * from another JPEG file.
+ */
+int insertExifSegmentToJPEGFile(const char *inJPEGFileName,
+                                const char *outJPGEFileName,
+                                const unsigned char *segment,
+                                unsigned int length);
+
+// flags for transformExifSegment()
+#define TRANSFORM_EXIF_DROP_THUMBNAIL 0x0001
+
+/**
+ * transformExifSegment()
+ *
+ * Update the raw Exif segment for the derivative image (e.g. resized JPEG)
+ *
+ * parameters
+ *  [in/out] segment : the segment data from the APP1 marker (0xFFE1)
+ *  [in/out] pLength : length of the segment data
+ *  [in] width : new PixelXDimension (0=not changed)
+ *  [in] height : new PixelYDimension (0=not changed)
+ *  [in] flags : combination of the following values
+ *      TRANSFORM_EXIF_DROP_THUMBNAIL : remove the 1st IFD and the thumbnail
+ *
+ * return
+ *   1: OK
+ *  -n: error
+ *      ERR_INVALID_POINTER
+ *      ERR_INVALID_APP1HEADER
+ *      ERR_INVALID_IFD
+ *
+ * note
+ * The segment is updated on memory without rebuilding the IFD tables.
+ * PixelXDimension and PixelYDimension are updated only if they exist.
+ * When the thumbnail is dropped, the length is reduced if the 1st IFD
+ * and the thumbnail are placed after the other IFDs, otherwise they are
+ * cleared with zero.
+ * ERR_INVALID_IFD is returned if the pointers to the IFDs are circular.
+ */
+int transformExifSegment(unsigned char *segment,
+                         unsigned int *pLength,
+                         unsigned int width,
+                         unsigned int height,
+                         int flags);
+
+
+/**
+ * updateExifSegmentInJPEGFileInPlace()
+ *
+ * Update the Exif segment in a JPEG file without creating a new file
+ *
+ * parameters
+ *  [in] JPEGFileName : target JPEG file (overwritten)
+ *  [in] ifdTableArray : address of the IFD tables array
+ *
+ * return
+ *   1: OK
+ *  -n: error
+ *      ERR_READ_FILE
+ *      ERR_WRITE_FILE
+ *      ERR_INVALID_JPEG
+ *      ERR_INVALID_APP1HEADER
+ *      ERR_INVALID_POINTER
+ *      ERR_MEMALLOC
+ *      ERR_VERIFY_FAILED
+ *      ERROR_UNKNOWN:
+ *
+ * note
+ * If the new segment is larger than the old one, the space is inserted
+ * with fallocate(FALLOC_FL_INSERT_RANGE) on Linux and the alignment slack
+ * is kept in a padding segment (APP15) for the later updates. If it is
+ * not supported, the rest of the file is shifted with a fixed size buffer.
+ * The file may be broken if the process is interrupted while shifting.
+ */
+int updateExifSegmentInJPEGFileInPlace(const char *JPEGFileName,
+                                       void **ifdTableArray);
+
+/**
+ * validateJPEGFile()
+ *
+ * Check the structure of a JPEG file and its Exif segment
+ *
+ * parameters
+ *  [in] JPEGFileName : target JPEG file
+ *  [out] pReason : (optional) receives the description of the first
+ *                  failed check ("OK" if valid). must not be freed
+ *
+ * return
+ *   1: valid (the Exif segment is found)
+ *   0: valid (the Exif segment is not found)
+ *  -n: error
+ *      ERR_READ_FILE
+ *      ERR_INVALID_JPEG
+ *      ERR_INVALID_APP1HEADER
+ *      ERR_INVALID_IFD
+ *
+ * note
+ * The SOI marker, the markers in front of the Exif segment, the APP1
+ * header and the entries of the 0th, Exif, GPS, Interoperability and
+ * 1st IFDs are checked to be in the segment. No memory is allocated
+ * and no tag node is created, so this is much cheaper than
+ * createIfdTableArray().
+ */
+int validateJPEGFile(const char *JPEGFileName, const char **pReason);
+
+/**
+ * createStringPool()
+ *
+ * Create the pool to share the ASCII tag values
+ *
+ * return
+ *  the pool, or NULL if failed to allocate
+ */
+void *createStringPool(void);
+
+/**
+ * freeStringPool()
+ *
+ * Free the pool created by createStringPool()
+ *
+ * parameters
+ *  [in] pool : the pool
+ *
+ * note
+ * The IFD tables and the TagNodeInfo created while the pool is set by
+ * setStringPool() must be freed before.
+ */
+void freeStringPool(void *pool);
+
+/**
+ * setStringPool()
+ *
+ * Set the pool to share the ASCII tag values
+ *
+ * parameters
+ *  [in] pool : the pool (NULL=off)
+ *
+ * note
+ * While the pool is set, the ASCII values of the tag nodes created by
+ * the library (e.g. by createIfdTableArray()) are interned in the pool,
+ * so the same strings share the storage across the files. The pool can
+ * be used by multiple threads at the same time.
+ * The interned values must not be modified. The values of TagNodeInfo
+ * created by createTagInfo() are not interned.
+ */
+void setStringPool(void *pool);
+
+/**
+ * getTagValueCode()
+ *
+ * Get the dictionary code of the interned ASCII value of the tag
+ *
+ * parameters
+ *  [in] tag : target TagNodeInfo
+ *
+ * return
+ *  n: the code (the index of the string in the pool)
+ *  -1: the value is not interned
+ */
+int getTagValueCode(TagNodeInfo *tag);
+
+/**
+ * getStringPoolValue()
+ *
+ * Get the string of the dictionary code
+ *
+ * parameters
+ *  [in] pool : the pool
+ *  [in] code : the code returned by getTagValueCode()
+ *  [out] pLength : (optional) length of the value (the count of the tag)
+ *
+ * return
+ *  the value, or NULL if the code is invalid
+ */
+const unsigned char *getStringPoolValue(void *pool, int code,
+                                        unsigned int *pLength);
+
+/**
+ * getStringPoolCount()
+ *
+ * Get the number of the strings in the pool (the codes are 0 to n-1)
+ *
+ * parameters
+ *  [in] pool : the pool
+ */
+int getStringPoolCount(void *pool);
+
+// flags for minifyExifSegmentInJPEGFile()
+#define MINIFY_REMOVE_THUMBNAIL 0x0001
+#define MINIFY_REMOVE_INTEROP   0x0002
+#define MINIFY_ESSENTIAL_ONLY   0x0004
+
+/**
+ * minifyExifSegmentInJPEGFile()
+ *
+ * Rewrite the Exif segment of a JPEG file into the smallest one
+ *
+ * parameters
+ *  [in] inJPEGFileName : original JPEG file
+ *  [in] outJPEGFileName : output JPEG file, or NULL to overwrite the
+ *                         original file
+ *  [in] flags : combination of the following values
+ *      MINIFY_REMOVE_THUMBNAIL : remove the 1st IFD and the thumbnail
+ *      MINIFY_REMOVE_INTEROP   : remove the Interoperability IFD
+ *      MINIFY_ESSENTIAL_ONLY   : remove all the tags except the essential
+ *                                ones
+ *  [in] keepTagIds : the essential tag IDs, or NULL for the default set
+ *                    (Make, Model, Orientation, the resolutions,
+ *                    DateTime, DateTimeOriginal and the tags required
+ *                    by the Exif standard)
+ *  [in] keepCount : number of keepTagIds
+ *  [out] pSavedBytes : (optional) the decrease of the file size
+ *
+ * return
+ *   1: OK
+ *   0: the Exif segment is not found (the file is not written)
+ *  -n: error
+ *      ERR_READ_FILE
+ *      ERR_WRITE_FILE
+ *      ERR_INVALID_JPEG
+ *      ERR_INVALID_APP1HEADER
+ *      ERR_INVALID_IFD
+ *      ERR_MEMALLOC
+ *      ERR_VERIFY_FAILED
+ *
+ * note
+ * The tags with the error and the tags with an empty value (an ASCII
+ * string of spaces, UNDEFINED data of zeros or a UserComment without
+ * the text) are removed, unless they are essential. The empty ASCII
+ * value of an essential tag is shortened to a null character. The
+ * IFDs left empty and their pointer tags are removed, and the whole
+ * segment is rebuilt without the unused area.
+ */
+int minifyExifSegmentInJPEGFile(const char *inJPEGFileName,
+                                const char *outJPEGFileName,
+                                int flags,
+                                const unsigned short *keepTagIds,
+                                int keepCount,
+                                long *pSavedBytes);
+
+/**
+ * minifyExifSegmentInJPEGFiles()
+ *
+ * Rewrite the Exif segments of the JPEG files into the smallest ones
+ *
+ * parameters
+ *  [in] inJPEGFileNames : array of the original JPEG files
+ *  [in] outJPEGFileNames : array of the output JPEG files, or NULL to
+ *                          overwrite the original files
+ *  [in] count : number of the files
+ *  [in] flags, keepTagIds, keepCount : same as minifyExifSegmentInJPEGFile()
+ *  [in] reportFileName : file to write the result of each JPEG file,
+ *                        or NULL to write to stdout
+ *
+ * return
+ *   n: number of the minified JPEG files
+ *  -n: error
+ *      ERR_WRITE_FILE : failed to create the report file
+ *      ERR_MEMALLOC
+ *
+ * note
+ * The files are processed by the threads set by setBatchThreads().
+ * The report has a line for each JPEG file and the total:
+ *   "path<TAB>OK<TAB>saved=n"
+ *   "path<TAB>NO-EXIF"
+ *   "path<TAB>ERROR(n)"
+ *   "total<TAB>files=n<TAB>saved=n"
+ */
+int minifyExifSegmentInJPEGFiles(const char **inJPEGFileNames,
+                                 const char **outJPEGFileNames,
+                                 int count,
+                                 int flags,
+                                 const unsigned short *keepTagIds,
+                                 int keepCount,
+                                 const char *reportFileName);
+
+/**
+ * splitExifSegmentToSidecar()
+ *
+ * Move the Exif segment of a JPEG file into a sidecar file
+ *
+ * parameters
+ *  [in] inJPEGFileName : original JPEG file
+ *  [in] outJPEGFileName : output JPEG file without the Exif segment
+ *  [in] sidecarFileName : output sidecar file
+ *
+ * return
+ *   1: OK
+ *   0: the Exif segment is not found (the files are not written)
+ *  -n: error
+ *      ERR_READ_FILE
+ *      ERR_WRITE_FILE
+ *      ERR_INVALID_JPEG
+ *      ERR_INVALID_APP1HEADER
+ *      ERR_MEMALLOC
+ *
+ * note
+ * The sidecar has a small header (the offset of the segment in the
+ * original file, the size and the identity of the output JPEG file)
+ * followed by the raw segment data. The image data is copied in the
+ * kernel by copy_file_range() if possible.
+ */
+int splitExifSegmentToSidecar(const char *inJPEGFileName,
+                              const char *outJPEGFileName,
+                              const char *sidecarFileName);
+
+/**
+ * joinExifSegmentFromSidecar()
+ *
+ * Put the Exif segment in the sidecar file back to the JPEG file
+ *
+ * parameters
+ *  [in] inJPEGFileName : JPEG file created by splitExifSegmentToSidecar()
+ *  [in] sidecarFileName : sidecar file created by splitExifSegmentToSidecar()
+ *  [in] outJPEGFileName : output JPEG file
+ *
+ * return
+ *   1: OK
+ *  -n: error
+ *      ERR_READ_FILE
+ *      ERR_WRITE_FILE
+ *      ERR_INVALID_SIDECAR : the sidecar is broken or not for the JPEG file
+ *      ERR_MEMALLOC
+ *
+ * note
+ * The segment is inserted at the original position without parsing, so
+ * the output is the same as the original file byte for byte.
+ */
+int joinExifSegmentFromSidecar(const char *inJPEGFileName,
+                               const char *sidecarFileName,
+                               const char *outJPEGFileName);
+
+// length of the key of splitExifSegmentToStore()
+#define EXIF_STORE_KEY_LEN 16
+
+/**
+ * splitExifSegmentToStore()
+ *
+ * Move the Exif segment of a JPEG file into the content-addressed store
+ *
+ * parameters
+ *  [in] inJPEGFileName : original JPEG file
+ *  [in] outJPEGFileName : output JPEG file without the Exif segment
+ *  [in] storeDirName : directory of the store (must exist)
+ *  [in] referenceFileName : output file which refers to the segment
+ *  [out] key : (optional) buffer to receive the key of the segment in
+ *              the store (EXIF_STORE_KEY_LEN + 1 bytes)
+ *
+ * return
+ *   2: OK (the same segment already exists in the store)
+ *   1: OK (the segment is added to the store)
+ *   0: the Exif segment is not found (the files are not written)
+ *  -n: error
+ *      ERR_READ_FILE
+ *      ERR_WRITE_FILE
+ *      ERR_INVALID_JPEG
+ *      ERR_INVALID_APP1HEADER
+ *      ERR_MEMALLOC
+ *
+ * note
+ * The segment is stored as "<storeDirName>/<key>", where the key is the
+ * XXH64 hash of the segment data in hexadecimal. It is written only
+ * once for the files which have the same segment. The data of the
+ * existing segment is compared, and it is replaced if it differs. The
+ * output JPEG file is written after the segment is stored. The reference
+ * file is a sidecar without the segment data (see
+ * splitExifSegmentToSidecar()) and has the key instead.
+ */
+int splitExifSegmentToStore(const char *inJPEGFileName,
+                            const char *outJPEGFileName,
+                            const char *storeDirName,
+                            const char *referenceFileName,
+                            char *key);
+
+/**
+ * joinExifSegmentFromStore()
+ *
+ * Put the Exif segment in the content-addressed store back to the JPEG file
+ *
+ * parameters
+ *  [in] inJPEGFileName : JPEG file created by splitExifSegmentToStore()
+ *  [in] referenceFileName : reference file created by splitExifSegmentToStore()
+ *  [in] storeDirName : directory of the store
+ *  [in] outJPEGFileName : output JPEG file
+ *
+ * return
+ *   1: OK
+ *  -n: error
+ *      ERR_READ_FILE
+ *      ERR_WRITE_FILE
+ *      ERR_INVALID_SIDECAR : the reference is broken or not for the JPEG
+ *                            file, or the segment in the store is broken
+ *      ERR_MEMALLOC
+ */
+int joinExifSegmentFromStore(const char *inJPEGFileName,
+                             const char *referenceFileName,
+                             const char *storeDirName,
+                             const char *outJPEGFileName);
+
+/**
+ * getImageHashOfJPEGFile()
+ *
+ * Get the hash of the image data of a JPEG file excluding the metadata
+ *
+ * parameters
+ *  [in] JPEGFileName : target JPEG file
+ *  [out] pHash : the XXH64 hash of the image data
+ *  [out] pIfdTableArray : (optional) receives the IFD tables array
+ *                         (see createIfdTableArray()), or NULL if the
+ *                         Exif segment is not found or broken
+ *
+ * return
+ *   1: OK
+ *  -n: error
+ *      ERR_READ_FILE
+ *      ERR_INVALID_JPEG
+ *      ERR_MEMALLOC
+ *
+ * note
+ * The marker segments are walked from SOI to EOI, and all of them
+ * except APPn and COM are hashed with the scan data. The files which
+ * differ only in the metadata have the same hash.
+ * The file is read only once for both the hash and the IFD tables.
+ */
+int getImageHashOfJPEGFile(const char *JPEGFileName,
+                           unsigned long long *pHash,
+                           void ***pIfdTableArray);
+
+/**
+ * getImageHashOfJPEGFiles()
+ *
+ * Get the hashes of the image data of the JPEG files excluding the metadata
+ *
+ * parameters
+ *  [in] JPEGFileNames : array of the target JPEG files
+ *  [in] count : number of the files
+ *  [out] hashes : array to receive the hash of each file
+ *  [out] ifdTableArrays : (optional) array to receive the IFD tables
+ *                         array of each file. see getImageHashOfJPEGFile()
+ *  [out] results : (optional) array to receive the result of each file.
+ *                  see getImageHashOfJPEGFile()
+ *
+ * return
+ *  number of the hashed files
+ *
+ * note
+ * The files are processed by the threads set by setBatchThreads().
+ */
+int getImageHashOfJPEGFiles(const char **JPEGFileNames,
+                            int count,
+                            unsigned long long *hashes,
+                            void ***ifdTableArrays,
+                            int *results);
+
+/**
+ * groupJPEGFilesByFingerprint()
+ *
+ * Group the JPEG files into the burst sequences and the likely duplicates
+ * by the fingerprint of the Exif
+ *
+ * parameters
+ *  [in] listFileName : file listing the paths of the target JPEG files,
+ *                      one path per line
+ *  [in] reportFileName : file to write the groups,
+ *                        or NULL to write to stdout
+ *  [in] burstGap : maximum interval of the shots in a burst sequence
+ *                  in msec (1000 if 0)
+ *
+ * return
+ *   n: number of the groups
+ *  -n: error
+ *      ERR_READ_FILE
+ *      ERR_WRITE_FILE
+ *      ERR_MEMALLOC
+ *
+ * note
+ * The fingerprint of a file consists of the camera (Make, Model and
+ * BodySerialNumber), the capture time (DateTimeOriginal and
+ * SubSecTimeOriginal), the settings (FocalLength and ExposureTime) and
+ * ImageUniqueID. The files without the Exif segment are ignored.
+ * The files of the same camera are "duplicates" if the capture time and
+ * the settings or ImageUniqueID are the same, and a "burst" if the
+ * capture times of the consecutive shots are within burstGap.
+ * The fingerprints are extracted and sorted by the threads set by
+ * setBatchThreads() in runs of a fixed number of files, and the runs
+ * are merged from a temporary file, so that the memory does not grow
+ * with the number of the files.
+ * The report has a line for each file of the groups:
+ *   "DUPLICATE<TAB>group<TAB>path"
+ *   "BURST<TAB>group<TAB>path"
+ * and the last line:
+ *   "total<TAB>files=n<TAB>bursts=n<TAB>duplicates=n"
+ */
+int groupJPEGFilesByFingerprint(const char *listFileName,
+                                const char *reportFileName,
+                                long burstGap);
+
+/**
+ * getTagStatisticsOfJPEGFiles()
+ *
+ * Get the statistics of the tags of the JPEG files
+ *
+ * parameters
+ *  [in] listFileName : file listing the paths of the target JPEG files,
+ *                      one path per line
+ *  [in] reportFileName : file to write the statistics,
+ *                        or NULL to write to stdout
+ *  [in] sampleRate : read 1 of n files at random, or 0 to read all files
+ *
+ * return
+ *   n: number of the files read
+ *  -n: error
+ *      ERR_READ_FILE
+ *      ERR_WRITE_FILE
+ *      ERR_MEMALLOC
+ *
+ * note
+ * The files are read by the threads set by setBatchThreads(). Each thread
+ * counts into its own partial statistics, and they are merged at the end.
+ * The number of the distinct values is estimated by HyperLogLog, and the
+ * percentiles of the sizes by a histogram of the logarithmic buckets
+ * (within 1/16 of the value).
+ * With the sample rate, the files are sampled with a fixed seed, and the
+ * percents estimate those of all the listed files. The distinct values
+ * are those of the sampled files.
+ * The report has the following lines:
+ *   "files<TAB>listed=n<TAB>read=n<TAB>exif=n<TAB>errors=n<TAB>sample=1/n"
+ *   "tag<TAB>ifd<TAB>tagId<TAB>name<TAB>count<TAB>percent"
+ *   "value<TAB>Make|Model|ExposureProgram<TAB>value<TAB>count<TAB>percent"
+ *   "distinct<TAB>Make|Model|ExposureProgram|Camera<TAB>n"
+ *   "size<TAB>Exif|Thumbnail|MakerNote<TAB>count=n<TAB>min=n<TAB>p50=n
+ *    <TAB>p90=n<TAB>p99=n<TAB>max=n"
+ * The percents are of the files with the Exif segment.
+ */
+int getTagStatisticsOfJPEGFiles(const char *listFileName,
+                                const char *reportFileName,
+                                unsigned int sampleRate);
+
+// kinds of the differences of diffIfdTableArrays()
+#define TAG_DIFF_ADDED   1 // the tag exists only in the second one
+#define TAG_DIFF_REMOVED 2 // the tag exists only in the first one
+#define TAG_DIFF_VALUE   3 // the value is changed
+#define TAG_DIFF_TYPE    4 // the type or the count is changed
+
+// a difference of the tags
+typedef struct {
+    IFD_TYPE ifdType;
+    unsigned short tagId;
+    int kind; // TAG_DIFF_xxx
+} TagDiffInfo;
+
+/**
+ * diffIfdTableArrays()
+ *
+ * Compare the tags of two IFD table arrays
+ *
+ * parameters
+ *  [in] ifdTableArrayA : the first IFD table array (NULL if no Exif)
+ *  [in] ifdTableArrayB : the second IFD table array (NULL if no Exif)
+ *  [out] pDiffs : (optional) receives the array of the differences.
+ *                 The caller must free it.
+ *
+ * return
+ *   n: number of the differences (0 if the same)
+ *  -n: error
+ *      ERR_MEMALLOC
+ *
+ * note
+ * The differences are sorted by the IFD type and the tag ID. The pointer
+ * tags (e.g. ExifIFDPointer) are not compared because their values
+ * depend on the layout, while the thumbnail data is compared as the
+ * value of JPEGInterchangeFormat. It is reported as added or removed if
+ * only one of them has the thumbnail data.
+ * If the IFD tables are not changed after parsing the same data, they
+ * are the same without comparing the tags.
+ */
+int diffIfdTableArrays(void **ifdTableArrayA,
+                       void **ifdTableArrayB,
+                       TagDiffInfo **pDiffs);
+
+/**
+ * diffExifSegmentOfJPEGFiles()
+ *
+ * Compare the tags of the Exif segments of two JPEG files
+ *
+ * parameters
+ *  [in] JPEGFileNameA : the first JPEG file
+ *  [in] JPEGFileNameB : the second JPEG file
+ *  [out] pDiffs : (optional) receives the array of the differences.
+ *                 The caller must free it.
+ *
+ * return
+ *   n: number of the differences (0 if the same)
+ *  -n: error
+ *      ERR_READ_FILE
+ *      ERR_INVALID_JPEG
+ *      ERR_INVALID_APP1HEADER
+ *      ERR_INVALID_IFD
+ *      ERR_MEMALLOC
+ *
+ * note
+ * If the raw bytes of the Exif segments are the same, the segments are
+ * not parsed. A file without the Exif segment has no tags.
+ * see diffIfdTableArrays()
+ */
+int diffExifSegmentOfJPEGFiles(const char *JPEGFileNameA,
+                               const char *JPEGFileNameB,
+                               TagDiffInfo **pDiffs);
+
+/**
+ * diffExifSegmentOfJPEGFilePairs()
+ *
+ * Compare the tags of the Exif segments of the pairs of the JPEG files
+ *
+ * parameters
+ *  [in] JPEGFileNamesA : array of the first JPEG file of each pair
+ *  [in] JPEGFileNamesB : array of the second JPEG file of each pair
+ *  [in] count : number of the pairs
+ *  [in] reportFileName : file to write the differences,
+ *                        or NULL to write to stdout
+ *
+ * return
+ *   n: number of the pairs which differ
+ *  -n: error
+ *      ERR_INVALID_POINTER
+ *      ERR_WRITE_FILE
+ *      ERR_MEMALLOC
+ *
+ * note
+ * The pairs are compared by the threads set by setBatchThreads(), and
+ * the report is written in the order of the pairs.
+ * The report has a line for each difference, or a line for the pair if
+ * there is no difference or an error:
+ *   "pathA<TAB>pathB<TAB>ADDED|REMOVED|VALUE|TYPE<TAB>ifd<TAB>tagId
+ *    <TAB>name<TAB>old value<TAB>new value"
+ *   "pathA<TAB>pathB<TAB>SAME"
+ *   "pathA<TAB>pathB<TAB>ERROR(n)"
+ * and the last line:
+ *   "total<TAB>pairs=n<TAB>same=n<TAB>diff=n<TAB>errors=n"
+ * The values of TYPE have the type and the count, e.g. "short[1] 6".
+ */
+int diffExifSegmentOfJPEGFilePairs(const char **JPEGFileNamesA,
+                                   const char **JPEGFileNamesB,
+                                   int count,
+                                   const char *reportFileName);
+
+// vendors of getMakerNoteVendor()
+#define MAKERNOTE_NONE     0 // no MakerNote, or the format is unknown
+#define MAKERNOTE_CANON    1
+#define MAKERNOTE_NIKON    2
+#define MAKERNOTE_SONY     3
+#define MAKERNOTE_FUJIFILM 4
+#define MAKERNOTE_OLYMPUS  5
+
+/**
+ * getMakerNoteVendor()
+ *
+ * Get the vendor of the MakerNote in the IFD tables array
+ *
+ * parameters
+ *  [in] ifdTableArray: address of the IFD tables array
+ *
+ * return
+ *  MAKERNOTE_xxx
+ *
+ * note
+ * The MakerNote tag of the Exif IFD is decoded as the IFD_MAKERNOTE
+ * table on the first call of this function, getTagInfo(),
+ * queryTagNodeIsExist() or queryTagNodesExist() with IFD_MAKERNOTE.
+ * The IFD-structured MakerNotes of Canon, Nikon, Sony, Fujifilm and
+ * Olympus are supported. The decoded table is read-only and is not
+ * included in the array, so it can't be updated nor written.
+ * The formats whose offsets are relative to the TIFF header (Canon,
+ * Sony, Olympus without the version) can be decoded only while the
+ * MakerNote tag is the same as the one in the file.
+ * The array must not be queried from multiple threads at the same time
+ * because the decoded table is cached in it.
+ */
+int getMakerNoteVendor(void **ifdTableArray);
+
 // Tag IDs
 // 0th IFD, 1st IFD, Exif IFD
 #define TAG_ImageWidth                   0x0100
@@ -518,6 +1601,8 @@ int removeAdobeMetadataSegmentFromJPEGFile(const char *inJPEGFileName,
 #define TAG_StripOffsets                 0x0111
 #define TAG_RowsPerStrip                 0x0116
 #define TAG_StripByteCounts              0x0117
+#define TAG_TileOffsets                  0x0144
+#define TAG_TileByteCounts               0x0145
 #define TAG_JPEGInterchangeFormat        0x0201
 #define TAG_JPEGInterchangeFormatLength  0x0202
 
@@ -537,6 +1622,7 @@ int removeAdobeMetadataSegmentFromJPEGFile(const char *inJPEGFileName,
 #define TAG_ExifIFDPointer               0x8769
 #define TAG_GPSInfoIFDPointer            0x8825
 #define TAG_InteroperabilityIFDPointer   0xA005
+#define TAG_SubIFDs                      0x014A
 
 #define TAG_Rating                       0x4746
 
@@ -657,4 +1743,20 @@ int removeAdobeMetadataSegmentFromJPEGFile(const char *inJPEGFileName,
 #define TAG_InteroperabilityIndex        0x0001
 #define TAG_InteroperabilityVersion      0x0002
 
+// MakerNote IFD (vendor specific)
+#define TAG_CanonFirmwareVersion         0x0007
+#define TAG_CanonOwnerName               0x0009
+#define TAG_CanonSerialNumber            0x000C
+#define TAG_CanonModelID                 0x0010
+#define TAG_CanonLensModel               0x0095
+#define TAG_NikonSerialNumber            0x001D
+#define TAG_NikonLensType                0x0083
+#define TAG_NikonLens                    0x0084
+#define TAG_NikonShutterCount            0x00A7
+#define TAG_SonyModelID                  0xB001
+#define TAG_SonyLensType                 0xB027
+#define TAG_FujifilmVersion              0x0000
+#define TAG_FujifilmSerialNumber         0x0010
+#define TAG_OlympusEquipment             0x2010
+
 #endif // _EXIF_H_
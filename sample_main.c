@@ -14,7 +14,7 @@
  * limitations under the License.
  *
  * gcc:
- * gcc -o exif sample_main.c exif.c
+ * gcc -o exif sample_main.c exif.c -lpthread -lm
  *
  * Microsoft Visual C++:
  * cl.exe /o exif sample_main.c exif.c
@@ -24,6 +24,8 @@
 #include <windows.h>
 #endif
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "exif.h"
 
@@ -33,6 +35,19 @@ int sample_removeSensitiveData(const char *srcJpgFileName, const char *outJpgFil
 int sample_queryTagExists(const char *srcJpgFileName);
 int sample_updateTagData(const char *srcJpgFileName, const char *outJpgFileName);
 int sample_saveThumbnail(const char *srcJpgFileName, const char *outFileName);
+int sample_removeGPSInPlace(const char *jpgFileName);
+int sample_shiftDateTime(const char *jpgFileName);
+int sample_updateFromManifest(const char *manifestFileName);
+int sample_transplantExif(const char *srcJpgFileName, const char *dstJpgFileName,
+                          const char *outJpgFileName);
+int sample_updateTagDataInPlace(const char *jpgFileName);
+int sample_validate(const char *jpgFileName);
+int sample_minify(const char *srcJpgFileName, const char *outJpgFileName);
+int sample_splitSidecar(const char *srcJpgFileName);
+int sample_diffExif(const char *srcJpgFileName, const char *otherJpgFileName);
+int sample_getMakerNote(const char *srcJpgFileName);
+int sample_splitStore(const char *srcJpgFileName);
+int sample_replaceDateTime(const char *srcJpgFileName, const char *outJpgFileName);
 
 // sample
 int main(int ac, char *av[])
@@ -146,6 +161,42 @@ int main(int ac, char *av[])
     // sample function E: Write Exif thumbnail data to file
     // result = sample_saveThumbnail(av[1], "thumbnail.jpg");
 
+    // sample function F: remove GPS IFD without rewriting the file
+    // result = sample_removeGPSInPlace(av[1]);
+
+    // sample function G: show the date and time shifted by 1 hour (dry-run)
+    // result = sample_shiftDateTime(av[1]);
+
+    // sample function H: update the tags listed in the manifest file (CSV)
+    // result = sample_updateFromManifest(av[1]);
+
+    // sample function I: copy the Exif segment to another JPEG file as it is
+    // result = sample_transplantExif(av[1], "resized.jpg", "transplant.jpg");
+
+    // sample function J: update the tag data without creating a new file
+    // result = sample_updateTagDataInPlace(av[1]);
+
+    // sample function K: check the structure of the JPEG file
+    // result = sample_validate(av[1]);
+
+    // sample function L: minify the Exif segment without the thumbnail
+    // result = sample_minify(av[1], "minify.jpg");
+
+    // sample function M: move the Exif segment to a sidecar file and back
+    // result = sample_splitSidecar(av[1]);
+
+    // sample function N: show the tags changed from the original file
+    // result = sample_diffExif(av[1], "updateTag.jpg");
+
+    // sample function O: get the lens and the shutter count in the MakerNote
+    // result = sample_getMakerNote(av[1]);
+
+    // sample function P: move the Exif segment to the store and back
+    // result = sample_splitStore(av[1]);
+
+    // sample function Q: replace "DateTime" keeping the size of the Exif segment
+    // result = sample_replaceDateTime(av[1], "replaceDateTime.jpg");
+
     return result;
 }
 
@@ -323,3 +374,325 @@ int sample_saveThumbnail(const char *srcJpgFileName, const char *outFileName)
     freeIfdTableArray(ifdTableArray);
     return 0;
 }
+
+/**
+ * sample_removeGPSInPlace()
+ *
+ * Remove GPS IFD without rewriting the file
+ *
+ */
+int sample_removeGPSInPlace(const char *jpgFileName)
+{
+    int sts = removeGPSIfdFromJPEGFileInPlace(jpgFileName);
+    if (sts < 0) {
+        printf("removeGPSIfdFromJPEGFileInPlace: ret=%d\n", sts);
+    } else if (sts == 0) {
+        printf("GPS IFD is not found in [%s]\n", jpgFileName);
+    }
+    return sts;
+}
+
+/**
+ * sample_shiftDateTime()
+ *
+ * Show the date and time shifted by 1 hour (dry-run)
+ *
+ */
+int sample_shiftDateTime(const char *jpgFileName)
+{
+    int sts = shiftDateTimeInJPEGFile(jpgFileName, 3600,
+                    SHIFT_DATETIME_GPS | SHIFT_DATETIME_DRYRUN, NULL, NULL, NULL, NULL);
+    if (sts < 0) {
+        printf("shiftDateTimeInJPEGFile: ret=%d\n", sts);
+    }
+    return sts;
+}
+
+/**
+ * sample_updateFromManifest()
+ *
+ * Update the tags of the JPEG files listed in the manifest file
+ *
+ * manifest example:
+ *   photo1.jpg,0th,0x010F,ascii,Camera Maker
+ *   photo1.jpg,exif,0x829D,rational,28/10
+ */
+int sample_updateFromManifest(const char *manifestFileName)
+{
+    int sts = updateTagDataInJPEGFilesFromManifest(manifestFileName, NULL);
+    if (sts < 0) {
+        printf("updateTagDataInJPEGFilesFromManifest: ret=%d\n", sts);
+    }
+    return sts;
+}
+
+/**
+ * sample_transplantExif()
+ *
+ * Copy the Exif segment to the resized JPEG file without the thumbnail
+ *
+ */
+int sample_transplantExif(const char *srcJpgFileName, const char *dstJpgFileName,
+                          const char *outJpgFileName)
+{
+    int sts;
+    unsigned int len;
+    unsigned char *segment;
+
+    segment = getExifSegmentFromJPEGFile(srcJpgFileName, &len, &sts);
+    if (!segment) {
+        printf("getExifSegmentFromJPEGFile: ret=%d\n", sts);
+        return sts;
+    }
+    sts = transformExifSegment(segment, &len, 640, 480,
+                               TRANSFORM_EXIF_DROP_THUMBNAIL);
+    if (sts < 0) {
+        printf("transformExifSegment: ret=%d\n", sts);
+    } else {
+        sts = insertExifSegmentToJPEGFile(dstJpgFileName, outJpgFileName,
+                                          segment, len);
+        if (sts < 0) {
+            printf("insertExifSegmentToJPEGFile: ret=%d\n", sts);
+        }
+    }
+    free(segment);
+    return sts;
+}
+
+/**
+ * sample_updateTagDataInPlace()
+ *
+ * Update the value of the Make tag in the JPEG file itself
+ *
+ */
+int sample_updateTagDataInPlace(const char *jpgFileName)
+{
+    const char *make = "Much Longer Camera Maker Name";
+    void **ifdTableArray;
+    TagNodeInfo *tag;
+    int result;
+
+    ifdTableArray = createIfdTableArray(jpgFileName, &result);
+    if (!ifdTableArray) {
+        printf("createIfdTableArray: ret=%d\n", result);
+        return result;
+    }
+    tag = createTagInfo(TAG_Make, TYPE_ASCII, strlen(make) + 1, &result);
+    if (!tag) {
+        printf("createTagInfo: ret=%d\n", result);
+        freeIfdTableArray(ifdTableArray);
+        return result;
+    }
+    strcpy((char*)tag->byteData, make);
+    removeTagNodeFromIfdTableArray(ifdTableArray, IFD_0TH, TAG_Make);
+    insertTagNodeToIfdTableArray(ifdTableArray, IFD_0TH, tag);
+    freeTagInfo(tag);
+
+    result = updateExifSegmentInJPEGFileInPlace(jpgFileName, ifdTableArray);
+    if (result < 0) {
+        printf("updateExifSegmentInJPEGFileInPlace: ret=%d\n", result);
+    }
+    freeIfdTableArray(ifdTableArray);
+    return result;
+}
+
+/**
+ * sample_validate()
+ *
+ * Check the structure of the JPEG file and its Exif segment
+ *
+ */
+int sample_validate(const char *jpgFileName)
+{
+    const char *reason;
+    int sts = validateJPEGFile(jpgFileName, &reason);
+    printf("%s: %s\n", jpgFileName, (sts >= 0) ? "valid" : "invalid");
+    if (sts < 0) {
+        printf("validateJPEGFile: ret=%d (%s)\n", sts, reason);
+    }
+    return sts;
+}
+
+/**
+ * sample_minify()
+ *
+ * Rewrite the Exif segment into the smallest one without the thumbnail
+ *
+ */
+int sample_minify(const char *srcJpgFileName, const char *outJpgFileName)
+{
+    long saved;
+    int sts = minifyExifSegmentInJPEGFile(srcJpgFileName, outJpgFileName,
+                                          MINIFY_REMOVE_THUMBNAIL, NULL, 0, &saved);
+    if (sts < 0) {
+        printf("minifyExifSegmentInJPEGFile: ret=%d\n", sts);
+    } else if (sts > 0) {
+        printf("%s: %ld bytes saved\n", outJpgFileName, saved);
+    }
+    return sts;
+}
+
+/**
+ * sample_splitSidecar()
+ *
+ * Move the Exif segment to a sidecar file and put it back
+ *
+ */
+int sample_splitSidecar(const char *srcJpgFileName)
+{
+    int sts = splitExifSegmentToSidecar(srcJpgFileName, "stripped.jpg", "stripped.exsc");
+    if (sts <= 0) {
+        printf("splitExifSegmentToSidecar: ret=%d\n", sts);
+        return sts;
+    }
+    sts = joinExifSegmentFromSidecar("stripped.jpg", "stripped.exsc", "joined.jpg");
+    if (sts < 0) {
+        printf("joinExifSegmentFromSidecar: ret=%d\n", sts);
+    }
+    return sts;
+}
+
+/**
+ * sample_diffExif()
+ *
+ * Show the tags added, removed or changed in another JPEG file
+ *
+ */
+int sample_diffExif(const char *srcJpgFileName, const char *otherJpgFileName)
+{
+    static const char *kinds[] = { "", "added", "removed", "value changed",
+                                   "type changed" };
+    TagDiffInfo *diffs;
+    int i, sts = diffExifSegmentOfJPEGFiles(srcJpgFileName, otherJpgFileName, &diffs);
+    if (sts < 0) {
+        printf("diffExifSegmentOfJPEGFiles: ret=%d\n", sts);
+        return sts;
+    }
+    for (i = 0; i < sts; i++) {
+        printf("IFD=%d tag=0x%04X: %s\n", diffs[i].ifdType, diffs[i].tagId,
+            kinds[diffs[i].kind]);
+    }
+    if (sts == 0) {
+        printf("no difference\n");
+    }
+    free(diffs);
+    return sts;
+}
+
+/**
+ * sample_getMakerNote()
+ *
+ * Get the lens and the shutter count in the MakerNote
+ *
+ */
+int sample_getMakerNote(const char *srcJpgFileName)
+{
+    int sts, vendor;
+    TagNodeInfo *tag;
+    void **ifdArray = createIfdTableArray(srcJpgFileName, &sts);
+    if (!ifdArray) {
+        printf("createIfdTableArray: ret=%d\n", sts);
+        return sts;
+    }
+    vendor = getMakerNoteVendor(ifdArray);
+    printf("MakerNote vendor=%d\n", vendor);
+    if (vendor == MAKERNOTE_NIKON) {
+        tag = getTagInfo(ifdArray, IFD_MAKERNOTE, TAG_NikonShutterCount);
+        if (tag) {
+            if (!tag->error) {
+                printf("ShutterCount: %u\n", tag->numData[0]);
+            }
+            freeTagInfo(tag);
+        }
+        tag = getTagInfo(ifdArray, IFD_MAKERNOTE, TAG_NikonLens);
+        if (tag) {
+            if (!tag->error && tag->count == 4) {
+                printf("Lens: %u/%u-%u/%u mm\n", tag->numData[0], tag->numData[1],
+                    tag->numData[2], tag->numData[3]);
+            }
+            freeTagInfo(tag);
+        }
+    } else if (vendor == MAKERNOTE_CANON) {
+        tag = getTagInfo(ifdArray, IFD_MAKERNOTE, TAG_CanonLensModel);
+        if (tag) {
+            if (!tag->error) {
+                printf("LensModel: %.*s\n", (int)tag->count, tag->byteData);
+            }
+            freeTagInfo(tag);
+        }
+    }
+    freeIfdTableArray(ifdArray);
+    return vendor;
+}
+
+/**
+ * sample_splitStore()
+ *
+ * Move the Exif segment to the store in the current directory and put it back
+ *
+ */
+int sample_splitStore(const char *srcJpgFileName)
+{
+    char key[EXIF_STORE_KEY_LEN + 1];
+    int sts = splitExifSegmentToStore(srcJpgFileName, "stripped.jpg", ".",
+                                      "stripped.exref", key);
+    if (sts <= 0) {
+        printf("splitExifSegmentToStore: ret=%d\n", sts);
+        return sts;
+    }
+    printf("key=%s (%s)\n", key, (sts == 2) ? "already stored" : "added");
+    sts = joinExifSegmentFromStore("stripped.jpg", "stripped.exref", ".", "joined.jpg");
+    if (sts < 0) {
+        printf("joinExifSegmentFromStore: ret=%d\n", sts);
+    }
+    return sts;
+}
+
+/**
+ * sample_replaceDateTime()
+ *
+ * Replace the value of "DateTime" tag in 0th IFD with a value of the same
+ * size, and check that the size of the Exif segment is not changed
+ *
+ */
+int sample_replaceDateTime(const char *srcJpgFileName, const char *outJpgFileName)
+{
+    TagNodeInfo *tag;
+    unsigned char *segment;
+    unsigned int srcLength = 0, outLength = 0;
+    int sts, result;
+    void **ifdTableArray = createIfdTableArray(srcJpgFileName, &result);
+
+    if (!ifdTableArray) {
+        printf("createIfdTableArray: ret=%d\n", result);
+        return result;
+    }
+    tag = getTagInfo(ifdTableArray, IFD_0TH, TAG_DateTime);
+    if (!tag || tag->error || tag->count != 20) {
+        printf("DateTime is not found\n");
+        freeTagInfo(tag);
+        freeIfdTableArray(ifdTableArray);
+        return 0;
+    }
+    strcpy((char*)tag->byteData, "2000:01:01 00:00:00");
+    removeTagNodeFromIfdTableArray(ifdTableArray, IFD_0TH, TAG_DateTime);
+    insertTagNodeToIfdTableArray(ifdTableArray, IFD_0TH, tag);
+    freeTagInfo(tag);
+
+    sts = updateExifSegmentInJPEGFile(srcJpgFileName, outJpgFileName, ifdTableArray);
+    freeIfdTableArray(ifdTableArray);
+    if (sts < 0) {
+        printf("updateExifSegmentInJPEGFile: ret=%d\n", sts);
+        return sts;
+    }
+    segment = getExifSegmentFromJPEGFile(srcJpgFileName, &srcLength, &result);
+    free(segment);
+    segment = getExifSegmentFromJPEGFile(outJpgFileName, &outLength, &result);
+    free(segment);
+    if (srcLength != outLength) {
+        printf("the segment length is changed: %u -> %u\n", srcLength, outLength);
+        return ERR_UNKNOWN;
+    }
+    printf("the segment length is kept: %u\n", outLength);
+    return sts;
+}